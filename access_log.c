@@ -0,0 +1,380 @@
+/*
+    File name    : access_log.c
+    creation date: 08-04-26
+    Author       : Solomon
+*/
+
+#include <stdio.h>      // provides snprintf()
+#include <string.h>     // provides memcpy(), strcmp(), strlen()
+#include <strings.h>    // provides strcasecmp()
+#include <errno.h>      // provides errno, EINTR
+#include <fcntl.h>      // provides open(), O_APPEND, O_CREAT
+#include <signal.h>     // provides signal(), kill(), SIGTERM, sig_atomic_t
+#include <time.h>       // provides clock_gettime(), gmtime_r(), strftime()
+#include <unistd.h>     // provides fork(), write(), usleep(), _exit()
+#include <sys/mman.h>   // provides mmap(), MAP_SHARED, MAP_ANONYMOUS
+#include <sys/wait.h>   // provides waitpid()
+#include <arpa/inet.h>  // provides inet_ntop()
+#include "access_log.h"
+#include "connection.h" // provides CONNECTION, monotonic_us()
+
+#define ACCESS_LOG_RING_MASK ((uint64_t)ACCESS_LOG_RING_SIZE - 1)
+
+// set up by the master before fork(), read only afterwards
+static ACCESS_LOG_RING*  g_arrRings;
+static int               g_iRingCount;
+static ACCESS_LOG_LEVEL  g_level = ACCESS_LOG_OFF;
+static unsigned          g_uSample = 1;
+static int               g_iLogFd = -1;
+static pid_t             g_writerPid = -1;
+
+// worker side
+static ACCESS_LOG_RING*  g_pRing;            // this worker's ring
+static uint64_t          g_uCachedTail;      // last tail seen, re-read only when the ring looks full
+static unsigned          g_uSampleCounter;
+
+// writer side
+static volatile sig_atomic_t g_bWriterRunning = 1;
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void access_log_copy_field(char* pDest, size_t iSize, const char* szSource)
+{
+    // truncating copy that always terminates, "-" for a field the request never had
+    if (!szSource || !*szSource) szSource = "-";
+
+    size_t iLen = strlen(szSource);
+    if (iLen >= iSize) iLen = iSize - 1;
+
+    memcpy(pDest, szSource, iLen);
+    pDest[iLen] = '\0';
+}
+
+/*===================================== Master ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool access_log_parse_level(const char* szLevel, ACCESS_LOG_LEVEL* pOut)
+{
+    if (!szLevel || !pOut) return false;
+
+    if      (strcasecmp(szLevel, "off")   == 0) *pOut = ACCESS_LOG_OFF;
+    else if (strcasecmp(szLevel, "error") == 0) *pOut = ACCESS_LOG_ERROR;
+    else if (strcasecmp(szLevel, "warn")  == 0) *pOut = ACCESS_LOG_WARN;
+    else if (strcasecmp(szLevel, "info")  == 0) *pOut = ACCESS_LOG_INFO;
+    else return false;
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool access_log_init(int iWorkerCount, ACCESS_LOG_LEVEL level, unsigned uSample, const char* szPath)
+{
+    if (level == ACCESS_LOG_OFF) return true;
+    if (iWorkerCount <= 0) return false;
+
+    int iFd = STDOUT_FILENO;
+    if (szPath && strcmp(szPath, "-") != 0)
+    {
+        iFd = open(szPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (iFd < 0) return false;
+    }
+
+    // zero filled by the kernel, pages are only touched as records arrive
+    size_t iSize = (size_t)iWorkerCount * sizeof(ACCESS_LOG_RING);
+    void* pMap = mmap(NULL, iSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pMap == MAP_FAILED)
+    {
+        if (iFd != STDOUT_FILENO) close(iFd);
+        return false;
+    }
+
+    g_arrRings   = pMap;
+    g_iRingCount = iWorkerCount;
+    g_level      = level;
+    g_uSample    = uSample ? uSample : 1;
+    g_iLogFd     = iFd;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void access_log_on_signal(int sig)
+{
+    (void)sig;
+    g_bWriterRunning = 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool access_log_write_all(const char* pData, size_t iLength)
+{
+    while (iLength > 0)
+    {
+        ssize_t n = write(g_iLogFd, pData, iLength);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        pData   += n;
+        iLength -= (size_t)n;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static size_t access_log_format_path(char* pOut, size_t iCapacity, const char* szPath)
+{
+    // quotes and control bytes are escaped, a log line can never be split or forged
+    static const char arrHex[] = "0123456789abcdef";
+
+    size_t iOff = 0;
+    for (const unsigned char* p = (const unsigned char*)szPath; *p && iOff + 4 < iCapacity; ++p)
+    {
+        if (*p < 0x20 || *p == 0x7f || *p == '"' || *p == '\\')
+        {
+            pOut[iOff++] = '\\';
+            pOut[iOff++] = 'x';
+            pOut[iOff++] = arrHex[*p >> 4];
+            pOut[iOff++] = arrHex[*p & 0x0f];
+        }
+        else pOut[iOff++] = (char)*p;
+    }
+
+    return iOff;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static size_t access_log_format(char* pOut, size_t iCapacity, const ACCESS_LOG_RECORD* pRec, int iWorker)
+{
+    /*
+        Common log format plus the request time in seconds and the worker:
+        1.2.3.4 - - [16/Oct/2026:04:43:25 +0000] "GET / HTTP/1.1" 200 412 0.000081 w0
+    */
+
+    static time_t tCached = (time_t)-1;
+    static char   szCachedTime[40];
+
+    time_t tNow = (time_t)(pRec->m_uTimeUs / 1000000u);
+    if (tNow != tCached)
+    {
+        struct tm tmUtc;
+        gmtime_r(&tNow, &tmUtc);
+        strftime(szCachedTime, sizeof(szCachedTime), "%d/%b/%Y:%H:%M:%S +0000", &tmUtc);
+        tCached = tNow;
+    }
+
+    char szAddr[INET_ADDRSTRLEN] = "-";
+    if (pRec->m_uPeerAddr)
+    {
+        struct in_addr addr = { .s_addr = pRec->m_uPeerAddr };
+        inet_ntop(AF_INET, &addr, szAddr, sizeof(szAddr));
+    }
+
+    char szPath[4 * sizeof(pRec->m_szPath)];
+    size_t iPathLen = access_log_format_path(szPath, sizeof(szPath), pRec->m_szPath);
+
+    int n = snprintf(pOut, iCapacity, "%s - - [%s] \"%s %.*s %s\" %u %llu %u.%06u w%d\n",
+                     szAddr, szCachedTime,
+                     pRec->m_szMethod, (int)iPathLen, szPath, pRec->m_szVersion,
+                     (unsigned)pRec->m_uStatus, (unsigned long long)pRec->m_uBytes,
+                     pRec->m_uLatencyUs / 1000000u, pRec->m_uLatencyUs % 1000000u,
+                     iWorker);
+
+    return (n > 0 && (size_t)n < iCapacity) ? (size_t)n : 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool access_log_sweep(char* pBatch, size_t* pBatchLen)
+{
+    /*
+        One pass over every ring. Records are formatted straight out of
+        shared memory and the tail is released only afterwards, so the
+        worker cannot reuse a slot that is still being read.
+        Returns true when at least one record was found.
+    */
+
+    bool bFound = false;
+
+    for (int iW = 0; iW < g_iRingCount; ++iW)
+    {
+        ACCESS_LOG_RING* pRing = &g_arrRings[iW];
+
+        uint64_t uTail = pRing->m_uTail;
+        uint64_t uHead = __atomic_load_n(&pRing->m_uHead, __ATOMIC_ACQUIRE);
+
+        while (uTail != uHead)
+        {
+            if (ACCESS_LOG_BATCH_SIZE - *pBatchLen < 2048)
+            {
+                access_log_write_all(pBatch, *pBatchLen);
+                *pBatchLen = 0;
+            }
+
+            const ACCESS_LOG_RECORD* pRec = &pRing->m_arrRecords[uTail & ACCESS_LOG_RING_MASK];
+            *pBatchLen += access_log_format(pBatch + *pBatchLen, ACCESS_LOG_BATCH_SIZE - *pBatchLen, pRec, iW);
+            uTail++;
+            bFound = true;
+        }
+
+        __atomic_store_n(&pRing->m_uTail, uTail, __ATOMIC_RELEASE);
+
+        uint64_t uDropped = __atomic_load_n(&pRing->m_uDropped, __ATOMIC_RELAXED);
+        if (uDropped != pRing->m_uDroppedReported)
+        {
+            int n = snprintf(pBatch + *pBatchLen, ACCESS_LOG_BATCH_SIZE - *pBatchLen,
+                             "access_log: worker %d dropped %llu records (ring full)\n",
+                             iW, (unsigned long long)(uDropped - pRing->m_uDroppedReported));
+            if (n > 0 && (size_t)n < ACCESS_LOG_BATCH_SIZE - *pBatchLen) *pBatchLen += (size_t)n;
+            pRing->m_uDroppedReported = uDropped;
+        }
+    }
+
+    return bFound;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void access_log_writer_main(void)
+{
+    /*
+        Ctrl-C reaches the whole process group; the writer waits for the
+        master's SIGTERM instead, which comes after the workers are gone,
+        so the last records are still written.
+    */
+
+    signal(SIGTERM, access_log_on_signal);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    static char arrBatch[ACCESS_LOG_BATCH_SIZE];
+    size_t iBatchLen = 0;
+
+    while (g_bWriterRunning)
+    {
+        bool bFound = access_log_sweep(arrBatch, &iBatchLen);
+
+        if (iBatchLen > 0)
+        {
+            access_log_write_all(arrBatch, iBatchLen);
+            iBatchLen = 0;
+        }
+
+        // nothing anywhere: sleep instead of spinning, records simply wait in the rings
+        if (!bFound) usleep(ACCESS_LOG_IDLE_US);
+    }
+
+    while (access_log_sweep(arrBatch, &iBatchLen)) { }
+    if (iBatchLen > 0) access_log_write_all(arrBatch, iBatchLen);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+pid_t access_log_spawn_writer(void)
+{
+    if (!g_arrRings) return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+
+    if (pid == 0)
+    {
+        access_log_writer_main();
+        _exit(0);
+    }
+
+    g_writerPid = pid;
+    return pid;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool access_log_is_writer(pid_t pid)
+{
+    return g_arrRings && pid > 0 && pid == g_writerPid;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void access_log_stop_writer(void)
+{
+    if (g_writerPid <= 0) return;
+
+    kill(g_writerPid, SIGTERM);
+    while (waitpid(g_writerPid, NULL, 0) == -1)
+    {
+        if (errno != EINTR) break;
+    }
+
+    g_writerPid = -1;
+}
+
+/*===================================== Worker ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void access_log_attach(int iWorkerIndex)
+{
+    if (!g_arrRings || iWorkerIndex < 0 || iWorkerIndex >= g_iRingCount) return;
+
+    // a respawned worker continues its slot's ring where the last process stopped
+    g_pRing       = &g_arrRings[iWorkerIndex];
+    g_uCachedTail = __atomic_load_n(&g_pRing->m_uTail, __ATOMIC_ACQUIRE);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void access_log_request(const CONNECTION* pConn)
+{
+    if (!g_pRing || !pConn) return;
+
+    int iStatus = pConn->m_iStatus;
+    ACCESS_LOG_LEVEL level = (iStatus >= 500 || iStatus < 100) ? ACCESS_LOG_ERROR
+                           : (iStatus >= 400)                  ? ACCESS_LOG_WARN
+                                                               : ACCESS_LOG_INFO;
+    if (level > g_level) return;
+
+    if (level == ACCESS_LOG_INFO && g_uSample > 1 && (++g_uSampleCounter % g_uSample) != 0)
+        return;
+
+    // the tail only moves forward, a stale copy can only make the ring look fuller
+    uint64_t uHead = g_pRing->m_uHead;
+    if (uHead - g_uCachedTail >= ACCESS_LOG_RING_SIZE)
+    {
+        g_uCachedTail = __atomic_load_n(&g_pRing->m_uTail, __ATOMIC_ACQUIRE);
+        if (uHead - g_uCachedTail >= ACCESS_LOG_RING_SIZE)
+        {
+            __atomic_store_n(&g_pRing->m_uDropped, g_pRing->m_uDropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    ACCESS_LOG_RECORD* pRec = &g_pRing->m_arrRecords[uHead & ACCESS_LOG_RING_MASK];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t uNow = monotonic_us();
+    uint64_t uLatency = uNow > pConn->m_uServeStartUs ? uNow - pConn->m_uServeStartUs : 0;
+
+    pRec->m_uTimeUs    = (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+    pRec->m_uBytes     = pConn->m_iResponseBytes;
+    pRec->m_uLatencyUs = uLatency > UINT32_MAX ? UINT32_MAX : (uint32_t)uLatency;
+    pRec->m_uPeerAddr  = pConn->m_uPeerAddr;
+    pRec->m_uStatus    = (uint16_t)(iStatus > 0 && iStatus < 1000 ? iStatus : 0);
+
+    const REQUEST_INFO* ri = &pConn->m_request;
+    access_log_copy_field(pRec->m_szMethod,  sizeof(pRec->m_szMethod),  ri->m_szMethod);
+    access_log_copy_field(pRec->m_szVersion, sizeof(pRec->m_szVersion), ri->m_szVersion);
+    access_log_copy_field(pRec->m_szPath,    sizeof(pRec->m_szPath),    ri->m_szPath);
+
+    // publishes the record: the writer reads it only after seeing this head
+    __atomic_store_n(&g_pRing->m_uHead, uHead + 1, __ATOMIC_RELEASE);
+}
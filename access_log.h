@@ -0,0 +1,99 @@
+/*
+    File name    : access_log.h
+    creation date: 08-04-26
+    Author       : Solomon
+*/
+
+/*
+    Asynchronous access log.
+
+    Workers never format or write a log line. When a response is done the
+    worker copies a fixed size binary record into its own ring buffer in
+    shared memory and moves on; the ring has exactly one producer (the
+    worker) and one consumer (the log writer process), so a release store
+    of the head / tail index is all the synchronisation there is.
+
+    The log writer is a separate process forked by the master. It sweeps
+    every ring, formats the records in one buffer and writes it with a
+    single write() per batch. A full ring drops the record (and counts it)
+    instead of ever blocking a worker; the writer reports the drops.
+
+    What gets logged is decided in the worker before the record is made:
+      level   : off, error (5xx), warn (4xx and 5xx) or info (everything)
+      sampling: with info, 1 in N of the remaining requests is kept;
+                errors and warnings are never sampled away
+*/
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>     // provides uint64_t, uint32_t
+#include <stdbool.h>
+#include <sys/types.h>  // provides pid_t
+
+#define ACCESS_LOG_RING_SIZE   4096   // records per worker, power of two
+#define ACCESS_LOG_RECORD_SIZE 256
+#define ACCESS_LOG_BATCH_SIZE  65536  // bytes the writer formats before a write()
+#define ACCESS_LOG_IDLE_US     10000  // writer sleep when every ring was empty
+
+typedef struct CONNECTION CONNECTION;
+
+typedef enum
+{
+    ACCESS_LOG_OFF = 0,
+    ACCESS_LOG_ERROR,      // 5xx (and responses without a status)
+    ACCESS_LOG_WARN,       // 4xx
+    ACCESS_LOG_INFO,       // everything else
+} ACCESS_LOG_LEVEL;
+
+typedef struct ACCESS_LOG_RECORD
+{
+    uint64_t m_uTimeUs;        // wall clock when the response was done
+    uint64_t m_uBytes;         // response bytes, headers included
+    uint32_t m_uLatencyUs;     // parsed -> last response byte
+    uint32_t m_uPeerAddr;      // IPv4, network byte order, 0 if unknown
+    uint16_t m_uStatus;
+    char     m_szMethod[12];
+    char     m_szVersion[10];
+    char     m_szPath[ACCESS_LOG_RECORD_SIZE - 48];   // truncated, always terminated
+} ACCESS_LOG_RECORD;
+
+_Static_assert(sizeof(ACCESS_LOG_RECORD) == ACCESS_LOG_RECORD_SIZE, "access log record must be one fixed size");
+
+typedef struct ACCESS_LOG_RING
+{
+    // producer side, written by the worker only
+    _Alignas(64) uint64_t m_uHead;      // next record to fill
+    uint64_t m_uDropped;                // records lost to a full ring
+
+    // consumer side, written by the log writer only
+    _Alignas(64) uint64_t m_uTail;      // next record to format
+    uint64_t m_uDroppedReported;
+
+    _Alignas(64) ACCESS_LOG_RECORD m_arrRecords[ACCESS_LOG_RING_SIZE];
+} ACCESS_LOG_RING;
+
+/*===================================== Master ======================================*/
+bool  access_log_init        (int iWorkerCount, ACCESS_LOG_LEVEL level, unsigned uSample, const char* szPath);
+pid_t access_log_spawn_writer(void);                 // -1 when logging is off or fork() failed
+bool  access_log_is_writer   (pid_t pid);            // the master respawns it like a worker
+void  access_log_stop_writer (void);                 // after the workers: it drains every ring first
+
+bool  access_log_parse_level (const char* szLevel, ACCESS_LOG_LEVEL* pOut);
+
+/*===================================== Worker ======================================*/
+void  access_log_attach      (int iWorkerIndex);
+void  access_log_request     (const CONNECTION* pConn);  // response fully sent
+
+#endif
+
+/*
+
+access_log_init()         -> maps one ring per worker slot and opens the log file ("-" = stdout);
+                             with level off nothing is mapped and every other call is a no-op
+access_log_spawn_writer() -> forks the log writer, which sweeps the rings until it gets SIGTERM
+                             and then drains whatever is left before exiting
+access_log_request()      -> applies level and sampling, then copies one record into the worker's ring
+                             (dropped and counted when the ring is full)
+
+*/
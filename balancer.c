@@ -0,0 +1,401 @@
+/*
+    File name    : balancer.c
+    creation date: 13-04-26
+    Author       : Solomon
+*/
+
+#include <stddef.h>     // provides size_t
+#include <stdint.h>     // provides uint64_t, uint32_t, uint8_t
+#include <string.h>     // provides strcmp(), strncmp(), strlen(), memset()
+#include <strings.h>    // provides strcasecmp()
+#include <unistd.h>     // provides getpid()
+#include <time.h>       // provides time()
+#include "balancer.h"
+#include "connection.h" // provides monotonic_us()
+
+// configuration, set by the master before fork
+static BALANCER_POLICY g_policy = BALANCER_ROUND_ROBIN;
+static BALANCER_KEY    g_key    = BALANCER_KEY_PATH;
+static char            g_szKeyHeader[128];
+static int             g_iCount;
+static int             g_arrWeights[BALANCER_MAX_UPSTREAMS];
+static uint8_t         g_arrMaglev[BALANCER_MAGLEV_SIZE];   // table entry -> upstream index
+
+// per worker
+static unsigned g_uNext;                                    // round robin position
+static int      g_arrCurrentWeights[BALANCER_MAX_UPSTREAMS];// smooth weighted round robin
+static uint32_t g_arrOutstanding[BALANCER_MAX_UPSTREAMS];
+static uint64_t g_arrLatencyEwmaUs[BALANCER_MAX_UPSTREAMS];
+static uint64_t g_arrLastSampleUs[BALANCER_MAX_UPSTREAMS];
+static uint64_t g_uRandom;                                  // xorshift state, seeded on first use
+
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Helper Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint64_t balancer_hash(const char* pData, size_t iLength, uint64_t uSeed)
+{
+    // FNV-1a, then a splitmix64 finalizer so nearby keys land far apart
+    uint64_t uHash = 0xcbf29ce484222325ull ^ uSeed;
+    for (size_t iX = 0; iX < iLength; ++iX)
+    {
+        uHash ^= (unsigned char)pData[iX];
+        uHash *= 0x100000001b3ull;
+    }
+
+    uHash ^= uHash >> 30; uHash *= 0xbf58476d1ce4e5b9ull;
+    uHash ^= uHash >> 27; uHash *= 0x94d049bb133111ebull;
+    uHash ^= uHash >> 31;
+    return uHash;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint64_t balancer_random(void)
+{
+    // xorshift64*, one state per worker process
+    if (g_uRandom == 0)
+        g_uRandom = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL) ^ 0x9e3779b97f4a7c15ull;
+
+    g_uRandom ^= g_uRandom >> 12;
+    g_uRandom ^= g_uRandom << 25;
+    g_uRandom ^= g_uRandom >> 27;
+    return g_uRandom * 0x2545f4914f6cdd1dull;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint64_t balancer_latency(int iUpstream, uint64_t uNowUs)
+{
+    // an upstream that lost every comparison gets no new samples; halving its average
+    // for every BALANCER_EWMA_DECAY_US without one makes it worth another try eventually
+    uint64_t uIdle  = uNowUs - g_arrLastSampleUs[iUpstream];
+    uint64_t uHalve = uIdle / BALANCER_EWMA_DECAY_US;
+    return uHalve >= 64 ? 0 : g_arrLatencyEwmaUs[iUpstream] >> uHalve;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void balancer_build_maglev(const char* const* arrNames)
+{
+    /*
+        Maglev population: every upstream walks its own permutation of the
+        table (offset + j * skip, both from its name) and claims the next
+        free entry on its turn. An upstream takes a turn each time its
+        credit reaches the largest weight, so entries follow the weights.
+    */
+
+    static uint32_t arrOffset[BALANCER_MAX_UPSTREAMS];
+    static uint32_t arrSkip[BALANCER_MAX_UPSTREAMS];
+    static uint32_t arrNext[BALANCER_MAX_UPSTREAMS];
+    static int      arrCredit[BALANCER_MAX_UPSTREAMS];
+
+    int iMaxWeight = 1;
+    for (int iX = 0; iX < g_iCount; ++iX)
+    {
+        size_t iLen = strlen(arrNames[iX]);
+        arrOffset[iX] = (uint32_t)(balancer_hash(arrNames[iX], iLen, 0) % BALANCER_MAGLEV_SIZE);
+        arrSkip[iX]   = (uint32_t)(balancer_hash(arrNames[iX], iLen, 1) % (BALANCER_MAGLEV_SIZE - 1)) + 1;
+        arrNext[iX]   = 0;
+        arrCredit[iX] = 0;
+        if (g_arrWeights[iX] > iMaxWeight) iMaxWeight = g_arrWeights[iX];
+    }
+
+    memset(g_arrMaglev, 0xff, sizeof(g_arrMaglev));
+
+    size_t iFilled = 0;
+    while (iFilled < BALANCER_MAGLEV_SIZE)
+    {
+        for (int iX = 0; iX < g_iCount && iFilled < BALANCER_MAGLEV_SIZE; ++iX)
+        {
+            arrCredit[iX] += g_arrWeights[iX];
+            if (arrCredit[iX] < iMaxWeight) continue;
+            arrCredit[iX] -= iMaxWeight;
+
+            uint32_t uEntry;
+            do
+            {
+                uEntry = (uint32_t)((arrOffset[iX] + (uint64_t)arrNext[iX] * arrSkip[iX]) % BALANCER_MAGLEV_SIZE);
+                arrNext[iX]++;
+            } while (g_arrMaglev[uEntry] != 0xff);
+
+            g_arrMaglev[uEntry] = (uint8_t)iX;
+            iFilled++;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline bool balancer_usable(uint32_t uUsable, int iUpstream)
+{
+    return (uUsable >> iUpstream) & 1u;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int balancer_pick_round_robin(uint32_t uUsable)
+{
+    for (int iX = 0; iX < g_iCount; ++iX)
+    {
+        int iCandidate = (int)(g_uNext++ % (unsigned)g_iCount);
+        if (balancer_usable(uUsable, iCandidate)) return iCandidate;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int balancer_pick_weighted(uint32_t uUsable)
+{
+    /*
+        Smooth weighted round robin: every upstream gains its weight, the
+        richest one is picked and pays the total back. Over a cycle each is
+        picked weight times, and heavy upstreams are spread out. Unusable
+        upstreams sit the round out.
+    */
+
+    int iBest = -1;
+    int iTotal = 0;
+    for (int iX = 0; iX < g_iCount; ++iX)
+    {
+        if (!balancer_usable(uUsable, iX)) continue;
+
+        g_arrCurrentWeights[iX] += g_arrWeights[iX];
+        iTotal += g_arrWeights[iX];
+        if (iBest < 0 || g_arrCurrentWeights[iX] > g_arrCurrentWeights[iBest]) iBest = iX;
+    }
+
+    if (iBest >= 0) g_arrCurrentWeights[iBest] -= iTotal;
+    return iBest;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int balancer_pick_least(uint32_t uUsable)
+{
+    // starting at a rotating position spreads ties instead of piling on upstream 0
+    unsigned uStart = g_uNext++;
+    int iBest = -1;
+
+    for (int iX = 0; iX < g_iCount; ++iX)
+    {
+        int iCandidate = (int)((uStart + (unsigned)iX) % (unsigned)g_iCount);
+        if (!balancer_usable(uUsable, iCandidate)) continue;
+        if (iBest < 0 || g_arrOutstanding[iCandidate] < g_arrOutstanding[iBest]) iBest = iCandidate;
+    }
+
+    return iBest;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int balancer_pick_p2c(uint32_t uUsable)
+{
+    /*
+        Two distinct upstreams at random; the cost of each is its latency
+        EWMA times the requests it already has plus one, so a slow upstream
+        and a busy one both lose. An upstream without samples costs 0 and is
+        tried first, which gives it its first samples. Averages decay while
+        no samples come in, see balancer_latency().
+    */
+
+    int arrCandidates[BALANCER_MAX_UPSTREAMS];
+    int iCandidates = 0;
+    for (int iX = 0; iX < g_iCount; ++iX)
+        if (balancer_usable(uUsable, iX)) arrCandidates[iCandidates++] = iX;
+
+    if (iCandidates == 0) return -1;
+    if (iCandidates == 1) return arrCandidates[0];
+
+    uint64_t uRandom = balancer_random();
+    int iPickA = (int)(uRandom % (uint64_t)iCandidates);
+    int iPickB = (int)((uRandom >> 32) % (uint64_t)(iCandidates - 1));
+    if (iPickB >= iPickA) iPickB++;
+
+    int iA = arrCandidates[iPickA];
+    int iB = arrCandidates[iPickB];
+
+    uint64_t uNowUs = monotonic_us();
+    uint64_t uCostA = balancer_latency(iA, uNowUs) * (g_arrOutstanding[iA] + 1u);
+    uint64_t uCostB = balancer_latency(iB, uNowUs) * (g_arrOutstanding[iB] + 1u);
+
+    if (uCostA == uCostB) return g_arrOutstanding[iA] <= g_arrOutstanding[iB] ? iA : iB;
+    return uCostA < uCostB ? iA : iB;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int balancer_pick_hash(const REQUEST_INFO* ri, uint32_t uUsable)
+{
+    const char* szKey = NULL;
+
+    if (g_key == BALANCER_KEY_PATH) szKey = ri->m_szPath;
+    else
+    {
+        for (size_t iX = 0; iX < ri->m_headers.count; ++iX)
+        {
+            const HEADER_KEY_VALUE* pH = &ri->m_headers.entries[iX];
+            if (pH->szKey && strcasecmp(pH->szKey, g_szKeyHeader) == 0)
+            {
+                szKey = pH->szValue;
+                break;
+            }
+        }
+    }
+
+    // nothing to hash: no affinity to keep either
+    if (!szKey) return balancer_pick_round_robin(uUsable);
+
+    // an unusable upstream's keys go to the next entries of the table, the other keys stay put
+    uint64_t uHash  = balancer_hash(szKey, strlen(szKey), 2);
+    size_t   iEntry = (size_t)(uHash % BALANCER_MAGLEV_SIZE);
+    for (size_t iX = 0; iX < BALANCER_MAGLEV_SIZE; ++iX)
+    {
+        int iCandidate = g_arrMaglev[(iEntry + iX) % BALANCER_MAGLEV_SIZE];
+        if (balancer_usable(uUsable, iCandidate)) return iCandidate;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Main Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool balancer_parse_policy(const char* szPolicy, BALANCER_POLICY* pOut)
+{
+    static const struct
+    {
+        const char*     m_szName;
+        BALANCER_POLICY m_policy;
+    } arrPolicies[] = {
+        { "rr",    BALANCER_ROUND_ROBIN },
+        { "wrr",   BALANCER_WEIGHTED },
+        { "least", BALANCER_LEAST_OUTSTANDING },
+        { "p2c",   BALANCER_P2C_EWMA },
+        { "hash",  BALANCER_HASH },
+    };
+
+    if (!szPolicy || !pOut) return false;
+
+    for (size_t iX = 0; iX < sizeof(arrPolicies) / sizeof(arrPolicies[0]); ++iX)
+    {
+        if (strcmp(szPolicy, arrPolicies[iX].m_szName) == 0)
+        {
+            *pOut = arrPolicies[iX].m_policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool balancer_parse_key(const char* szKey)
+{
+    if (!szKey) return false;
+
+    if (strcmp(szKey, "path") == 0)
+    {
+        g_key = BALANCER_KEY_PATH;
+        return true;
+    }
+
+    if (strncmp(szKey, "header:", 7) != 0) return false;
+
+    size_t iLen = strlen(szKey + 7);
+    if (iLen == 0 || iLen >= sizeof(g_szKeyHeader)) return false;
+
+    memcpy(g_szKeyHeader, szKey + 7, iLen + 1);
+    g_key = BALANCER_KEY_HEADER;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool balancer_init(BALANCER_POLICY policy, const char* const* arrNames, const int* arrWeights, int iCount)
+{
+    if (iCount <= 0 || iCount > BALANCER_MAX_UPSTREAMS || !arrNames || !arrWeights) return false;
+
+    g_policy = policy;
+    g_iCount = iCount;
+
+    for (int iX = 0; iX < iCount; ++iX)
+    {
+        int iWeight = arrWeights[iX];
+        if (iWeight < 1 || iWeight > BALANCER_MAX_WEIGHT) return false;
+
+        g_arrWeights[iX] = iWeight;
+    }
+
+    if (policy == BALANCER_HASH) balancer_build_maglev(arrNames);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int balancer_pick(const REQUEST_INFO* ri, uint32_t uUsable)
+{
+    if (g_iCount <= 0) return -1;
+
+    uint32_t uAll = g_iCount >= 32 ? 0xffffffffu : ((1u << g_iCount) - 1u);
+    uUsable &= uAll;
+    if (uUsable == 0) uUsable = uAll;
+
+    switch (g_policy)
+    {
+        case BALANCER_WEIGHTED:          return balancer_pick_weighted(uUsable);
+        case BALANCER_LEAST_OUTSTANDING: return balancer_pick_least(uUsable);
+        case BALANCER_P2C_EWMA:          return balancer_pick_p2c(uUsable);
+        case BALANCER_HASH:              return ri ? balancer_pick_hash(ri, uUsable) : balancer_pick_round_robin(uUsable);
+        case BALANCER_ROUND_ROBIN:
+        default:                         return balancer_pick_round_robin(uUsable);
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void balancer_request_started(int iUpstream)
+{
+    if (iUpstream < 0 || iUpstream >= g_iCount) return;
+    g_arrOutstanding[iUpstream]++;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void balancer_record_latency(int iUpstream, uint64_t uLatencyUs)
+{
+    if (iUpstream < 0 || iUpstream >= g_iCount) return;
+
+    // the first sample is taken as is, later ones move the average by 1/8 of the difference
+    uint64_t uNowUs = monotonic_us();
+    uint64_t uEwma  = balancer_latency(iUpstream, uNowUs);
+    if (uEwma == 0)                uEwma = uLatencyUs ? uLatencyUs : 1;
+    else if (uLatencyUs >= uEwma)  uEwma += (uLatencyUs - uEwma) >> BALANCER_EWMA_SHIFT;
+    else                           uEwma -= (uEwma - uLatencyUs) >> BALANCER_EWMA_SHIFT;
+
+    g_arrLatencyEwmaUs[iUpstream] = uEwma;
+    g_arrLastSampleUs[iUpstream]  = uNowUs;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void balancer_request_finished(int iUpstream)
+{
+    if (iUpstream < 0 || iUpstream >= g_iCount) return;
+    if (g_arrOutstanding[iUpstream] > 0) g_arrOutstanding[iUpstream]--;
+}
@@ -0,0 +1,82 @@
+/*
+    File name    : balancer.h
+    creation date: 13-04-26
+    Author       : Solomon
+*/
+
+/*
+    Upstream selection for the reverse proxy.
+
+    The proxy asks balancer_pick() for an upstream index per request and
+    reports back when a request to that upstream starts, when its response
+    head arrived (latency sample) and when it is over. What the policy does
+    with that is its own business:
+
+      rr     round robin
+      wrr    smooth weighted round robin (the same interleaving nginx uses,
+             a weight 5/1/1 set gives a a b a c a a rather than a a a a a b c)
+      least  fewest requests in flight, ties broken round robin
+      p2c    power of two choices: two upstreams drawn at random, the one
+             with the lower latency EWMA x (in flight + 1) wins
+      hash   consistent hash of a request key (path or a header) through a
+             Maglev lookup table: a key keeps its upstream, and adding or
+             removing one upstream only moves the keys that had to move
+
+    In flight counts and latency averages are per worker, every worker
+    balances the requests it sees by what it observed itself. The Maglev
+    table is built once by the master and inherited by every worker.
+*/
+
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stdint.h>     // provides uint64_t, uint32_t
+#include <stdbool.h>
+#include "http.h"       // provides REQUEST_INFO
+
+#define BALANCER_MAX_UPSTREAMS   32      // same bound as PROXY_MAX_UPSTREAMS
+#define BALANCER_MAGLEV_SIZE     65537   // prime, much larger than the upstream count
+#define BALANCER_EWMA_SHIFT      3       // latency EWMA weight of a new sample: 1/8
+#define BALANCER_EWMA_DECAY_US   1000000 // a latency EWMA without new samples halves every second
+#define BALANCER_MAX_WEIGHT      1000
+
+typedef enum
+{
+    BALANCER_ROUND_ROBIN = 0,
+    BALANCER_WEIGHTED,
+    BALANCER_LEAST_OUTSTANDING,
+    BALANCER_P2C_EWMA,
+    BALANCER_HASH,
+} BALANCER_POLICY;
+
+typedef enum
+{
+    BALANCER_KEY_PATH = 0,      // request target, query string included
+    BALANCER_KEY_HEADER,        // value of one request header
+} BALANCER_KEY;
+
+/*===================================== Master ======================================*/
+bool balancer_parse_policy(const char* szPolicy, BALANCER_POLICY* pOut);
+bool balancer_parse_key   (const char* szKey);      // "path" or "header:NAME"
+bool balancer_init        (BALANCER_POLICY policy, const char* const* arrNames, const int* arrWeights, int iCount);
+
+/*===================================== Worker ======================================*/
+int  balancer_pick            (const REQUEST_INFO* ri, uint32_t uUsable);   // upstream index, -1 when there is none
+void balancer_request_started (int iUpstream);
+void balancer_record_latency  (int iUpstream, uint64_t uLatencyUs);
+void balancer_request_finished(int iUpstream);
+
+#endif
+
+/*
+
+balancer_parse_key()      -> key hashed by the hash policy; a request without the header is placed round robin
+balancer_init()           -> stores the policy and weights and, for hash, builds the Maglev table; the
+                             permutations come from the upstream names rather than their positions, and
+                             each upstream fills entries in proportion to its weight
+balancer_pick()           -> applies the policy to the upstreams whose bit is set in uUsable (all of them
+                             when none is); O(1) except least and p2c (O(upstreams)). hash sends the
+                             keys of an unusable upstream to the following table entries
+balancer_record_latency() -> folds a time-to-response-head sample into the upstream's EWMA (p2c)
+
+*/
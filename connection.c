@@ -0,0 +1,477 @@
+/*
+    File name    : connection.c
+    creation date: 03-03-26
+    Author       : Solomon
+*/
+
+#include <stdlib.h>     // provides realloc()
+#include <string.h>     // provides memmove(), memcpy()
+#include <errno.h>      // provides errno, EAGAIN, EWOULDBLOCK, EINTR
+#include <time.h>       // provides clock_gettime(), CLOCK_MONOTONIC
+#include <unistd.h>     // provides close()
+#include <sys/socket.h> // provides recv()
+#include <sys/resource.h> // provides getrlimit(), RLIMIT_NOFILE
+#include "connection.h"
+#include "pool.h"       // provides Pool
+#include "metrics.h"    // provides metrics_connection_opened(), metrics_bytes_received(), metrics_bytes_sent()
+
+#define CONNECTION_POOL_SLAB     256  // CONNECTION objects per slab
+#define READ_BUFFER_POOL_SLAB    16   // read buffers per slab (1 MB)
+#define CONNECTION_TABLE_MIN     1024
+#define CONNECTION_TABLE_MAX     (1 << 20)
+
+/*
+    Per worker (each worker is a forked process, so these are never shared):
+    connection objects and read buffers come from pools, and a flat table
+    maps a descriptor to its connection for the epoll loop.
+*/
+static Pool         g_connectionPool;
+static Pool         g_readBufferPool;
+static bool         g_bPoolsReady;
+static CONNECTION** g_arrConnections;
+static size_t       g_iTableSize;
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool connection_pools_ready(void)
+{
+    if (g_bPoolsReady) return true;
+
+    // one extra byte so the buffer can always be '\0' terminated
+    if (!poolInit(&g_connectionPool, sizeof(CONNECTION), CONNECTION_POOL_SLAB) ||
+        !poolInit(&g_readBufferPool, CONNECTION_READ_BUFFER_SIZE + 1, READ_BUFFER_POOL_SLAB))
+        return false;
+
+    g_bPoolsReady = true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool connection_table_put(int iFd, CONNECTION* pConn)
+{
+    /*
+        Sized to the descriptor limit up front (pages are only touched as
+        descriptors get used) and doubled if a descriptor ever lands past it.
+    */
+
+    if ((size_t)iFd >= g_iTableSize)
+    {
+        size_t iSize = g_iTableSize;
+        if (iSize == 0)
+        {
+            struct rlimit limit;
+            iSize = CONNECTION_TABLE_MIN;
+            if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+                iSize = limit.rlim_cur < CONNECTION_TABLE_MAX ? (size_t)limit.rlim_cur : CONNECTION_TABLE_MAX;
+            if (iSize < CONNECTION_TABLE_MIN) iSize = CONNECTION_TABLE_MIN;
+        }
+        while (iSize <= (size_t)iFd) iSize *= 2;
+
+        CONNECTION** arrGrown = realloc(g_arrConnections, iSize * sizeof(CONNECTION*));
+        if (!arrGrown) return false;
+
+        memset(arrGrown + g_iTableSize, 0, (iSize - g_iTableSize) * sizeof(CONNECTION*));
+        g_arrConnections = arrGrown;
+        g_iTableSize = iSize;
+    }
+
+    g_arrConnections[iFd] = pConn;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void connection_table_remove(int iFd, const CONNECTION* pConn)
+{
+    // a descriptor number may already belong to a newer connection
+    if (iFd >= 0 && (size_t)iFd < g_iTableSize && g_arrConnections[iFd] == pConn)
+        g_arrConnections[iFd] = NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+CONNECTION* connection_lookup(int iFd)
+{
+    if (iFd < 0 || (size_t)iFd >= g_iTableSize) return NULL;
+    return g_arrConnections[iFd];
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool connection_acquire_buffer(CONNECTION* pConn)
+{
+    if (!pConn) return false;
+    if (pConn->m_pReadBuffer) return true;
+
+    pConn->m_pReadBuffer = poolAlloc(&g_readBufferPool);
+    if (!pConn->m_pReadBuffer) return false;
+
+    pConn->m_pReadBuffer[0] = '\0';
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void connection_release_buffer(CONNECTION* pConn)
+{
+    // only an empty buffer goes back, request pointers may borrow from a full one
+    if (!pConn || !pConn->m_pReadBuffer || pConn->m_iReadLength > 0) return;
+
+    poolFree(&g_readBufferPool, pConn->m_pReadBuffer);
+    pConn->m_pReadBuffer = NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+CONNECTION* connection_create(int iFd)
+{
+    if (iFd < 0 || !connection_pools_ready()) return NULL;
+
+    CONNECTION* pConn = poolAlloc(&g_connectionPool);
+    if (!pConn) return NULL;
+    memset(pConn, 0, sizeof(*pConn));
+
+    if (!connection_table_put(iFd, pConn))
+    {
+        poolFree(&g_connectionPool, pConn);
+        return NULL;
+    }
+
+    // the read buffer is only attached while there are bytes to hold
+    pConn->m_iFd           = iFd;
+    pConn->m_iReadCapacity = CONNECTION_READ_BUFFER_SIZE;
+
+    arenaInit(&pConn->m_arena, CONNECTION_ARENA_BLOCK_SIZE);
+    output_queue_init(&pConn->m_output);
+    http_parser_init(&pConn->m_parser, &pConn->m_request);
+    pConn->m_request.m_pArena = &pConn->m_arena;
+    pConn->m_uCreatedAt    = monotonic_ms();
+    pConn->m_uLastActivity = pConn->m_uCreatedAt;
+    pConn->m_uRequestStart = pConn->m_uCreatedAt; // the first request is due from the accept on
+    timerNodeInit(&pConn->m_timer, pConn);
+
+    metrics_connection_opened();
+    return pConn;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void connection_destroy(CONNECTION* pConn)
+{
+    if (!pConn) return;
+
+    if (pConn->m_iFd >= 0)
+    {
+        connection_table_remove(pConn->m_iFd, pConn);
+        close(pConn->m_iFd);
+    }
+    output_queue_clear(&pConn->m_output);
+    free_request_info(&pConn->m_request);
+    arenaDestroy(&pConn->m_arena);
+
+    pConn->m_iReadLength = 0;
+    connection_release_buffer(pConn);
+    poolFree(&g_connectionPool, pConn);
+
+    metrics_connection_closed();
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void connection_forget_fd(CONNECTION* pConn)
+{
+    // the socket was closed by someone else (io_uring close), only the bookkeeping is left
+    if (!pConn || pConn->m_iFd < 0) return;
+
+    connection_table_remove(pConn->m_iFd, pConn);
+    pConn->m_iFd = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+CONN_READ_RESULT connection_read(CONNECTION* pConn)
+{
+    /*
+        Drains everything the kernel has for this socket into the read buffer.
+        Stops when recv() would block or when the buffer is full; a full
+        buffer is reported by connection_parse() and not here.
+    */
+
+    if (!pConn || !connection_acquire_buffer(pConn)) return CONN_READ_ERROR;
+
+    CONN_READ_RESULT result = CONN_READ_OK;
+
+    while (pConn->m_iReadLength < pConn->m_iReadCapacity)
+    {
+        ssize_t n = recv(
+            pConn->m_iFd,
+            pConn->m_pReadBuffer + pConn->m_iReadLength,
+            pConn->m_iReadCapacity - pConn->m_iReadLength,
+            0
+        );
+
+        if (n > 0)
+        {
+            pConn->m_iReadLength += (size_t)n;
+            pConn->m_pReadBuffer[pConn->m_iReadLength] = '\0';
+            pConn->m_uLastActivity = monotonic_ms();
+            metrics_bytes_received((size_t)n);
+            continue;
+        }
+
+        if (n == 0)
+        {
+            pConn->m_bPeerClosed = true;
+            result = CONN_READ_CLOSED;
+            break;
+        }
+
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+        result = CONN_READ_ERROR;
+        break;
+    }
+
+    // a wakeup that brought nothing does not keep a buffer attached
+    connection_release_buffer(pConn);
+    return result;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+PARSER_STATUS connection_parse(CONNECTION* pConn)
+{
+    /*
+        Resumes the parser where the previous EPOLLIN left it.
+        A request that still needs bytes while the buffer is already full can
+        never complete, so it is reported as an error.
+    */
+
+    if (!pConn) return PARSER_ERROR;
+
+    // nothing buffered (and possibly no buffer attached)
+    if (pConn->m_iReadLength == 0) return PARSER_NEED_MORE;
+
+    PARSER_STATUS status = http_parser_execute(
+        &pConn->m_parser,
+        &pConn->m_request,
+        pConn->m_pReadBuffer,
+        pConn->m_iReadLength
+    );
+
+    if (status == PARSER_NEED_MORE && pConn->m_iReadLength >= pConn->m_iReadCapacity)
+    {
+        pConn->m_request.m_parseResult = ERR_OUT_OF_BOUNDS;
+        status = PARSER_ERROR;
+    }
+
+    if (status == PARSER_NEED_MORE) return status;
+
+    // the request's latency is counted from here to its last response byte
+    pConn->m_uServeStartUs = monotonic_us();
+    if (status == PARSER_ERROR) metrics_parse_error(pConn->m_request.m_parseResult);
+
+    return status;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void connection_finish_request(CONNECTION* pConn)
+{
+    /*
+        Everything the request allocated lives in the arena, so releasing
+        it is a pointer rewind instead of a free() per allocation; the
+        caller makes sure the output queue (which points into the arena)
+        has drained first.
+        Bytes after the request (a pipelined request) move to the front of
+        the buffer so the parser can start on them right away.
+    */
+
+    if (!pConn) return;
+
+    const char* pRequestEnd = pConn->m_request.m_pRequestEnd;
+    if (pRequestEnd && pRequestEnd > pConn->m_pReadBuffer)
+    {
+        size_t iConsumed = (size_t)(pRequestEnd - pConn->m_pReadBuffer);
+        if (iConsumed > pConn->m_iReadLength) iConsumed = pConn->m_iReadLength;
+
+        memmove(pConn->m_pReadBuffer, pRequestEnd, pConn->m_iReadLength - iConsumed);
+        pConn->m_iReadLength -= iConsumed;
+        pConn->m_pReadBuffer[pConn->m_iReadLength] = '\0';
+    }
+
+    free_request_info(&pConn->m_request);
+    arenaReset(&pConn->m_arena);
+    http_parser_init(&pConn->m_parser, &pConn->m_request);
+
+    // keep-alive idle time is measured from here
+    pConn->m_uRequestStart = 0;
+    pConn->m_uLastActivity = monotonic_ms();
+    pConn->m_iStatus        = 0;
+    pConn->m_iResponseBytes = 0;
+
+    // an idle keep-alive connection holds no read buffer
+    connection_release_buffer(pConn);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool connection_queue_copy(CONNECTION* pConn, const void* pData, size_t iLength)
+{
+    /*
+        Response bytes usually come from the caller's stack, so they are
+        copied into the request arena where they stay valid until the
+        queue drains and the request is finished.
+    */
+
+    if (!pConn || (!pData && iLength)) return false;
+    if (iLength == 0) return true;
+
+    char* pCopy = arenaAlloc(&pConn->m_arena, iLength);
+    if (!pCopy) return false;
+
+    memcpy(pCopy, pData, iLength);
+    if (!output_queue_push_memory(&pConn->m_output, pCopy, iLength)) return false;
+
+    pConn->m_iResponseBytes += iLength;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool connection_queue_file(CONNECTION* pConn, int iFileFd, off_t iOffset, size_t iLength)
+{
+    if (!pConn || iFileFd < 0) return false;
+
+    if (!output_queue_push_file(&pConn->m_output, iFileFd, iOffset, iLength, true))
+    {
+        close(iFileFd);
+        return false;
+    }
+
+    pConn->m_iResponseBytes += iLength;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool connection_queue_shared
+(
+    CONNECTION*    pConn,
+    const char*    pData,
+    size_t         iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void*          pReleaseCtx
+)
+{
+    // cached bytes are queued without a copy, the owner is told when they are sent
+    if (pConn && pData &&
+        output_queue_push_shared_memory(&pConn->m_output, pData, iLength, pfnRelease, pReleaseCtx))
+    {
+        pConn->m_iResponseBytes += iLength;
+        return true;
+    }
+
+    if (pfnRelease) pfnRelease(pReleaseCtx);
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool connection_queue_shared_file
+(
+    CONNECTION*    pConn,
+    int            iFileFd,
+    off_t          iOffset,
+    size_t         iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void*          pReleaseCtx
+)
+{
+    /*
+        The descriptor belongs to a cache; the release callback runs once
+        the range is sent or dropped, and also when queueing fails.
+    */
+
+    if (pConn && iFileFd >= 0 &&
+        output_queue_push_shared_file(&pConn->m_output, iFileFd, iOffset, iLength, pfnRelease, pReleaseCtx))
+    {
+        pConn->m_iResponseBytes += iLength;
+        return true;
+    }
+
+    if (pfnRelease) pfnRelease(pReleaseCtx);
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+OUTPUT_RESULT connection_flush(CONNECTION* pConn)
+{
+    if (!pConn) return OUTPUT_ERROR;
+
+    size_t iPending = pConn->m_output.m_iPendingBytes;
+
+    OUTPUT_RESULT result = output_queue_flush(&pConn->m_output, pConn->m_iFd);
+    if (result != OUTPUT_ERROR) pConn->m_uLastActivity = monotonic_ms();
+
+    // what left the queue went to the socket (an error clears the rest)
+    if (result != OUTPUT_ERROR) metrics_bytes_sent(iPending - pConn->m_output.m_iPendingBytes);
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+uint64_t connection_deadline(CONNECTION* pConn, const CONN_TIMEOUTS* pTimeouts, uint64_t uNowMs)
+{
+    /*
+        The header deadline does not move while bytes trickle in, so a
+        client sending one byte at a time (slowloris) still runs out of
+        time. Body and write deadlines move with every bit of progress,
+        since a large transfer may legitimately take long.
+    */
+
+    if (!output_queue_empty(&pConn->m_output))
+    {
+        pConn->m_timerKind = CONN_TIMER_WRITE;
+        return pConn->m_uLastActivity + pTimeouts->m_uWriteMs;
+    }
+
+    if (pConn->m_iReadLength == 0 && pConn->m_uRequestStart == 0)
+    {
+        pConn->m_timerKind = CONN_TIMER_KEEPALIVE;
+        return pConn->m_uLastActivity + pTimeouts->m_uKeepAliveMs;
+    }
+
+    if (pConn->m_parser.m_state >= PARSER_STATE_BODY)
+    {
+        pConn->m_timerKind = CONN_TIMER_BODY;
+        return pConn->m_uLastActivity + pTimeouts->m_uBodyMs;
+    }
+
+    if (pConn->m_uRequestStart == 0) pConn->m_uRequestStart = uNowMs;
+
+    pConn->m_timerKind = CONN_TIMER_HEADER;
+    return pConn->m_uRequestStart + pTimeouts->m_uHeaderMs;
+}
@@ -0,0 +1,144 @@
+/*
+    File name    : connection.h
+    creation date: 03-03-26
+    Author       : Solomon
+*/
+
+/*
+    Every accepted client gets one CONNECTION, taken from a per worker pool.
+    The epoll loop registers the descriptor itself and finds the state
+    again through connection_lookup(), a flat table indexed by fd.
+
+    Bytes are accumulated in the connection's read buffer across as many
+    EPOLLIN events as it takes. Each event feeds only the new bytes to the
+    incremental parser, which reports when the request is complete.
+    The 64 KB buffer comes from a pool and is attached only while bytes are
+    pending, so an idle keep-alive connection costs just the small struct.
+
+    Responses are never written straight to the socket. They are queued on
+    the connection (see output_queue.h) and flushed; if the socket buffer
+    fills up the worker waits for EPOLLOUT and the next pipelined request is
+    not parsed until the current response has fully left.
+
+    Every connection always has exactly one deadline in the worker's timer
+    wheel, chosen by what it is waiting for (see CONN_TIMER_KIND).
+*/
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>     // provides size_t
+#include <stdint.h>     // provides uint64_t
+#include <stdbool.h>
+#include "http.h"       // provides HTTP_PARSER, REQUEST_INFO
+#include "arena.h"      // provides Arena
+#include "output_queue.h" // provides OUTPUT_QUEUE
+#include "timer_wheel.h"  // provides TimerNode
+
+#define CONNECTION_READ_BUFFER_SIZE 65536
+#define CONNECTION_ARENA_BLOCK_SIZE 4096
+
+typedef enum
+{
+    CONN_READ_OK = 0,      // new bytes were appended (or nothing was pending yet)
+    CONN_READ_CLOSED,      // peer closed the connection
+    CONN_READ_ERROR,       // recv() failed with a real error
+} CONN_READ_RESULT;
+
+typedef enum
+{
+    CONN_TIMER_HEADER = 0, // request headers incomplete, counted from the request's first byte
+    CONN_TIMER_BODY,       // headers done, body incomplete, counted from the last read progress
+    CONN_TIMER_KEEPALIVE,  // idle between two requests, counted from the end of the last response
+    CONN_TIMER_WRITE,      // response queued, counted from the last write progress
+} CONN_TIMER_KIND;
+
+typedef struct CONN_TIMEOUTS
+{
+    uint64_t m_uHeaderMs;
+    uint64_t m_uBodyMs;
+    uint64_t m_uKeepAliveMs;
+    uint64_t m_uWriteMs;
+} CONN_TIMEOUTS;
+
+typedef struct CONNECTION
+{
+    int      m_iFd;
+
+    // read side
+    char*    m_pReadBuffer;      // pooled buffer, NULL while nothing is buffered
+    size_t   m_iReadCapacity;    // usable bytes (one extra byte is kept for '\0')
+    size_t   m_iReadLength;      // bytes received so far
+
+    // request being parsed, its pointers borrow from m_pReadBuffer
+    HTTP_PARSER  m_parser;
+    REQUEST_INFO m_request;
+
+    // every parser / path / response scratch allocation of the current request
+    Arena        m_arena;
+
+    // write side, memory segments point into m_arena
+    OUTPUT_QUEUE m_output;
+    bool     m_bCloseAfterFlush;   // response said "Connection: close"
+    bool     m_bPeerClosed;        // recv() returned 0, nothing more will arrive
+    uint32_t m_uEpollEvents;       // interest currently registered for m_iFd
+
+    // timestamps (monotonic clock, milliseconds)
+    uint64_t m_uCreatedAt;
+    uint64_t m_uLastActivity;
+    uint64_t m_uRequestStart;      // first byte of the current request, 0 while idle
+    uint64_t m_uServeStartUs;      // monotonic_us() when the current request was parsed
+
+    int      m_iStatus;            // status of the queued response, 0 until one is queued
+    size_t   m_iResponseBytes;     // bytes queued for the current response
+    uint32_t m_uPeerAddr;          // client IPv4 address, network byte order (0 if unknown)
+
+    // proxied request whose response is still coming from an upstream, NULL otherwise
+    struct UPSTREAM_CONN* m_pUpstream;
+
+    // deadline in the worker's timer wheel, data points back to the owner
+    TimerNode        m_timer;
+    CONN_TIMER_KIND  m_timerKind;
+} CONNECTION;
+
+CONNECTION*       connection_create (int iFd);
+void              connection_destroy(CONNECTION* pConn);  // closes the socket and frees the state
+void              connection_forget_fd(CONNECTION* pConn); // the socket was closed elsewhere
+CONNECTION*       connection_lookup (int iFd);            // NULL when iFd is not a live connection
+bool              connection_acquire_buffer(CONNECTION* pConn); // attaches a read buffer if none is
+void              connection_release_buffer(CONNECTION* pConn); // detaches it again while it is empty
+CONN_READ_RESULT  connection_read   (CONNECTION* pConn);  // recv() until EAGAIN or buffer full
+PARSER_STATUS     connection_parse  (CONNECTION* pConn);  // feeds the new bytes to the parser
+void              connection_finish_request(CONNECTION* pConn); // drops the served request, keeps pipelined bytes
+
+bool              connection_queue_copy(CONNECTION* pConn, const void* pData, size_t iLength); // copies into the arena
+bool              connection_queue_file(CONNECTION* pConn, int iFileFd, off_t iOffset, size_t iLength); // takes the fd
+bool              connection_queue_shared(CONNECTION* pConn, const char* pData, size_t iLength,
+                                          OUT_RELEASE_FN pfnRelease, void* pReleaseCtx); // bytes stay with their owner
+bool              connection_queue_shared_file(CONNECTION* pConn, int iFileFd, off_t iOffset, size_t iLength,
+                                               OUT_RELEASE_FN pfnRelease, void* pReleaseCtx); // fd stays with its owner
+OUTPUT_RESULT     connection_flush     (CONNECTION* pConn); // sends queued bytes until drained or EAGAIN
+uint64_t          connection_deadline  (CONNECTION* pConn, const CONN_TIMEOUTS* pTimeouts, uint64_t uNowMs);
+
+uint64_t          monotonic_ms(void);
+uint64_t          monotonic_us(void);     // same clock, for latency measurements
+
+#endif
+
+/*
+
+connection_create()        -> takes the state from the pool and registers the socket in the fd table
+connection_lookup()        -> fd table lookup for epoll events
+connection_acquire_buffer()-> attaches a pooled read buffer (connection_read() does it on its own)
+connection_release_buffer()-> gives an empty read buffer back to the pool
+connection_read()          -> drains the socket into the read buffer, resuming where the last event stopped
+connection_parse()         -> resumes the incremental parser on the bytes that arrived since the last call
+connection_finish_request()-> drops the served request, rewinds its arena and moves pipelined bytes to the front
+connection_queue_copy()    -> appends a copy of response bytes to the output queue
+connection_queue_file()    -> appends a file range to the output queue, the fd is closed once it is sent
+connection_flush()         -> writes as much of the output queue as the socket takes right now
+connection_deadline()      -> picks the timeout that applies to the connection's current state and returns
+                              when it runs out (m_timerKind says which one)
+connection_destroy()       -> closes the socket and releases everything the connection owns
+
+*/
@@ -0,0 +1,174 @@
+/*
+    File name: arena.c
+    Created at: 14-03-26
+    Author: Solomon
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static size_t alignUp(size_t value)
+{
+    return (value + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static ArenaBlock* newBlock(size_t capacity)
+{
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + capacity);
+    if (!block) return NULL;
+
+    block->next = NULL;
+    block->capacity = capacity;
+    return block;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+bool arenaInit(Arena* a, size_t blockSize)
+{
+    if (!a || blockSize == 0) return false;
+
+    a->first = NULL;
+    a->current = NULL;
+    a->offset = 0;
+    a->blockSize = alignUp(blockSize);
+    a->lastAlloc = NULL;
+
+    return true;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void* arenaAlloc(Arena* a, size_t size)
+{
+    if (!a || size == 0) return NULL;
+
+    size = alignUp(size);
+
+    if (!a->current)
+    {
+        size_t capacity = size > a->blockSize ? size : a->blockSize;
+        a->first = newBlock(capacity);
+        if (!a->first) return NULL;
+        a->current = a->first;
+        a->offset = 0;
+    }
+
+    // move on to the next kept block (or a new one) once the current one is full
+    while (a->offset + size > a->current->capacity)
+    {
+        ArenaBlock* next = a->current->next;
+
+        if (!next || next->capacity < size)
+        {
+            size_t capacity = size > a->blockSize ? size : a->blockSize;
+            ArenaBlock* block = newBlock(capacity);
+            if (!block) return NULL;
+
+            // insert right after current so the blocks already kept stay reachable
+            block->next = next;
+            a->current->next = block;
+            next = block;
+        }
+
+        a->current = next;
+        a->offset = 0;
+    }
+
+    void* ptr = a->current->data + a->offset;
+    a->offset += size;
+    a->lastAlloc = ptr;
+
+    return ptr;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void* arenaCalloc(Arena* a, size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size) return NULL;
+
+    void* ptr = arenaAlloc(a, count * size);
+    if (ptr) memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void* arenaRealloc(Arena* a, void* ptr, size_t oldSize, size_t newSize)
+{
+    if (!a) return NULL;
+    if (!ptr) return arenaAlloc(a, newSize);
+    if (newSize <= oldSize) return ptr;
+
+    // the last allocation can simply be extended when its block has room
+    if (ptr == a->lastAlloc)
+    {
+        size_t start = (size_t)((char*)ptr - a->current->data);
+        if (start + alignUp(newSize) <= a->current->capacity)
+        {
+            a->offset = start + alignUp(newSize);
+            return ptr;
+        }
+    }
+
+    void* grown = arenaAlloc(a, newSize);
+    if (!grown) return NULL;
+
+    memcpy(grown, ptr, oldSize);
+    return grown;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+char* arenaStrndup(Arena* a, const char* s, size_t len)
+{
+    if (!s) return NULL;
+
+    char* copy = arenaAlloc(a, len + 1);
+    if (!copy) return NULL;
+
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void arenaReset(Arena* a)
+{
+    if (!a) return;
+
+    a->current = a->first;
+    a->offset = 0;
+    a->lastAlloc = NULL;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void arenaDestroy(Arena* a)
+{
+    if (!a) return;
+
+    ArenaBlock* block = a->first;
+    while (block)
+    {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    a->first = a->current = NULL;
+    a->offset = 0;
+    a->lastAlloc = NULL;
+}
@@ -0,0 +1,44 @@
+/*
+    File name: arena.h
+    Created at: 14-03-26
+    Author: Solomon
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Bump allocator for memory that lives exactly as long as one request.
+    Allocations are never freed one by one; arenaReset() rewinds the whole
+    arena in O(1) and keeps every block for the next request, so after the
+    first few requests a connection no longer calls malloc() at all.
+*/
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock* next;
+    size_t capacity;   // usable bytes in data[]
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena
+{
+    ArenaBlock* first;     // first block, allocated lazily and kept across resets
+    ArenaBlock* current;   // block allocations are carved from
+    size_t offset;         // bytes used in current
+    size_t blockSize;      // default capacity of new blocks
+    void* lastAlloc;       // most recent allocation (can be grown in place)
+} Arena;
+
+bool  arenaInit   (Arena* a, size_t blockSize);
+void* arenaAlloc  (Arena* a, size_t size);                                // uninitialized, 16 byte aligned
+void* arenaCalloc (Arena* a, size_t count, size_t size);                  // zeroed
+void* arenaRealloc(Arena* a, void* ptr, size_t oldSize, size_t newSize);  // grows in place when ptr is the last allocation
+char* arenaStrndup(Arena* a, const char* s, size_t len);
+void  arenaReset  (Arena* a);
+void  arenaDestroy(Arena* a);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+    File name: pool.c
+    Created at: 02-04-26
+    Author: Solomon
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "pool.h"
+
+#define POOL_ALIGNMENT 16
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static size_t alignUp(size_t value)
+{
+    return (value + (POOL_ALIGNMENT - 1)) & ~(size_t)(POOL_ALIGNMENT - 1);
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static bool addSlab(Pool* p)
+{
+    size_t header = alignUp(sizeof(PoolSlab));
+
+    PoolSlab* slab = aligned_alloc(POOL_ALIGNMENT, header + p->objectSize * p->objectsPerSlab);
+    if (!slab) return false;
+
+    slab->next = p->slabs;
+    p->slabs = slab;
+
+    // thread the new objects onto the free list, lowest address first
+    char* first = (char*)slab + header;
+    for (size_t i = p->objectsPerSlab; i > 0; --i)
+    {
+        void** object = (void**)(first + (i - 1) * p->objectSize);
+        *object = p->freeList;
+        p->freeList = object;
+    }
+
+    p->capacity += p->objectsPerSlab;
+    return true;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+bool poolInit(Pool* p, size_t objectSize, size_t objectsPerSlab)
+{
+    if (!p || objectSize == 0 || objectsPerSlab == 0) return false;
+
+    if (objectSize < sizeof(void*)) objectSize = sizeof(void*);
+
+    p->objectSize = alignUp(objectSize);
+    p->objectsPerSlab = objectsPerSlab;
+    p->slabs = NULL;
+    p->freeList = NULL;
+    p->inUse = 0;
+    p->capacity = 0;
+
+    return true;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void* poolAlloc(Pool* p)
+{
+    if (!p || p->objectSize == 0) return NULL;
+
+    if (!p->freeList && !addSlab(p)) return NULL;
+
+    void** object = p->freeList;
+    p->freeList = *object;
+    p->inUse++;
+
+    return object;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void poolFree(Pool* p, void* object)
+{
+    if (!p || !object) return;
+
+    *(void**)object = p->freeList;
+    p->freeList = object;
+    p->inUse--;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void poolDestroy(Pool* p)
+{
+    if (!p) return;
+
+    PoolSlab* slab = p->slabs;
+    while (slab)
+    {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    p->slabs = NULL;
+    p->freeList = NULL;
+    p->inUse = 0;
+    p->capacity = 0;
+}
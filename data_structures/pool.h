@@ -0,0 +1,49 @@
+/*
+    File name: pool.h
+    Created at: 02-04-26
+    Author: Solomon
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Fixed size object allocator. Objects are carved out of large slabs and
+    recycled through an intrusive free list, so allocating and freeing are
+    a couple of pointer moves and a long running process does not fragment
+    the heap with many same sized malloc() / free() pairs.
+    Slabs are only returned to the system by poolDestroy().
+*/
+
+typedef struct PoolSlab
+{
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct Pool
+{
+    size_t objectSize;       // rounded up to 16 bytes
+    size_t objectsPerSlab;
+    PoolSlab* slabs;         // every slab, for poolDestroy()
+    void* freeList;          // free objects, the first bytes of each link to the next
+    size_t inUse;            // objects handed out
+    size_t capacity;         // objects in all slabs
+} Pool;
+
+bool  poolInit   (Pool* p, size_t objectSize, size_t objectsPerSlab);
+void* poolAlloc  (Pool* p);                 // uninitialized, 16 byte aligned
+void  poolFree   (Pool* p, void* object);
+void  poolDestroy(Pool* p);
+
+#endif
+
+/*
+
+poolAlloc()   -> pops an object off the free list, adding a new slab first when it is empty
+poolFree()    -> pushes the object back onto the free list, the slab itself is kept
+poolDestroy() -> frees every slab at once, objects still in use become invalid
+
+*/
@@ -0,0 +1,244 @@
+/*
+    File name: timer_wheel.c
+    Created at: 30-03-26
+    Author: Solomon
+*/
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_SLOT_MASK ((uint64_t)TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_DELTA (((uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static void linkNode(TimerWheel* w, TimerNode* n)
+{
+    uint64_t delta = n->expires > w->current ? n->expires - w->current : 0;
+    if (delta > TIMER_WHEEL_MAX_DELTA)
+    {
+        delta = TIMER_WHEEL_MAX_DELTA;
+        n->expires = w->current + delta;
+    }
+
+    // a timer already due goes into the slot processed next
+    uint64_t expires = n->expires > w->current ? n->expires : w->current;
+
+    unsigned level = 0;
+    while (level + 1 < TIMER_WHEEL_LEVELS &&
+           delta >= ((uint64_t)1 << ((level + 1) * TIMER_WHEEL_SLOT_BITS)))
+        level++;
+
+    unsigned slot = (unsigned)((expires >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK);
+
+    TimerNode** head = &w->slots[level][slot];
+    n->next = *head;
+    if (n->next) n->next->pprev = &n->next;
+    n->pprev = head;
+    *head = n;
+
+    n->level = (unsigned char)level;
+    n->slot = (unsigned char)slot;
+    w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static void unlinkNode(TimerWheel* w, TimerNode* n)
+{
+    *n->pprev = n->next;
+    if (n->next) n->next->pprev = n->pprev;
+
+    if (!w->slots[n->level][n->slot])
+        w->occupied[n->level] &= ~((uint64_t)1 << n->slot);
+
+    n->next = NULL;
+    n->pprev = NULL;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+static unsigned cascade(TimerWheel* w, unsigned level)
+{
+    // moves every timer of the slot that just came due one or more levels down
+    unsigned slot = (unsigned)((w->current >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK);
+
+    TimerNode* list = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (list)
+    {
+        TimerNode* next = list->next;
+        linkNode(w, list);
+        list = next;
+    }
+
+    return slot;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+bool timerWheelInit(TimerWheel* w, uint64_t nowMs, uint64_t tickMs)
+{
+    if (!w || tickMs == 0) return false;
+
+    memset(w, 0, sizeof(*w));
+    w->tickMs = tickMs;
+    w->current = nowMs / tickMs;
+
+    return true;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void timerNodeInit(TimerNode* n, void* data)
+{
+    if (!n) return;
+
+    memset(n, 0, sizeof(*n));
+    n->data = data;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+bool timerNodePending(const TimerNode* n)
+{
+    return n && n->pprev;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void timerWheelSchedule(TimerWheel* w, TimerNode* n, uint64_t expiresMs)
+{
+    if (!w || !n) return;
+
+    if (n->pprev) unlinkNode(w, n);
+    else w->count++;
+
+    // rounded up: a timer never fires before its deadline
+    n->expires = (expiresMs + w->tickMs - 1) / w->tickMs;
+    linkNode(w, n);
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+void timerWheelCancel(TimerWheel* w, TimerNode* n)
+{
+    if (!w || !n || !n->pprev) return;
+
+    unlinkNode(w, n);
+    w->count--;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+size_t timerWheelAdvance(TimerWheel* w, uint64_t nowMs, TimerCallback callback, void* context)
+{
+    if (!w) return 0;
+
+    uint64_t target = nowMs / w->tickMs;
+    size_t fired = 0;
+
+    // nothing scheduled: the wheel can jump instead of turning
+    if (w->count == 0)
+    {
+        if (target >= w->current) w->current = target + 1;
+        return 0;
+    }
+
+    while (w->current <= target)
+    {
+        unsigned slot = (unsigned)(w->current & TIMER_WHEEL_SLOT_MASK);
+
+        // at each wrap of a level the next slot of the level above comes down
+        if (slot == 0)
+        {
+            for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+                if (cascade(w, level) != 0) break;
+        }
+
+        // an empty first level has nothing due before its next wrap
+        if (w->occupied[0] == 0)
+        {
+            uint64_t wrap = (w->current | TIMER_WHEEL_SLOT_MASK) + 1;
+            w->current = wrap <= target + 1 ? wrap : target + 1;
+            continue;
+        }
+
+        // detached first, so callbacks can cancel or reschedule any timer
+        TimerNode* expired = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        w->occupied[0] &= ~((uint64_t)1 << slot);
+        if (expired) expired->pprev = &expired;
+
+        w->current++;
+
+        while (expired)
+        {
+            TimerNode* n = expired;
+            unlinkNode(w, n);
+            w->count--;
+            fired++;
+
+            if (callback) callback(n, context);
+        }
+    }
+
+    return fired;
+}
+
+/////////////////////////////////////////
+/////////////////////////////////////////
+int timerWheelTimeout(const TimerWheel* w, uint64_t nowMs)
+{
+    /*
+        Level 0 gives the exact next tick; a higher level gives the tick its
+        next occupied slot cascades, which is never later than the timers in
+        it. Waking up for a cascade costs one extra wakeup, never a late timer.
+    */
+
+    if (!w || w->count == 0) return -1;
+
+    uint64_t nextTick = UINT64_MAX;
+
+    uint64_t bits = w->occupied[0];
+    if (bits)
+    {
+        unsigned index = (unsigned)(w->current & TIMER_WHEEL_SLOT_MASK);
+        uint64_t rotated = index ? (bits >> index) | (bits << (TIMER_WHEEL_SLOTS - index)) : bits;
+        nextTick = w->current + (uint64_t)__builtin_ctzll(rotated);
+    }
+
+    for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        bits = w->occupied[level];
+        if (!bits) continue;
+
+        unsigned shift = level * TIMER_WHEEL_SLOT_BITS;
+        uint64_t position = w->current >> shift;
+        unsigned index = (unsigned)(position & TIMER_WHEEL_SLOT_MASK);
+
+        for (unsigned slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+        {
+            if (!(bits & ((uint64_t)1 << slot))) continue;
+
+            // the slot under the current position is only due now when the
+            // levels below just wrapped, otherwise it is a full turn away
+            uint64_t distance = (slot - index) & TIMER_WHEEL_SLOT_MASK;
+            if (distance == 0 && (w->current & (((uint64_t)1 << shift) - 1)) != 0)
+                distance = TIMER_WHEEL_SLOTS;
+
+            uint64_t tick = (position + distance) << shift;
+            if (tick < nextTick) nextTick = tick;
+        }
+    }
+
+    uint64_t dueMs = nextTick * w->tickMs;
+    if (dueMs <= nowMs) return 0;
+
+    uint64_t waitMs = dueMs - nowMs;
+    return waitMs > INT32_MAX ? INT32_MAX : (int)waitMs;
+}
@@ -0,0 +1,68 @@
+/*
+    File name: timer_wheel.h
+    Created at: 30-03-26
+    Author: Solomon
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+    Hierarchical timer wheel: 4 levels of 64 slots. Level 0 holds timers
+    due within 64 ticks, each higher level covers 64 times the range of the
+    one below and is cascaded down one slot at a time as the wheel turns.
+    Scheduling and cancelling are O(1) pointer updates on an intrusive
+    node, so every connection can re-arm its deadline on every event.
+
+    Time is in milliseconds from any monotonic source; timers never fire
+    early, at most one tick late.
+*/
+
+#define TIMER_WHEEL_LEVELS    4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS     (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct TimerNode
+{
+    struct TimerNode*  next;
+    struct TimerNode** pprev;   // pointer that points at this node, NULL when not scheduled
+    uint64_t expires;           // tick the timer is due
+    unsigned char level;
+    unsigned char slot;
+    void* data;                 // owner, untouched by the wheel
+} TimerNode;
+
+typedef struct TimerWheel
+{
+    TimerNode* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS];   // bit i set while slots[level][i] is not empty
+    uint64_t current;                        // next tick to process
+    uint64_t tickMs;
+    size_t count;                            // scheduled timers
+} TimerWheel;
+
+typedef void (*TimerCallback)(TimerNode* node, void* context);
+
+bool   timerWheelInit    (TimerWheel* w, uint64_t nowMs, uint64_t tickMs);
+void   timerNodeInit     (TimerNode* n, void* data);
+bool   timerNodePending  (const TimerNode* n);
+void   timerWheelSchedule(TimerWheel* w, TimerNode* n, uint64_t expiresMs);   // (re)schedules n
+void   timerWheelCancel  (TimerWheel* w, TimerNode* n);                       // no-op when not scheduled
+size_t timerWheelAdvance (TimerWheel* w, uint64_t nowMs, TimerCallback callback, void* context);
+int    timerWheelTimeout (const TimerWheel* w, uint64_t nowMs);               // ms to wait, -1 when empty
+
+#endif
+
+/*
+
+timerWheelSchedule() -> links the node into the slot matching its deadline, unlinking it first if needed
+timerWheelAdvance()  -> processes every tick up to nowMs, cascading higher levels down and calling
+                        callback once for every timer that became due (the node is already unlinked,
+                        so the callback may free or reschedule it)
+timerWheelTimeout()  -> how long a poller may sleep before the wheel needs to turn again
+
+*/
@@ -0,0 +1,491 @@
+/*
+    File name    : file_cache.c
+    creation date: 24-03-26
+    Author       : Solomon
+*/
+
+#define _GNU_SOURCE       // enables strdup()
+
+#include <stdlib.h>       // provides calloc(), realloc(), free()
+#include <string.h>       // provides strcmp(), strlen(), memcpy(), strdup()
+#include <stdio.h>        // provides snprintf()
+#include <unistd.h>       // provides close(), read(), pread()
+#include <dirent.h>       // provides opendir(), readdir(), closedir()
+#include <errno.h>        // provides errno, EINTR, ENOTDIR
+#include <sys/inotify.h>  // provides inotify_init1(), inotify_add_watch(), struct inotify_event
+#include <linux/limits.h> // provides PATH_MAX, NAME_MAX
+#include "file_cache.h"
+
+#define FILE_CACHE_BUCKETS 2048   // power of two, a bit more than twice the default entry limit
+
+#define FILE_CACHE_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct WATCHED_DIR
+{
+    int   m_iWd;
+    char* m_szPrefix;   // URL path of the directory, "" for the root
+} WATCHED_DIR;
+
+typedef struct FILE_CACHE
+{
+    FILE_CACHE_ENTRY* m_arrBuckets[FILE_CACHE_BUCKETS];
+    FILE_CACHE_ENTRY* m_pLruHead;   // most recently used
+    FILE_CACHE_ENTRY* m_pLruTail;   // least recently used, evicted first
+    size_t            m_iCount;
+    size_t            m_iMaxEntries;
+    size_t            m_iSmallFileMax;
+
+    char*             m_szRoot;
+    int               m_iInotifyFd;
+    WATCHED_DIR*      m_arrWatches;
+    size_t            m_iWatchCount;
+    size_t            m_iWatchCapacity;
+    bool              m_bEnabled;
+} FILE_CACHE;
+
+// each worker is a separate process, so this is per worker
+static FILE_CACHE g_cache = { .m_iInotifyFd = -1 };
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint32_t hash_key(const char* szKey)
+{
+    // FNV-1a, keys are short paths
+    uint32_t uHash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)szKey; *p; ++p)
+    {
+        uHash ^= *p;
+        uHash *= 16777619u;
+    }
+    return uHash;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void entry_free(FILE_CACHE_ENTRY* pEntry)
+{
+    if (pEntry->m_iFd >= 0) close(pEntry->m_iFd);
+    free(pEntry->m_szKey);
+    free(pEntry->m_szEntityHeaders);
+    free(pEntry->m_pRendered);
+    free(pEntry);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void lru_unlink(FILE_CACHE_ENTRY* pEntry)
+{
+    if (pEntry->m_pLruPrev) pEntry->m_pLruPrev->m_pLruNext = pEntry->m_pLruNext;
+    else                    g_cache.m_pLruHead = pEntry->m_pLruNext;
+
+    if (pEntry->m_pLruNext) pEntry->m_pLruNext->m_pLruPrev = pEntry->m_pLruPrev;
+    else                    g_cache.m_pLruTail = pEntry->m_pLruPrev;
+
+    pEntry->m_pLruPrev = NULL;
+    pEntry->m_pLruNext = NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void lru_push_front(FILE_CACHE_ENTRY* pEntry)
+{
+    pEntry->m_pLruPrev = NULL;
+    pEntry->m_pLruNext = g_cache.m_pLruHead;
+
+    if (g_cache.m_pLruHead) g_cache.m_pLruHead->m_pLruPrev = pEntry;
+    g_cache.m_pLruHead = pEntry;
+
+    if (!g_cache.m_pLruTail) g_cache.m_pLruTail = pEntry;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_remove(FILE_CACHE_ENTRY* pEntry)
+{
+    /*
+        Makes the entry unreachable and drops the cache's reference;
+        responses still sending it keep it alive until they release it.
+    */
+
+    FILE_CACHE_ENTRY** ppSlot = &g_cache.m_arrBuckets[pEntry->m_uHash & (FILE_CACHE_BUCKETS - 1)];
+    while (*ppSlot && *ppSlot != pEntry)
+        ppSlot = &(*ppSlot)->m_pNextInBucket;
+    if (*ppSlot) *ppSlot = pEntry->m_pNextInBucket;
+
+    lru_unlink(pEntry);
+    pEntry->m_pNextInBucket = NULL;
+    pEntry->m_bCached = false;
+    g_cache.m_iCount--;
+
+    file_cache_release(pEntry);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static FILE_CACHE_ENTRY* cache_find(const char* szKey, uint32_t uHash)
+{
+    FILE_CACHE_ENTRY* pEntry = g_cache.m_arrBuckets[uHash & (FILE_CACHE_BUCKETS - 1)];
+    while (pEntry)
+    {
+        if (pEntry->m_uHash == uHash && strcmp(pEntry->m_szKey, szKey) == 0)
+            return pEntry;
+        pEntry = pEntry->m_pNextInBucket;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_clear(void)
+{
+    while (g_cache.m_pLruHead)
+        cache_remove(g_cache.m_pLruHead);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_invalidate(const char* szKey)
+{
+    FILE_CACHE_ENTRY* pEntry = cache_find(szKey, hash_key(szKey));
+    if (pEntry) cache_remove(pEntry);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static WATCHED_DIR* watch_find(int iWd)
+{
+    for (size_t iX = 0; iX < g_cache.m_iWatchCount; ++iX)
+        if (g_cache.m_arrWatches[iX].m_iWd == iWd)
+            return &g_cache.m_arrWatches[iX];
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void watch_forget(int iWd)
+{
+    for (size_t iX = 0; iX < g_cache.m_iWatchCount; ++iX)
+    {
+        if (g_cache.m_arrWatches[iX].m_iWd != iWd) continue;
+
+        free(g_cache.m_arrWatches[iX].m_szPrefix);
+        g_cache.m_arrWatches[iX] = g_cache.m_arrWatches[--g_cache.m_iWatchCount];
+        return;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool watch_tree(const char* szPrefix)
+{
+    /*
+        Adds a watch for the directory ROOT + szPrefix and every directory
+        below it. inotify is not recursive, so new subdirectories are added
+        again from file_cache_process_events().
+    */
+
+    char szDir[PATH_MAX];
+    int iLen = snprintf(szDir, sizeof(szDir), "%s%s", g_cache.m_szRoot, szPrefix);
+    if (iLen < 0 || (size_t)iLen >= sizeof(szDir)) return false;
+
+    int iWd = inotify_add_watch(g_cache.m_iInotifyFd, szDir, FILE_CACHE_WATCH_MASK | IN_ONLYDIR);
+    if (iWd < 0) return errno == ENOTDIR;   // DT_UNKNOWN entry that was not a directory
+
+    // the same directory can be reported twice (create event racing the scan)
+    if (!watch_find(iWd))
+    {
+        if (g_cache.m_iWatchCount == g_cache.m_iWatchCapacity)
+        {
+            size_t iNewCapacity = g_cache.m_iWatchCapacity ? g_cache.m_iWatchCapacity * 2 : 16;
+            WATCHED_DIR* pGrown = realloc(g_cache.m_arrWatches, iNewCapacity * sizeof(WATCHED_DIR));
+            if (!pGrown) return false;
+
+            g_cache.m_arrWatches = pGrown;
+            g_cache.m_iWatchCapacity = iNewCapacity;
+        }
+
+        char* szCopy = strdup(szPrefix);
+        if (!szCopy) return false;
+
+        g_cache.m_arrWatches[g_cache.m_iWatchCount].m_iWd = iWd;
+        g_cache.m_arrWatches[g_cache.m_iWatchCount].m_szPrefix = szCopy;
+        g_cache.m_iWatchCount++;
+    }
+
+    DIR* pDir = opendir(szDir);
+    if (!pDir) return false;
+
+    bool bOk = true;
+    struct dirent* pDirent;
+    while ((pDirent = readdir(pDir)) != NULL)
+    {
+        if (pDirent->d_type != DT_DIR && pDirent->d_type != DT_UNKNOWN) continue;
+        if (strcmp(pDirent->d_name, ".") == 0 || strcmp(pDirent->d_name, "..") == 0) continue;
+
+        char szChild[PATH_MAX];
+        iLen = snprintf(szChild, sizeof(szChild), "%s/%s", szPrefix, pDirent->d_name);
+        if (iLen < 0 || (size_t)iLen >= sizeof(szChild)) continue;
+
+        if (!watch_tree(szChild)) bOk = false;
+    }
+
+    closedir(pDir);
+    return bOk;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool entry_render_small_file(FILE_CACHE_ENTRY* pEntry)
+{
+    /*
+        Reads the whole file behind the entity headers, so a hit needs no
+        file access at all. A short read (file truncated while we read)
+        leaves the entry as a plain fd entry.
+    */
+
+    size_t iBodyLen = (size_t)pEntry->m_stat.st_size;
+    size_t iTotal   = pEntry->m_iEntityHeadersLen + 2 + iBodyLen;
+
+    char* pRendered = malloc(iTotal);
+    if (!pRendered) return false;
+
+    memcpy(pRendered, pEntry->m_szEntityHeaders, pEntry->m_iEntityHeadersLen);
+    memcpy(pRendered + pEntry->m_iEntityHeadersLen, "\r\n", 2);
+
+    size_t iRead = 0;
+    while (iRead < iBodyLen)
+    {
+        ssize_t n = pread(pEntry->m_iFd, pRendered + pEntry->m_iEntityHeadersLen + 2 + iRead,
+                          iBodyLen - iRead, (off_t)iRead);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            free(pRendered);
+            return false;
+        }
+        iRead += (size_t)n;
+    }
+
+    pEntry->m_pRendered    = pRendered;
+    pEntry->m_iRenderedLen = iTotal;
+
+    close(pEntry->m_iFd);
+    pEntry->m_iFd = -1;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool file_cache_init(const char* szRoot, size_t iMaxEntries, size_t iSmallFileMax)
+{
+    /*
+        Called by each worker after fork, so every worker has its own
+        inotify instance and its own descriptors.
+        If the watches cannot be set up the cache stays disabled: serving
+        stale files would be worse than the extra syscalls.
+    */
+
+    if (!szRoot || g_cache.m_bEnabled) return g_cache.m_bEnabled;
+
+    g_cache.m_iMaxEntries   = iMaxEntries ? iMaxEntries : FILE_CACHE_MAX_ENTRIES;
+    g_cache.m_iSmallFileMax = iSmallFileMax;
+    g_cache.m_szRoot = strdup(szRoot);
+    if (!g_cache.m_szRoot) return false;
+
+    g_cache.m_iInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_cache.m_iInotifyFd < 0)
+    {
+        file_cache_shutdown();
+        return false;
+    }
+
+    if (!watch_tree(""))
+    {
+        file_cache_shutdown();
+        return false;
+    }
+
+    g_cache.m_bEnabled = true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void file_cache_shutdown(void)
+{
+    cache_clear();
+
+    for (size_t iX = 0; iX < g_cache.m_iWatchCount; ++iX)
+        free(g_cache.m_arrWatches[iX].m_szPrefix);
+    free(g_cache.m_arrWatches);
+
+    if (g_cache.m_iInotifyFd >= 0) close(g_cache.m_iInotifyFd);
+    free(g_cache.m_szRoot);
+
+    memset(&g_cache, 0, sizeof(g_cache));
+    g_cache.m_iInotifyFd = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int file_cache_watch_fd(void)
+{
+    return g_cache.m_bEnabled ? g_cache.m_iInotifyFd : -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void file_cache_process_events(void)
+{
+    if (!g_cache.m_bEnabled) return;
+
+    char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1)
+    {
+        ssize_t n = read(g_cache.m_iInotifyFd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        for (char* p = buffer; p < buffer + n; )
+        {
+            const struct inotify_event* pEvent = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + pEvent->len;
+
+            // lost events: nothing in the cache can be trusted anymore
+            if (pEvent->mask & IN_Q_OVERFLOW)
+            {
+                cache_clear();
+                continue;
+            }
+
+            if (pEvent->mask & IN_IGNORED)
+            {
+                watch_forget(pEvent->wd);
+                continue;
+            }
+
+            WATCHED_DIR* pWatch = watch_find(pEvent->wd);
+            if (!pWatch) continue;
+
+            // a watched directory itself went away or moved
+            if (pEvent->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            {
+                cache_clear();
+                continue;
+            }
+
+            if (pEvent->len == 0) continue;
+
+            char szKey[PATH_MAX];
+            int iLen = snprintf(szKey, sizeof(szKey), "%s/%s", pWatch->m_szPrefix, pEvent->name);
+            if (iLen < 0 || (size_t)iLen >= sizeof(szKey))
+            {
+                cache_clear();
+                continue;
+            }
+
+            if (pEvent->mask & IN_ISDIR)
+            {
+                // every cached path below a renamed / removed directory is stale
+                if (pEvent->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE))
+                    cache_clear();
+                if (pEvent->mask & (IN_CREATE | IN_MOVED_TO))
+                    watch_tree(szKey);
+                continue;
+            }
+
+            cache_invalidate(szKey);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+FILE_CACHE_ENTRY* file_cache_lookup(const char* szKey)
+{
+    if (!g_cache.m_bEnabled || !szKey) return NULL;
+
+    FILE_CACHE_ENTRY* pEntry = cache_find(szKey, hash_key(szKey));
+    if (!pEntry) return NULL;
+
+    if (g_cache.m_pLruHead != pEntry)
+    {
+        lru_unlink(pEntry);
+        lru_push_front(pEntry);
+    }
+
+    pEntry->m_iRefCount++;
+    return pEntry;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+FILE_CACHE_ENTRY* file_cache_insert
+(
+    const char*        szKey,
+    int                iFd,
+    const struct stat* pStat,
+    const char*        szMIMEType,
+    const char*        szEntityHeaders,
+    size_t             iEntityHeadersLen
+)
+{
+    if (!g_cache.m_bEnabled || !szKey || iFd < 0 || !pStat) return NULL;
+
+    FILE_CACHE_ENTRY* pEntry = calloc(1, sizeof(FILE_CACHE_ENTRY));
+    if (!pEntry) return NULL;
+
+    pEntry->m_szKey = strdup(szKey);
+    pEntry->m_szEntityHeaders = malloc(iEntityHeadersLen + 1);
+    if (!pEntry->m_szKey || !pEntry->m_szEntityHeaders)
+    {
+        free(pEntry->m_szKey);
+        free(pEntry->m_szEntityHeaders);
+        free(pEntry);
+        return NULL;
+    }
+
+    memcpy(pEntry->m_szEntityHeaders, szEntityHeaders, iEntityHeadersLen);
+    pEntry->m_szEntityHeaders[iEntityHeadersLen] = '\0';
+    pEntry->m_iEntityHeadersLen = iEntityHeadersLen;
+
+    pEntry->m_iFd        = iFd;
+    pEntry->m_stat       = *pStat;
+    pEntry->m_szMIMEType = szMIMEType;
+    pEntry->m_uHash      = hash_key(szKey);
+    pEntry->m_iRefCount  = 2;   // the cache's and the caller's
+    pEntry->m_bCached    = true;
+
+    if (g_cache.m_iSmallFileMax && (size_t)pStat->st_size <= g_cache.m_iSmallFileMax)
+        entry_render_small_file(pEntry);
+
+    // the same file opened twice (both missed before either was inserted)
+    FILE_CACHE_ENTRY* pOld = cache_find(szKey, pEntry->m_uHash);
+    if (pOld) cache_remove(pOld);
+
+    while (g_cache.m_iCount >= g_cache.m_iMaxEntries && g_cache.m_pLruTail)
+        cache_remove(g_cache.m_pLruTail);
+
+    FILE_CACHE_ENTRY** ppBucket = &g_cache.m_arrBuckets[pEntry->m_uHash & (FILE_CACHE_BUCKETS - 1)];
+    pEntry->m_pNextInBucket = *ppBucket;
+    *ppBucket = pEntry;
+
+    lru_push_front(pEntry);
+    g_cache.m_iCount++;
+
+    return pEntry;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void file_cache_release(void* pContext)
+{
+    FILE_CACHE_ENTRY* pEntry = pContext;
+    if (!pEntry) return;
+
+    if (--pEntry->m_iRefCount == 0)
+        entry_free(pEntry);
+}
@@ -0,0 +1,85 @@
+/*
+    File name    : file_cache.h
+    creation date: 24-03-26
+    Author       : Solomon
+*/
+
+/*
+    Per-worker cache of open static files.
+
+    Keyed by the normalized URL path of the file that is actually served
+    ("/" is stored as "/index.html"), an entry keeps the open descriptor,
+    its stat, the MIME type and the pre-rendered entity headers
+    (Content-Type, Content-Length, Last-Modified). A hit costs no
+    filesystem syscall at all before the sendfile().
+
+    Files up to the small-file limit are also read into memory once: the
+    entry then holds the entity headers, the blank line and the body in one
+    buffer (m_pRendered), its descriptor is closed, and a hit is answered
+    with one sendmsg() of the per-request head plus that buffer.
+
+    Entries are refcounted: the cache holds one reference and every queued
+    response holds one more, so an entry that is evicted or invalidated
+    while its file is still being sent keeps its descriptor open until the
+    last response using it is done.
+
+    The root is watched with inotify (every directory, recursively). Any
+    change to a file drops its entry; directory renames / removals and
+    queue overflows drop everything. Without inotify nothing is cached.
+    Changes to the target of a symlink that lives outside the root are
+    not seen.
+*/
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>     // provides size_t
+#include <stdint.h>     // provides uint32_t
+#include <stdbool.h>
+#include <sys/stat.h>   // provides struct stat
+
+#define FILE_CACHE_MAX_ENTRIES    1024
+#define FILE_CACHE_SMALL_FILE_MAX (32 * 1024)   // bytes, 0 disables the in-memory copies
+
+typedef struct FILE_CACHE_ENTRY
+{
+    char*        m_szKey;              // e.g. "/css/site.css"
+    int          m_iFd;                // -1 for small files (served from m_pRendered)
+    struct stat  m_stat;
+    const char*  m_szMIMEType;         // static string from getMIMEType()
+    char*        m_szEntityHeaders;    // "Content-Type: ..\r\nContent-Length: ..\r\nLast-Modified: ..\r\n"
+    size_t       m_iEntityHeadersLen;
+
+    char*        m_pRendered;          // small files: entity headers + "\r\n" + body, NULL otherwise
+    size_t       m_iRenderedLen;
+
+    uint32_t     m_uHash;
+    unsigned     m_iRefCount;
+    bool         m_bCached;            // still reachable through the table
+
+    struct FILE_CACHE_ENTRY* m_pNextInBucket;
+    struct FILE_CACHE_ENTRY* m_pLruPrev;   // towards most recently used
+    struct FILE_CACHE_ENTRY* m_pLruNext;   // towards least recently used
+} FILE_CACHE_ENTRY;
+
+bool              file_cache_init          (const char* szRoot, size_t iMaxEntries, size_t iSmallFileMax); // once per worker
+void              file_cache_shutdown      (void);
+int               file_cache_watch_fd      (void); // inotify fd to register with epoll, -1 when disabled
+void              file_cache_process_events(void); // drains inotify, called when the watch fd is readable
+
+FILE_CACHE_ENTRY* file_cache_lookup (const char* szKey); // returns a reference or NULL
+FILE_CACHE_ENTRY* file_cache_insert (const char* szKey, int iFd, const struct stat* pStat, const char* szMIMEType,
+                                     const char* szEntityHeaders, size_t iEntityHeadersLen); // owns iFd on success, returns a reference
+void              file_cache_release(void* pEntry);      // drops a reference, matches OUT_RELEASE_FN
+
+#endif
+
+/*
+
+file_cache_init()           -> sets up the table and the inotify watches on the root
+file_cache_process_events() -> invalidates entries for every file that changed
+file_cache_lookup()         -> finds a file by URL path and marks it most recently used
+file_cache_insert()         -> adds an opened file, evicting the least recently used entry when full
+file_cache_release()        -> gives back a reference taken by lookup / insert
+
+*/
@@ -0,0 +1,397 @@
+/*
+    File name    : health.c
+    creation date: 14-04-26
+    Author       : Solomon
+*/
+
+#define _GNU_SOURCE     // enables SOCK_NONBLOCK, SOCK_CLOEXEC
+
+#include <stdio.h>      // provides snprintf(), fprintf()
+#include <string.h>     // provides memcpy(), memset(), strlen(), strncmp()
+#include <errno.h>      // provides errno, EINPROGRESS, EINTR
+#include <signal.h>     // provides signal(), kill(), SIGTERM, sig_atomic_t
+#include <unistd.h>     // provides fork(), close(), usleep(), _exit()
+#include <poll.h>       // provides poll(), struct pollfd
+#include <sys/mman.h>   // provides mmap(), MAP_SHARED, MAP_ANONYMOUS
+#include <sys/socket.h> // provides socket(), connect(), send(), recv(), getsockopt()
+#include <sys/wait.h>   // provides waitpid()
+#include <netinet/in.h> // provides struct sockaddr_in
+#include "health.h"
+#include "proxy.h"      // provides PROXY_UPSTREAM
+#include "connection.h" // provides monotonic_ms()
+
+typedef enum
+{
+    PROBE_CONNECTING = 0,
+    PROBE_READING,          // request sent, waiting for the status line
+    PROBE_DONE,
+} PROBE_STATE;
+
+typedef struct HEALTH_PROBE
+{
+    int         m_iFd;
+    PROBE_STATE m_state;
+    bool        m_bPassed;
+    size_t      m_iLength;
+    char        m_arrResponse[HEALTH_PROBE_RESPONSE_SIZE];
+} HEALTH_PROBE;
+
+// set up by the master before fork(), read only afterwards
+static HEALTH_SLOT*       g_arrSlots;
+static int                g_iCount;
+static struct sockaddr_in g_arrAddrs[HEALTH_MAX_UPSTREAMS];
+static char               g_arrNames[HEALTH_MAX_UPSTREAMS][64];
+static char               g_szCheckPath[256];
+static uint64_t           g_uIntervalMs = DEFAULT_HEALTH_INTERVAL_MS;
+static uint64_t           g_uTimeoutMs  = DEFAULT_HEALTH_TIMEOUT_MS;
+static uint32_t           g_uEjectAfter = DEFAULT_HEALTH_EJECT_AFTER;
+static uint64_t           g_uEjectMs    = DEFAULT_HEALTH_EJECT_MS;
+static pid_t              g_checkerPid  = -1;
+
+// checker side
+static volatile sig_atomic_t g_bCheckerRunning = 1;
+
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Helper Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void health_on_signal(int sig)
+{
+    (void)sig;
+    g_bCheckerRunning = 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool health_probe_passed(const HEALTH_PROBE* pProbe)
+{
+    // "HTTP/1.x 2xx" or "HTTP/1.x 3xx", nothing after the status code matters
+    const char* p = pProbe->m_arrResponse;
+    if (pProbe->m_iLength < 12 || strncmp(p, "HTTP/1.", 7) != 0 || p[8] != ' ') return false;
+    return (p[9] == '2' || p[9] == '3') && p[10] >= '0' && p[10] <= '9' && p[11] >= '0' && p[11] <= '9';
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void health_probe_start(HEALTH_PROBE* pProbe, int iUpstream)
+{
+    memset(pProbe, 0, sizeof(*pProbe));
+    pProbe->m_state = PROBE_DONE;
+
+    pProbe->m_iFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pProbe->m_iFd < 0) return;
+
+    const struct sockaddr_in* pAddr = &g_arrAddrs[iUpstream];
+    if (connect(pProbe->m_iFd, (const struct sockaddr*)pAddr, sizeof(*pAddr)) < 0 && errno != EINPROGRESS)
+    {
+        close(pProbe->m_iFd);
+        pProbe->m_iFd = -1;
+        return;
+    }
+
+    pProbe->m_state = PROBE_CONNECTING;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void health_probe_step(HEALTH_PROBE* pProbe, int iUpstream, short iRevents)
+{
+    if (pProbe->m_state == PROBE_CONNECTING)
+    {
+        int iError = 0;
+        socklen_t iLen = sizeof(iError);
+        if (getsockopt(pProbe->m_iFd, SOL_SOCKET, SO_ERROR, &iError, &iLen) < 0 || iError != 0)
+        {
+            pProbe->m_state = PROBE_DONE;
+            return;
+        }
+
+        // a few dozen bytes on a fresh socket: one send() takes all of it
+        char szRequest[512];
+        int iRequestLen = snprintf(szRequest, sizeof(szRequest),
+            "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: Solomon-health\r\nConnection: close\r\n\r\n",
+            g_szCheckPath, g_arrNames[iUpstream]);
+
+        if (iRequestLen <= 0 || (size_t)iRequestLen >= sizeof(szRequest) ||
+            send(pProbe->m_iFd, szRequest, (size_t)iRequestLen, MSG_NOSIGNAL) != iRequestLen)
+        {
+            pProbe->m_state = PROBE_DONE;
+            return;
+        }
+
+        pProbe->m_state = PROBE_READING;
+        return;
+    }
+
+    if (pProbe->m_state != PROBE_READING || !(iRevents & (POLLIN | POLLHUP | POLLERR))) return;
+
+    ssize_t iRead = recv(pProbe->m_iFd, pProbe->m_arrResponse + pProbe->m_iLength,
+                         sizeof(pProbe->m_arrResponse) - pProbe->m_iLength, 0);
+    if (iRead < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (iRead > 0) pProbe->m_iLength += (size_t)iRead;
+
+    // the status line is all we want; the rest of the response is not read
+    if (iRead <= 0 || pProbe->m_iLength >= 12)
+    {
+        pProbe->m_bPassed = health_probe_passed(pProbe);
+        pProbe->m_state   = PROBE_DONE;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void health_run_round(HEALTH_PROBE* arrProbes)
+{
+    /*
+        One round probes every upstream at once: all connects are started,
+        then a single poll() loop drives them until they are done or the
+        timeout is up. A slow upstream costs the round its timeout, not
+        the other upstreams their probes.
+    */
+
+    for (int iX = 0; iX < g_iCount; ++iX) health_probe_start(&arrProbes[iX], iX);
+
+    uint64_t uDeadline = monotonic_ms() + g_uTimeoutMs;
+    while (g_bCheckerRunning)
+    {
+        struct pollfd arrPoll[HEALTH_MAX_UPSTREAMS];
+        int arrIndex[HEALTH_MAX_UPSTREAMS];
+        int iPending = 0;
+
+        for (int iX = 0; iX < g_iCount; ++iX)
+        {
+            if (arrProbes[iX].m_state == PROBE_DONE) continue;
+            arrPoll[iPending].fd      = arrProbes[iX].m_iFd;
+            arrPoll[iPending].events  = arrProbes[iX].m_state == PROBE_CONNECTING ? POLLOUT : POLLIN;
+            arrPoll[iPending].revents = 0;
+            arrIndex[iPending++]      = iX;
+        }
+
+        uint64_t uNow = monotonic_ms();
+        if (iPending == 0 || uNow >= uDeadline) break;
+
+        int iReady = poll(arrPoll, (nfds_t)iPending, (int)(uDeadline - uNow));
+        if (iReady < 0 && errno != EINTR) break;
+
+        for (int iX = 0; iX < iPending && iReady > 0; ++iX)
+        {
+            if (arrPoll[iX].revents)
+                health_probe_step(&arrProbes[arrIndex[iX]], arrIndex[iX], arrPoll[iX].revents);
+        }
+    }
+
+    for (int iX = 0; iX < g_iCount; ++iX)
+    {
+        if (arrProbes[iX].m_iFd >= 0) close(arrProbes[iX].m_iFd);
+        arrProbes[iX].m_iFd = -1;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void health_checker_main(void)
+{
+    // like the log writer: Ctrl-C is for the master, the checker waits for its SIGTERM
+    signal(SIGTERM, health_on_signal);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    static HEALTH_PROBE arrProbes[HEALTH_MAX_UPSTREAMS];
+    int arrStreak[HEALTH_MAX_UPSTREAMS];        // > 0: passes in a row, < 0: failures in a row
+    memset(arrStreak, 0, sizeof(arrStreak));
+
+    while (g_bCheckerRunning)
+    {
+        uint64_t uRoundStart = monotonic_ms();
+        health_run_round(arrProbes);
+
+        for (int iX = 0; iX < g_iCount && g_bCheckerRunning; ++iX)
+        {
+            HEALTH_SLOT* pSlot = &g_arrSlots[iX];
+            bool bPassed = arrProbes[iX].m_bPassed;
+
+            __atomic_store_n(&pSlot->m_uProbes, pSlot->m_uProbes + 1, __ATOMIC_RELAXED);
+            if (!bPassed)
+                __atomic_store_n(&pSlot->m_uProbeFailures, pSlot->m_uProbeFailures + 1, __ATOMIC_RELAXED);
+
+            if (bPassed) arrStreak[iX] = arrStreak[iX] > 0 ? arrStreak[iX] + 1 : 1;
+            else         arrStreak[iX] = arrStreak[iX] < 0 ? arrStreak[iX] - 1 : -1;
+
+            bool bDown = __atomic_load_n(&pSlot->m_uDown, __ATOMIC_RELAXED) != 0;
+            if (!bDown && arrStreak[iX] <= -HEALTH_FALL)
+            {
+                __atomic_store_n(&pSlot->m_uDown, 1, __ATOMIC_RELEASE);
+                fprintf(stderr, "health: upstream %s is down\n", g_arrNames[iX]);
+            }
+            else if (bDown && arrStreak[iX] >= HEALTH_RISE)
+            {
+                // probes say it recovered: an ejection still running is lifted with it
+                __atomic_store_n(&pSlot->m_uEjectedUntilMs, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&pSlot->m_uConsecutiveFailures, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&pSlot->m_uDown, 0, __ATOMIC_RELEASE);
+                fprintf(stderr, "health: upstream %s is up\n", g_arrNames[iX]);
+            }
+        }
+
+        // sleep out the rest of the interval; SIGTERM cuts the sleep short
+        uint64_t uElapsed = monotonic_ms() - uRoundStart;
+        if (g_bCheckerRunning && uElapsed < g_uIntervalMs)
+            usleep((useconds_t)((g_uIntervalMs - uElapsed) * 1000));
+    }
+}
+
+/*===================================== Master ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void health_configure(const char* szCheckPath, uint64_t uIntervalMs, uint64_t uTimeoutMs,
+                      int iEjectAfter, uint64_t uEjectMs)
+{
+    if (szCheckPath && szCheckPath[0] == '/')
+        snprintf(g_szCheckPath, sizeof(g_szCheckPath), "%s", szCheckPath);
+
+    if (uIntervalMs)      g_uIntervalMs = uIntervalMs;
+    if (uTimeoutMs)       g_uTimeoutMs  = uTimeoutMs;
+    if (iEjectAfter >= 0) g_uEjectAfter = (uint32_t)iEjectAfter;
+    if (uEjectMs)         g_uEjectMs    = uEjectMs;
+
+    // a probe that outlives the interval would only delay the next round
+    if (g_uTimeoutMs > g_uIntervalMs) g_uTimeoutMs = g_uIntervalMs;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool health_init(const PROXY_UPSTREAM* arrUpstreams, int iCount)
+{
+    if (!arrUpstreams || iCount <= 0 || iCount > HEALTH_MAX_UPSTREAMS) return false;
+
+    // zero filled by the kernel: every upstream starts up and not ejected
+    size_t iSize = (size_t)iCount * sizeof(HEALTH_SLOT);
+    void* pMap = mmap(NULL, iSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pMap == MAP_FAILED) return false;
+
+    for (int iX = 0; iX < iCount; ++iX)
+    {
+        g_arrAddrs[iX] = arrUpstreams[iX].m_addr;
+        snprintf(g_arrNames[iX], sizeof(g_arrNames[iX]), "%s", arrUpstreams[iX].m_szName);
+    }
+
+    g_arrSlots = pMap;
+    g_iCount   = iCount;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+pid_t health_spawn_checker(void)
+{
+    if (!g_arrSlots || g_szCheckPath[0] == '\0') return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+
+    if (pid == 0)
+    {
+        health_checker_main();
+        _exit(0);
+    }
+
+    g_checkerPid = pid;
+    return pid;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool health_is_checker(pid_t pid)
+{
+    return g_arrSlots && pid > 0 && pid == g_checkerPid;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void health_stop_checker(void)
+{
+    if (g_checkerPid <= 0) return;
+
+    kill(g_checkerPid, SIGTERM);
+    while (waitpid(g_checkerPid, NULL, 0) == -1)
+    {
+        if (errno != EINTR) break;
+    }
+
+    g_checkerPid = -1;
+}
+
+/*===================================== Worker ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+uint32_t health_usable_mask(uint64_t uNowMs)
+{
+    uint32_t uAll = g_iCount >= 32 ? 0xffffffffu : ((1u << g_iCount) - 1u);
+    if (!g_arrSlots) return uAll;
+
+    uint32_t uMask = 0;
+    for (int iX = 0; iX < g_iCount; ++iX)
+    {
+        const HEALTH_SLOT* pSlot = &g_arrSlots[iX];
+        if (__atomic_load_n(&pSlot->m_uDown, __ATOMIC_ACQUIRE)) continue;
+        if (uNowMs < __atomic_load_n(&pSlot->m_uEjectedUntilMs, __ATOMIC_RELAXED)) continue;
+        uMask |= 1u << iX;
+    }
+
+    // nothing usable: better to try them all than to refuse every request
+    return uMask ? uMask : uAll;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void health_report(int iUpstream, bool bSuccess, uint64_t uNowMs)
+{
+    if (!g_arrSlots || g_uEjectAfter == 0 || iUpstream < 0 || iUpstream >= g_iCount) return;
+
+    HEALTH_SLOT* pSlot = &g_arrSlots[iUpstream];
+
+    if (bSuccess)
+    {
+        // the common case reads only, the shared line is written when something changes
+        if (__atomic_load_n(&pSlot->m_uConsecutiveFailures, __ATOMIC_RELAXED) != 0)
+            __atomic_store_n(&pSlot->m_uConsecutiveFailures, 0, __ATOMIC_RELAXED);
+
+        // healthy for as long as the longest ejection: the next one starts short again
+        uint64_t uUntil = __atomic_load_n(&pSlot->m_uEjectedUntilMs, __ATOMIC_RELAXED);
+        if (uUntil && uNowMs >= uUntil + HEALTH_EJECT_MAX_MS)
+        {
+            __atomic_store_n(&pSlot->m_uEjections, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&pSlot->m_uEjectedUntilMs, 0, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    uint32_t uFailures = __atomic_add_fetch(&pSlot->m_uConsecutiveFailures, 1, __ATOMIC_RELAXED);
+    if (uFailures < g_uEjectAfter) return;
+
+    // several workers may cross the threshold together; the one that resets the count ejects
+    if (!__atomic_compare_exchange_n(&pSlot->m_uConsecutiveFailures, &uFailures, 0, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    // failures of requests sent while every upstream was unusable do not extend an ejection
+    if (uNowMs < __atomic_load_n(&pSlot->m_uEjectedUntilMs, __ATOMIC_RELAXED)) return;
+
+    uint32_t uEjections = __atomic_add_fetch(&pSlot->m_uEjections, 1, __ATOMIC_RELAXED);
+    uint32_t uShift     = uEjections - 1 < 20 ? uEjections - 1 : 20;
+    uint64_t uDuration  = g_uEjectMs << uShift;
+    if (uDuration > HEALTH_EJECT_MAX_MS) uDuration = HEALTH_EJECT_MAX_MS;
+
+    __atomic_store_n(&pSlot->m_uEjectedUntilMs, uNowMs + uDuration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pSlot->m_uEjectionsTotal, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,90 @@
+/*
+    File name    : health.h
+    creation date: 14-04-26
+    Author       : Solomon
+*/
+
+/*
+    Upstream health.
+
+    Two independent signals decide whether the balancer may pick an
+    upstream, both kept in one shared memory segment mapped by the master
+    before fork, so every worker sees the same picture:
+
+      active   a checker process forked by the master probes every upstream
+               with "GET <path>" each interval. HEALTH_FALL failed probes in
+               a row mark it down, HEALTH_RISE good ones bring it back.
+               A probe passes on a 2xx or 3xx status within the timeout.
+
+      passive  workers report the outcome of every proxied exchange. After
+               N consecutive failures (connect errors, resets, timeouts or a
+               5xx response) the upstream is ejected for the ejection time;
+               each further ejection doubles that time up to
+               HEALTH_EJECT_MAX_MS. A good exchange resets the failure
+               count, and a long stretch without ejections resets the
+               backoff.
+
+    When every upstream is down or ejected the proxy ignores both signals
+    and spreads the load over all of them: a guess beats a certain 502.
+*/
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>     // provides uint64_t, uint32_t
+#include <stdbool.h>
+#include <sys/types.h>  // provides pid_t
+
+#define HEALTH_MAX_UPSTREAMS        32      // same bound as PROXY_MAX_UPSTREAMS
+#define HEALTH_RISE                 2       // good probes in a row to come back up
+#define HEALTH_FALL                 3       // failed probes in a row to go down
+#define HEALTH_EJECT_MAX_MS         300000  // ejection backoff cap
+#define HEALTH_PROBE_RESPONSE_SIZE  64      // enough for the status line
+
+#define DEFAULT_HEALTH_INTERVAL_MS  5000
+#define DEFAULT_HEALTH_TIMEOUT_MS   2000
+#define DEFAULT_HEALTH_EJECT_AFTER  5       // consecutive failures, 0 turns ejection off
+#define DEFAULT_HEALTH_EJECT_MS     10000   // first ejection
+
+typedef struct PROXY_UPSTREAM PROXY_UPSTREAM;
+
+typedef struct HEALTH_SLOT
+{
+    // active state, written by the checker only
+    _Alignas(64) uint32_t m_uDown;
+    uint64_t m_uProbes;
+    uint64_t m_uProbeFailures;
+
+    // passive state, written by every worker
+    _Alignas(64) uint32_t m_uConsecutiveFailures;
+    uint32_t m_uEjections;                  // ejections since the backoff was last reset
+    uint64_t m_uEjectedUntilMs;             // monotonic_ms(), 0 when not ejected
+    uint64_t m_uEjectionsTotal;
+} HEALTH_SLOT;
+
+/*===================================== Master ======================================*/
+void  health_configure     (const char* szCheckPath, uint64_t uIntervalMs, uint64_t uTimeoutMs,
+                            int iEjectAfter, uint64_t uEjectMs);
+bool  health_init          (const PROXY_UPSTREAM* arrUpstreams, int iCount);
+pid_t health_spawn_checker (void);                 // -1 when active checks are off or fork() failed
+bool  health_is_checker    (pid_t pid);            // the master respawns it like a worker
+void  health_stop_checker  (void);
+
+/*===================================== Worker ======================================*/
+uint32_t health_usable_mask(uint64_t uNowMs);      // bit i set: upstream i may be picked
+void     health_report     (int iUpstream, bool bSuccess, uint64_t uNowMs);
+
+#endif
+
+/*
+
+health_configure()     -> an empty / NULL path leaves active checks off; iEjectAfter 0 leaves ejection off
+health_init()          -> maps one HEALTH_SLOT per upstream; every upstream starts up
+health_spawn_checker() -> forks the checker; each round probes every upstream in parallel (non-blocking
+                          connects under one poll()), then sleeps out the interval. State changes are
+                          reported on stderr
+health_usable_mask()   -> upstreams neither down nor ejected; every configured one when that is none
+health_report()        -> passive outcome of one exchange; the worker whose failure reaches the
+                          threshold ejects the upstream
+
+*/
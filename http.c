@@ -4,11 +4,14 @@
     Author: Solomon
 */
 
-#include <string.h>  // provides memcmp(), strcmp()
+#include <string.h>  // provides memcmp(), strcmp(), memchr(), memmove()
+#include <strings.h> // provides strcasecmp()
 #include <stdio.h>   // provides printf()
 #include <stdbool.h> // provides bool type
 #include <stdlib.h>  // all dynamic memory allocation
 #include "http.h"
+#include "http_scan.h"
+#include "arena.h"    // provides arenaCalloc(), arenaRealloc()
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //======================================== MAIN PARSER API ========================================//
@@ -30,30 +33,6 @@
 
 /* ---------- small helpers ---------- */
 
-/* Find the first occurrence of `needle` inside `haystack` but limited to haystack_len.
- * Returns pointer to the match inside haystack, or NULL if not found.
- */
-static char* find_substr_in_bounds
-(
-    const char* haystack,
-    size_t      haystack_len,
-    const char* needle
-)
-{
-    if (!haystack || !needle) return NULL;
-
-    size_t needle_len = strlen(needle);
-    if (needle_len == 0 || haystack_len < needle_len) return NULL;
-
-    const char* end_search = haystack + (haystack_len - needle_len) + 1;
-    for (const char* p = haystack; p < end_search; ++p)
-    {
-        if (memcmp(p, needle, needle_len) == 0)
-            return (char*)p;
-    }
-    return NULL;
-}
-
 /* Safe helper: returns remaining bytes from a pointer into the raw buffer.
    If ptr is outside range, returns 0. */
 static size_t remaining_from_pointer
@@ -70,21 +49,48 @@ static size_t remaining_from_pointer
     return ri->m_iTotalRawBytes - offset;
 }
 
-//////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////////
-PARSE_RESULT launch_parser
+/* Parser allocations come from ri->m_pArena when the worker attached one
+ * (released all at once by arenaReset) and from the heap otherwise. */
+static void* request_calloc
+(
+    REQUEST_INFO* ri,
+    size_t        count,
+    size_t        size
+)
+{
+    if (ri->m_pArena) return arenaCalloc(ri->m_pArena, count, size);
+    return calloc(count, size);
+}
+
+static void* request_realloc
+(
+    REQUEST_INFO* ri,
+    void*         ptr,
+    size_t        old_size,
+    size_t        new_size
+)
+{
+    if (ri->m_pArena) return arenaRealloc(ri->m_pArena, ptr, old_size, new_size);
+    return realloc(ptr, new_size);
+}
+
+static void request_free
+(
+    REQUEST_INFO* ri,
+    void*         ptr
+)
+{
+    if (!ri->m_pArena) free(ptr);
+}
+
+/* Resets every REQUEST_INFO field so the parser can own allocations again. */
+static void reset_request_info
 (
     REQUEST_INFO* ri,
     const char*   pBytestream,
     size_t        bytestream_len
 )
 {
-    if (!ri || !pBytestream) {
-        if (ri) ri->m_parseResult = ERR_NULL_CHECK_FAILED;
-        return ERR_NULL_CHECK_FAILED;
-    }
-
-    /* Initialize REQUEST_INFO fields conservatively so parser can own allocations */
     ri->m_pRawRequest            = pBytestream;
     ri->m_iTotalRawBytes         = bytestream_len;
 
@@ -113,6 +119,107 @@ PARSE_RESULT launch_parser
 
     /* initialize parse result to success; parser stages will overwrite on error */
     ri->m_parseResult = PARSE_SUCCESS;
+}
+
+/* Terminates a line in place (a trailing '\r' becomes '\0').
+ * pLine[iLen] must be writable (it is the '\r' or '\n' that ended the line).
+ * Returns the length of the line without the CR. */
+static size_t terminate_line
+(
+    char*  pLine,
+    size_t iLen
+)
+{
+    if (iLen > 0 && pLine[iLen - 1] == '\r') iLen--;
+    pLine[iLen] = '\0';
+    return iLen;
+}
+
+/* Splits a '\0' terminated request line into method, path and version. */
+static PARSE_RESULT split_request_line
+(
+    REQUEST_INFO* ri,
+    char*         pLine
+)
+{
+    char* pSavePtr = NULL;
+
+    ri->m_szMethod = strtok_r(pLine, " ", &pSavePtr);
+    ri->m_szPath   = strtok_r(NULL, " ", &pSavePtr);
+    ri->m_szVersion= strtok_r(NULL, " ", &pSavePtr);
+
+    if (!ri->m_szMethod) return ERR_INVALID_METHOD;
+    if (!ri->m_szPath)   return ERR_INVALID_PATH;
+    if (!ri->m_szVersion)return ERR_INVALID_PROTOCOL;
+
+    /* ensure no extra token after version */
+    if (strtok_r(NULL, " ", &pSavePtr) != NULL) return ERR_INVALID_FORMAT;
+
+    return PARSE_SUCCESS;
+}
+
+/* Adds one '\0' terminated "Key: value" line to h_entries, splitting it in place.
+ * pColon is the first ':' of the line when the scanner already found it (NULL: search here).
+ * Returns ERR_INVALID_FORMAT when the line has no key / colon. */
+static PARSE_RESULT append_header_line
+(
+    REQUEST_INFO* ri,
+    HEADERS*      h_entries,
+    char*         pLine,
+    size_t        iLen,
+    char*         pColon
+)
+{
+    if (!pColon) pColon = memchr(pLine, ':', iLen);
+    if (!pColon || pColon == pLine || pColon >= pLine + iLen) return ERR_INVALID_FORMAT;
+
+    /* ensure capacity */
+    if (h_entries->count >= h_entries->capacity)
+    {
+        size_t old_cap = h_entries->capacity;
+        size_t new_cap = old_cap ? old_cap * 2 : 16;
+        HEADER_KEY_VALUE* pTemp = request_realloc(ri, h_entries->entries,
+                                                  old_cap * sizeof(HEADER_KEY_VALUE),
+                                                  new_cap * sizeof(HEADER_KEY_VALUE));
+        if (!pTemp) return ERR_CALLOC_FAILED;
+
+        /* zero the added portion */
+        memset(pTemp + old_cap, 0, (new_cap - old_cap) * sizeof(HEADER_KEY_VALUE));
+        h_entries->entries = pTemp;
+        h_entries->capacity = new_cap;
+    }
+
+    *pColon = '\0';
+
+    char* pValue = pColon + 1;
+    char* pValueEnd = pLine + iLen;
+    while (pValue < pValueEnd && (*pValue == ' ' || *pValue == '\t')) pValue++;
+    while (pValueEnd > pValue && (pValueEnd[-1] == ' ' || pValueEnd[-1] == '\t')) pValueEnd--;
+    *pValueEnd = '\0';
+
+    h_entries->entries[h_entries->count].szKey   = pLine;
+    h_entries->entries[h_entries->count].szValue = pValue;
+    h_entries->count++;
+
+    return PARSE_SUCCESS;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////
+PARSE_RESULT launch_parser
+(
+    REQUEST_INFO* ri,
+    const char*   pBytestream,
+    size_t        bytestream_len
+)
+{
+    if (!ri || !pBytestream) {
+        if (ri) ri->m_parseResult = ERR_NULL_CHECK_FAILED;
+        return ERR_NULL_CHECK_FAILED;
+    }
+
+    /* Initialize REQUEST_INFO fields conservatively so parser can own allocations */
+    reset_request_info(ri, pBytestream, bytestream_len);
 
     /* parse stages (each uses ri->m_pRawRequest directly) */
     PARSE_RESULT rc;
@@ -137,8 +244,6 @@ PARSE_RESULT launch_parser
 
     ri->m_parseResult = PARSE_SUCCESS;
 
-    print_request_info(ri);
-
     return PARSE_SUCCESS;
 }
 
@@ -157,40 +262,20 @@ PARSE_RESULT parse_request_line
 
     ri->m_pRequestStart = ri->m_pRawRequest;
 
-    /* find the first CRLF within bounds */
-    char* pLineEnd = find_substr_in_bounds(szRequestBuffer, total_len, "\r\n");
-    if (!pLineEnd) return ERR_NULL_CHECK_FAILED;
+    /* find the first LF within bounds */
+    HTTP_SCAN scan;
+    http_scan_lines(szRequestBuffer, total_len, 0, true, &scan);
+    if (scan.m_iLineCount == 0) return ERR_NULL_CHECK_FAILED;
 
-    size_t iOffset = (size_t)(pLineEnd - szRequestBuffer) + 2;
-    if (iOffset > total_len) return ERR_INVALID_FORMAT;
+    size_t iLineEnd = scan.m_arrLines[0].m_iEnd;
+    if (scan.m_iBareCR < iLineEnd) return ERR_REQUEST_LINE_PARSE_FAILED;
 
-    ri->m_pHeadersStart = (const char*)(pLineEnd + 2);
+    ri->m_pHeadersStart = (const char*)(szRequestBuffer + iLineEnd + 1);
 
-    /* Temporarily terminate the first line so strtok_r works */
-    char saved_char = *pLineEnd;
-    *pLineEnd = '\0';
+    /* terminate the first line in place so strtok_r works */
+    terminate_line(szRequestBuffer, iLineEnd);
 
-    char* pSavePtr = NULL;
-
-    ri->m_szMethod = strtok_r(szRequestBuffer, " ", &pSavePtr);
-    ri->m_szPath   = strtok_r(NULL, " ", &pSavePtr);
-    ri->m_szVersion= strtok_r(NULL, " ", &pSavePtr);
-
-    if (!ri->m_szMethod) { *pLineEnd = saved_char; return ERR_INVALID_METHOD; }
-    if (!ri->m_szPath)   { *pLineEnd = saved_char; return ERR_INVALID_PATH; }
-    if (!ri->m_szVersion){ *pLineEnd = saved_char; return ERR_INVALID_PROTOCOL; }
-
-    /* ensure no extra token after version */
-    if (strtok_r(NULL, " ", &pSavePtr) != NULL)
-    {
-        *pLineEnd = saved_char;
-        return ERR_INVALID_FORMAT;
-    }
-
-    /* restore byte we clobbered (should be '\r') */
-    *pLineEnd = saved_char;
-
-    return PARSE_SUCCESS;
+    return split_request_line(ri, szRequestBuffer);
 }
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -208,96 +293,61 @@ PARSE_RESULT parse_headers
     size_t rem_len = remaining_from_pointer(ri, pHeadersStart);
     if (rem_len == 0) return ERR_INVALID_FORMAT;
 
-    /* find end of headers: \r\n\r\n */
-    char* pHeadersEnd = find_substr_in_bounds(pHeadersStart, rem_len, "\r\n\r\n");
-    if (!pHeadersEnd) return ERR_INVALID_FORMAT;
-
-    size_t iOffset = (size_t)(pHeadersEnd - pHeadersStart) + 4;
-    if (iOffset > rem_len) return ERR_INVALID_FORMAT;
-
-    ri->m_pBodyStart = (const char*)(pHeadersEnd + 4);
-
-    /* Null-terminate header block for easy line parsing */
-    char saved_char = *pHeadersEnd;
-    *pHeadersEnd = '\0';
-
-    char* pCurrentLine = pHeadersStart;
     HEADERS* h_entries = &ri->m_headers;
 
     /* If caller left headers uninitialized, parser will allocate them and take ownership */
     if (!h_entries->entries || h_entries->capacity == 0)
     {
         size_t init_capacity = 16;
-        h_entries->entries = calloc(init_capacity, sizeof(HEADER_KEY_VALUE));
-        if (!h_entries->entries)
-        {
-            *pHeadersEnd = saved_char;
-            return ERR_CALLOC_FAILED;
-        }
+        h_entries->entries = request_calloc(ri, init_capacity, sizeof(HEADER_KEY_VALUE));
+        if (!h_entries->entries) return ERR_CALLOC_FAILED;
         h_entries->capacity = init_capacity;
         h_entries->count = 0;
     }
 
-    while (pCurrentLine && *pCurrentLine != '\0')
+    /* one scanner pass per HTTP_SCAN_MAX_LINES lines, stopping at the empty line */
+    char* pCurrentLine = pHeadersStart;
+    bool  bMalformed = false;
+
+    while (1)
     {
-        /* ensure capacity */
-        if (h_entries->count >= h_entries->capacity)
-        {
-            size_t old_cap = h_entries->capacity;
-            size_t new_cap = old_cap ? old_cap * 2 : 16;
-            HEADER_KEY_VALUE* pTemp = realloc(h_entries->entries, new_cap * sizeof(HEADER_KEY_VALUE));
-            if (!pTemp)
-            {
-                *pHeadersEnd = saved_char;
-                return ERR_CALLOC_FAILED;
-            }
-            /* zero the added portion */
-            if (new_cap > old_cap)
-            {
-                size_t added = new_cap - old_cap;
-                memset(pTemp + old_cap, 0, added * sizeof(HEADER_KEY_VALUE));
-            }
-            h_entries->entries = pTemp;
-            h_entries->capacity = new_cap;
-        }
+        size_t iAvailable = remaining_from_pointer(ri, pCurrentLine);
+        HTTP_SCAN scan;
+        http_scan_lines(pCurrentLine, iAvailable, 0, true, &scan);
 
-        /* find end of this header line */
-        char* pLineEnd = find_substr_in_bounds(pCurrentLine, remaining_from_pointer(ri, pCurrentLine), "\r\n");
-        if (!pLineEnd) break;
+        /* no empty line: the header block is not terminated */
+        if (scan.m_iLineCount == 0) return ERR_INVALID_FORMAT;
 
-        /* isolate header line */
-        char saved_line_char = *pLineEnd;
-        *pLineEnd = '\0';
+        char* pScanBase = pCurrentLine;
 
-        /* find colon */
-        char* pColon = strchr(pCurrentLine, ':');
-        if (!pColon)
+        for (size_t iL = 0; iL < scan.m_iLineCount; ++iL)
         {
-            /* restore and stop parsing headers */
-            *pLineEnd = saved_line_char;
-            break;
-        }
+            size_t iEnd = scan.m_arrLines[iL].m_iEnd;
+            if (scan.m_iBareCR < iEnd) return ERR_HEADERS_PARSE_FAILED;
 
-        *pColon = '\0';
-        h_entries->entries[h_entries->count].szKey = pCurrentLine;
+            char*  pColon = scan.m_arrLines[iL].m_iColon != HTTP_SCAN_NONE ?
+                            pScanBase + scan.m_arrLines[iL].m_iColon : NULL;
+            size_t iLineLen = terminate_line(pCurrentLine, (size_t)(pScanBase + iEnd - pCurrentLine));
 
-        char* pValue = pColon + 1;
-        while (*pValue == ' ') pValue++;
+            if (iLineLen == 0)
+            {
+                ri->m_pBodyStart = (const char*)(pScanBase + iEnd + 1);
+                return PARSE_SUCCESS;
+            }
 
-        h_entries->entries[h_entries->count].szValue = pValue;
-        h_entries->count++;
+            if (!bMalformed)
+            {
+                PARSE_RESULT rc = append_header_line(ri, h_entries, pCurrentLine, iLineLen, pColon);
+                if (rc == ERR_CALLOC_FAILED) return rc;
+                if (rc != PARSE_SUCCESS) bMalformed = true; /* stop collecting headers at the first malformed line */
+            }
 
-        /* restore header line terminator just in case (not strictly necessary) */
-        *pLineEnd = saved_line_char;
+            /* advance to next line */
+            pCurrentLine = pScanBase + iEnd + 1;
+        }
 
-        /* advance to next line */
-        pCurrentLine = pLineEnd + 2;
+        if (scan.m_iScanned == iAvailable) return ERR_INVALID_FORMAT;
     }
-
-    /* restore original header end character (should be '\r') */
-    *pHeadersEnd = saved_char;
-
-    return PARSE_SUCCESS;
 }
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -400,7 +450,7 @@ PARSE_RESULT decode_chunked_body
 
     size_t iCount = 0;
     size_t iCapacity = 1024;
-    char* pBodyBuffer = calloc(iCapacity, 1);
+    char* pBodyBuffer = request_calloc(ri, iCapacity, 1);
     if (!pBodyBuffer) return ERR_CALLOC_FAILED;
 
     size_t iChunkSize = 0;
@@ -439,9 +489,9 @@ PARSE_RESULT decode_chunked_body
         /* ensure capacity */
         while (!(iCount + iChunkSize < iCapacity))
         {
+            char* pTempBuffer = request_realloc(ri, pBodyBuffer, iCapacity, iCapacity * 2);
+            if (!pTempBuffer) { request_free(ri, pBodyBuffer); return ERR_CALLOC_FAILED; }
             iCapacity *= 2;
-            char* pTempBuffer = realloc(pBodyBuffer, iCapacity);
-            if (!pTempBuffer) { free(pBodyBuffer); return ERR_CALLOC_FAILED; }
             pBodyBuffer = pTempBuffer;
         }
 
@@ -500,8 +550,9 @@ PARSE_RESULT decode_chunked_body
         ri->m_pRequestEnd = pCurrentByte;
     }
 
-    /* shrink to fit and null-terminate for convenience */
-    char* pTemp = realloc(pBodyBuffer, iCount + 1);
+    /* shrink to fit (heap only, the capacity check above left room for '\0' in arena
+     * memory) and null-terminate for convenience */
+    char* pTemp = ri->m_pArena ? pBodyBuffer : realloc(pBodyBuffer, iCount + 1);
     if (!pTemp) goto safe_return;
     pTemp[iCount] = '\0';
     pBodyBuffer = pTemp;
@@ -513,10 +564,396 @@ PARSE_RESULT decode_chunked_body
     return PARSE_SUCCESS;
 
 safe_return:
-    if (pBodyBuffer) free(pBodyBuffer);
+    if (pBodyBuffer) request_free(ri, pBodyBuffer);
     return ERR_INVALID_FORMAT;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//===================================== INCREMENTAL PARSER ======================================//
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The incremental parser is line oriented for everything except body bytes:
+ * - request line, header lines, chunk-size lines and trailers are handled once their LF arrives
+ * - Content-Length bodies and chunk data are consumed by count without scanning
+ * Chunk data is moved down in place right behind the previous chunk, so a chunked body ends up
+ * contiguous at m_iBodyStart without any heap allocation.
+ */
+
+/* Records a failure on both the parser and REQUEST_INFO. */
+static PARSER_STATUS parser_fail
+(
+    REQUEST_INFO* ri,
+    PARSE_RESULT  rc
+)
+{
+    ri->m_parseResult = rc;
+    return PARSER_ERROR;
+}
+
+/* Marks the request complete at offset iEnd. */
+static void parser_finish
+(
+    HTTP_PARSER*  pParser,
+    REQUEST_INFO* ri,
+    char*         pBuffer,
+    size_t        iEnd
+)
+{
+    pParser->m_state = PARSER_STATE_DONE;
+
+    ri->m_iTotalRawBytes = iEnd;
+    ri->m_pRequestEnd    = pBuffer + iEnd;
+
+    if (ri->m_is_chunked)
+    {
+        ri->m_iBodyLength = pParser->m_iBodyWrite - pParser->m_iBodyStart;
+        ri->m_szBody      = pBuffer + pParser->m_iBodyStart;
+
+        /* the decoded body is always shorter than its encoding, so there is room for '\0' */
+        pBuffer[pParser->m_iBodyWrite] = '\0';
+    }
+    else if (pParser->m_iContentLength > 0)
+    {
+        ri->m_iBodyLength = pParser->m_iContentLength;
+        ri->m_szBody      = pBuffer + pParser->m_iBodyStart;
+    }
+    else
+    {
+        ri->m_iBodyLength = 0;
+        ri->m_szBody      = NULL;
+    }
+
+    ri->m_parseResult = PARSE_SUCCESS;
+}
+
+/* Interprets the framing headers right after they were split into key / value. */
+static PARSE_RESULT parser_on_header
+(
+    HTTP_PARSER*            pParser,
+    REQUEST_INFO*           ri,
+    const HEADER_KEY_VALUE* pHeader
+)
+{
+    if (strcasecmp(pHeader->szKey, "Content-Length") == 0)
+    {
+        const char* p = pHeader->szValue;
+        if (*p < '0' || *p > '9') return ERR_INVALID_FORMAT;
+
+        size_t iValue = 0;
+        for (; *p >= '0' && *p <= '9'; ++p)
+        {
+            if (iValue > ((size_t)-1 - 9) / 10) return ERR_OUT_OF_BOUNDS;
+            iValue = iValue * 10 + (size_t)(*p - '0');
+        }
+        if (*p != '\0') return ERR_INVALID_FORMAT;
+
+        /* repeated Content-Length headers must agree */
+        if (pParser->m_bHasContentLength && pParser->m_iContentLength != iValue)
+            return ERR_INVALID_FORMAT;
+
+        /* both framings at once is the shape of request smuggling (RFC 9112 section 6.3) */
+        if (ri->m_is_chunked) return ERR_INVALID_FORMAT;
+
+        pParser->m_bHasContentLength = true;
+        pParser->m_iContentLength    = iValue;
+    }
+    else if (strcasecmp(pHeader->szKey, "Transfer-Encoding") == 0)
+    {
+        if (strcasecmp(pHeader->szValue, "chunked") != 0) return ERR_UNSUPPORTED_TRANSFER_ENCODING;
+        if (pParser->m_bHasContentLength) return ERR_INVALID_FORMAT;
+        ri->m_is_chunked = true;
+    }
+
+    return PARSE_SUCCESS;
+}
+
+/* Parses the hex size at the start of a chunk-size line (extensions after ';' are ignored). */
+static PARSE_RESULT parse_chunk_size
+(
+    const char* pLine,
+    size_t      iLen,
+    size_t*     pOutSize
+)
+{
+    size_t iSize = 0;
+    size_t iX = 0;
+
+    for (; iX < iLen; ++iX)
+    {
+        char c = pLine[iX];
+        unsigned iDigit;
+
+        if (c >= '0' && c <= '9')      iDigit = (unsigned)(c - '0');
+        else if (c >= 'a' && c <= 'f') iDigit = (unsigned)(10 + c - 'a');
+        else if (c >= 'A' && c <= 'F') iDigit = (unsigned)(10 + c - 'A');
+        else break;
+
+        if (iX >= 15) return ERR_OUT_OF_BOUNDS; /* too many hex digits */
+        iSize = (iSize << 4) | iDigit;
+    }
+
+    if (iX == 0) return ERR_INVALID_FORMAT;
+    if (iX < iLen && pLine[iX] != ';' && pLine[iX] != ' ' && pLine[iX] != '\t')
+        return ERR_INVALID_FORMAT;
+
+    *pOutSize = iSize;
+    return PARSE_SUCCESS;
+}
+
+/* Handles one complete line; pLine is not terminated yet and iLen excludes the LF.
+ * pColon is the first ':' of the line as found by the scanner (NULL if none / not scanned). */
+static PARSE_RESULT parser_on_line
+(
+    HTTP_PARSER*  pParser,
+    REQUEST_INFO* ri,
+    char*         pBuffer,
+    char*         pLine,
+    size_t        iLen,
+    char*         pColon
+)
+{
+    PARSE_RESULT rc;
+
+    switch (pParser->m_state)
+    {
+        case PARSER_STATE_REQUEST_LINE:
+        {
+            iLen = terminate_line(pLine, iLen);
+
+            /* tolerate empty lines before the request line (RFC 9112 section 2.2) */
+            if (iLen == 0) return PARSE_SUCCESS;
+
+            ri->m_pRequestStart = pLine;
+            rc = split_request_line(ri, pLine);
+            if (rc != PARSE_SUCCESS) return rc;
+
+            ri->m_pHeadersStart = pBuffer + pParser->m_iCursor;
+            pParser->m_state = PARSER_STATE_HEADERS;
+            return PARSE_SUCCESS;
+        }
+
+        case PARSER_STATE_HEADERS:
+        {
+            iLen = terminate_line(pLine, iLen);
+
+            if (iLen > 0)
+            {
+                /* obsolete line folding is rejected (RFC 9112 section 5.2) */
+                if (pLine[0] == ' ' || pLine[0] == '\t') return ERR_HEADERS_PARSE_FAILED;
+
+                rc = append_header_line(ri, &ri->m_headers, pLine, iLen, pColon);
+                if (rc == ERR_INVALID_FORMAT) return ERR_HEADERS_PARSE_FAILED;
+                if (rc != PARSE_SUCCESS) return rc;
+
+                return parser_on_header(pParser, ri, &ri->m_headers.entries[ri->m_headers.count - 1]);
+            }
+
+            /* empty line: end of the header block */
+            pParser->m_iBodyStart = pParser->m_iCursor;
+            pParser->m_iBodyWrite = pParser->m_iCursor;
+            ri->m_pBodyStart      = pBuffer + pParser->m_iCursor;
+
+            if (ri->m_is_chunked)
+                pParser->m_state = PARSER_STATE_CHUNK_SIZE;
+            else if (pParser->m_iContentLength > 0)
+            {
+                pParser->m_state     = PARSER_STATE_BODY;
+                pParser->m_iRemaining = pParser->m_iContentLength;
+            }
+            else
+                parser_finish(pParser, ri, pBuffer, pParser->m_iCursor);
+
+            return PARSE_SUCCESS;
+        }
+
+        case PARSER_STATE_CHUNK_SIZE:
+        {
+            size_t iChunkSize = 0;
+            if (iLen > 0 && pLine[iLen - 1] == '\r') iLen--;
+
+            rc = parse_chunk_size(pLine, iLen, &iChunkSize);
+            if (rc != PARSE_SUCCESS) return rc;
+
+            if (iChunkSize == 0)
+                pParser->m_state = PARSER_STATE_TRAILERS;
+            else
+            {
+                pParser->m_state      = PARSER_STATE_CHUNK_DATA;
+                pParser->m_iRemaining = iChunkSize;
+            }
+            return PARSE_SUCCESS;
+        }
+
+        case PARSER_STATE_CHUNK_DATA_END:
+        {
+            if (!(iLen == 0 || (iLen == 1 && pLine[0] == '\r'))) return ERR_BODY_PARSE_FAILED;
+            pParser->m_state = PARSER_STATE_CHUNK_SIZE;
+            return PARSE_SUCCESS;
+        }
+
+        case PARSER_STATE_TRAILERS:
+        {
+            iLen = terminate_line(pLine, iLen);
+
+            if (iLen == 0)
+            {
+                parser_finish(pParser, ri, pBuffer, pParser->m_iCursor);
+                return PARSE_SUCCESS;
+            }
+
+            rc = append_header_line(ri, &ri->m_trailerHeaders, pLine, iLen, pColon);
+            if (rc == ERR_INVALID_FORMAT) return ERR_BODY_PARSE_FAILED;
+            return rc;
+        }
+
+        default:
+            return ERR_INVALID_FORMAT;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////
+void http_parser_init
+(
+    HTTP_PARSER*  pParser,
+    REQUEST_INFO* ri
+)
+{
+    if (pParser) memset(pParser, 0, sizeof(*pParser));
+    if (ri) reset_request_info(ri, NULL, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////
+PARSER_STATUS http_parser_execute
+(
+    HTTP_PARSER*  pParser,
+    REQUEST_INFO* ri,
+    char*         pBuffer,
+    size_t        iLength
+)
+{
+    if (!pParser || !ri || !pBuffer)
+    {
+        if (ri) ri->m_parseResult = ERR_NULL_CHECK_FAILED;
+        return PARSER_ERROR;
+    }
+
+    if (pParser->m_state == PARSER_STATE_DONE) return PARSER_DONE;
+
+    ri->m_pRawRequest    = pBuffer;
+    ri->m_iTotalRawBytes = iLength;
+
+    while (pParser->m_iCursor < iLength)
+    {
+        if (pParser->m_state == PARSER_STATE_BODY)
+        {
+            size_t iAvailable = iLength - pParser->m_iCursor;
+            if (iAvailable < pParser->m_iRemaining)
+            {
+                pParser->m_iRemaining -= iAvailable;
+                pParser->m_iCursor     = iLength;
+                return PARSER_NEED_MORE;
+            }
+
+            pParser->m_iCursor += pParser->m_iRemaining;
+            pParser->m_iRemaining = 0;
+            parser_finish(pParser, ri, pBuffer, pParser->m_iCursor);
+            return PARSER_DONE;
+        }
+
+        if (pParser->m_state == PARSER_STATE_CHUNK_DATA)
+        {
+            size_t iAvailable = iLength - pParser->m_iCursor;
+            size_t iTake = iAvailable < pParser->m_iRemaining ? iAvailable : pParser->m_iRemaining;
+
+            /* decode in place: the write position never passes the read position */
+            memmove(pBuffer + pParser->m_iBodyWrite, pBuffer + pParser->m_iCursor, iTake);
+            pParser->m_iBodyWrite += iTake;
+            pParser->m_iCursor    += iTake;
+            pParser->m_iRemaining -= iTake;
+
+            if (pParser->m_iRemaining > 0) return PARSER_NEED_MORE;
+
+            pParser->m_state      = PARSER_STATE_CHUNK_DATA_END;
+            pParser->m_iLineStart = pParser->m_iCursor;
+            continue;
+        }
+
+        /* chunk framing lines: one line at a time, the bytes after them are chunk data */
+        if (pParser->m_state == PARSER_STATE_CHUNK_SIZE || pParser->m_state == PARSER_STATE_CHUNK_DATA_END)
+        {
+            char* pLF = memchr(pBuffer + pParser->m_iCursor, '\n', iLength - pParser->m_iCursor);
+            if (!pLF)
+            {
+                pParser->m_iCursor = iLength;
+                return PARSER_NEED_MORE;
+            }
+
+            char*  pLine = pBuffer + pParser->m_iLineStart;
+            size_t iLineLen = (size_t)(pLF - pLine);
+
+            pParser->m_iCursor    = (size_t)(pLF - pBuffer) + 1;
+            pParser->m_iLineStart = pParser->m_iCursor;
+
+            PARSE_RESULT rc = parser_on_line(pParser, ri, pBuffer, pLine, iLineLen, NULL);
+            if (rc != PARSE_SUCCESS) return parser_fail(ri, rc);
+            continue;
+        }
+
+        /* request line, headers, trailers: one scanner pass over the new bytes yields
+         * every line end and colon, stopping at the empty line that ends the block */
+        size_t iBase = pParser->m_iCursor;
+        HTTP_SCAN scan;
+        http_scan_lines(pBuffer + iBase, iLength - iBase, iBase - pParser->m_iLineStart, true, &scan);
+
+        size_t iL = 0;
+        for (; iL < scan.m_iLineCount; ++iL)
+        {
+            size_t iEnd = iBase + scan.m_arrLines[iL].m_iEnd;
+            if (scan.m_iBareCR != HTTP_SCAN_NONE && iBase + scan.m_iBareCR < iEnd)
+                return parser_fail(ri, ERR_INVALID_FORMAT);
+
+            /* the colon of the first line may have arrived with an earlier call */
+            size_t iColon = (iL == 0 && pParser->m_iLineColon) ? pParser->m_iLineColon :
+                            scan.m_arrLines[iL].m_iColon != HTTP_SCAN_NONE ?
+                            iBase + scan.m_arrLines[iL].m_iColon : 0;
+
+            char*  pLine = pBuffer + pParser->m_iLineStart;
+            size_t iLineLen = iEnd - pParser->m_iLineStart;
+
+            pParser->m_iCursor    = iEnd + 1;
+            pParser->m_iLineStart = pParser->m_iCursor;
+            pParser->m_iLineColon = 0;
+
+            PARSE_RESULT rc = parser_on_line(pParser, ri, pBuffer, pLine, iLineLen,
+                                             iColon ? pBuffer + iColon : NULL);
+            if (rc != PARSE_SUCCESS) return parser_fail(ri, rc);
+
+            if (pParser->m_state == PARSER_STATE_DONE) return PARSER_DONE;
+
+            /* the rest of the scanned bytes is body, leave them to the body states */
+            if (pParser->m_state != PARSER_STATE_REQUEST_LINE &&
+                pParser->m_state != PARSER_STATE_HEADERS &&
+                pParser->m_state != PARSER_STATE_TRAILERS) break;
+        }
+
+        if (iL < scan.m_iLineCount || scan.m_iScanned < iLength - iBase) continue;
+
+        /* every byte was scanned and the last line is still incomplete */
+        if (scan.m_iBareCR != HTTP_SCAN_NONE) return parser_fail(ri, ERR_INVALID_FORMAT);
+        if (scan.m_iTailColon != HTTP_SCAN_NONE && (scan.m_iLineCount > 0 || !pParser->m_iLineColon))
+            pParser->m_iLineColon = iBase + scan.m_iTailColon;
+
+        /* a CR ending the read is checked against the byte after it: the next scan starts on it */
+        pParser->m_iCursor = pBuffer[iLength - 1] == '\r' ? iLength - 1 : iLength;
+        return PARSER_NEED_MORE;
+    }
+
+    return PARSER_NEED_MORE;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //======================================= HELPER FUNCTIONS ======================================//
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -532,7 +969,7 @@ void free_request_info
 
     if (ri->m_headers.entries)
     {
-        free(ri->m_headers.entries);
+        request_free(ri, ri->m_headers.entries);
         ri->m_headers.entries = NULL;
     }
     ri->m_headers.count = 0;
@@ -540,7 +977,7 @@ void free_request_info
 
     if (ri->m_trailerHeaders.entries)
     {
-        free(ri->m_trailerHeaders.entries);
+        request_free(ri, ri->m_trailerHeaders.entries);
         ri->m_trailerHeaders.entries = NULL;
     }
     ri->m_trailerHeaders.count = 0;
@@ -548,7 +985,7 @@ void free_request_info
 
     if (ri->m_body_is_heap_allocated && ri->m_szBody)
     {
-        free((void*)ri->m_szBody);
+        request_free(ri, (void*)ri->m_szBody);
         ri->m_szBody = NULL;
     }
     ri->m_iBodyLength = 0;
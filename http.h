@@ -25,8 +25,13 @@
  * - HEADERS.entries is heap-allocated (owning) and must be freed by free_request_info().
  * - If ri->m_body_is_heap_allocated is true, ri->m_szBody is heap memory that must be freed.
  * - Parser NEVER frees the raw buffer passed by the worker.
+ * - If ri->m_pArena is set, every parser allocation above comes from that arena instead of
+ *   the heap. free_request_info() then frees nothing; the worker releases the memory of the
+ *   whole request at once with arenaReset().
  */
 
+typedef struct Arena Arena;
+
 /* ---------------- Parse result codes ---------------- */
 
 typedef enum {
@@ -95,8 +100,49 @@ typedef struct REQUEST_INFO {
 
     // status of the http request
     PARSE_RESULT m_parseResult;
+
+    /* Per-request arena (owned by the worker's connection), NULL to use the heap.
+     * Kept across http_parser_init() so a connection attaches it only once. */
+    Arena*       m_pArena;
 } REQUEST_INFO;
 
+/* ---------------- Incremental parser ---------------- */
+
+typedef enum {
+    PARSER_NEED_MORE = 0, /* every byte received so far was consumed, request is not complete */
+    PARSER_DONE,          /* a complete request is described by REQUEST_INFO */
+    PARSER_ERROR,         /* request is malformed; REQUEST_INFO.m_parseResult tells why */
+} PARSER_STATUS;
+
+typedef enum {
+    PARSER_STATE_REQUEST_LINE = 0,
+    PARSER_STATE_HEADERS,
+    PARSER_STATE_BODY,          /* Content-Length body */
+    PARSER_STATE_CHUNK_SIZE,
+    PARSER_STATE_CHUNK_DATA,
+    PARSER_STATE_CHUNK_DATA_END, /* CRLF closing a chunk */
+    PARSER_STATE_TRAILERS,
+    PARSER_STATE_DONE,
+} PARSER_STATE;
+
+/*
+ * HTTP_PARSER keeps everything needed to resume where the previous call stopped.
+ * All positions are offsets into the caller's buffer, which may grow between calls
+ * but must not move (REQUEST_INFO keeps pointers into it).
+ */
+typedef struct HTTP_PARSER
+{
+    PARSER_STATE m_state;
+    size_t       m_iCursor;        /* first byte that has not been scanned yet */
+    size_t       m_iLineStart;     /* start of the line being assembled */
+    size_t       m_iLineColon;     /* first ':' of that line if already scanned, 0 if not seen */
+    size_t       m_iBodyStart;
+    size_t       m_iBodyWrite;     /* chunked: where the next decoded byte goes */
+    size_t       m_iRemaining;     /* bytes left in the Content-Length body or current chunk */
+    size_t       m_iContentLength;
+    bool         m_bHasContentLength;
+} HTTP_PARSER;
+
 /* ===================== Public API ===================== */
 
 /*
@@ -112,6 +158,25 @@ typedef struct REQUEST_INFO {
  */
 PARSE_RESULT launch_parser(REQUEST_INFO* ri, const char* pBytestream, size_t bytestream_len);
 
+/*
+ * http_parser_init:
+ *  - Resets parser state and REQUEST_INFO before the first byte of a new request.
+ *
+ * http_parser_execute:
+ *  - pBuffer holds every byte received so far for the current request (starting at
+ *    offset 0), iLength is its current size. Only bytes after the previous call's
+ *    position are scanned, so a request arriving in many pieces is scanned once.
+ *  - The buffer is mutated in place ('\0' terminators, chunked bodies are decoded
+ *    in place), so header/body pointers in REQUEST_INFO are borrowed from pBuffer
+ *    and nothing is heap allocated for the body.
+ *  - Returns PARSER_DONE once ri->m_pRequestEnd is known; bytes after it belong to
+ *    the next request.
+ *
+ * Ownership: the same as launch_parser, free_request_info() must be called afterwards.
+ */
+void          http_parser_init   (HTTP_PARSER* pParser, REQUEST_INFO* ri);
+PARSER_STATUS http_parser_execute(HTTP_PARSER* pParser, REQUEST_INFO* ri, char* pBuffer, size_t iLength);
+
 /* Lower-level parse functions which operate on ri->m_pRawRequest.
  * They are exposed for testing or incremental parsing if needed.
  * They expect ri->m_pRawRequest and m_iTotalRawBytes to be set before call.
@@ -133,7 +198,7 @@ PARSE_RESULT decode_chunked_body(REQUEST_INFO *ri, const char *body_start, size_
  * - Frees any heap allocations made by the parser and resets fields to safe defaults.
  * - DOES NOT free ri itself and DOES NOT free the worker-owned raw buffer (m_pRawRequest).
  *
- * Implementations must:
+ * Implementations must (only when ri->m_pArena is NULL):
  *   if (ri->m_headers.entries) free(ri->m_headers.entries);
  *   if (ri->m_trailerHeaders.entries) free(ri->m_trailerHeaders.entries);
  *   if (ri->m_body_is_heap_allocated && ri->m_szBody) free((void*)ri->m_szBody);
@@ -0,0 +1,307 @@
+/*
+    File name: http_scan.c
+    Creation date: 09-03-26
+    Author: Solomon
+*/
+
+#include <string.h>  // provides memcpy(), memset()
+#include "http_scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HTTP_SCAN_X86 1
+#include <immintrin.h>  // provides SSE2 / AVX2 intrinsics
+#endif
+
+/*
+ * Every SIMD variant turns 64 input bytes into three 64-bit masks (one bit per byte for
+ * LF, CR and ':') and hands them to the same block walker, so the line / colon logic is
+ * written once. The tail of the input (< 64 bytes) is copied into a zeroed block first.
+ */
+
+typedef struct SCAN_STATE
+{
+    const char* pData;
+    size_t      iLen;
+    int64_t     iLineStart;   /* start of the current line, negative when it began before pData */
+    uint32_t    iColon;       /* first ':' of the current line */
+    bool        bStopAtEmptyLine;
+    bool        bStopped;
+} SCAN_STATE;
+
+typedef void (*SCAN_FN)(const char*, size_t, size_t, bool, HTTP_SCAN*);
+
+/* ---------- small helpers ---------- */
+
+static inline uint64_t low_mask(int64_t iBits)
+{
+    if (iBits <= 0) return 0;
+    if (iBits >= 64) return ~0ULL;
+    return (1ULL << iBits) - 1;
+}
+
+static void scan_begin(SCAN_STATE* st, const char* pData, size_t iLen, size_t iPartialLen, bool bStop, HTTP_SCAN* pScan)
+{
+    st->pData            = pData;
+    st->iLen             = iLen;
+    st->iLineStart       = -(int64_t)iPartialLen;
+    st->iColon           = HTTP_SCAN_NONE;
+    st->bStopAtEmptyLine = bStop;
+    st->bStopped         = false;
+
+    pScan->m_iLineCount = 0;
+    pScan->m_iScanned   = iLen;
+    pScan->m_iTailColon = HTTP_SCAN_NONE;
+    pScan->m_iBareCR    = HTTP_SCAN_NONE;
+}
+
+/* Records one line ending at iEnd; returns true when the scan must stop. */
+static inline bool scan_emit_line(SCAN_STATE* st, HTTP_SCAN* pScan, size_t iEnd)
+{
+    HTTP_SCAN_LINE* pLine = &pScan->m_arrLines[pScan->m_iLineCount++];
+    pLine->m_iEnd   = (uint32_t)iEnd;
+    pLine->m_iColon = st->iColon;
+
+    int64_t iLineLen = (int64_t)iEnd - st->iLineStart;
+    bool bEmpty = iLineLen == 0 ||
+                  (iLineLen == 1 && st->pData[(ptrdiff_t)iEnd - 1] == '\r');
+
+    st->iLineStart = (int64_t)iEnd + 1;
+    st->iColon     = HTTP_SCAN_NONE;
+
+    if ((bEmpty && st->bStopAtEmptyLine) || pScan->m_iLineCount == HTTP_SCAN_MAX_LINES)
+    {
+        pScan->m_iScanned = iEnd + 1;
+        st->bStopped = true;
+    }
+
+    return st->bStopped;
+}
+
+/* Consumes the masks of the 64-byte block starting at iBase. */
+static inline void scan_block(SCAN_STATE* st, HTTP_SCAN* pScan, size_t iBase,
+                              uint64_t mLF, uint64_t mCR, uint64_t mColon)
+{
+    /* a CR is bare unless the next byte is LF; a CR on the very last byte is still pending */
+    if (pScan->m_iBareCR == HTTP_SCAN_NONE && mCR)
+    {
+        uint64_t mNextLF = mLF >> 1;
+        if (iBase + 64 < st->iLen && st->pData[iBase + 64] == '\n') mNextLF |= 1ULL << 63;
+
+        uint64_t mBare = mCR & ~mNextLF;
+        if (iBase + 64 >= st->iLen) mBare &= low_mask((int64_t)(st->iLen - iBase) - 1);
+        if (mBare) pScan->m_iBareCR = (uint32_t)(iBase + (size_t)__builtin_ctzll(mBare));
+    }
+
+    while (mLF)
+    {
+        int iBit = __builtin_ctzll(mLF);
+        mLF &= mLF - 1;
+
+        if (st->iColon == HTTP_SCAN_NONE)
+        {
+            uint64_t mCandidates = mColon & low_mask(iBit) & ~low_mask(st->iLineStart - (int64_t)iBase);
+            if (mCandidates) st->iColon = (uint32_t)(iBase + (size_t)__builtin_ctzll(mCandidates));
+        }
+
+        if (scan_emit_line(st, pScan, iBase + (size_t)iBit)) return;
+    }
+
+    if (st->iColon == HTTP_SCAN_NONE)
+    {
+        uint64_t mCandidates = mColon & ~low_mask(st->iLineStart - (int64_t)iBase);
+        if (mCandidates) st->iColon = (uint32_t)(iBase + (size_t)__builtin_ctzll(mCandidates));
+    }
+}
+
+static void scan_end(SCAN_STATE* st, HTTP_SCAN* pScan)
+{
+    if (!st->bStopped) pScan->m_iTailColon = st->iColon;
+}
+
+/* ---------- scalar ---------- */
+
+static void scan_lines_scalar(const char* pData, size_t iLen, size_t iPartialLen, bool bStop, HTTP_SCAN* pScan)
+{
+    SCAN_STATE st;
+    scan_begin(&st, pData, iLen, iPartialLen, bStop, pScan);
+
+    for (size_t iX = 0; iX < iLen; ++iX)
+    {
+        char c = pData[iX];
+
+        if (c == '\n')
+        {
+            if (scan_emit_line(&st, pScan, iX)) return;
+        }
+        else if (c == ':')
+        {
+            if (st.iColon == HTTP_SCAN_NONE) st.iColon = (uint32_t)iX;
+        }
+        else if (c == '\r')
+        {
+            if (pScan->m_iBareCR == HTTP_SCAN_NONE && iX + 1 < iLen && pData[iX + 1] != '\n')
+                pScan->m_iBareCR = (uint32_t)iX;
+        }
+    }
+
+    scan_end(&st, pScan);
+}
+
+#ifdef HTTP_SCAN_X86
+
+/* ---------- SSE2 ---------- */
+
+static inline void block_masks_sse2(const char* p, uint64_t* pLF, uint64_t* pCR, uint64_t* pColon)
+{
+    const __m128i vLF    = _mm_set1_epi8('\n');
+    const __m128i vCR    = _mm_set1_epi8('\r');
+    const __m128i vColon = _mm_set1_epi8(':');
+
+    uint64_t mLF = 0, mCR = 0, mColon = 0;
+    for (int k = 0; k < 4; ++k)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+        mLF    |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vLF))    << (16 * k);
+        mCR    |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vCR))    << (16 * k);
+        mColon |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vColon)) << (16 * k);
+    }
+
+    *pLF = mLF; *pCR = mCR; *pColon = mColon;
+}
+
+static void scan_lines_sse2(const char* pData, size_t iLen, size_t iPartialLen, bool bStop, HTTP_SCAN* pScan)
+{
+    SCAN_STATE st;
+    scan_begin(&st, pData, iLen, iPartialLen, bStop, pScan);
+
+    uint64_t mLF, mCR, mColon;
+    size_t iBase = 0;
+
+    for (; iBase + 64 <= iLen; iBase += 64)
+    {
+        block_masks_sse2(pData + iBase, &mLF, &mCR, &mColon);
+        scan_block(&st, pScan, iBase, mLF, mCR, mColon);
+        if (st.bStopped) return;
+    }
+
+    if (iBase < iLen)
+    {
+        char tail[64];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, pData + iBase, iLen - iBase);
+
+        block_masks_sse2(tail, &mLF, &mCR, &mColon);
+        uint64_t mValid = low_mask((int64_t)(iLen - iBase));
+        scan_block(&st, pScan, iBase, mLF & mValid, mCR & mValid, mColon & mValid);
+        if (st.bStopped) return;
+    }
+
+    scan_end(&st, pScan);
+}
+
+/* ---------- AVX2 ---------- */
+
+__attribute__((target("avx2")))
+static inline void block_masks_avx2(const char* p, uint64_t* pLF, uint64_t* pCR, uint64_t* pColon)
+{
+    const __m256i vLF    = _mm256_set1_epi8('\n');
+    const __m256i vCR    = _mm256_set1_epi8('\r');
+    const __m256i vColon = _mm256_set1_epi8(':');
+
+    __m256i vLo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i vHi = _mm256_loadu_si256((const __m256i*)(p + 32));
+
+    *pLF = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vLo, vLF)) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vHi, vLF)) << 32;
+    *pCR = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vLo, vCR)) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vHi, vCR)) << 32;
+    *pColon = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vLo, vColon)) |
+              (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vHi, vColon)) << 32;
+}
+
+__attribute__((target("avx2")))
+static void scan_lines_avx2(const char* pData, size_t iLen, size_t iPartialLen, bool bStop, HTTP_SCAN* pScan)
+{
+    SCAN_STATE st;
+    scan_begin(&st, pData, iLen, iPartialLen, bStop, pScan);
+
+    uint64_t mLF, mCR, mColon;
+    size_t iBase = 0;
+
+    for (; iBase + 64 <= iLen; iBase += 64)
+    {
+        block_masks_avx2(pData + iBase, &mLF, &mCR, &mColon);
+        scan_block(&st, pScan, iBase, mLF, mCR, mColon);
+        if (st.bStopped) return;
+    }
+
+    if (iBase < iLen)
+    {
+        char tail[64];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, pData + iBase, iLen - iBase);
+
+        block_masks_avx2(tail, &mLF, &mCR, &mColon);
+        uint64_t mValid = low_mask((int64_t)(iLen - iBase));
+        scan_block(&st, pScan, iBase, mLF & mValid, mCR & mValid, mColon & mValid);
+        if (st.bStopped) return;
+    }
+
+    scan_end(&st, pScan);
+}
+
+#endif /* HTTP_SCAN_X86 */
+
+/* ---------- runtime dispatch ---------- */
+
+static SCAN_FN     g_pScanImpl = NULL;
+static const char* g_szScanBackend = "scalar";
+
+static void scan_resolve(void)
+{
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        g_pScanImpl = scan_lines_avx2;
+        g_szScanBackend = "avx2";
+        return;
+    }
+    g_pScanImpl = scan_lines_sse2;
+    g_szScanBackend = "sse2";
+#else
+    g_pScanImpl = scan_lines_scalar;
+    g_szScanBackend = "scalar";
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////
+void http_scan_lines
+(
+    const char* pData,
+    size_t      iLen,
+    size_t      iPartialLen,
+    bool        bStopAtEmptyLine,
+    HTTP_SCAN*  pScan
+)
+{
+    if (!g_pScanImpl) scan_resolve();
+
+    /* tiny inputs (a single short line) are not worth a vector setup */
+    if (iLen < 16)
+    {
+        scan_lines_scalar(pData, iLen, iPartialLen, bStopAtEmptyLine, pScan);
+        return;
+    }
+
+    g_pScanImpl(pData, iLen, iPartialLen, bStopAtEmptyLine, pScan);
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////
+const char* http_scan_backend(void)
+{
+    if (!g_pScanImpl) scan_resolve();
+    return g_szScanBackend;
+}
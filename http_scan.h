@@ -0,0 +1,61 @@
+/*
+    File name: http_scan.h
+    Purpose  : single pass delimiter scanner used by the HTTP parser
+    Author   : Solomon
+    Date     : 2026-03-09
+*/
+
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>   // provides size_t
+#include <stdint.h>   // provides uint32_t
+#include <stdbool.h>  // provides bool type
+
+/*
+ * The scanner walks a block of header bytes once and finds every LF, the first ':'
+ * of every line and any CR that is not followed by LF. The parser then consumes the
+ * resulting line / colon offsets instead of searching each line again.
+ *
+ * Implementations are chosen once at runtime:
+ *  - AVX2  (32 bytes per compare) when the CPU supports it
+ *  - SSE2  (16 bytes per compare) on every other x86-64 CPU
+ *  - scalar everywhere else
+ */
+
+#define HTTP_SCAN_MAX_LINES 64
+#define HTTP_SCAN_NONE      UINT32_MAX
+
+typedef struct HTTP_SCAN_LINE
+{
+    uint32_t m_iEnd;    /* offset of the '\n' ending the line */
+    uint32_t m_iColon;  /* offset of the first ':' of the line, HTTP_SCAN_NONE when absent
+                           (or when it was before pData, i.e. in the partial line prefix) */
+} HTTP_SCAN_LINE;
+
+typedef struct HTTP_SCAN
+{
+    HTTP_SCAN_LINE m_arrLines[HTTP_SCAN_MAX_LINES];
+    size_t         m_iLineCount;
+    size_t         m_iScanned;   /* bytes examined; less than iLen only when the scan stopped early */
+    uint32_t       m_iTailColon; /* first ':' after the last reported LF, HTTP_SCAN_NONE if none */
+    uint32_t       m_iBareCR;    /* first CR not followed by LF, HTTP_SCAN_NONE if none */
+} HTTP_SCAN;
+
+/*
+ * http_scan_lines:
+ *  - pData / iLen is the block to scan (offsets in HTTP_SCAN are relative to pData).
+ *  - iPartialLen is the number of bytes of the current line that precede pData
+ *    (0 when pData starts a new line); those bytes must be in memory right before
+ *    pData. It only matters for empty line detection.
+ *  - bStopAtEmptyLine stops right after the first empty line ("\n" or "\r\n"),
+ *    so a header block scan does not run into the body.
+ *  - The scan also stops once HTTP_SCAN_MAX_LINES lines were reported.
+ *  - iLen must be below 4 GiB (offsets are 32 bit).
+ */
+void http_scan_lines(const char* pData, size_t iLen, size_t iPartialLen, bool bStopAtEmptyLine, HTTP_SCAN* pScan);
+
+/* Name of the implementation selected for this CPU ("avx2", "sse2" or "scalar"). */
+const char* http_scan_backend(void);
+
+#endif /* HTTP_SCAN_H */
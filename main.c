@@ -4,11 +4,20 @@
     Author: Solomon
 */
 
-#include <stdio.h>      // provides printf()
+#include <stdio.h>      // provides printf(), fprintf()
+#include <stdlib.h>     // provides strtol()
+#include <stdint.h>     // provides uint64_t
 #include <string.h>     // provides memset()
+#include <getopt.h>     // provides getopt_long(), struct option
 #include <arpa/inet.h>  // provides htonl() and htons()
 #include <signal.h>     // providse signal(), SIGINT, SIGTERM, sig_atomic_t
 #include "server.h"     // server_setup_listener(), server_c(), server_master_loop(), server_spawn_workers()
+#include "metrics.h"    // provides metrics_init()
+#include "access_log.h" // provides access_log_init(), access_log_spawn_writer()
+#include "proxy.h"      // provides proxy_add_upstream(), proxy_configure()
+#include "balancer.h"   // provides balancer_parse_policy(), balancer_parse_key()
+#include "health.h"     // provides health_configure(), health_spawn_checker()
+#include "proxy_cache.h" // provides proxy_cache_init()
 
 volatile sig_atomic_t g_master_running = 1;
 
@@ -18,27 +27,260 @@ static void master_on_signal(int sig)
     g_master_running = 0;
 }
 
-int main(void)
+static void print_usage(const char* szProgram)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -p, --port N          port to listen on (default 8080)\n"
+        "  -w, --workers N|auto  number of worker processes (default 4, max %d),\n"
+        "                        auto = one per cpu this process may run on\n"
+        "      --pin-cpus        pin each worker to its own cpu and its local NUMA node\n"
+        "  -b, --backlog N       listen() backlog (default 128)\n"
+        "      --reuseport       one SO_REUSEPORT listening socket per worker\n"
+        "      --reuseport-cpu   with --reuseport, steer connections to socket (cpu %% workers)\n"
+        "  -a, --accept-batch N  connections accepted per listener wakeup (default %d)\n"
+        "      --io-uring        run workers on io_uring (falls back to epoll if unsupported)\n"
+        "      --header-timeout S     seconds to receive a request's headers (default %d)\n"
+        "      --body-timeout S       seconds without progress while receiving a body (default %d)\n"
+        "      --keepalive-timeout S  seconds an idle keep-alive connection is kept (default %d)\n"
+        "      --write-timeout S      seconds without progress while sending a response (default %d)\n"
+        "      --access-log PATH      access log file, - for stdout (default -)\n"
+        "      --log-level L          off, error (5xx), warn (4xx and 5xx) or info (default info)\n"
+        "      --log-sample N         with info, log 1 in N successful requests (default 1)\n"
+        "  -u, --upstream HOST:PORT[,weight=N]\n"
+        "                             proxy to this backend, repeat for more (max %d)\n"
+        "      --proxy-prefix PATH    requests under PATH are proxied (default /)\n"
+        "      --upstream-timeout S   seconds an upstream may stay silent while a response is due (default %d)\n"
+        "      --upstream-keepalive N idle upstream connections kept per backend and worker (default %d)\n"
+        "      --lb POLICY            rr, wrr, least, p2c or hash (default rr)\n"
+        "      --lb-hash-key KEY      what hash keys on: path or header:NAME (default path)\n"
+        "      --health-check PATH    probe every upstream with GET PATH (default off)\n"
+        "      --health-interval S    seconds between probe rounds (default %d)\n"
+        "      --health-timeout S     seconds a probe may take (default %d)\n"
+        "      --eject-after N        consecutive failed exchanges that eject an upstream, 0 = never (default %d)\n"
+        "      --eject-time S         first ejection in seconds, doubled on each repeat (default %d)\n"
+        "      --proxy-cache MB       shared cache for proxied responses, 0 = off (default %d)\n"
+        "  -h, --help            show this help\n",
+        szProgram, MAX_WORKERS, DEFAULT_ACCEPT_BATCH,
+        DEFAULT_HEADER_TIMEOUT_MS / 1000, DEFAULT_BODY_TIMEOUT_MS / 1000,
+        DEFAULT_KEEPALIVE_TIMEOUT_MS / 1000, DEFAULT_WRITE_TIMEOUT_MS / 1000,
+        PROXY_MAX_UPSTREAMS, DEFAULT_PROXY_READ_TIMEOUT_MS / 1000, DEFAULT_PROXY_KEEPALIVE,
+        DEFAULT_HEALTH_INTERVAL_MS / 1000, DEFAULT_HEALTH_TIMEOUT_MS / 1000,
+        DEFAULT_HEALTH_EJECT_AFTER, DEFAULT_HEALTH_EJECT_MS / 1000, DEFAULT_PROXY_CACHE_MB);
+}
+
+static bool parse_int_arg(const char* szArg, int iMin, int iMax, int* pOut)
+{
+    char* pEnd = NULL;
+    long iValue = strtol(szArg, &pEnd, 10);
+    if (!pEnd || *pEnd != '\0' || iValue < iMin || iValue > iMax) return false;
+
+    *pOut = (int)iValue;
+    return true;
+}
+
+static bool parse_seconds_arg(const char* szArg, uint64_t* pOutMs)
+{
+    int iSeconds;
+    if (!parse_int_arg(szArg, 1, 86400, &iSeconds)) return false;
+
+    *pOutMs = (uint64_t)iSeconds * 1000u;
+    return true;
+}
+
+int main(int argc, char** argv)
 {
     signal(SIGINT, master_on_signal);
     signal(SIGTERM, master_on_signal);
 
+    int  iPort          = 8080;
+    int  iWorkers       = 4;
+    int  iBacklog       = 128;
+    bool bReusePort     = false;
+    bool bReusePortCpu  = false;
+    int  iAcceptBatch   = DEFAULT_ACCEPT_BATCH;
+
+    bool bPinWorkers    = false;
+    bool bUseIoUring    = false;
+
+    const char*      szAccessLog = "-";
+    ACCESS_LOG_LEVEL logLevel    = ACCESS_LOG_INFO;
+    int              iLogSample  = 1;
+
+    const char* szProxyPrefix     = "/";
+    uint64_t    uUpstreamTimeout  = DEFAULT_PROXY_READ_TIMEOUT_MS;
+    int         iUpstreamKeepAlive = DEFAULT_PROXY_KEEPALIVE;
+    BALANCER_POLICY lbPolicy       = BALANCER_ROUND_ROBIN;
+
+    const char* szHealthPath     = NULL;
+    uint64_t    uHealthInterval  = DEFAULT_HEALTH_INTERVAL_MS;
+    uint64_t    uHealthTimeout   = DEFAULT_HEALTH_TIMEOUT_MS;
+    int         iEjectAfter      = DEFAULT_HEALTH_EJECT_AFTER;
+    uint64_t    uEjectTime       = DEFAULT_HEALTH_EJECT_MS;
+    int         iProxyCacheMb    = DEFAULT_PROXY_CACHE_MB;
+
+    CONN_TIMEOUTS timeouts = {
+        .m_uHeaderMs    = DEFAULT_HEADER_TIMEOUT_MS,
+        .m_uBodyMs      = DEFAULT_BODY_TIMEOUT_MS,
+        .m_uKeepAliveMs = DEFAULT_KEEPALIVE_TIMEOUT_MS,
+        .m_uWriteMs     = DEFAULT_WRITE_TIMEOUT_MS,
+    };
+
+    enum
+    {
+        OPT_REUSEPORT = 256, OPT_REUSEPORT_CPU, OPT_PIN_CPUS, OPT_IO_URING,
+        OPT_HEADER_TIMEOUT, OPT_BODY_TIMEOUT, OPT_KEEPALIVE_TIMEOUT, OPT_WRITE_TIMEOUT,
+        OPT_ACCESS_LOG, OPT_LOG_LEVEL, OPT_LOG_SAMPLE,
+        OPT_PROXY_PREFIX, OPT_UPSTREAM_TIMEOUT, OPT_UPSTREAM_KEEPALIVE,
+        OPT_LB, OPT_LB_HASH_KEY,
+        OPT_HEALTH_CHECK, OPT_HEALTH_INTERVAL, OPT_HEALTH_TIMEOUT, OPT_EJECT_AFTER, OPT_EJECT_TIME,
+        OPT_PROXY_CACHE,
+    };
+
+    static const struct option arrOptions[] = {
+        { "port",          required_argument, NULL, 'p' },
+        { "workers",       required_argument, NULL, 'w' },
+        { "backlog",       required_argument, NULL, 'b' },
+        { "reuseport",     no_argument,       NULL, OPT_REUSEPORT },
+        { "reuseport-cpu", no_argument,       NULL, OPT_REUSEPORT_CPU },
+        { "accept-batch",  required_argument, NULL, 'a' },
+        { "pin-cpus",      no_argument,       NULL, OPT_PIN_CPUS },
+        { "io-uring",      no_argument,       NULL, OPT_IO_URING },
+        { "header-timeout",    required_argument, NULL, OPT_HEADER_TIMEOUT },
+        { "body-timeout",      required_argument, NULL, OPT_BODY_TIMEOUT },
+        { "keepalive-timeout", required_argument, NULL, OPT_KEEPALIVE_TIMEOUT },
+        { "write-timeout",     required_argument, NULL, OPT_WRITE_TIMEOUT },
+        { "access-log",        required_argument, NULL, OPT_ACCESS_LOG },
+        { "log-level",         required_argument, NULL, OPT_LOG_LEVEL },
+        { "log-sample",        required_argument, NULL, OPT_LOG_SAMPLE },
+        { "upstream",           required_argument, NULL, 'u' },
+        { "proxy-prefix",       required_argument, NULL, OPT_PROXY_PREFIX },
+        { "upstream-timeout",   required_argument, NULL, OPT_UPSTREAM_TIMEOUT },
+        { "upstream-keepalive", required_argument, NULL, OPT_UPSTREAM_KEEPALIVE },
+        { "lb",                 required_argument, NULL, OPT_LB },
+        { "lb-hash-key",        required_argument, NULL, OPT_LB_HASH_KEY },
+        { "health-check",       required_argument, NULL, OPT_HEALTH_CHECK },
+        { "health-interval",    required_argument, NULL, OPT_HEALTH_INTERVAL },
+        { "health-timeout",     required_argument, NULL, OPT_HEALTH_TIMEOUT },
+        { "eject-after",        required_argument, NULL, OPT_EJECT_AFTER },
+        { "eject-time",         required_argument, NULL, OPT_EJECT_TIME },
+        { "proxy-cache",        required_argument, NULL, OPT_PROXY_CACHE },
+        { "help",          no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int iOpt;
+    while ((iOpt = getopt_long(argc, argv, "p:w:b:a:u:h", arrOptions, NULL)) != -1)
+    {
+        bool bOk = true;
+        switch (iOpt)
+        {
+            case 'p':               bOk = parse_int_arg(optarg, 1, 65535, &iPort);          break;
+            case 'w':
+                if (strcmp(optarg, "auto") == 0) iWorkers = 0;
+                else bOk = parse_int_arg(optarg, 1, MAX_WORKERS, &iWorkers);
+                break;
+            case 'b':               bOk = parse_int_arg(optarg, 1, 65535, &iBacklog);       break;
+            case 'a':               bOk = parse_int_arg(optarg, 1, 4096, &iAcceptBatch);    break;
+            case OPT_REUSEPORT:     bReusePort = true;                                       break;
+            case OPT_REUSEPORT_CPU: bReusePort = true; bReusePortCpu = true;                 break;
+            case OPT_PIN_CPUS:      bPinWorkers = true;                                      break;
+            case OPT_IO_URING:      bUseIoUring = true;                                      break;
+            case OPT_HEADER_TIMEOUT:    bOk = parse_seconds_arg(optarg, &timeouts.m_uHeaderMs);    break;
+            case OPT_BODY_TIMEOUT:      bOk = parse_seconds_arg(optarg, &timeouts.m_uBodyMs);      break;
+            case OPT_KEEPALIVE_TIMEOUT: bOk = parse_seconds_arg(optarg, &timeouts.m_uKeepAliveMs); break;
+            case OPT_WRITE_TIMEOUT:     bOk = parse_seconds_arg(optarg, &timeouts.m_uWriteMs);     break;
+            case OPT_ACCESS_LOG:        szAccessLog = optarg;                                      break;
+            case OPT_LOG_LEVEL:         bOk = access_log_parse_level(optarg, &logLevel);           break;
+            case OPT_LOG_SAMPLE:        bOk = parse_int_arg(optarg, 1, 1000000, &iLogSample);      break;
+            case 'u':
+                bOk = proxy_add_upstream(optarg);
+                if (!bOk) fprintf(stderr, "upstream %s: cannot be resolved, bad weight or too many upstreams\n", optarg);
+                break;
+            case OPT_PROXY_PREFIX:       bOk = optarg[0] == '/'; szProxyPrefix = optarg;                 break;
+            case OPT_UPSTREAM_TIMEOUT:   bOk = parse_seconds_arg(optarg, &uUpstreamTimeout);              break;
+            case OPT_UPSTREAM_KEEPALIVE: bOk = parse_int_arg(optarg, 0, 4096, &iUpstreamKeepAlive);       break;
+            case OPT_LB:                 bOk = balancer_parse_policy(optarg, &lbPolicy);                   break;
+            case OPT_LB_HASH_KEY:        bOk = balancer_parse_key(optarg);                                 break;
+            case OPT_HEALTH_CHECK:       bOk = optarg[0] == '/'; szHealthPath = optarg;                   break;
+            case OPT_HEALTH_INTERVAL:    bOk = parse_seconds_arg(optarg, &uHealthInterval);               break;
+            case OPT_HEALTH_TIMEOUT:     bOk = parse_seconds_arg(optarg, &uHealthTimeout);                break;
+            case OPT_EJECT_AFTER:        bOk = parse_int_arg(optarg, 0, 1000, &iEjectAfter);              break;
+            case OPT_EJECT_TIME:         bOk = parse_seconds_arg(optarg, &uEjectTime);                    break;
+            case OPT_PROXY_CACHE:        bOk = parse_int_arg(optarg, 0, PROXY_CACHE_MAX_MB, &iProxyCacheMb); break;
+            case 'h':               print_usage(argv[0]); return 0;
+            default:                bOk = false;                                             break;
+        }
+
+        if (!bOk)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    health_configure(szHealthPath, uHealthInterval, uHealthTimeout, iEjectAfter, uEjectTime);
+    if (!proxy_configure(szProxyPrefix, uUpstreamTimeout, iUpstreamKeepAlive, lbPolicy))
+    {
+        fprintf(stderr, "proxy: cannot set up the load balancer\n");
+        return 1;
+    }
+
+    // upstream sockets are driven by the epoll loop only
+    if (bUseIoUring && proxy_enabled())
+    {
+        fprintf(stderr, "proxy: upstreams are served by the epoll loop, --io-uring is ignored\n");
+        bUseIoUring = false;
+    }
+
     printf("entered inside the server:\n");
     SERVER server = server_create(
         AF_INET,
         SOCK_STREAM,
         IPPROTO_TCP,
         INADDR_ANY,
-        8080,
-        128,
-        4
+        iPort,
+        iBacklog,
+        iWorkers
     );
 
+    server.m_bReusePort            = bReusePort;
+    server.m_bReusePortCpuSteering = bReusePortCpu;
+    server.m_iAcceptBatch          = iAcceptBatch;
+    server.m_bPinWorkers           = bPinWorkers;
+    server.m_bUseIoUring           = bUseIoUring;
+    server.m_timeouts              = timeouts;
+
     memset(&server.m_si_address, 0, sizeof(server.m_si_address));
     server.m_si_address.sin_family = AF_INET;
     server.m_si_address.sin_addr.s_addr = htonl(server.m_iInterface);
     server.m_si_address.sin_port = htons(server.m_iPort);
 
+    // the listener needs the final worker count (one REUSEPORT socket each)
+    if (server_plan_workers(&server) < 0)
+        return 1;
+
+    // shared with every worker, so it must exist before the first fork()
+    if (!metrics_init(server.m_iWorkerCount))
+        fprintf(stderr, "metrics: shared segment unavailable, %s is disabled\n", METRICS_PATH);
+
+    // one store for every worker, mapped before they fork as well
+    if (proxy_enabled() && !proxy_cache_init((size_t)iProxyCacheMb << 20, server.m_iWorkerCount))
+        fprintf(stderr, "proxy cache: shared segment unavailable, responses are not cached\n");
+
+    // the writer is forked before the listener exists, it never holds the socket
+    if (!access_log_init(server.m_iWorkerCount, logLevel, (unsigned)iLogSample, szAccessLog))
+    {
+        perror("access log");
+        return 1;
+    }
+    if (logLevel != ACCESS_LOG_OFF && access_log_spawn_writer() < 0)
+        fprintf(stderr, "access log: writer process could not be started\n");
+
+    // same for the health checker, which only ever talks to the upstreams
+    if (szHealthPath && proxy_enabled() && health_spawn_checker() < 0)
+        fprintf(stderr, "health: checker process could not be started\n");
+
     if (server_setup_listener(&server) < 0)
         return 1;
 
@@ -0,0 +1,323 @@
+/*
+    File name    : metrics.c
+    creation date: 06-04-26
+    Author       : Solomon
+*/
+
+#include <stdio.h>      // provides snprintf()
+#include <string.h>     // provides strncmp()
+#include <time.h>       // provides time()
+#include <sys/mman.h>   // provides mmap(), MAP_SHARED, MAP_ANONYMOUS
+#include "metrics.h"
+#include "connection.h" // provides CONNECTION, monotonic_us()
+#include "response.h"   // provides send_content_response()
+
+// request latency histogram bounds, microseconds
+static const uint64_t METRICS_LATENCY_BOUNDS_US[METRICS_LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 5000000,
+};
+
+static const char* const METRICS_PARSE_NAMES[METRICS_PARSE_RESULTS] = {
+    [PARSE_SUCCESS]                     = "success",
+    [ERR_NULL_CHECK_FAILED]             = "null_check_failed",
+    [ERR_EMPTY_REQUEST]                 = "empty_request",
+    [ERR_INVALID_METHOD]                = "invalid_method",
+    [ERR_INVALID_PATH]                  = "invalid_path",
+    [ERR_INVALID_PROTOCOL]              = "invalid_protocol",
+    [ERR_CALLOC_FAILED]                 = "calloc_failed",
+    [ERR_INVALID_FORMAT]                = "invalid_format",
+    [ERR_OUT_OF_BOUNDS]                 = "out_of_bounds",
+    [ERR_REQUEST_LINE_PARSE_FAILED]     = "request_line_parse_failed",
+    [ERR_HEADERS_PARSE_FAILED]          = "headers_parse_failed",
+    [ERR_BODY_PARSE_FAILED]             = "body_parse_failed",
+    [ERR_UNSUPPORTED_TRANSFER_ENCODING] = "unsupported_transfer_encoding",
+};
+
+static const char* const METRICS_STATUS_NAMES[METRICS_STATUS_CLASSES] = {
+    "none", "1xx", "2xx", "3xx", "4xx", "5xx",
+};
+
+static METRICS_SHARED* g_pShared;   // inherited by every worker through fork()
+static METRICS_WORKER* g_pSlot;     // this worker's slot, NULL in the master
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline void metrics_add(uint64_t* pCounter, uint64_t uValue)
+{
+    // single writer per slot: a relaxed load / store pair is enough for
+    // the scraper to never see a torn value, and costs a plain add
+    __atomic_store_n(pCounter, __atomic_load_n(pCounter, __ATOMIC_RELAXED) + uValue, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline uint64_t metrics_read(const uint64_t* pCounter)
+{
+    return __atomic_load_n(pCounter, __ATOMIC_RELAXED);
+}
+
+/*===================================== Master ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool metrics_init(int iWorkerCount)
+{
+    if (iWorkerCount <= 0) return false;
+
+    size_t iSize = sizeof(METRICS_SHARED) + (size_t)iWorkerCount * sizeof(METRICS_WORKER);
+
+    // zero filled by the kernel
+    void* pMap = mmap(NULL, iSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pMap == MAP_FAILED) return false;
+
+    g_pShared = pMap;
+    g_pShared->m_iWorkerCount = iWorkerCount;
+    g_pShared->m_uStartTime   = (uint64_t)time(NULL);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_worker_restarted(void)
+{
+    if (g_pShared) metrics_add(&g_pShared->m_uWorkerRestarts, 1);
+}
+
+/*===================================== Worker ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_attach(int iWorkerIndex)
+{
+    if (!g_pShared || iWorkerIndex < 0 || iWorkerIndex >= g_pShared->m_iWorkerCount) return;
+
+    g_pSlot = &g_pShared->m_arrWorkers[iWorkerIndex];
+
+    // connections of a previous process in this slot died with it
+    __atomic_store_n(&g_pSlot->m_uConnectionsActive, 0, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_connection_opened(void)
+{
+    if (!g_pSlot) return;
+
+    metrics_add(&g_pSlot->m_uConnectionsAccepted, 1);
+    metrics_add(&g_pSlot->m_uConnectionsActive, 1);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_connection_closed(void)
+{
+    if (g_pSlot) metrics_add(&g_pSlot->m_uConnectionsActive, (uint64_t)-1);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_bytes_received(size_t iBytes)
+{
+    if (g_pSlot) metrics_add(&g_pSlot->m_uBytesReceived, iBytes);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_bytes_sent(size_t iBytes)
+{
+    if (g_pSlot) metrics_add(&g_pSlot->m_uBytesSent, iBytes);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_parse_error(PARSE_RESULT result)
+{
+    if (!g_pSlot) return;
+
+    // a request that could not be parsed any further without a result of its own
+    if ((unsigned)result >= METRICS_PARSE_RESULTS) result = ERR_INVALID_FORMAT;
+    metrics_add(&g_pSlot->m_arrParseErrors[result], 1);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void metrics_request_done(const CONNECTION* pConn)
+{
+    if (!g_pSlot || !pConn) return;
+
+    int iClass = pConn->m_iStatus / 100;
+    if (iClass < 1 || iClass >= METRICS_STATUS_CLASSES) iClass = 0;
+
+    uint64_t uNow = monotonic_us();
+    uint64_t uLatency = uNow > pConn->m_uServeStartUs ? uNow - pConn->m_uServeStartUs : 0;
+
+    size_t iBucket = 0;
+    while (iBucket < METRICS_LATENCY_BUCKETS && uLatency > METRICS_LATENCY_BOUNDS_US[iBucket])
+        iBucket++;
+
+    metrics_add(&g_pSlot->m_uRequests, 1);
+    metrics_add(&g_pSlot->m_arrStatus[iClass], 1);
+    metrics_add(&g_pSlot->m_arrLatency[iBucket], 1);
+    metrics_add(&g_pSlot->m_uLatencySumUs, uLatency);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool metrics_is_request(const REQUEST_INFO* ri)
+{
+    if (!ri || !ri->m_szPath) return false;
+
+    size_t iLen = sizeof(METRICS_PATH) - 1;
+    if (strncmp(ri->m_szPath, METRICS_PATH, iLen) != 0) return false;
+
+    char cNext = ri->m_szPath[iLen];
+    return cNext == '\0' || cNext == '?';
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void metrics_sum(METRICS_WORKER* pTotal)
+{
+    memset(pTotal, 0, sizeof(*pTotal));
+
+    for (int iW = 0; iW < g_pShared->m_iWorkerCount; ++iW)
+    {
+        const METRICS_WORKER* pSlot = &g_pShared->m_arrWorkers[iW];
+
+        pTotal->m_uRequests            += metrics_read(&pSlot->m_uRequests);
+        pTotal->m_uBytesReceived       += metrics_read(&pSlot->m_uBytesReceived);
+        pTotal->m_uBytesSent           += metrics_read(&pSlot->m_uBytesSent);
+        pTotal->m_uConnectionsAccepted += metrics_read(&pSlot->m_uConnectionsAccepted);
+        pTotal->m_uConnectionsActive   += metrics_read(&pSlot->m_uConnectionsActive);
+        pTotal->m_uLatencySumUs        += metrics_read(&pSlot->m_uLatencySumUs);
+
+        for (int iX = 0; iX < METRICS_STATUS_CLASSES; ++iX)
+            pTotal->m_arrStatus[iX] += metrics_read(&pSlot->m_arrStatus[iX]);
+        for (int iX = 0; iX < METRICS_PARSE_RESULTS; ++iX)
+            pTotal->m_arrParseErrors[iX] += metrics_read(&pSlot->m_arrParseErrors[iX]);
+        for (int iX = 0; iX <= METRICS_LATENCY_BUCKETS; ++iX)
+            pTotal->m_arrLatency[iX] += metrics_read(&pSlot->m_arrLatency[iX]);
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static size_t metrics_render(char* pBuffer, size_t iCapacity)
+{
+    /*
+        Prometheus text exposition format 0.0.4. Totals are summed over
+        every worker at scrape time; requests and open connections are
+        also broken down per worker to spot an unbalanced listener.
+    */
+
+    METRICS_WORKER total;
+    metrics_sum(&total);
+
+    size_t iOff = 0;
+
+    // snprintf() into whatever is left, a full buffer just stops growing
+#define METRICS_PRINT(...) \
+    do { \
+        if (iOff < iCapacity) { \
+            int n = snprintf(pBuffer + iOff, iCapacity - iOff, __VA_ARGS__); \
+            if (n > 0) iOff += (size_t)n; \
+        } \
+    } while (0)
+
+    METRICS_PRINT("# HELP server_start_time_seconds Unix time the master process started.\n"
+                  "# TYPE server_start_time_seconds gauge\n"
+                  "server_start_time_seconds %llu\n",
+                  (unsigned long long)g_pShared->m_uStartTime);
+
+    METRICS_PRINT("# HELP server_workers Worker processes.\n"
+                  "# TYPE server_workers gauge\n"
+                  "server_workers %d\n",
+                  g_pShared->m_iWorkerCount);
+
+    METRICS_PRINT("# HELP server_worker_restarts_total Workers respawned after dying.\n"
+                  "# TYPE server_worker_restarts_total counter\n"
+                  "server_worker_restarts_total %llu\n",
+                  (unsigned long long)metrics_read(&g_pShared->m_uWorkerRestarts));
+
+    METRICS_PRINT("# HELP server_connections_accepted_total Client connections accepted.\n"
+                  "# TYPE server_connections_accepted_total counter\n"
+                  "server_connections_accepted_total %llu\n",
+                  (unsigned long long)total.m_uConnectionsAccepted);
+
+    METRICS_PRINT("# HELP server_connections_active Client connections currently open.\n"
+                  "# TYPE server_connections_active gauge\n");
+    for (int iW = 0; iW < g_pShared->m_iWorkerCount; ++iW)
+        METRICS_PRINT("server_connections_active{worker=\"%d\"} %lld\n", iW,
+                      (long long)metrics_read(&g_pShared->m_arrWorkers[iW].m_uConnectionsActive));
+
+    METRICS_PRINT("# HELP server_received_bytes_total Bytes read from clients.\n"
+                  "# TYPE server_received_bytes_total counter\n"
+                  "server_received_bytes_total %llu\n",
+                  (unsigned long long)total.m_uBytesReceived);
+
+    METRICS_PRINT("# HELP server_sent_bytes_total Bytes written to clients.\n"
+                  "# TYPE server_sent_bytes_total counter\n"
+                  "server_sent_bytes_total %llu\n",
+                  (unsigned long long)total.m_uBytesSent);
+
+    METRICS_PRINT("# HELP server_http_requests_total Requests answered, by status class.\n"
+                  "# TYPE server_http_requests_total counter\n");
+    for (int iX = 0; iX < METRICS_STATUS_CLASSES; ++iX)
+        METRICS_PRINT("server_http_requests_total{code=\"%s\"} %llu\n",
+                      METRICS_STATUS_NAMES[iX], (unsigned long long)total.m_arrStatus[iX]);
+
+    METRICS_PRINT("# HELP server_worker_http_requests_total Requests answered by each worker.\n"
+                  "# TYPE server_worker_http_requests_total counter\n");
+    for (int iW = 0; iW < g_pShared->m_iWorkerCount; ++iW)
+        METRICS_PRINT("server_worker_http_requests_total{worker=\"%d\"} %llu\n", iW,
+                      (unsigned long long)metrics_read(&g_pShared->m_arrWorkers[iW].m_uRequests));
+
+    METRICS_PRINT("# HELP server_http_parse_errors_total Requests rejected by the parser, by reason.\n"
+                  "# TYPE server_http_parse_errors_total counter\n");
+    for (int iX = 1; iX < METRICS_PARSE_RESULTS; ++iX)
+        METRICS_PRINT("server_http_parse_errors_total{reason=\"%s\"} %llu\n",
+                      METRICS_PARSE_NAMES[iX], (unsigned long long)total.m_arrParseErrors[iX]);
+
+    METRICS_PRINT("# HELP server_http_request_duration_seconds Time from a parsed request to its last response byte.\n"
+                  "# TYPE server_http_request_duration_seconds histogram\n");
+    uint64_t uCumulative = 0;
+    for (int iX = 0; iX < METRICS_LATENCY_BUCKETS; ++iX)
+    {
+        uCumulative += total.m_arrLatency[iX];
+        METRICS_PRINT("server_http_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                      (double)METRICS_LATENCY_BOUNDS_US[iX] / 1e6, (unsigned long long)uCumulative);
+    }
+    uCumulative += total.m_arrLatency[METRICS_LATENCY_BUCKETS];
+    METRICS_PRINT("server_http_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                  "server_http_request_duration_seconds_sum %.6f\n"
+                  "server_http_request_duration_seconds_count %llu\n",
+                  (unsigned long long)uCumulative,
+                  (double)total.m_uLatencySumUs / 1e6,
+                  (unsigned long long)uCumulative);
+
+#undef METRICS_PRINT
+
+    return iOff < iCapacity ? iOff : iCapacity;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool metrics_send_response(CONNECTION* pConn, const REQUEST_INFO* ri)
+{
+    if (!pConn) return false;
+
+    if (!g_pShared)
+        return send_simple_response(pConn, ri, 404, "Not Found", NULL, 0);
+
+    // fixed series plus two per-worker ones
+    size_t iCapacity = 8192 + (size_t)g_pShared->m_iWorkerCount * 128;
+
+    char* pBody = arenaAlloc(&pConn->m_arena, iCapacity);
+    if (!pBody)
+        return send_simple_response(pConn, ri, 500, "Internal Server Error", NULL, 0);
+
+    size_t iLength = metrics_render(pBody, iCapacity);
+
+    return send_content_response(pConn, ri, 200, "OK", "text/plain; version=0.0.4; charset=utf-8", pBody, iLength);
+}
@@ -0,0 +1,92 @@
+/*
+    File name    : metrics.h
+    creation date: 06-04-26
+    Author       : Solomon
+*/
+
+/*
+    Server wide counters, shared by the master and every worker.
+
+    One anonymous MAP_SHARED mapping is created by the master before the
+    workers are forked, so every process sees the same pages. Each worker
+    slot owns its own cache-line aligned block and is the only writer of
+    it: updates are plain relaxed stores, no locked instruction and no line
+    bouncing between workers. A scrape of /metrics (answered by whichever
+    worker got it) sums every slot and renders Prometheus text format.
+
+    Counters survive a worker being respawned, its slot keeps counting;
+    only the active connection gauge starts over with the new process.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>     // provides size_t
+#include <stdint.h>     // provides uint64_t
+#include <stdbool.h>
+#include "http.h"       // provides PARSE_RESULT, REQUEST_INFO
+
+#define METRICS_PATH "/metrics"
+
+#define METRICS_CACHE_LINE      64
+#define METRICS_STATUS_CLASSES  6    // 1xx .. 5xx, [0] = no status was recorded
+#define METRICS_PARSE_RESULTS   (ERR_UNSUPPORTED_TRANSFER_ENCODING + 1)
+#define METRICS_LATENCY_BUCKETS 14   // upper bounds in METRICS_LATENCY_BOUNDS_US, plus +Inf
+
+typedef struct CONNECTION CONNECTION;
+
+typedef struct METRICS_WORKER
+{
+    _Alignas(METRICS_CACHE_LINE)
+    uint64_t m_uRequests;                                   // responses completely sent
+    uint64_t m_uBytesReceived;
+    uint64_t m_uBytesSent;
+    uint64_t m_uConnectionsAccepted;
+    uint64_t m_uConnectionsActive;                          // gauge, reset when the worker starts
+    uint64_t m_arrStatus[METRICS_STATUS_CLASSES];
+    uint64_t m_arrParseErrors[METRICS_PARSE_RESULTS];       // indexed by PARSE_RESULT
+
+    // request latency: parsed -> last response byte handed to the kernel
+    uint64_t m_arrLatency[METRICS_LATENCY_BUCKETS + 1];     // not cumulative, summed on render
+    uint64_t m_uLatencySumUs;
+} METRICS_WORKER;
+
+typedef struct METRICS_SHARED
+{
+    _Alignas(METRICS_CACHE_LINE)
+    int      m_iWorkerCount;
+    uint64_t m_uStartTime;                                  // unix seconds, master start
+    uint64_t m_uWorkerRestarts;                             // written by the master only
+
+    METRICS_WORKER m_arrWorkers[];
+} METRICS_SHARED;
+
+/*===================================== Master ======================================*/
+bool metrics_init            (int iWorkerCount);   // before fork
+void metrics_worker_restarted(void);
+
+/*===================================== Worker ======================================*/
+void metrics_attach          (int iWorkerIndex);   // after fork, selects the slot written from now on
+
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_bytes_received  (size_t iBytes);
+void metrics_bytes_sent      (size_t iBytes);
+void metrics_parse_error     (PARSE_RESULT result);
+void metrics_request_done    (const CONNECTION* pConn);  // response fully sent
+
+bool metrics_is_request      (const REQUEST_INFO* ri);
+bool metrics_send_response   (CONNECTION* pConn, const REQUEST_INFO* ri);
+
+#endif
+
+/*
+
+metrics_init()          -> maps the shared segment, one slot per worker plus the master's fields
+metrics_attach()        -> points the recording functions at the worker's own slot; without a segment
+                           (or before attach) every recording function is a no-op
+metrics_request_done()  -> counts the request by status class and adds its latency to the histogram
+metrics_is_request()    -> true for a request of METRICS_PATH (query string ignored)
+metrics_send_response() -> sums every worker slot and queues the Prometheus text exposition
+
+*/
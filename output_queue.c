@@ -0,0 +1,293 @@
+/*
+    File name    : output_queue.c
+    creation date: 20-03-26
+    Author       : Solomon
+*/
+
+#include <errno.h>        // provides errno, EAGAIN, EWOULDBLOCK, EINTR
+#include <string.h>       // provides memset()
+#include <unistd.h>       // provides close()
+#include <sys/socket.h>   // provides sendmsg(), struct msghdr, MSG_NOSIGNAL, MSG_MORE
+#include <sys/uio.h>      // provides struct iovec
+#include "output_queue.h"
+#include "static_files.h" // provides sendFileToSocket()
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static OUT_SEGMENT* queue_tail_slot(OUTPUT_QUEUE* pQueue)
+{
+    if (pQueue->m_iCount >= OUTPUT_QUEUE_MAX_SEGMENTS) return NULL;
+
+    size_t iIndex = (pQueue->m_iHead + pQueue->m_iCount) % OUTPUT_QUEUE_MAX_SEGMENTS;
+    return &pQueue->m_arrSegments[iIndex];
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void queue_pop(OUTPUT_QUEUE* pQueue)
+{
+    OUT_SEGMENT* pSegment = &pQueue->m_arrSegments[pQueue->m_iHead];
+
+    if (pSegment->m_pfnRelease)
+        pSegment->m_pfnRelease(pSegment->m_pReleaseCtx);
+    else if (pSegment->m_type == OUT_SEGMENT_FILE && pSegment->m_bOwnsFd && pSegment->m_iFileFd >= 0)
+        close(pSegment->m_iFileFd);
+
+    pQueue->m_iPendingBytes -= pSegment->m_iLength;
+    memset(pSegment, 0, sizeof(*pSegment));
+
+    pQueue->m_iHead = (pQueue->m_iHead + 1) % OUTPUT_QUEUE_MAX_SEGMENTS;
+    pQueue->m_iCount--;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void output_queue_consume(OUTPUT_QUEUE* pQueue, size_t iSent)
+{
+    // spreads the bytes of one sendmsg() over the memory segments it covered
+    if (!pQueue) return;
+
+    while (iSent > 0 && pQueue->m_iCount > 0)
+    {
+        OUT_SEGMENT* pSegment = &pQueue->m_arrSegments[pQueue->m_iHead];
+        size_t iTake = iSent < pSegment->m_iLength ? iSent : pSegment->m_iLength;
+
+        pSegment->m_pData       += iTake;
+        pSegment->m_iLength     -= iTake;
+        pQueue->m_iPendingBytes -= iTake;
+        iSent -= iTake;
+
+        if (pSegment->m_iLength == 0) queue_pop(pQueue);
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void output_queue_init(OUTPUT_QUEUE* pQueue)
+{
+    if (!pQueue) return;
+    memset(pQueue, 0, sizeof(*pQueue));
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool output_queue_push_memory(OUTPUT_QUEUE* pQueue, const char* pData, size_t iLength)
+{
+    if (!pQueue || (!pData && iLength)) return false;
+    if (iLength == 0) return true;
+
+    OUT_SEGMENT* pSegment = queue_tail_slot(pQueue);
+    if (!pSegment) return false;
+
+    pSegment->m_type    = OUT_SEGMENT_MEMORY;
+    pSegment->m_pData   = pData;
+    pSegment->m_iFileFd = -1;
+    pSegment->m_iLength = iLength;
+
+    pQueue->m_iCount++;
+    pQueue->m_iPendingBytes += iLength;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool output_queue_push_shared_memory
+(
+    OUTPUT_QUEUE*  pQueue,
+    const char*    pData,
+    size_t         iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void*          pReleaseCtx
+)
+{
+    if (!pQueue || !pData || iLength == 0) return false;
+
+    OUT_SEGMENT* pSegment = queue_tail_slot(pQueue);
+    if (!output_queue_push_memory(pQueue, pData, iLength)) return false;
+
+    pSegment->m_pfnRelease  = pfnRelease;
+    pSegment->m_pReleaseCtx = pReleaseCtx;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool output_queue_push_file(OUTPUT_QUEUE* pQueue, int iFileFd, off_t iOffset, size_t iLength, bool bOwnsFd)
+{
+    if (!pQueue || iFileFd < 0) return false;
+
+    OUT_SEGMENT* pSegment = queue_tail_slot(pQueue);
+    if (!pSegment) return false;
+
+    pSegment->m_type    = OUT_SEGMENT_FILE;
+    pSegment->m_iFileFd = iFileFd;
+    pSegment->m_iOffset = iOffset;
+    pSegment->m_iLength = iLength;
+    pSegment->m_bOwnsFd = bOwnsFd;
+
+    pQueue->m_iCount++;
+    pQueue->m_iPendingBytes += iLength;
+
+    // an empty file still needs its descriptor released in order
+    if (iLength == 0 && pQueue->m_iCount == 1) queue_pop(pQueue);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool output_queue_push_shared_file
+(
+    OUTPUT_QUEUE*  pQueue,
+    int            iFileFd,
+    off_t          iOffset,
+    size_t         iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void*          pReleaseCtx
+)
+{
+    if (!output_queue_push_file(pQueue, iFileFd, iOffset, iLength, false))
+        return false;
+
+    // an empty range was already popped (and must still be released)
+    if (iLength == 0 && pQueue->m_iCount == 0)
+    {
+        if (pfnRelease) pfnRelease(pReleaseCtx);
+        return true;
+    }
+
+    size_t iIndex = (pQueue->m_iHead + pQueue->m_iCount - 1) % OUTPUT_QUEUE_MAX_SEGMENTS;
+    pQueue->m_arrSegments[iIndex].m_pfnRelease  = pfnRelease;
+    pQueue->m_arrSegments[iIndex].m_pReleaseCtx = pReleaseCtx;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+size_t output_queue_gather(const OUTPUT_QUEUE* pQueue, struct iovec* pIov, size_t iMaxIov, size_t* pBytes)
+{
+    /*
+        Describes the run of memory segments at the head of the queue as an
+        iovec array, so headers and body can leave in one gathered send.
+        Returns 0 when the queue is empty or starts with a file range.
+    */
+
+    size_t iIovCount = 0;
+    size_t iBytes = 0;
+
+    for (size_t iX = 0; pQueue && iX < pQueue->m_iCount && iIovCount < iMaxIov; ++iX)
+    {
+        const OUT_SEGMENT* pNext = &pQueue->m_arrSegments[(pQueue->m_iHead + iX) % OUTPUT_QUEUE_MAX_SEGMENTS];
+        if (pNext->m_type != OUT_SEGMENT_MEMORY) break;
+
+        pIov[iIovCount].iov_base = (void*)pNext->m_pData;
+        pIov[iIovCount].iov_len  = pNext->m_iLength;
+        iBytes += pNext->m_iLength;
+        iIovCount++;
+    }
+
+    if (pBytes) *pBytes = iBytes;
+    return iIovCount;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool output_queue_file_follows(const OUTPUT_QUEUE* pQueue, size_t iIovCount)
+{
+    /*
+        True when a non empty file range comes right after the gathered
+        memory run, i.e. more bytes are about to follow it. An empty range
+        does not count: a MSG_MORE send nobody follows sits in the socket.
+    */
+
+    if (!pQueue || iIovCount >= pQueue->m_iCount) return false;
+
+    const OUT_SEGMENT* pNext = &pQueue->m_arrSegments[(pQueue->m_iHead + iIovCount) % OUTPUT_QUEUE_MAX_SEGMENTS];
+    return pNext->m_type == OUT_SEGMENT_FILE && pNext->m_iLength > 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+OUTPUT_RESULT output_queue_flush(OUTPUT_QUEUE* pQueue, int iSocketFd)
+{
+    /*
+        Sends segments oldest first until the queue is empty or the socket
+        would block. Partial progress is recorded in the segment itself, so
+        the next call (on EPOLLOUT) continues at the exact byte it stopped.
+    */
+
+    if (!pQueue) return OUTPUT_ERROR;
+
+    while (pQueue->m_iCount > 0)
+    {
+        OUT_SEGMENT* pSegment = &pQueue->m_arrSegments[pQueue->m_iHead];
+
+        if (pSegment->m_iLength == 0)
+        {
+            queue_pop(pQueue);
+            continue;
+        }
+
+        ssize_t n;
+        if (pSegment->m_type == OUT_SEGMENT_MEMORY)
+        {
+            // consecutive memory segments (headers + body) leave in one syscall
+            struct iovec arrIov[OUTPUT_QUEUE_MAX_SEGMENTS];
+            size_t iIovCount = output_queue_gather(pQueue, arrIov, OUTPUT_QUEUE_MAX_SEGMENTS, NULL);
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov    = arrIov;
+            msg.msg_iovlen = iIovCount;
+
+            // a file range right behind (head + sendfile body): let the head share its packets
+            int iFlags = MSG_NOSIGNAL;
+            if (output_queue_file_follows(pQueue, iIovCount)) iFlags |= MSG_MORE;
+
+            n = sendmsg(iSocketFd, &msg, iFlags);
+            if (n > 0)
+            {
+                output_queue_consume(pQueue, (size_t)n);
+                continue;
+            }
+        }
+        else
+            n = sendFileToSocket(iSocketFd, pSegment->m_iFileFd, &pSegment->m_iOffset, pSegment->m_iLength);
+
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return OUTPUT_BLOCKED;
+            return OUTPUT_ERROR;
+        }
+
+        // a file that shrank under us cannot complete the promised Content-Length
+        if (n == 0) return OUTPUT_ERROR;
+
+        pSegment->m_iLength     -= (size_t)n;
+        pQueue->m_iPendingBytes -= (size_t)n;
+
+        if (pSegment->m_iLength == 0) queue_pop(pQueue);
+    }
+
+    return OUTPUT_DRAINED;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void output_queue_clear(OUTPUT_QUEUE* pQueue)
+{
+    if (!pQueue) return;
+
+    while (pQueue->m_iCount > 0)
+        queue_pop(pQueue);
+
+    pQueue->m_iHead = 0;
+    pQueue->m_iPendingBytes = 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool output_queue_empty(const OUTPUT_QUEUE* pQueue)
+{
+    return !pQueue || pQueue->m_iCount == 0;
+}
@@ -0,0 +1,95 @@
+/*
+    File name    : output_queue.h
+    creation date: 20-03-26
+    Author       : Solomon
+*/
+
+/*
+    Everything a response consists of is queued on the connection first:
+    header bytes, body bytes and file ranges. The queue is flushed right
+    away and whatever the socket did not accept stays queued until the
+    worker sees EPOLLOUT for that connection, so a slow reader never
+    blocks the worker and never gets a truncated response.
+
+    Memory segments are not copied by the queue; they must stay valid until
+    the queue is drained (the connection keeps them in its request arena).
+*/
+
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <stddef.h>     // provides size_t
+#include <stdbool.h>
+#include <sys/types.h>  // provides off_t
+#include <sys/uio.h>    // provides struct iovec
+
+#define OUTPUT_QUEUE_MAX_SEGMENTS 8
+
+typedef enum
+{
+    OUT_SEGMENT_MEMORY = 0,
+    OUT_SEGMENT_FILE,
+} OUT_SEGMENT_TYPE;
+
+// called once a shared segment is done (sent or dropped), instead of closing / forgetting it
+typedef void (*OUT_RELEASE_FN)(void* pContext);
+
+typedef struct OUT_SEGMENT
+{
+    OUT_SEGMENT_TYPE m_type;
+
+    const char* m_pData;     // memory: next byte to send
+    int         m_iFileFd;   // file: descriptor to read from
+    off_t       m_iOffset;   // file: next offset to send
+    size_t      m_iLength;   // bytes still to send
+    bool        m_bOwnsFd;   // file: close m_iFileFd once the segment is done
+
+    OUT_RELEASE_FN m_pfnRelease;  // hands a shared buffer / fd back to its owner
+    void*          m_pReleaseCtx;
+} OUT_SEGMENT;
+
+typedef struct OUTPUT_QUEUE
+{
+    OUT_SEGMENT m_arrSegments[OUTPUT_QUEUE_MAX_SEGMENTS];
+    size_t      m_iHead;          // index of the oldest segment
+    size_t      m_iCount;         // queued segments
+    size_t      m_iPendingBytes;  // bytes in all queued segments
+} OUTPUT_QUEUE;
+
+typedef enum
+{
+    OUTPUT_DRAINED = 0,  // queue is empty
+    OUTPUT_BLOCKED,      // socket buffer is full, wait for EPOLLOUT
+    OUTPUT_ERROR,        // peer is gone or a file read failed
+} OUTPUT_RESULT;
+
+void          output_queue_init       (OUTPUT_QUEUE* pQueue);
+bool          output_queue_push_memory(OUTPUT_QUEUE* pQueue, const char* pData, size_t iLength);
+bool          output_queue_push_shared_memory(OUTPUT_QUEUE* pQueue, const char* pData, size_t iLength,
+                                              OUT_RELEASE_FN pfnRelease, void* pReleaseCtx);
+bool          output_queue_push_file  (OUTPUT_QUEUE* pQueue, int iFileFd, off_t iOffset, size_t iLength, bool bOwnsFd);
+bool          output_queue_push_shared_file(OUTPUT_QUEUE* pQueue, int iFileFd, off_t iOffset, size_t iLength,
+                                            OUT_RELEASE_FN pfnRelease, void* pReleaseCtx);
+OUTPUT_RESULT output_queue_flush      (OUTPUT_QUEUE* pQueue, int iSocketFd);
+size_t        output_queue_gather     (const OUTPUT_QUEUE* pQueue, struct iovec* pIov, size_t iMaxIov, size_t* pBytes);
+bool          output_queue_file_follows(const OUTPUT_QUEUE* pQueue, size_t iIovCount); // send the gathered run with MSG_MORE
+void          output_queue_consume    (OUTPUT_QUEUE* pQueue, size_t iSent); // after a send done outside flush()
+void          output_queue_clear      (OUTPUT_QUEUE* pQueue); // drops every segment, closes owned files
+bool          output_queue_empty      (const OUTPUT_QUEUE* pQueue);
+
+#endif
+
+/*
+
+output_queue_push_memory() -> appends bytes (not copied) to the response being queued
+output_queue_push_file()   -> appends a byte range of an open file
+output_queue_push_shared_file() -> same, for a descriptor someone else owns (released through the callback)
+output_queue_push_shared_memory() -> appends bytes owned by a cache (released through the callback)
+output_queue_flush()       -> sends as much as the socket accepts without blocking,
+                              adjacent memory segments go out together in one sendmsg(),
+                              with MSG_MORE when a file range follows them
+output_queue_gather()      -> iovec view of the memory segments at the head, for callers that send themselves (io_uring)
+output_queue_consume()     -> records bytes such a send delivered
+output_queue_clear()       -> throws away what is left (connection is closing)
+
+*/
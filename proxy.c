@@ -0,0 +1,1503 @@
+/*
+    File name    : proxy.c
+    creation date: 12-04-26
+    Author       : Solomon
+*/
+
+#define _GNU_SOURCE     // enables memmem(), strcasestr(), SOCK_NONBLOCK, SOCK_CLOEXEC
+
+#include <stddef.h>     // provides offsetof()
+#include <stdio.h>      // provides snprintf()
+#include <stdlib.h>     // provides realloc(), strtol()
+#include <string.h>     // provides memcpy(), memmem(), strlen(), strncmp()
+#include <strings.h>    // provides strcasecmp(), strncasecmp()
+#include <errno.h>      // provides errno, EAGAIN, EINPROGRESS, EINTR
+#include <unistd.h>     // provides close()
+#include <netdb.h>      // provides getaddrinfo(), freeaddrinfo()
+#include <arpa/inet.h>  // provides inet_ntop()
+#include <netinet/tcp.h>// provides TCP_NODELAY
+#include <sys/epoll.h>  // provides epoll_ctl(), EPOLLIN, EPOLLOUT
+#include <sys/socket.h> // provides socket(), connect(), sendmsg(), recv()
+#include <sys/uio.h>    // provides struct iovec
+#include "proxy.h"
+#include "balancer.h"   // provides balancer_pick(), balancer_request_started()
+#include "health.h"     // provides health_usable_mask(), health_report()
+#include "proxy_cache.h" // provides proxy_cache_serve(), proxy_cache_fill_begin(), proxy_cache_join()
+#include "connection.h" // provides CONNECTION, connection_queue_shared(), monotonic_ms()
+#include "response.h"   // provides RESPONSE_BUILDER, send_simple_response()
+#include "pool.h"       // provides Pool
+#include "timer_wheel.h"  // provides TimerWheel
+
+#define UPSTREAM_POOL_SLAB 32   // UPSTREAM_CONN objects per slab
+
+typedef enum
+{
+    UPSTREAM_IDLE = 0,         // in the keep-alive pool, no request
+    UPSTREAM_CONNECTING,
+    UPSTREAM_SENDING,          // request partly written
+    UPSTREAM_READING,          // request sent, response (head or body) being read
+    UPSTREAM_DONE,             // whole response queued on the client, waiting for it to leave
+    UPSTREAM_WAITING,          // no socket: the client waits for another request's fetch of the same key
+} UPSTREAM_STATE;
+
+typedef enum
+{
+    UPSTREAM_BODY_NONE = 0,    // HEAD, 1xx, 204, 304 or Content-Length: 0
+    UPSTREAM_BODY_LENGTH,
+    UPSTREAM_BODY_CHUNKED,     // passed through as is, only scanned for its end
+    UPSTREAM_BODY_UNTIL_CLOSE,
+} UPSTREAM_BODY;
+
+typedef enum
+{
+    CHUNK_SIZE = 0,            // start of a chunk-size line, a hex digit must follow
+    CHUNK_SIZE_DIGITS,         // more digits, the extension or the line end
+    CHUNK_EXTENSION,
+    CHUNK_DATA,
+    CHUNK_DATA_END,            // CRLF after the data
+    CHUNK_TRAILER_START,       // start of a trailer line, an empty one ends the body
+    CHUNK_TRAILER_LINE,
+} CHUNK_STATE;
+
+struct UPSTREAM_CONN
+{
+    int            m_iFd;
+    int            m_iUpstream;        // index in g_arrUpstreams
+    UPSTREAM_STATE m_state;
+    uint32_t       m_uEvents;          // epoll interest currently registered
+    CONNECTION*    m_pClient;          // owner of the request in flight, NULL while idle
+
+    // request, both parts borrowed from the client (arena / read buffer)
+    const char*    m_pRequestHead;
+    size_t         m_iRequestHeadLength;
+    const char*    m_pRequestBody;
+    size_t         m_iRequestBodyLength;
+    size_t         m_iRequestSent;
+    bool           m_bIdempotent;      // may be sent again on a fresh connection
+    bool           m_bHeadRequest;     // the response has no body whatever its headers say
+    bool           m_bReused;          // came out of the pool for this request
+    bool           m_bRetried;
+    bool           m_bCounted;         // the balancer counts this request as in flight
+    uint64_t       m_uStartUs;         // monotonic_us() when the request was handed to this upstream
+
+    // response
+    size_t         m_iLength;          // bytes in m_arrBuffer
+    size_t         m_iScan;            // head: where the search for the blank line resumes
+    bool           m_bHeadQueued;      // the client has the head, errors can only close it now
+    UPSTREAM_BODY  m_body;
+    uint64_t       m_uRemaining;       // length: body bytes left, chunked: bytes left in the chunk
+    CHUNK_STATE    m_chunkState;
+    bool           m_bKeepAlive;       // the upstream connection may serve another request
+    PROXY_CACHE_ITEM* m_pCacheFill;    // shared cache item the response is copied into, NULL if none
+    PROXY_CACHE_TICKET m_fetch;        // the fetch in flight this request leads or waits on
+
+    // idle pool of the upstream, most recently used first
+    UPSTREAM_CONN* m_pNextIdle;
+    UPSTREAM_CONN* m_pPrevIdle;
+
+    // requests of this worker waiting on a fetch in flight
+    UPSTREAM_CONN* m_pNextWaiting;
+    UPSTREAM_CONN* m_pPrevWaiting;
+
+    TimerNode      m_timer;
+    char           m_arrBuffer[PROXY_BUFFER_SIZE];
+};
+
+typedef struct UPSTREAM_IDLE_LIST
+{
+    UPSTREAM_CONN* m_pHead;
+    int            m_iCount;
+} UPSTREAM_IDLE_LIST;
+
+// configuration, set by the master before fork
+static PROXY_UPSTREAM g_arrUpstreams[PROXY_MAX_UPSTREAMS];
+static int            g_iUpstreamCount;
+static char           g_szPrefix[256] = "/";
+static size_t         g_iPrefixLength   = 1;
+static uint64_t       g_uReadTimeoutMs  = DEFAULT_PROXY_READ_TIMEOUT_MS;
+static int            g_iKeepAlive      = DEFAULT_PROXY_KEEPALIVE;
+
+// per worker
+static int                g_iEpollFd = -1;
+static PROXY_FLUSH_FN     g_pfnFlush;
+static Pool               g_upstreamPool;
+static TimerWheel         g_timers;
+static UPSTREAM_IDLE_LIST g_arrIdle[PROXY_MAX_UPSTREAMS];
+static UPSTREAM_CONN*     g_pWaiting;
+static UPSTREAM_CONN**    g_arrByFd;
+static size_t             g_iTableSize;
+
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Helper Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool upstream_table_put(int iFd, UPSTREAM_CONN* pUp)
+{
+    // a few upstream sockets per worker, grown like the connection table
+    if ((size_t)iFd >= g_iTableSize)
+    {
+        size_t iSize = g_iTableSize ? g_iTableSize : 1024;
+        while (iSize <= (size_t)iFd) iSize *= 2;
+
+        UPSTREAM_CONN** arrGrown = realloc(g_arrByFd, iSize * sizeof(UPSTREAM_CONN*));
+        if (!arrGrown) return false;
+
+        memset(arrGrown + g_iTableSize, 0, (iSize - g_iTableSize) * sizeof(UPSTREAM_CONN*));
+        g_arrByFd = arrGrown;
+        g_iTableSize = iSize;
+    }
+
+    g_arrByFd[iFd] = pUp;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static UPSTREAM_CONN* upstream_lookup(int iFd)
+{
+    if (iFd < 0 || (size_t)iFd >= g_iTableSize) return NULL;
+    return g_arrByFd[iFd];
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool upstream_set_events(UPSTREAM_CONN* pUp, uint32_t uEvents)
+{
+    if (pUp->m_uEvents == uEvents) return true;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = uEvents;
+    ev.data.fd = pUp->m_iFd;
+
+    if (epoll_ctl(g_iEpollFd, EPOLL_CTL_MOD, pUp->m_iFd, &ev) < 0) return false;
+
+    pUp->m_uEvents = uEvents;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_arm_timer(UPSTREAM_CONN* pUp, uint64_t uAfterMs)
+{
+    timerWheelSchedule(&g_timers, &pUp->m_timer, monotonic_ms() + uAfterMs);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_idle_unlink(UPSTREAM_CONN* pUp)
+{
+    UPSTREAM_IDLE_LIST* pList = &g_arrIdle[pUp->m_iUpstream];
+
+    if (pUp->m_pPrevIdle) pUp->m_pPrevIdle->m_pNextIdle = pUp->m_pNextIdle;
+    else                  pList->m_pHead = pUp->m_pNextIdle;
+    if (pUp->m_pNextIdle) pUp->m_pNextIdle->m_pPrevIdle = pUp->m_pPrevIdle;
+
+    pUp->m_pNextIdle = NULL;
+    pUp->m_pPrevIdle = NULL;
+    pList->m_iCount--;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_wait_unlink(UPSTREAM_CONN* pUp)
+{
+    if (pUp->m_pPrevWaiting) pUp->m_pPrevWaiting->m_pNextWaiting = pUp->m_pNextWaiting;
+    else                     g_pWaiting = pUp->m_pNextWaiting;
+    if (pUp->m_pNextWaiting) pUp->m_pNextWaiting->m_pPrevWaiting = pUp->m_pPrevWaiting;
+
+    pUp->m_pNextWaiting = NULL;
+    pUp->m_pPrevWaiting = NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_settle(UPSTREAM_CONN* pUp)
+{
+    // the request is over for the balancer, however it ended
+    if (!pUp->m_bCounted) return;
+    pUp->m_bCounted = false;
+    balancer_request_finished(pUp->m_iUpstream);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_close(UPSTREAM_CONN* pUp)
+{
+    // closing the descriptor also removes it from the epoll set
+    upstream_settle(pUp);
+    timerWheelCancel(&g_timers, &pUp->m_timer);
+    if (pUp->m_state == UPSTREAM_IDLE)         upstream_idle_unlink(pUp);
+    else if (pUp->m_state == UPSTREAM_WAITING) upstream_wait_unlink(pUp);
+
+    // a response cut short is not stored; whoever waited for it fetches on its own
+    if (pUp->m_pCacheFill) proxy_cache_fill_abort(pUp->m_pCacheFill);
+    pUp->m_pCacheFill = NULL;
+    proxy_cache_fetch_done(&pUp->m_fetch, false);
+
+    if (pUp->m_iFd >= 0)
+    {
+        if ((size_t)pUp->m_iFd < g_iTableSize && g_arrByFd[pUp->m_iFd] == pUp)
+            g_arrByFd[pUp->m_iFd] = NULL;
+        close(pUp->m_iFd);
+    }
+
+    poolFree(&g_upstreamPool, pUp);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_release(UPSTREAM_CONN* pUp)
+{
+    /*
+        The response is complete and the client has all of it. A connection
+        that can serve another request goes to the front of its upstream's
+        idle list, where the next request picks it up warm.
+    */
+
+    UPSTREAM_IDLE_LIST* pList = &g_arrIdle[pUp->m_iUpstream];
+    upstream_settle(pUp);
+
+    if (!pUp->m_bKeepAlive || pList->m_iCount >= g_iKeepAlive ||
+        !upstream_set_events(pUp, EPOLLIN | EPOLLRDHUP))
+    {
+        pUp->m_state = UPSTREAM_DONE;
+        upstream_close(pUp);
+        return;
+    }
+
+    // an idle connection that becomes readable was closed (or is misbehaving)
+    pUp->m_state   = UPSTREAM_IDLE;
+    pUp->m_pClient = NULL;
+
+    pUp->m_pPrevIdle = NULL;
+    pUp->m_pNextIdle = pList->m_pHead;
+    if (pList->m_pHead) pList->m_pHead->m_pPrevIdle = pUp;
+    pList->m_pHead = pUp;
+    pList->m_iCount++;
+
+    upstream_arm_timer(pUp, PROXY_IDLE_TIMEOUT_MS);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static UPSTREAM_CONN* upstream_dial(int iUpstream, bool* pbRefused)
+{
+    // *pbRefused tells a failed connect() (the upstream's doing) from a failure of ours
+    *pbRefused = false;
+
+    UPSTREAM_CONN* pUp = poolAlloc(&g_upstreamPool);
+    if (!pUp) return NULL;
+    memset(pUp, 0, offsetof(UPSTREAM_CONN, m_arrBuffer));
+
+    pUp->m_iUpstream = iUpstream;
+    pUp->m_iFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    timerNodeInit(&pUp->m_timer, pUp);
+
+    if (pUp->m_iFd < 0)
+    {
+        poolFree(&g_upstreamPool, pUp);
+        return NULL;
+    }
+
+    // request heads are written in one piece, there is nothing to batch
+    int iOne = 1;
+    setsockopt(pUp->m_iFd, IPPROTO_TCP, TCP_NODELAY, &iOne, sizeof(iOne));
+
+    const struct sockaddr_in* pAddr = &g_arrUpstreams[iUpstream].m_addr;
+    int iRc = connect(pUp->m_iFd, (const struct sockaddr*)pAddr, sizeof(*pAddr));
+    *pbRefused = iRc < 0 && errno != EINPROGRESS;
+
+    pUp->m_state   = (iRc == 0) ? UPSTREAM_SENDING : UPSTREAM_CONNECTING;
+    pUp->m_uEvents = EPOLLOUT;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLOUT;
+    ev.data.fd = pUp->m_iFd;
+
+    if (*pbRefused ||
+        !upstream_table_put(pUp->m_iFd, pUp) ||
+        epoll_ctl(g_iEpollFd, EPOLL_CTL_ADD, pUp->m_iFd, &ev) < 0)
+    {
+        pUp->m_state = UPSTREAM_DONE;
+        upstream_close(pUp);
+        return NULL;
+    }
+
+    upstream_arm_timer(pUp, PROXY_CONNECT_TIMEOUT_MS);
+    return pUp;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static UPSTREAM_CONN* upstream_acquire(int iUpstream, bool* pbRefused)
+{
+    // pooled connection first, a new one only when the pool is empty
+    UPSTREAM_IDLE_LIST* pList = &g_arrIdle[iUpstream];
+
+    UPSTREAM_CONN* pUp = pList->m_pHead;
+    *pbRefused = false;
+    if (pUp)
+    {
+        upstream_idle_unlink(pUp);
+        timerWheelCancel(&g_timers, &pUp->m_timer);
+        pUp->m_state   = UPSTREAM_SENDING;
+        pUp->m_bReused = true;
+        return pUp;
+    }
+
+    return upstream_dial(iUpstream, pbRefused);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool upstream_wait(CONNECTION* pConn, const PROXY_CACHE_TICKET* pFetch)
+{
+    /*
+        Parks the client on another request's fetch of the same key. The
+        placeholder has no socket, only the client and a timer that bounds
+        the wait: past it the client goes to the upstream itself.
+    */
+
+    UPSTREAM_CONN* pUp = poolAlloc(&g_upstreamPool);
+    if (!pUp) return false;
+    memset(pUp, 0, offsetof(UPSTREAM_CONN, m_arrBuffer));
+
+    pUp->m_iFd     = -1;
+    pUp->m_state   = UPSTREAM_WAITING;
+    pUp->m_pClient = pConn;
+    pUp->m_fetch   = *pFetch;
+    timerNodeInit(&pUp->m_timer, pUp);
+
+    pUp->m_pNextWaiting = g_pWaiting;
+    if (g_pWaiting) g_pWaiting->m_pPrevWaiting = pUp;
+    g_pWaiting = pUp;
+
+    pConn->m_pUpstream = pUp;
+    upstream_arm_timer(pUp, PROXY_CONNECT_TIMEOUT_MS + g_uReadTimeoutMs);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_reset_exchange(UPSTREAM_CONN* pUp)
+{
+    pUp->m_iRequestSent = 0;
+    pUp->m_iLength      = 0;
+    pUp->m_iScan        = 0;
+    pUp->m_bHeadQueued  = false;
+    pUp->m_body         = UPSTREAM_BODY_NONE;
+    pUp->m_uRemaining   = 0;
+    pUp->m_chunkState   = CHUNK_SIZE;
+    pUp->m_bKeepAlive   = false;
+    pUp->m_pCacheFill   = NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool upstream_send(UPSTREAM_CONN* pUp)
+{
+    /*
+        Writes what is left of the request (head and body as one gathered
+        send) and switches to reading once all of it is out. False when the
+        socket failed.
+    */
+
+    size_t iTotal = pUp->m_iRequestHeadLength + pUp->m_iRequestBodyLength;
+
+    while (pUp->m_iRequestSent < iTotal)
+    {
+        struct iovec arrIov[2];
+        size_t iIovCount = 0;
+        size_t iSent = pUp->m_iRequestSent;
+
+        if (iSent < pUp->m_iRequestHeadLength)
+        {
+            arrIov[iIovCount].iov_base = (void*)(pUp->m_pRequestHead + iSent);
+            arrIov[iIovCount].iov_len  = pUp->m_iRequestHeadLength - iSent;
+            iIovCount++;
+            iSent = 0;
+        }
+        else iSent -= pUp->m_iRequestHeadLength;
+
+        if (pUp->m_iRequestBodyLength > iSent)
+        {
+            arrIov[iIovCount].iov_base = (void*)(pUp->m_pRequestBody + iSent);
+            arrIov[iIovCount].iov_len  = pUp->m_iRequestBodyLength - iSent;
+            iIovCount++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = arrIov;
+        msg.msg_iovlen = iIovCount;
+
+        ssize_t n = sendmsg(pUp->m_iFd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                upstream_arm_timer(pUp, g_uReadTimeoutMs);
+                return upstream_set_events(pUp, EPOLLOUT);
+            }
+            return false;
+        }
+
+        pUp->m_iRequestSent += (size_t)n;
+    }
+
+    pUp->m_state = UPSTREAM_READING;
+    upstream_arm_timer(pUp, g_uReadTimeoutMs);
+    return upstream_set_events(pUp, EPOLLIN);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool upstream_start(UPSTREAM_CONN* pUp)
+{
+    // a connect still in progress sends once EPOLLOUT says it completed
+    upstream_reset_exchange(pUp);
+    if (pUp->m_state == UPSTREAM_CONNECTING) return true;
+
+    pUp->m_state = UPSTREAM_SENDING;
+    return upstream_send(pUp);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool upstream_retry(UPSTREAM_CONN** ppUp, bool* pbUpstreamFault)
+{
+    /*
+        A pooled connection may have been closed by the upstream just
+        before we used it; nothing of the response arrived, so an
+        idempotent request is sent again once, on a fresh connection.
+        When that connection cannot even be made on our side,
+        *pbUpstreamFault is cleared: the request failed because of us.
+    */
+
+    UPSTREAM_CONN* pOld = *ppUp;
+    if (!pOld->m_bReused || pOld->m_bRetried || !pOld->m_bIdempotent || pOld->m_iLength > 0)
+        return false;
+
+    bool bRefused;
+    UPSTREAM_CONN* pNew = upstream_dial(pOld->m_iUpstream, &bRefused);
+    if (!pNew)
+    {
+        *pbUpstreamFault = bRefused;
+        return false;
+    }
+
+    pNew->m_pClient            = pOld->m_pClient;
+    pNew->m_pRequestHead       = pOld->m_pRequestHead;
+    pNew->m_iRequestHeadLength = pOld->m_iRequestHeadLength;
+    pNew->m_pRequestBody       = pOld->m_pRequestBody;
+    pNew->m_iRequestBodyLength = pOld->m_iRequestBodyLength;
+    pNew->m_bIdempotent        = pOld->m_bIdempotent;
+    pNew->m_bHeadRequest       = pOld->m_bHeadRequest;
+    pNew->m_bRetried           = true;
+    pNew->m_bCounted           = pOld->m_bCounted;
+    pNew->m_uStartUs           = pOld->m_uStartUs;
+    pNew->m_fetch              = pOld->m_fetch;
+    pOld->m_bCounted           = false;
+    memset(&pOld->m_fetch, 0, sizeof(pOld->m_fetch));
+
+    pNew->m_pClient->m_pUpstream = pNew;
+    pOld->m_state = UPSTREAM_DONE;
+    upstream_close(pOld);
+
+    *ppUp = pNew;
+    return upstream_start(pNew);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_fail(UPSTREAM_CONN* pUp, int iStatus, bool bUpstreamFault)
+{
+    /*
+        The exchange cannot complete. Before the client got the head it is
+        answered with iStatus; after that the only honest signal left is
+        closing the client once what it already has is sent.
+        Only bUpstreamFault (connect / send / recv errors, timeouts, a
+        malformed response) counts against the upstream's health; a full
+        client queue or a worker short of memory or descriptors does not.
+    */
+
+    CONNECTION* pClient = pUp->m_pClient;
+    bool bHeadQueued = pUp->m_bHeadQueued;
+
+    if (bUpstreamFault && iStatus == 502 && !bHeadQueued && upstream_retry(&pUp, &bUpstreamFault))
+        return;
+
+    if (bUpstreamFault) health_report(pUp->m_iUpstream, false, monotonic_ms());
+    pClient->m_pUpstream = NULL;
+    pUp->m_state = UPSTREAM_DONE;
+    upstream_close(pUp);
+
+    if (bHeadQueued)
+        pClient->m_bCloseAfterFlush = true;
+    else if (iStatus == 504)
+        send_simple_response(pClient, &pClient->m_request, 504, "Gateway Timeout", NULL, 0);
+    else
+        send_simple_response(pClient, &pClient->m_request, 502, "Bad Gateway", NULL, 0);
+
+    g_pfnFlush(pClient);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static const char* proxy_find_header(const REQUEST_INFO* ri, const char* szName)
+{
+    for (size_t iX = 0; iX < ri->m_headers.count; ++iX)
+    {
+        const char* szKey = ri->m_headers.entries[iX].szKey;
+        if (szKey && strcasecmp(szKey, szName) == 0) return ri->m_headers.entries[iX].szValue;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool proxy_is_hop_header(const char* szKey)
+{
+    // meaningful for one connection only, or rewritten by us below
+    static const char* const arrHop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade",
+        "Transfer-Encoding", "Content-Length", "Expect", "X-Forwarded-For",
+    };
+
+    for (size_t iX = 0; iX < sizeof(arrHop) / sizeof(arrHop[0]); ++iX)
+        if (strcasecmp(szKey, arrHop[iX]) == 0) return true;
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static char* proxy_build_request(CONNECTION* pConn, const REQUEST_INFO* ri, int iUpstream, size_t* pLength)
+{
+    /*
+        The request as the upstream gets it, in the client's arena (valid
+        until the request is finished). An HTTP/1.0 client is forwarded as
+        HTTP/1.0 with keep-alive, so the upstream never answers it chunked.
+        A chunked request body was already decoded by the parser and goes
+        out with a Content-Length.
+    */
+
+    bool bClient10 = ri->m_szVersion && strcmp(ri->m_szVersion, "HTTP/1.0") == 0;
+
+    char szPeer[INET_ADDRSTRLEN] = "";
+    if (pConn->m_uPeerAddr)
+    {
+        struct in_addr addr = { .s_addr = pConn->m_uPeerAddr };
+        inet_ntop(AF_INET, &addr, szPeer, sizeof(szPeer));
+    }
+
+    const char* szForwarded = proxy_find_header(ri, "X-Forwarded-For");
+    const char* szHost      = proxy_find_header(ri, "Host");
+
+    size_t iSize = strlen(ri->m_szMethod) + strlen(ri->m_szPath) + 256 +
+                   (szForwarded ? strlen(szForwarded) : 0) + sizeof(g_arrUpstreams[0].m_szName);
+    for (size_t iX = 0; iX < ri->m_headers.count; ++iX)
+    {
+        const HEADER_KEY_VALUE* pH = &ri->m_headers.entries[iX];
+        if (pH->szKey && pH->szValue) iSize += strlen(pH->szKey) + strlen(pH->szValue) + 4;
+    }
+
+    char* pOut = arenaAlloc(&pConn->m_arena, iSize);
+    if (!pOut) return NULL;
+
+    size_t iOff = (size_t)snprintf(pOut, iSize, "%s %s %s\r\n", ri->m_szMethod, ri->m_szPath,
+                                   bClient10 ? "HTTP/1.0" : "HTTP/1.1");
+
+    for (size_t iX = 0; iX < ri->m_headers.count && iOff < iSize; ++iX)
+    {
+        const HEADER_KEY_VALUE* pH = &ri->m_headers.entries[iX];
+        if (!pH->szKey || !pH->szValue || proxy_is_hop_header(pH->szKey)) continue;
+
+        iOff += (size_t)snprintf(pOut + iOff, iSize - iOff, "%s: %s\r\n", pH->szKey, pH->szValue);
+    }
+
+    if (!szHost && iOff < iSize)
+        iOff += (size_t)snprintf(pOut + iOff, iSize - iOff, "Host: %s\r\n", g_arrUpstreams[iUpstream].m_szName);
+
+    if ((szPeer[0] || szForwarded) && iOff < iSize)
+        iOff += (size_t)snprintf(pOut + iOff, iSize - iOff, "X-Forwarded-For: %s%s%s\r\n",
+                                 szForwarded ? szForwarded : "", szForwarded && szPeer[0] ? ", " : "", szPeer);
+
+    if (bClient10 && iOff < iSize)
+        iOff += (size_t)snprintf(pOut + iOff, iSize - iOff, "Connection: keep-alive\r\n");
+
+    if ((ri->m_iBodyLength > 0 || proxy_find_header(ri, "Content-Length") || ri->m_is_chunked) && iOff < iSize)
+        iOff += (size_t)snprintf(pOut + iOff, iSize - iOff, "Content-Length: %zu\r\n", ri->m_iBodyLength);
+
+    if (iOff + 2 >= iSize) return NULL;
+
+    memcpy(pOut + iOff, "\r\n", 2);
+    *pLength = iOff + 2;
+    return pOut;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool proxy_is_idempotent(const char* szMethod)
+{
+    static const char* const arrMethods[] = { "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE" };
+
+    for (size_t iX = 0; iX < sizeof(arrMethods) / sizeof(arrMethods[0]); ++iX)
+        if (strcmp(szMethod, arrMethods[iX]) == 0) return true;
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool proxy_skip_response_header(const char* szKey)
+{
+    // hop-by-hop, or written by the response head of this server
+    static const char* const arrSkip[] = { "Connection", "Keep-Alive", "Proxy-Connection", "Date", "Server" };
+
+    for (size_t iX = 0; iX < sizeof(arrSkip) / sizeof(arrSkip[0]); ++iX)
+        if (strcasecmp(szKey, arrSkip[iX]) == 0) return true;
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool proxy_parse_length(const char* szValue, uint64_t* puLength)
+{
+    // digits only, the rules parser_on_header() applies to requests
+    const char* p = szValue;
+    if (*p < '0' || *p > '9') return false;
+
+    uint64_t uValue = 0;
+    for (; *p >= '0' && *p <= '9'; ++p)
+    {
+        if (uValue > (UINT64_MAX - 9) / 10) return false;
+        uValue = uValue * 10 + (uint64_t)(*p - '0');
+    }
+    if (*p != '\0') return false;
+
+    *puLength = uValue;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool proxy_final_coding_is_chunked(const char* szValue)
+{
+    // the last entry of the coding list, "gzip, chunked" is chunked, "chunked, gzip" is not
+    const char* pLast = strrchr(szValue, ',');
+    pLast = pLast ? pLast + 1 : szValue;
+    while (*pLast == ' ' || *pLast == '\t') pLast++;
+
+    size_t iLen = strlen(pLast);
+    while (iLen > 0 && (pLast[iLen - 1] == ' ' || pLast[iLen - 1] == '\t')) iLen--;
+
+    return iLen == 7 && strncasecmp(pLast, "chunked", 7) == 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int upstream_parse_head(UPSTREAM_CONN* pUp, size_t* pBodyAt)
+{
+    /*
+        Looks for the end of the response head in the receive buffer and,
+        once it is there, queues the client's version of it: our status
+        line / Date / Server / Connection, then the upstream's end-to-end
+        headers unchanged (framing headers included, the body is passed
+        through as it comes). A Content-Length that is not all digits, or
+        repeated with another value, makes the response unusable: the
+        client must frame the body exactly as we do. It is forwarded once,
+        and not at all next to a Transfer-Encoding, which decides the
+        framing: chunks when chunked is the final coding, else the body runs
+        until the connection closes (RFC 9112 section 6.3).
+        Returns 1 when the head was queued (*pBodyAt = first body byte),
+        0 when more bytes are needed, -1 for an unusable response and -2
+        when the client's head could not be queued (our failure).
+    */
+
+    CONNECTION* pClient = pUp->m_pClient;
+    char* pBuf = pUp->m_arrBuffer;
+
+    while (1)
+    {
+        size_t iFrom = pUp->m_iScan > 3 ? pUp->m_iScan - 3 : 0;
+        char* pEnd = memmem(pBuf + iFrom, pUp->m_iLength - iFrom, "\r\n\r\n", 4);
+        if (!pEnd)
+        {
+            pUp->m_iScan = pUp->m_iLength;
+            return pUp->m_iLength >= sizeof(pUp->m_arrBuffer) ? -1 : 0;
+        }
+
+        size_t iHeadEnd = (size_t)(pEnd - pBuf) + 4;
+
+        // status line: HTTP/1.x SSS reason
+        if (iHeadEnd < 14 || strncmp(pBuf, "HTTP/1.", 7) != 0 || pBuf[8] != ' ') return -1;
+        bool bUpstream10 = pBuf[7] == '0';
+
+        int iStatus = 0;
+        for (int iX = 9; iX < 12; ++iX)
+        {
+            if (pBuf[iX] < '0' || pBuf[iX] > '9') return -1;
+            iStatus = iStatus * 10 + (pBuf[iX] - '0');
+        }
+
+        // interim responses (100 Continue...) are dropped, the final one follows
+        if (iStatus >= 100 && iStatus < 200)
+        {
+            if (iStatus == 101) return -1;
+            memmove(pBuf, pBuf + iHeadEnd, pUp->m_iLength - iHeadEnd);
+            pUp->m_iLength -= iHeadEnd;
+            pUp->m_iScan    = 0;
+            continue;
+        }
+
+        char* pLine = memchr(pBuf, '\n', iHeadEnd);
+        if (pLine[-1] != '\r') return -1;
+
+        char* szReason = pBuf + 12;
+        while (*szReason == ' ') szReason++;
+        pLine[-1] = '\0';
+        pLine++;
+
+        bool     bHasCoding    = false;
+        bool     bChunked      = false;
+        bool     bHasLength    = false;
+        uint64_t uLength       = 0;
+        bool     bSaysClose    = false;
+        bool     bSaysKeep     = false;
+        size_t   iHeaders      = 0;
+
+        PROXY_CACHE_POLICY policy;
+        proxy_cache_policy_init(&policy);
+
+        // first pass: framing and connection handling decide the head we write
+        for (char* p = pLine; p < pBuf + iHeadEnd - 2; )
+        {
+            char* pNext  = memchr(p, '\n', (size_t)(pBuf + iHeadEnd - p)) + 1;
+            char* pColon = memchr(p, ':', (size_t)(pNext - p));
+            if (!pColon || pNext[-2] != '\r') return -1;
+
+            *pColon = '\0';
+            pNext[-2] = '\0';
+            char* szValue = pColon + 1;
+            while (*szValue == ' ' || *szValue == '\t') szValue++;
+
+            if (strcasecmp(p, "Transfer-Encoding") == 0)
+            {
+                // a repeated header continues the list, its last coding is the final one
+                bHasCoding = true;
+                bChunked   = proxy_final_coding_is_chunked(szValue);
+            }
+            else if (strcasecmp(p, "Content-Length") == 0)
+            {
+                uint64_t uValue;
+                if (!proxy_parse_length(szValue, &uValue) || (bHasLength && uValue != uLength)) return -1;
+                bHasLength = true;
+                uLength    = uValue;
+            }
+            else if (strcasecmp(p, "Connection") == 0)
+            {
+                if (strcasestr(szValue, "close"))      bSaysClose = true;
+                if (strcasestr(szValue, "keep-alive")) bSaysKeep  = true;
+            }
+
+            proxy_cache_note_header(&policy, p, szValue);
+            iHeaders++;
+            p = pNext;
+        }
+
+        if (pUp->m_bHeadRequest || iStatus == 204 || iStatus == 304) pUp->m_body = UPSTREAM_BODY_NONE;
+        else if (bChunked)                                          pUp->m_body = UPSTREAM_BODY_CHUNKED;
+        else if (bHasCoding)                                        pUp->m_body = UPSTREAM_BODY_UNTIL_CLOSE;
+        else if (bHasLength)                                        pUp->m_body = uLength ? UPSTREAM_BODY_LENGTH : UPSTREAM_BODY_NONE;
+        else                                                        pUp->m_body = UPSTREAM_BODY_UNTIL_CLOSE;
+
+        pUp->m_uRemaining = pUp->m_body == UPSTREAM_BODY_LENGTH ? uLength : 0;
+        pUp->m_bKeepAlive = (bUpstream10 ? bSaysKeep : !bSaysClose) && pUp->m_body != UPSTREAM_BODY_UNTIL_CLOSE;
+
+        // a body that ends with the connection can only end the client's as well
+        if (pUp->m_body == UPSTREAM_BODY_UNTIL_CLOSE) pClient->m_bCloseAfterFlush = true;
+
+        // a storable response is copied into the shared cache as it passes. The item is
+        // sized up front, so only a known length qualifies (": " may add a byte per header)
+        if (proxy_cache_enabled() && !pUp->m_bHeadRequest &&
+            (pUp->m_body == UPSTREAM_BODY_LENGTH || pUp->m_body == UPSTREAM_BODY_NONE))
+            pUp->m_pCacheFill = proxy_cache_fill_begin(&pClient->m_request, iStatus, szReason, &policy,
+                                                       iHeadEnd + iHeaders, pUp->m_body == UPSTREAM_BODY_LENGTH ? uLength : 0);
+
+        // nothing will be stored for the requests waiting on this one: they are sent on now, and
+        // later ones are not held back either, unless the upstream is failing (5xx may well pass)
+        if (!pUp->m_pCacheFill) proxy_cache_fetch_done(&pUp->m_fetch, iStatus < 500);
+
+        RESPONSE_BUILDER builder;
+        response_begin(&builder, pClient, &pClient->m_request, iStatus, szReason);
+        bool bLengthSent = false;
+
+        for (char* p = pLine; p < pBuf + iHeadEnd - 2; )
+        {
+            size_t iKeyLen   = strlen(p);
+            char*  szValue   = p + iKeyLen + 1;
+            while (*szValue == ' ' || *szValue == '\t') szValue++;
+            char*  pNext     = szValue + strlen(szValue) + 2;
+
+            // one Content-Length goes out, and none next to a Transfer-Encoding
+            bool bLength = strcasecmp(p, "Content-Length") == 0;
+            bool bDrop   = bLength && (bHasCoding || bLengthSent);
+            bLengthSent |= bLength;
+
+            if (!bDrop && !proxy_skip_response_header(p))
+            {
+                response_add_header(&builder, p, szValue);
+                proxy_cache_fill_header(pUp->m_pCacheFill, p, szValue);
+            }
+            p = pNext;
+        }
+
+        // the upstream's own framing headers describe the body
+        response_add_raw_headers(&builder, "", 0, true);
+        if (!response_finish(&builder)) return -2;
+
+        pUp->m_bHeadQueued = true;
+        *pBodyAt = iHeadEnd;
+        balancer_record_latency(pUp->m_iUpstream, monotonic_us() - pUp->m_uStartUs);
+        health_report(pUp->m_iUpstream, iStatus < 500, monotonic_ms());
+        return 1;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static long upstream_scan_chunked(UPSTREAM_CONN* pUp, const char* p, size_t iLength, bool* pbDone)
+{
+    /*
+        Follows the chunked framing only to find where the body ends; the
+        bytes themselves go to the client untouched. Returns the bytes that
+        belong to the body, -1 for a malformed stream (a size line without
+        a hex digit included): the response fails and the connection, out
+        of step with the upstream, is closed rather than pooled.
+    */
+
+    size_t iX = 0;
+
+    while (iX < iLength)
+    {
+        char c = p[iX];
+
+        switch (pUp->m_chunkState)
+        {
+            case CHUNK_SIZE:
+            case CHUNK_SIZE_DIGITS:
+            case CHUNK_EXTENSION:
+                iX++;
+                if (pUp->m_chunkState != CHUNK_SIZE && c == '\n')
+                {
+                    if (pUp->m_uRemaining == 0) pUp->m_chunkState = CHUNK_TRAILER_START;
+                    else                        pUp->m_chunkState = CHUNK_DATA;
+                }
+                else if (pUp->m_chunkState == CHUNK_EXTENSION) {}
+                else if (pUp->m_chunkState == CHUNK_SIZE_DIGITS && c == '\r') {}
+                else if (pUp->m_chunkState == CHUNK_SIZE_DIGITS && (c == ';' || c == ' ' || c == '\t'))
+                    pUp->m_chunkState = CHUNK_EXTENSION;
+                else
+                {
+                    int iDigit = (c >= '0' && c <= '9') ? c - '0' :
+                                 (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                                 (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+                    if (iDigit < 0 || pUp->m_uRemaining >> 60) return -1;
+                    pUp->m_uRemaining = pUp->m_uRemaining * 16 + (uint64_t)iDigit;
+                    pUp->m_chunkState = CHUNK_SIZE_DIGITS;
+                }
+                break;
+
+            case CHUNK_DATA:
+            {
+                size_t iTake = iLength - iX;
+                if (iTake > pUp->m_uRemaining) iTake = (size_t)pUp->m_uRemaining;
+                iX += iTake;
+                pUp->m_uRemaining -= iTake;
+                if (pUp->m_uRemaining == 0) pUp->m_chunkState = CHUNK_DATA_END;
+                break;
+            }
+
+            case CHUNK_DATA_END:
+                iX++;
+                if (c == '\n') pUp->m_chunkState = CHUNK_SIZE;
+                else if (c != '\r') return -1;
+                break;
+
+            case CHUNK_TRAILER_START:
+                iX++;
+                if (c == '\n')
+                {
+                    *pbDone = true;
+                    return (long)iX;
+                }
+                if (c != '\r') pUp->m_chunkState = CHUNK_TRAILER_LINE;
+                break;
+
+            case CHUNK_TRAILER_LINE:
+                iX++;
+                if (c == '\n') pUp->m_chunkState = CHUNK_TRAILER_START;
+                break;
+        }
+    }
+
+    return (long)iX;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static long upstream_scan_body(UPSTREAM_CONN* pUp, const char* p, size_t iLength, bool* pbDone)
+{
+    // bytes of p that belong to the body, *pbDone once its last byte is among them
+    switch (pUp->m_body)
+    {
+        case UPSTREAM_BODY_NONE:
+            *pbDone = true;
+            return 0;
+
+        case UPSTREAM_BODY_LENGTH:
+        {
+            size_t iTake = iLength < pUp->m_uRemaining ? iLength : (size_t)pUp->m_uRemaining;
+            pUp->m_uRemaining -= iTake;
+            *pbDone = pUp->m_uRemaining == 0;
+            return (long)iTake;
+        }
+
+        case UPSTREAM_BODY_CHUNKED:
+            return upstream_scan_chunked(pUp, p, iLength, pbDone);
+
+        case UPSTREAM_BODY_UNTIL_CLOSE:
+        default:
+            return (long)iLength;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_complete(UPSTREAM_CONN* pUp)
+{
+    /*
+        The whole response is queued. The connection stays attached to the
+        client until it drained (the last bytes still point into our
+        buffer); proxy_client_drained() then hands it back to the pool.
+    */
+
+    timerWheelCancel(&g_timers, &pUp->m_timer);
+    pUp->m_state = UPSTREAM_DONE;
+    upstream_set_events(pUp, 0);
+
+    // every body byte went through the fill: later requests are answered from the cache
+    if (pUp->m_pCacheFill) proxy_cache_fill_commit(pUp->m_pCacheFill);
+    pUp->m_pCacheFill = NULL;
+    proxy_cache_fetch_done(&pUp->m_fetch, false);
+
+    // may finish the request, serve the next one and reuse this connection
+    g_pfnFlush(pUp->m_pClient);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void upstream_receive(UPSTREAM_CONN* pUp)
+{
+    /*
+        Reads the response and queues it on the client as it arrives.
+        The buffer is only refilled once the client took everything queued
+        from it; until then the upstream socket is not polled at all.
+    */
+
+    CONNECTION* pClient = pUp->m_pClient;
+
+    while (1)
+    {
+        if (!output_queue_empty(&pClient->m_output))
+        {
+            upstream_set_events(pUp, 0);
+            return;
+        }
+
+        // everything before was sent, the buffer starts over
+        if (pUp->m_bHeadQueued) pUp->m_iLength = 0;
+
+        ssize_t n = recv(pUp->m_iFd, pUp->m_arrBuffer + pUp->m_iLength,
+                         sizeof(pUp->m_arrBuffer) - pUp->m_iLength, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!upstream_set_events(pUp, EPOLLIN)) upstream_fail(pUp, 502, false);
+                return;
+            }
+            upstream_fail(pUp, 502, true);
+            return;
+        }
+
+        if (n == 0)
+        {
+            if (pUp->m_bHeadQueued && pUp->m_body == UPSTREAM_BODY_UNTIL_CLOSE)
+            {
+                pUp->m_bKeepAlive = false;
+                upstream_complete(pUp);
+            }
+            else upstream_fail(pUp, 502, true);
+            return;
+        }
+
+        upstream_arm_timer(pUp, g_uReadTimeoutMs);
+
+        size_t iBodyAt = pUp->m_iLength;
+        pUp->m_iLength += (size_t)n;
+
+        if (!pUp->m_bHeadQueued)
+        {
+            int iRc = upstream_parse_head(pUp, &iBodyAt);
+            if (iRc < 0)
+            {
+                upstream_fail(pUp, 502, iRc == -1);
+                return;
+            }
+            if (iRc == 0) continue;
+        }
+
+        bool bDone = false;
+        long iBody = upstream_scan_body(pUp, pUp->m_arrBuffer + iBodyAt, pUp->m_iLength - iBodyAt, &bDone);
+        if (iBody < 0)
+        {
+            upstream_fail(pUp, 502, true);
+            return;
+        }
+
+        // anything after the end of the response makes the connection unusable
+        if (bDone && iBodyAt + (size_t)iBody < pUp->m_iLength) pUp->m_bKeepAlive = false;
+
+        if (iBody > 0 &&
+            !connection_queue_shared(pClient, pUp->m_arrBuffer + iBodyAt, (size_t)iBody, NULL, NULL))
+        {
+            upstream_fail(pUp, 502, false);
+            return;
+        }
+
+        // more body than announced: the client gets it as before, the cache does not
+        if (pUp->m_pCacheFill && iBody > 0 &&
+            !proxy_cache_fill_body(pUp->m_pCacheFill, pUp->m_arrBuffer + iBodyAt, (size_t)iBody))
+        {
+            proxy_cache_fill_abort(pUp->m_pCacheFill);
+            pUp->m_pCacheFill = NULL;
+        }
+
+        if (bDone)
+        {
+            upstream_complete(pUp);
+            return;
+        }
+
+        // flushing may close the client, which takes this connection with it
+        if (!g_pfnFlush(pClient)) return;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Main Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_add_upstream(const char* szSpec)
+{
+    if (!szSpec || g_iUpstreamCount >= PROXY_MAX_UPSTREAMS) return false;
+
+    // "host:port" or "host:port,weight=N"
+    const char* pComma = strchr(szSpec, ',');
+    size_t iSpecLen = pComma ? (size_t)(pComma - szSpec) : strlen(szSpec);
+    if (iSpecLen >= sizeof(g_arrUpstreams[0].m_szName)) return false;
+
+    int iWeight = 1;
+    if (pComma)
+    {
+        char* pEnd = NULL;
+        if (strncmp(pComma + 1, "weight=", 7) != 0) return false;
+        long lWeight = strtol(pComma + 8, &pEnd, 10);
+        if (pEnd == pComma + 8 || *pEnd != '\0' || lWeight < 1 || lWeight > BALANCER_MAX_WEIGHT) return false;
+        iWeight = (int)lWeight;
+    }
+
+    char szHostPort[sizeof(g_arrUpstreams[0].m_szName)];
+    memcpy(szHostPort, szSpec, iSpecLen);
+    szHostPort[iSpecLen] = '\0';
+
+    const char* pColon = strrchr(szHostPort, ':');
+    size_t iHostLen = pColon ? (size_t)(pColon - szHostPort) : 0;
+    if (!pColon || iHostLen == 0) return false;
+
+    char szHost[sizeof(szHostPort)];
+    memcpy(szHost, szHostPort, iHostLen);
+    szHost[iHostLen] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* pResult = NULL;
+    if (getaddrinfo(szHost, pColon + 1, &hints, &pResult) != 0 || !pResult) return false;
+
+    PROXY_UPSTREAM* pUpstream = &g_arrUpstreams[g_iUpstreamCount++];
+    memcpy(&pUpstream->m_addr, pResult->ai_addr, sizeof(pUpstream->m_addr));
+    memcpy(pUpstream->m_szName, szHostPort, iSpecLen + 1);
+    pUpstream->m_iWeight = iWeight;
+
+    freeaddrinfo(pResult);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_configure(const char* szPrefix, uint64_t uReadTimeoutMs, int iKeepAlive, BALANCER_POLICY policy)
+{
+    if (szPrefix && szPrefix[0] == '/')
+    {
+        snprintf(g_szPrefix, sizeof(g_szPrefix), "%s", szPrefix);
+        g_iPrefixLength = strlen(g_szPrefix);
+    }
+
+    if (uReadTimeoutMs) g_uReadTimeoutMs = uReadTimeoutMs;
+    if (iKeepAlive >= 0) g_iKeepAlive = iKeepAlive;
+
+    if (g_iUpstreamCount == 0) return true;
+
+    // the balancer only knows indices; names seed the hash table, weights the wrr / hash shares
+    const char* arrNames[PROXY_MAX_UPSTREAMS];
+    int         arrWeights[PROXY_MAX_UPSTREAMS];
+    for (int iX = 0; iX < g_iUpstreamCount; ++iX)
+    {
+        arrNames[iX]   = g_arrUpstreams[iX].m_szName;
+        arrWeights[iX] = g_arrUpstreams[iX].m_iWeight;
+    }
+
+    return balancer_init(policy, arrNames, arrWeights, g_iUpstreamCount) &&
+           health_init(g_arrUpstreams, g_iUpstreamCount);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_enabled(void)
+{
+    return g_iUpstreamCount > 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_attach(int iEpollFd, PROXY_FLUSH_FN pfnFlush)
+{
+    if (!proxy_enabled() || iEpollFd < 0 || !pfnFlush) return false;
+
+    if (!poolInit(&g_upstreamPool, sizeof(UPSTREAM_CONN), UPSTREAM_POOL_SLAB)) return false;
+    timerWheelInit(&g_timers, monotonic_ms(), PROXY_TIMER_TICK_MS);
+
+    g_iEpollFd = iEpollFd;
+    g_pfnFlush = pfnFlush;
+
+    // wakes the requests waiting on a fetch, whichever worker made it
+    int iWakeFd = proxy_cache_wake_fd();
+    if (iWakeFd >= 0)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events  = EPOLLIN;
+        ev.data.fd = iWakeFd;
+
+        // nobody could wake this worker's waiters: it does not wait at all
+        if (epoll_ctl(g_iEpollFd, EPOLL_CTL_ADD, iWakeFd, &ev) < 0) proxy_cache_attach(-1);
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_shutdown(void)
+{
+    if (g_iEpollFd < 0) return;
+
+    for (size_t iFd = 0; iFd < g_iTableSize; ++iFd)
+        if (g_arrByFd[iFd]) upstream_close(g_arrByFd[iFd]);
+
+    while (g_pWaiting) upstream_close(g_pWaiting);
+
+    free(g_arrByFd);
+    g_arrByFd = NULL;
+    g_iTableSize = 0;
+
+    poolDestroy(&g_upstreamPool);
+    g_iEpollFd = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_is_request(const REQUEST_INFO* ri)
+{
+    if (g_iEpollFd < 0 || !ri || !ri->m_szPath) return false;
+    if (strncmp(ri->m_szPath, g_szPrefix, g_iPrefixLength) != 0) return false;
+
+    // whole path segments only: /api covers /api, /api/x and /api?q, not /apiary
+    char cNext = ri->m_szPath[g_iPrefixLength];
+    return g_szPrefix[g_iPrefixLength - 1] == '/' || cNext == '\0' || cNext == '/' || cNext == '?';
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void proxy_start(CONNECTION* pConn, const REQUEST_INFO* ri, bool bMayWait)
+{
+    /*
+        Starts the exchange and returns; the response is queued on the
+        client later, from the upstream's events. Anything that fails before
+        an upstream connection is in play is answered here with 502.
+    */
+
+    // a fresh stored response needs no upstream at all
+    if (proxy_cache_serve(pConn, ri)) return;
+
+    // nor does a miss some other request is already fetching: it waits for that response
+    PROXY_CACHE_TICKET fetch;
+    if (proxy_cache_join(ri, bMayWait, PROXY_CONNECT_TIMEOUT_MS + g_uReadTimeoutMs, &fetch) == PROXY_CACHE_WAIT)
+    {
+        if (upstream_wait(pConn, &fetch)) return;
+        memset(&fetch, 0, sizeof(fetch));
+    }
+
+    int iUpstream = balancer_pick(ri, health_usable_mask(monotonic_ms()));
+
+    size_t iHeadLength = 0;
+    char* pHead = iUpstream >= 0 ? proxy_build_request(pConn, ri, iUpstream, &iHeadLength) : NULL;
+
+    bool bRefused = false;
+    UPSTREAM_CONN* pUp = pHead ? upstream_acquire(iUpstream, &bRefused) : NULL;
+    if (!pUp)
+    {
+        // a refused connect() is already known here; running out of memory or descriptors is ours
+        if (bRefused) health_report(iUpstream, false, monotonic_ms());
+        proxy_cache_fetch_done(&fetch, false);
+        send_simple_response(pConn, ri, 502, "Bad Gateway", NULL, 0);
+        return;
+    }
+
+    pUp->m_pClient            = pConn;
+    pUp->m_pRequestHead       = pHead;
+    pUp->m_iRequestHeadLength = iHeadLength;
+    pUp->m_pRequestBody       = ri->m_szBody;
+    pUp->m_iRequestBodyLength = ri->m_szBody ? ri->m_iBodyLength : 0;
+    pUp->m_bIdempotent        = proxy_is_idempotent(ri->m_szMethod);
+    pUp->m_bHeadRequest       = strcmp(ri->m_szMethod, "HEAD") == 0;
+    pUp->m_bRetried           = false;
+    pUp->m_bCounted           = true;
+    pUp->m_uStartUs           = monotonic_us();
+    pUp->m_fetch              = fetch;
+    pConn->m_pUpstream        = pUp;
+    balancer_request_started(iUpstream);
+
+    // the send failed on the upstream's socket, unless a retry could not get a new one
+    bool bUpstreamFault = true;
+    if (upstream_start(pUp) || upstream_retry(&pUp, &bUpstreamFault)) return;
+
+    if (bUpstreamFault) health_report(pUp->m_iUpstream, false, monotonic_ms());
+    pConn->m_pUpstream = NULL;
+    pUp->m_state = UPSTREAM_DONE;
+    upstream_close(pUp);
+    send_simple_response(pConn, ri, 502, "Bad Gateway", NULL, 0);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_forward(CONNECTION* pConn, const REQUEST_INFO* ri)
+{
+    proxy_start(pConn, ri, true);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void proxy_resume_waiter(UPSTREAM_CONN* pUp)
+{
+    // off the waiting list already; the fetch it waited on is over, or the wait timed out
+    CONNECTION* pClient = pUp->m_pClient;
+    pClient->m_pUpstream = NULL;
+    pUp->m_state = UPSTREAM_DONE;
+    upstream_close(pUp);
+
+    // a hit now, else a fetch of its own: waiting once more could queue it behind every later miss
+    proxy_start(pClient, &pClient->m_request, false);
+    g_pfnFlush(pClient);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void proxy_wake_waiters(void)
+{
+    /*
+        Some fetch a request of this worker waits on is over. The ones it
+        concerns are taken off the list before any is resumed, resuming may
+        park new requests on it.
+    */
+
+    UPSTREAM_CONN* pReady = NULL;
+
+    for (UPSTREAM_CONN* pUp = g_pWaiting; pUp; )
+    {
+        UPSTREAM_CONN* pNext = pUp->m_pNextWaiting;
+        if (!proxy_cache_fetch_pending(&pUp->m_fetch))
+        {
+            upstream_wait_unlink(pUp);
+            pUp->m_pNextWaiting = pReady;
+            pReady = pUp;
+        }
+        pUp = pNext;
+    }
+
+    while (pReady)
+    {
+        UPSTREAM_CONN* pUp = pReady;
+        pReady = pUp->m_pNextWaiting;
+        proxy_resume_waiter(pUp);
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_handle_event(int iFd, uint32_t uEvents)
+{
+    // the counter is reset first: a fetch ending meanwhile wakes us again
+    if (iFd == proxy_cache_wake_fd())
+    {
+        proxy_cache_drain_wakeups();
+        proxy_wake_waiters();
+        return true;
+    }
+
+    UPSTREAM_CONN* pUp = upstream_lookup(iFd);
+    if (!pUp) return false;
+
+    switch (pUp->m_state)
+    {
+        case UPSTREAM_IDLE:
+            // nothing is expected on an idle connection: closed by the upstream
+            upstream_close(pUp);
+            break;
+
+        case UPSTREAM_CONNECTING:
+        {
+            int iError = 0;
+            socklen_t iLen = sizeof(iError);
+            if ((uEvents & (EPOLLERR | EPOLLHUP)) ||
+                getsockopt(pUp->m_iFd, SOL_SOCKET, SO_ERROR, &iError, &iLen) < 0 || iError != 0)
+            {
+                upstream_fail(pUp, 502, true);
+                break;
+            }
+
+            pUp->m_state = UPSTREAM_SENDING;
+            if (!upstream_send(pUp)) upstream_fail(pUp, 502, true);
+            break;
+        }
+
+        case UPSTREAM_SENDING:
+            if (!upstream_send(pUp)) upstream_fail(pUp, 502, true);
+            break;
+
+        case UPSTREAM_READING:
+            upstream_receive(pUp);
+            break;
+
+        case UPSTREAM_DONE:
+            // the response is complete, the connection just cannot be reused
+            pUp->m_bKeepAlive = false;
+            upstream_set_events(pUp, 0);
+            break;
+
+        case UPSTREAM_WAITING:
+            // has no socket, never registered
+            break;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_client_drained(CONNECTION* pConn)
+{
+    UPSTREAM_CONN* pUp = pConn->m_pUpstream;
+    if (!pUp) return true;
+
+    if (pUp->m_state == UPSTREAM_DONE)
+    {
+        pConn->m_pUpstream = NULL;
+        upstream_release(pUp);
+        return true;
+    }
+
+    // the buffer is free again, the next read happens on the upstream's EPOLLIN
+    if (pUp->m_state == UPSTREAM_READING && !upstream_set_events(pUp, EPOLLIN))
+        pConn->m_bCloseAfterFlush = true;
+
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_client_closed(CONNECTION* pConn)
+{
+    UPSTREAM_CONN* pUp = pConn->m_pUpstream;
+    if (!pUp) return;
+
+    // the rest of the response would arrive on a connection nobody reads
+    pConn->m_pUpstream = NULL;
+    if (pUp->m_state == UPSTREAM_WAITING) upstream_wait_unlink(pUp);
+    pUp->m_state = UPSTREAM_DONE;
+    upstream_close(pUp);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void proxy_on_timeout(TimerNode* pNode, void* pContext)
+{
+    (void)pContext;
+    UPSTREAM_CONN* pUp = (UPSTREAM_CONN*)pNode->data;
+
+    if (pUp->m_state == UPSTREAM_IDLE)
+        upstream_close(pUp);
+    else if (pUp->m_state == UPSTREAM_WAITING)
+    {
+        upstream_wait_unlink(pUp);
+        proxy_resume_waiter(pUp);
+    }
+    else upstream_fail(pUp, 504, true);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int proxy_timeout(uint64_t uNowMs)
+{
+    if (g_iEpollFd < 0) return -1;
+    return timerWheelTimeout(&g_timers, uNowMs);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_advance(uint64_t uNowMs)
+{
+    if (g_iEpollFd < 0) return;
+    timerWheelAdvance(&g_timers, uNowMs, proxy_on_timeout, NULL);
+}
@@ -0,0 +1,109 @@
+/*
+    File name    : proxy.h
+    creation date: 12-04-26
+    Author       : Solomon
+*/
+
+/*
+    Reverse proxy.
+
+    Requests under the proxied path prefix are not answered locally: the
+    worker forwards them to one of the configured upstreams and streams the
+    upstream's response back to the client. Everything happens in the
+    worker's own epoll loop; upstream sockets are registered next to the
+    client sockets and told apart because connection_lookup() does not know
+    them.
+
+    Upstream connections are persistent. Each worker keeps a small pool of
+    idle keep-alive connections per upstream and takes one from there before
+    dialing a new one, so a proxied request normally costs no connect() and
+    no handshake. A pooled connection that turns out to be dead (the
+    upstream closed it while it was idle) is replaced once for idempotent
+    requests.
+
+    Response bytes are not copied: the upstream's receive buffer is queued
+    on the client as a shared segment and the next recv() only happens once
+    the client took all of it, so a slow client slows the upstream read
+    down instead of growing a buffer.
+
+    With the shared response cache on (see proxy_cache.h) a fresh stored
+    response answers a GET / HEAD before any upstream is picked, and a
+    storable response is copied into the cache while it is passed through.
+    A miss for a key another request (of any worker) is already fetching
+    parks its client without an upstream connection until that response
+    is stored, then answers from the cache.
+*/
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>     // provides uint64_t, uint32_t
+#include <stdbool.h>
+#include <netinet/in.h> // provides struct sockaddr_in
+#include "http.h"       // provides REQUEST_INFO
+#include "balancer.h"   // provides BALANCER_POLICY, BALANCER_MAX_UPSTREAMS
+
+#define PROXY_MAX_UPSTREAMS          BALANCER_MAX_UPSTREAMS
+#define PROXY_BUFFER_SIZE            16384   // per upstream connection, a response head must fit in it
+#define PROXY_CONNECT_TIMEOUT_MS     3000
+#define PROXY_IDLE_TIMEOUT_MS        30000   // a pooled connection unused this long is closed
+#define PROXY_TIMER_TICK_MS          100
+
+#define DEFAULT_PROXY_READ_TIMEOUT_MS 60000  // upstream silent this long while a response is due
+#define DEFAULT_PROXY_KEEPALIVE       32     // idle connections kept per upstream, per worker
+
+typedef struct CONNECTION    CONNECTION;
+typedef struct UPSTREAM_CONN UPSTREAM_CONN;
+
+typedef struct PROXY_UPSTREAM
+{
+    struct sockaddr_in m_addr;
+    char               m_szName[64];       // "host:port" as configured, Host header of HTTP/1.0 clients
+    int                m_iWeight;          // share under wrr and hash, 1 unless ",weight=N" was given
+} PROXY_UPSTREAM;
+
+// the worker's answer to "bytes were queued on this client": flush it and carry on.
+// Returns false when the client connection was closed on the way.
+typedef bool (*PROXY_FLUSH_FN)(CONNECTION* pConn);
+
+/*===================================== Master ======================================*/
+bool proxy_add_upstream(const char* szSpec);            // resolves "host:port[,weight=N]" once, before fork
+bool proxy_configure   (const char* szPrefix, uint64_t uReadTimeoutMs, int iKeepAlive, BALANCER_POLICY policy);
+bool proxy_enabled     (void);                          // at least one upstream is configured
+
+/*===================================== Worker ======================================*/
+bool proxy_attach        (int iEpollFd, PROXY_FLUSH_FN pfnFlush);
+void proxy_shutdown      (void);                        // closes every upstream connection
+
+bool proxy_is_request    (const REQUEST_INFO* ri);      // path is under the proxied prefix
+void proxy_forward       (CONNECTION* pConn, const REQUEST_INFO* ri);
+bool proxy_handle_event  (int iFd, uint32_t uEvents);   // false when iFd is not an upstream socket
+bool proxy_client_drained(CONNECTION* pConn);           // true once the proxied response is complete
+void proxy_client_closed (CONNECTION* pConn);           // client is going away mid response
+
+int  proxy_timeout       (uint64_t uNowMs);             // ms until the next upstream deadline, -1 if none
+void proxy_advance       (uint64_t uNowMs);             // fires due upstream deadlines
+
+#endif
+
+/*
+
+proxy_add_upstream()   -> adds one backend, resolved to an IPv4 address when the option is parsed
+proxy_configure()      -> proxy settings, and hands the upstream names / weights to the balancer
+proxy_forward()        -> answers from the shared cache when it can, or waits for a fetch of the same key
+                          already in flight; otherwise asks the balancer for an
+                          upstream, rewrites the request for the upstream (hop-by-hop headers dropped, X-Forwarded-For
+                          added), takes a pooled connection or dials one and starts sending; while the
+                          response is due, CONNECTION::m_pUpstream is set and the worker parks the client.
+                          A request that cannot even be started is answered with 502 right away
+proxy_handle_event()   -> connect completion, request write and response read of an upstream socket,
+                          and the wakeup of the requests waiting on a fetch;
+                          the response head is re-rendered with our Date / Server / Connection, the body
+                          (Content-Length, chunked or until close) is passed through unchanged
+proxy_client_drained() -> the client took everything queued: resumes the upstream read, or, when the
+                          response is complete, returns the upstream connection to the pool and
+                          detaches it from the client
+proxy_client_closed()  -> drops the upstream connection of a client that disappeared, it is never reused
+proxy_advance()        -> connect and read timeouts (504) and idle pool expiry
+
+*/
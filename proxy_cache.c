@@ -0,0 +1,1136 @@
+/*
+    File name    : proxy_cache.c
+    creation date: 15-04-26
+    Author       : Solomon
+*/
+
+#define _GNU_SOURCE     // enables strptime(), timegm(), MAP_NORESERVE
+
+#include <stdio.h>      // provides snprintf()
+#include <stdlib.h>     // provides strtoll(), strtoull(), malloc(), free()
+#include <string.h>     // provides memcpy(), memcmp(), memset(), strlen(), strcmp()
+#include <strings.h>    // provides strcasecmp()
+#include <ctype.h>      // provides tolower()
+#include <time.h>       // provides strptime(), timegm(), time()
+#include <unistd.h>     // provides read(), write(), close()
+#include <sys/mman.h>   // provides mmap(), MAP_SHARED, MAP_ANONYMOUS
+#include <sys/eventfd.h>// provides eventfd(), EFD_NONBLOCK, EFD_CLOEXEC
+#include "proxy_cache.h"
+#include "server.h"     // provides MAX_WORKERS
+#include "connection.h" // provides CONNECTION, monotonic_ms()
+#include "response.h"   // provides RESPONSE_BUILDER, response_add_prerendered()
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>  // provides _mm_pause()
+#endif
+
+#define PROXY_CACHE_MAX_ITEM        ((size_t)PROXY_CACHE_MIN_ITEM << (PROXY_CACHE_CLASSES - 1))
+#define PROXY_CACHE_BUCKETS_PER_PAGE 256     // one bucket per 4 KB of pages
+#define PROXY_CACHE_MAX_LIFETIME_S  (365 * 24 * 3600)
+#define PROXY_CACHE_NO_CLASS        0xff
+#define PROXY_CACHE_WAITER_WORDS    ((MAX_WORKERS + 63) / 64)
+
+_Static_assert(PROXY_CACHE_MAX_ITEM == PROXY_CACHE_PAGE_SIZE, "the largest class is exactly one page");
+_Static_assert((PROXY_CACHE_STRIPES & (PROXY_CACHE_STRIPES - 1)) == 0, "stripes must be a power of two");
+_Static_assert(PROXY_CACHE_BUCKETS_PER_PAGE >= PROXY_CACHE_STRIPES, "every stripe needs buckets of its own");
+
+struct PROXY_CACHE_ITEM
+{
+    PROXY_CACHE_ITEM* m_pNext;          // bucket chain while linked, free list while free
+    uint64_t          m_uHash;
+    uint64_t          m_uExpiresMs;     // monotonic_ms() from which it is stale
+    uint64_t          m_uBornMs;        // monotonic_ms() the upstream generated it, for Age
+    uint32_t          m_uRefs;          // index + queued responses, the filler's until commit
+    uint8_t           m_uClass;
+    uint8_t           m_bLinked;        // reachable through the index
+    uint8_t           m_bReferenced;    // CLOCK bit, set by every hit
+    uint8_t           m_bFailed;        // the fill overflowed what was reserved
+    uint8_t           m_bHeadClosed;    // the blank line after the headers is written
+    uint16_t          m_iStatus;
+    uint16_t          m_iKeyLength;
+    uint16_t          m_iVaryLength;
+    uint16_t          m_iReasonLength;
+    uint32_t          m_iHeadMax;       // room reserved for the rendered headers and blank line
+    uint32_t          m_iHeadLength;
+    uint32_t          m_iBodyLength;
+    uint32_t          m_iBodyFilled;
+    char              m_arrData[];      // key, vary pairs, reason '\0', rendered headers + body
+};
+
+typedef struct PROXY_CACHE_CLASS
+{
+    _Alignas(64) uint32_t m_uLocked;
+    uint32_t          m_iItemSize;
+    uint32_t          m_iPages;         // pages carved into this class
+    uint32_t          m_iHandPage;      // CLOCK hand: page, then item within it
+    uint32_t          m_iHandItem;
+    PROXY_CACHE_ITEM* m_pFree;
+} PROXY_CACHE_CLASS;
+
+typedef struct PROXY_CACHE_STRIPE
+{
+    _Alignas(64) uint32_t m_uLocked;
+} PROXY_CACHE_STRIPE;
+
+typedef enum
+{
+    PROXY_CACHE_FETCH_FREE = 0,
+    PROXY_CACHE_FETCH_IN_FLIGHT,
+    PROXY_CACHE_FETCH_NO_STORE,             // pass marker: the last response for the key was not storable
+} PROXY_CACHE_FETCH_STATE;
+
+// one upstream fetch in flight, guarded by the stripe lock of its key
+typedef struct PROXY_CACHE_FETCH
+{
+    uint64_t m_uHash;
+    uint64_t m_uSinceMs;                    // in flight: monotonic_ms() it started, pass marker: until
+    uint32_t m_uGeneration;                 // bumped when the fetch ends, read unlocked by the waiters
+    uint32_t m_uState;                      // PROXY_CACHE_FETCH_STATE
+    uint64_t m_arrWaiters[PROXY_CACHE_WAITER_WORDS]; // one bit per worker with a client waiting on it
+} PROXY_CACHE_FETCH;
+
+typedef struct PROXY_CACHE_SHARED
+{
+    _Alignas(64) uint32_t m_uPagesUsed;     // pages given to a class so far, they never come back
+    PROXY_CACHE_CLASS  m_arrClasses[PROXY_CACHE_CLASSES];
+    PROXY_CACHE_STRIPE m_arrStripes[PROXY_CACHE_STRIPES];
+    PROXY_CACHE_FETCH  m_arrFetches[PROXY_CACHE_STRIPES * PROXY_CACHE_FETCH_SLOTS]; // a group per stripe
+} PROXY_CACHE_SHARED;
+
+// set up by the master before fork(), at the same address in every worker
+static PROXY_CACHE_SHARED* g_pShared;
+static uint8_t*            g_arrPageClass;  // class owning each page, PROXY_CACHE_NO_CLASS while unused
+static PROXY_CACHE_ITEM**  g_arrBuckets;
+static size_t              g_iBucketMask;
+static char*               g_pPages;
+static uint32_t            g_iPageCount;
+static int*                g_arrWakeFds;    // eventfd of every worker, NULL when misses are not collapsed
+static int                 g_iWakeCount;
+
+// per worker
+static int                 g_iWorkerIndex = -1;
+
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Helper Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline void cache_lock(uint32_t* pLock)
+{
+    // test and test-and-set: waiters spin on their own copy of the line
+    while (__atomic_exchange_n(pLock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(pLock, __ATOMIC_RELAXED))
+        {
+#if defined(__x86_64__) && defined(__GNUC__)
+            _mm_pause();
+#endif
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline void cache_unlock(uint32_t* pLock)
+{
+    __atomic_store_n(pLock, 0, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline uint32_t cache_stripe_index(uint64_t uHash)
+{
+    // buckets of one stripe share its low bits, so a chain is always under one lock
+    return (uint32_t)((uHash & g_iBucketMask) & (PROXY_CACHE_STRIPES - 1));
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline uint32_t* cache_stripe_lock(uint64_t uHash)
+{
+    return &g_pShared->m_arrStripes[cache_stripe_index(uHash)].m_uLocked;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint64_t cache_hash(const char* pKey, size_t iLength)
+{
+    // FNV-1a, 64 bit
+    uint64_t uHash = 14695981039346656037ull;
+    for (size_t iX = 0; iX < iLength; ++iX)
+    {
+        uHash ^= (unsigned char)pKey[iX];
+        uHash *= 1099511628211ull;
+    }
+    return uHash;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline const char* cache_vary(const PROXY_CACHE_ITEM* pItem)
+{
+    return pItem->m_arrData + pItem->m_iKeyLength;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline const char* cache_reason(const PROXY_CACHE_ITEM* pItem)
+{
+    return cache_vary(pItem) + pItem->m_iVaryLength;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static inline char* cache_rendered(PROXY_CACHE_ITEM* pItem)
+{
+    return pItem->m_arrData + pItem->m_iKeyLength + pItem->m_iVaryLength + pItem->m_iReasonLength + 1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static const char* cache_find_header(const REQUEST_INFO* ri, const char* szName)
+{
+    for (size_t iX = 0; iX < ri->m_headers.count; ++iX)
+    {
+        const char* szKey = ri->m_headers.entries[iX].szKey;
+        if (szKey && strcasecmp(szKey, szName) == 0) return ri->m_headers.entries[iX].szValue;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static const char* cache_next_directive(const char* p, char* szName, size_t iNameSize, int64_t* piValue)
+{
+    /*
+        One Cache-Control / Pragma directive: its name lowercased into
+        szName and its numeric value (-1 when it has none). Returns where
+        the next directive starts, NULL once the list is done.
+    */
+
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (*p == '\0') return NULL;
+
+    size_t iLen = 0;
+    while (*p && *p != '=' && *p != ',' && *p != ' ' && *p != '\t')
+    {
+        if (iLen + 1 < iNameSize) szName[iLen++] = (char)tolower((unsigned char)*p);
+        p++;
+    }
+    szName[iLen] = '\0';
+
+    *piValue = -1;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '=')
+    {
+        p++;
+        if (*p == '"') p++;
+        if (*p >= '0' && *p <= '9')
+        {
+            char* pEnd = NULL;
+            long long llValue = strtoll(p, &pEnd, 10);
+            *piValue = llValue > PROXY_CACHE_MAX_LIFETIME_S ? PROXY_CACHE_MAX_LIFETIME_S : llValue;
+            p = pEnd;
+        }
+    }
+
+    // whatever else the directive carries (quoted field lists...) is not needed
+    while (*p && *p != ',') p++;
+    return p;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool cache_request_bypasses(const REQUEST_INFO* ri, bool* pbNoStore, int64_t* piMaxAge)
+{
+    // true when the client wants the upstream's answer, not ours
+    *pbNoStore = false;
+    *piMaxAge  = -1;
+
+    bool bBypass = false;
+    char szName[32];
+    int64_t iValue;
+
+    const char* p = cache_find_header(ri, "Cache-Control");
+    while (p && (p = cache_next_directive(p, szName, sizeof(szName), &iValue)))
+    {
+        if (strcmp(szName, "no-store") == 0)     { *pbNoStore = true; bBypass = true; }
+        else if (strcmp(szName, "no-cache") == 0) bBypass = true;
+        else if (strcmp(szName, "max-age") == 0 && iValue >= 0)
+        {
+            *piMaxAge = iValue;
+            if (iValue == 0) bBypass = true;
+        }
+    }
+
+    p = cache_find_header(ri, "Pragma");
+    while (p && (p = cache_next_directive(p, szName, sizeof(szName), &iValue)))
+        if (strcmp(szName, "no-cache") == 0) bBypass = true;
+
+    return bBypass;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static size_t cache_build_key(const REQUEST_INFO* ri, char* pOut, size_t iSize)
+{
+    // the same path on two virtual hosts is two resources; 0 when it does not fit
+    const char* szHost = cache_find_header(ri, "Host");
+    int iLen = snprintf(pOut, iSize, "%s %s", szHost ? szHost : "", ri->m_szPath);
+    return (iLen > 0 && (size_t)iLen < iSize) ? (size_t)iLen : 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool cache_build_vary(const REQUEST_INFO* ri, const char* szVary, char* pOut, size_t iSize, size_t* pLength)
+{
+    /*
+        For every header name the response varies on: the name, lowercased,
+        and the value this request sent ("" when it sent none), each '\0'
+        terminated. A later request matches when it sends the same values.
+    */
+
+    size_t iOff = 0;
+
+    for (const char* p = szVary; p && *p; )
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+
+        char szName[64];
+        size_t iName = 0;
+        while (*p && *p != ',' && *p != ' ' && *p != '\t')
+        {
+            if (iName + 1 >= sizeof(szName)) return false;
+            szName[iName++] = (char)tolower((unsigned char)*p++);
+        }
+        if (iName == 0) continue;
+        szName[iName] = '\0';
+
+        const char* szValue = cache_find_header(ri, szName);
+        if (!szValue) szValue = "";
+        size_t iValue = strlen(szValue);
+
+        if (iOff + iName + iValue + 2 > iSize) return false;
+        memcpy(pOut + iOff, szName, iName + 1);
+        iOff += iName + 1;
+        memcpy(pOut + iOff, szValue, iValue + 1);
+        iOff += iValue + 1;
+    }
+
+    *pLength = iOff;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool cache_vary_matches(const PROXY_CACHE_ITEM* pItem, const REQUEST_INFO* ri)
+{
+    const char* p    = cache_vary(pItem);
+    const char* pEnd = p + pItem->m_iVaryLength;
+
+    while (p < pEnd)
+    {
+        const char* szName  = p;
+        const char* szValue = szName + strlen(szName) + 1;
+        p = szValue + strlen(szValue) + 1;
+
+        const char* szSent = cache_find_header(ri, szName);
+        if (strcmp(szSent ? szSent : "", szValue) != 0) return false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static time_t cache_parse_date(const char* szValue)
+{
+    // IMF-fixdate only ("Sun, 06 Nov 1994 08:49:37 GMT"), 0 for anything else
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+
+    const char* pEnd = strptime(szValue, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!pEnd) return 0;
+
+    time_t t = timegm(&tm);
+    return t > 0 ? t : 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool cache_status_storable(int iStatus)
+{
+    // heuristically cacheable statuses; with an explicit lifetime anything else is rare
+    switch (iStatus)
+    {
+        case 200: case 203: case 204: case 300: case 301: case 404: case 410:
+            return true;
+        default:
+            return false;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint64_t cache_fresh_ms(const PROXY_CACHE_POLICY* pPolicy)
+{
+    // what is left of the lifetime once the upstream's Age is taken off, 0 when nothing is
+    int64_t iLifetime;
+
+    if (pPolicy->m_iSMaxAge >= 0)    iLifetime = pPolicy->m_iSMaxAge;
+    else if (pPolicy->m_iMaxAge >= 0) iLifetime = pPolicy->m_iMaxAge;
+    else if (pPolicy->m_tExpires)
+    {
+        time_t tBase = pPolicy->m_tDate ? pPolicy->m_tDate : time(NULL);
+        iLifetime = (int64_t)(pPolicy->m_tExpires - tBase);
+        if (iLifetime > PROXY_CACHE_MAX_LIFETIME_S) iLifetime = PROXY_CACHE_MAX_LIFETIME_S;
+    }
+    else return 0;
+
+    if (iLifetime <= 0 || (uint64_t)iLifetime <= pPolicy->m_uAge) return 0;
+    return ((uint64_t)iLifetime - pPolicy->m_uAge) * 1000;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_unlink_locked(PROXY_CACHE_ITEM* pItem)
+{
+    // caller holds the item's stripe lock
+    PROXY_CACHE_ITEM** ppSlot = &g_arrBuckets[pItem->m_uHash & g_iBucketMask];
+    while (*ppSlot && *ppSlot != pItem) ppSlot = &(*ppSlot)->m_pNext;
+    if (*ppSlot) *ppSlot = pItem->m_pNext;
+
+    pItem->m_pNext = NULL;
+    __atomic_store_n(&pItem->m_bLinked, 0, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_free(PROXY_CACHE_ITEM* pItem)
+{
+    PROXY_CACHE_CLASS* pClass = &g_pShared->m_arrClasses[pItem->m_uClass];
+
+    cache_lock(&pClass->m_uLocked);
+    pItem->m_pNext  = pClass->m_pFree;
+    pClass->m_pFree = pItem;
+    cache_unlock(&pClass->m_uLocked);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_unref(PROXY_CACHE_ITEM* pItem)
+{
+    // only an unlinked item can lose its last reference: the index holds one
+    if (__atomic_sub_fetch(&pItem->m_uRefs, 1, __ATOMIC_ACQ_REL) == 0)
+        cache_free(pItem);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool cache_claim_page(int iClass)
+{
+    // caller holds the class lock; pages are handed out once and stay with their class
+    uint32_t uPage = __atomic_load_n(&g_pShared->m_uPagesUsed, __ATOMIC_RELAXED);
+    do
+    {
+        if (uPage >= g_iPageCount) return false;
+    } while (!__atomic_compare_exchange_n(&g_pShared->m_uPagesUsed, &uPage, uPage + 1, false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    PROXY_CACHE_CLASS* pClass = &g_pShared->m_arrClasses[iClass];
+    char*  pPage    = g_pPages + (size_t)uPage * PROXY_CACHE_PAGE_SIZE;
+    size_t iPerPage = PROXY_CACHE_PAGE_SIZE / pClass->m_iItemSize;
+
+    // pushed backwards so the free list hands the page out front to back
+    for (size_t iX = iPerPage; iX-- > 0; )
+    {
+        PROXY_CACHE_ITEM* pItem = (PROXY_CACHE_ITEM*)(pPage + iX * pClass->m_iItemSize);
+        pItem->m_uClass = (uint8_t)iClass;
+        pItem->m_pNext  = pClass->m_pFree;
+        pClass->m_pFree = pItem;
+    }
+
+    g_arrPageClass[uPage] = (uint8_t)iClass;
+    pClass->m_iPages++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static PROXY_CACHE_ITEM* cache_evict(int iClass, uint64_t uNowMs)
+{
+    /*
+        CLOCK over the items of one class, caller holds the class lock.
+        Only an item the index alone references can go; the stripe lock is
+        taken to unlink it, and the check repeated under it, since hits
+        take their reference under that lock. Two turns of the hand are
+        enough for every cleared bit to come round once more.
+    */
+
+    PROXY_CACHE_CLASS* pClass = &g_pShared->m_arrClasses[iClass];
+    if (pClass->m_iPages == 0) return NULL;
+
+    size_t iPerPage = PROXY_CACHE_PAGE_SIZE / pClass->m_iItemSize;
+    size_t iBudget  = 2 * (size_t)pClass->m_iPages * iPerPage;
+
+    for (size_t iStep = 0; iStep < iBudget; )
+    {
+        if (pClass->m_iHandItem >= iPerPage || g_arrPageClass[pClass->m_iHandPage] != iClass)
+        {
+            pClass->m_iHandPage = (pClass->m_iHandPage + 1) % g_iPageCount;
+            pClass->m_iHandItem = 0;
+            continue;
+        }
+
+        PROXY_CACHE_ITEM* pItem = (PROXY_CACHE_ITEM*)(g_pPages + (size_t)pClass->m_iHandPage * PROXY_CACHE_PAGE_SIZE +
+                                                      (size_t)pClass->m_iHandItem * pClass->m_iItemSize);
+        pClass->m_iHandItem++;
+        iStep++;
+
+        if (!__atomic_load_n(&pItem->m_bLinked, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&pItem->m_uRefs, __ATOMIC_RELAXED) != 1)
+            continue;
+
+        bool bExpired = uNowMs >= pItem->m_uExpiresMs;
+        if (!bExpired && __atomic_load_n(&pItem->m_bReferenced, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&pItem->m_bReferenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint32_t* pStripe = cache_stripe_lock(pItem->m_uHash);
+        cache_lock(pStripe);
+        bool bTaken = pItem->m_bLinked && __atomic_load_n(&pItem->m_uRefs, __ATOMIC_RELAXED) == 1;
+        if (bTaken)
+        {
+            cache_unlink_locked(pItem);
+            __atomic_store_n(&pItem->m_uRefs, 0, __ATOMIC_RELAXED);
+        }
+        cache_unlock(pStripe);
+
+        if (bTaken) return pItem;
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static PROXY_CACHE_ITEM* cache_alloc(size_t iSize, uint64_t uNowMs)
+{
+    // free item of the smallest class that fits, else a new page, else the CLOCK's victim
+    int iClass = 0;
+    while (iClass < PROXY_CACHE_CLASSES && ((size_t)PROXY_CACHE_MIN_ITEM << iClass) < iSize) iClass++;
+    if (iClass == PROXY_CACHE_CLASSES) return NULL;
+
+    PROXY_CACHE_CLASS* pClass = &g_pShared->m_arrClasses[iClass];
+    cache_lock(&pClass->m_uLocked);
+
+    if (!pClass->m_pFree) cache_claim_page(iClass);
+
+    PROXY_CACHE_ITEM* pItem = pClass->m_pFree;
+    if (pItem) pClass->m_pFree = pItem->m_pNext;
+    else       pItem = cache_evict(iClass, uNowMs);
+
+    cache_unlock(&pClass->m_uLocked);
+
+    if (pItem)
+    {
+        memset(pItem, 0, sizeof(*pItem));
+        pItem->m_uClass = (uint8_t)iClass;
+        pItem->m_uRefs  = 1;
+    }
+    return pItem;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_close_head(PROXY_CACHE_ITEM* pItem)
+{
+    // the room for the blank line was reserved with the headers
+    if (pItem->m_bHeadClosed) return;
+
+    memcpy(cache_rendered(pItem) + pItem->m_iHeadLength, "\r\n", 2);
+    pItem->m_iHeadLength += 2;
+    pItem->m_bHeadClosed  = true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_fetch_end_locked(PROXY_CACHE_FETCH* pFetch, uint64_t* arrWake)
+{
+    // caller holds the stripe lock; the waiters are woken once it is released
+    memcpy(arrWake, pFetch->m_arrWaiters, sizeof(pFetch->m_arrWaiters));
+    memset(pFetch->m_arrWaiters, 0, sizeof(pFetch->m_arrWaiters));
+    pFetch->m_uState = PROXY_CACHE_FETCH_FREE;
+    __atomic_add_fetch(&pFetch->m_uGeneration, 1, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void cache_wake(const uint64_t* arrWake)
+{
+    // the eventfd counter folds repeated wakeups of one worker into one readable event
+    uint64_t uOne = 1;
+
+    for (int iWord = 0; iWord < PROXY_CACHE_WAITER_WORDS; ++iWord)
+    {
+        for (uint64_t uBits = arrWake[iWord]; uBits; uBits &= uBits - 1)
+        {
+            int iWorker = iWord * 64 + __builtin_ctzll(uBits);
+            if (iWorker >= g_iWakeCount) break;
+
+            // EAGAIN is a full counter, readable already
+            ssize_t n = write(g_arrWakeFds[iWorker], &uOne, sizeof(uOne));
+            (void)n;
+        }
+    }
+}
+
+/*===================================== Master ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_cache_init(size_t iBytes, int iWorkerCount)
+{
+    if (iBytes == 0) return true;
+
+    size_t iPages = iBytes / PROXY_CACHE_PAGE_SIZE;
+    if (iPages == 0) iPages = 1;
+    if (iPages >= UINT32_MAX) return false;
+
+    size_t iBuckets = 1;
+    while (iBuckets < iPages * PROXY_CACHE_BUCKETS_PER_PAGE) iBuckets <<= 1;
+
+    // header, page owners, index, then the pages on a page boundary of their own
+    size_t iOwnersAt = (sizeof(PROXY_CACHE_SHARED) + 63) & ~(size_t)63;
+    size_t iIndexAt  = (iOwnersAt + iPages + 63) & ~(size_t)63;
+    size_t iPagesAt  = (iIndexAt + iBuckets * sizeof(PROXY_CACHE_ITEM*) + 4095) & ~(size_t)4095;
+    size_t iSize     = iPagesAt + iPages * PROXY_CACHE_PAGE_SIZE;
+
+    // zero filled by the kernel: every lock free, every list and bucket empty. Pages
+    // are only backed once a class carves them
+    void* pMap = mmap(NULL, iSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pMap == MAP_FAILED) return false;
+
+    g_pShared      = pMap;
+    g_arrPageClass = (uint8_t*)pMap + iOwnersAt;
+    g_arrBuckets   = (PROXY_CACHE_ITEM**)((char*)pMap + iIndexAt);
+    g_iBucketMask  = iBuckets - 1;
+    g_pPages       = (char*)pMap + iPagesAt;
+    g_iPageCount   = (uint32_t)iPages;
+
+    memset(g_arrPageClass, PROXY_CACHE_NO_CLASS, iPages);
+    for (int iX = 0; iX < PROXY_CACHE_CLASSES; ++iX)
+        g_pShared->m_arrClasses[iX].m_iItemSize = (uint32_t)PROXY_CACHE_MIN_ITEM << iX;
+
+    // without the wakeups every miss goes to the upstream, the cache itself still works
+    if (iWorkerCount <= 0 || iWorkerCount > MAX_WORKERS) return true;
+
+    g_arrWakeFds = malloc((size_t)iWorkerCount * sizeof(int));
+    if (!g_arrWakeFds) return true;
+
+    for (g_iWakeCount = 0; g_iWakeCount < iWorkerCount; ++g_iWakeCount)
+    {
+        g_arrWakeFds[g_iWakeCount] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (g_arrWakeFds[g_iWakeCount] >= 0) continue;
+
+        while (g_iWakeCount-- > 0) close(g_arrWakeFds[g_iWakeCount]);
+        free(g_arrWakeFds);
+        g_arrWakeFds = NULL;
+        g_iWakeCount = 0;
+        break;
+    }
+
+    return true;
+}
+
+/*===================================== Worker ======================================*/
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_attach(int iWorkerIndex)
+{
+    if (!g_pShared || !g_arrWakeFds || iWorkerIndex < 0 || iWorkerIndex >= g_iWakeCount) return;
+
+    g_iWorkerIndex = iWorkerIndex;
+
+    // wakeups for the clients of a previous process in this slot went with it
+    proxy_cache_drain_wakeups();
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_cache_enabled(void)
+{
+    return g_pShared != NULL;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_cache_serve(CONNECTION* pConn, const REQUEST_INFO* ri)
+{
+    /*
+        A hit takes a reference under the stripe lock and hands it to the
+        queued slice; the item's bytes go out straight from the segment and
+        the reference is dropped once they are sent.
+    */
+
+    if (!g_pShared || !pConn || !ri || !ri->m_szMethod || !ri->m_szPath) return false;
+
+    bool bHead = strcmp(ri->m_szMethod, "HEAD") == 0;
+    if (!bHead && strcmp(ri->m_szMethod, "GET") != 0) return false;
+
+    bool    bNoStore;
+    int64_t iMaxAge;
+    if (cache_request_bypasses(ri, &bNoStore, &iMaxAge)) return false;
+
+    char szKey[PROXY_CACHE_KEY_MAX];
+    size_t iKeyLength = cache_build_key(ri, szKey, sizeof(szKey));
+    if (iKeyLength == 0) return false;
+
+    uint64_t uHash  = cache_hash(szKey, iKeyLength);
+    uint64_t uNowMs = monotonic_ms();
+
+    PROXY_CACHE_ITEM* pFound = NULL;
+    PROXY_CACHE_ITEM* pStale = NULL;
+
+    uint32_t* pStripe = cache_stripe_lock(uHash);
+    cache_lock(pStripe);
+
+    for (PROXY_CACHE_ITEM* pItem = g_arrBuckets[uHash & g_iBucketMask]; pItem; pItem = pItem->m_pNext)
+    {
+        if (pItem->m_uHash != uHash || pItem->m_iKeyLength != iKeyLength ||
+            memcmp(pItem->m_arrData, szKey, iKeyLength) != 0 || !cache_vary_matches(pItem, ri))
+            continue;
+
+        // one item per key and Vary values: a stale one has no fresher twin
+        if (uNowMs >= pItem->m_uExpiresMs)
+        {
+            pStale = pItem;
+            cache_unlink_locked(pItem);
+            break;
+        }
+
+        __atomic_add_fetch(&pItem->m_uRefs, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pItem->m_bReferenced, 1, __ATOMIC_RELAXED);
+        pFound = pItem;
+        break;
+    }
+
+    cache_unlock(pStripe);
+
+    if (pStale) cache_unref(pStale);
+    if (!pFound) return false;
+
+    uint64_t uAge = (uNowMs - pFound->m_uBornMs) / 1000;
+    if (iMaxAge >= 0 && uAge > (uint64_t)iMaxAge)
+    {
+        cache_unref(pFound);
+        return false;
+    }
+
+    char szAge[24];
+    snprintf(szAge, sizeof(szAge), "%llu", (unsigned long long)uAge);
+
+    const char* szReason = cache_reason(pFound);
+    size_t iLength = pFound->m_iHeadLength + (bHead ? 0 : pFound->m_iBodyLength);
+
+    // a failed queue is the worker's to notice, as for every other response
+    RESPONSE_BUILDER builder;
+    response_begin(&builder, pConn, ri, pFound->m_iStatus, szReason[0] ? szReason : NULL);
+    response_add_header(&builder, "Age", szAge);
+    response_add_prerendered(&builder, cache_rendered(pFound), iLength, proxy_cache_release, pFound);
+    response_finish(&builder);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+PROXY_CACHE_ROLE proxy_cache_join(const REQUEST_INFO* ri, bool bMayWait, uint64_t uStaleMs, PROXY_CACHE_TICKET* pTicket)
+{
+    /*
+        Called after proxy_cache_serve() missed. The fetches of a key live
+        in the group of slots of its stripe, so the stripe lock covers the
+        lookup, the registration and the waiter bits at once. Keys are told
+        apart by their hash only: a collision costs a waiter one wakeup and
+        a trip to the upstream, nothing else.
+    */
+
+    memset(pTicket, 0, sizeof(*pTicket));
+    if (!g_pShared || g_iWorkerIndex < 0 || !ri || !ri->m_szMethod || !ri->m_szPath) return PROXY_CACHE_PASS;
+
+    // a HEAD may wait for a GET, but its own response is never stored
+    bool bHead = strcmp(ri->m_szMethod, "HEAD") == 0;
+    if (!bHead && strcmp(ri->m_szMethod, "GET") != 0) return PROXY_CACHE_PASS;
+
+    bool    bNoStore;
+    int64_t iMaxAge;
+    if (cache_request_bypasses(ri, &bNoStore, &iMaxAge) || cache_find_header(ri, "Authorization"))
+        return PROXY_CACHE_PASS;
+
+    char szKey[PROXY_CACHE_KEY_MAX];
+    size_t iKeyLength = cache_build_key(ri, szKey, sizeof(szKey));
+    if (iKeyLength == 0) return PROXY_CACHE_PASS;
+
+    uint64_t uHash   = cache_hash(szKey, iKeyLength);
+    uint64_t uNowMs  = monotonic_ms();
+    uint32_t uStripe = cache_stripe_index(uHash);
+
+    PROXY_CACHE_FETCH* arrGroup = &g_pShared->m_arrFetches[uStripe * PROXY_CACHE_FETCH_SLOTS];
+    PROXY_CACHE_FETCH* pFetch   = NULL;
+    PROXY_CACHE_FETCH* pFree    = NULL;
+    PROXY_CACHE_ROLE   role     = PROXY_CACHE_PASS;
+    uint64_t arrWake[PROXY_CACHE_WAITER_WORDS] = { 0 };
+
+    cache_lock(&g_pShared->m_arrStripes[uStripe].m_uLocked);
+
+    for (int iX = 0; iX < PROXY_CACHE_FETCH_SLOTS; ++iX)
+    {
+        PROXY_CACHE_FETCH* pSlot = &arrGroup[iX];
+        if (pSlot->m_uState == PROXY_CACHE_FETCH_NO_STORE && uNowMs >= pSlot->m_uSinceMs)
+            pSlot->m_uState = PROXY_CACHE_FETCH_FREE;
+
+        if (pSlot->m_uState == PROXY_CACHE_FETCH_FREE)
+        {
+            if (!pFree) pFree = pSlot;
+        }
+        else if (pSlot->m_uHash == uHash)
+        {
+            pFetch = pSlot;
+            break;
+        }
+    }
+
+    // a leader silent this long died or hung: its waiters are sent on, this request fetches anew
+    if (pFetch && pFetch->m_uState == PROXY_CACHE_FETCH_IN_FLIGHT && uNowMs - pFetch->m_uSinceMs >= uStaleMs)
+    {
+        cache_fetch_end_locked(pFetch, arrWake);
+        pFree  = pFetch;
+        pFetch = NULL;
+    }
+
+    if (pFetch)
+    {
+        if (pFetch->m_uState == PROXY_CACHE_FETCH_IN_FLIGHT && bMayWait)
+        {
+            pFetch->m_arrWaiters[g_iWorkerIndex / 64] |= 1ull << (g_iWorkerIndex % 64);
+            role = PROXY_CACHE_WAIT;
+        }
+    }
+    else if (pFree && !bHead)
+    {
+        pFree->m_uHash    = uHash;
+        pFree->m_uSinceMs = uNowMs;
+        pFree->m_uState   = PROXY_CACHE_FETCH_IN_FLIGHT;
+        pFetch = pFree;
+        role   = PROXY_CACHE_LEAD;
+    }
+
+    if (role != PROXY_CACHE_PASS)
+    {
+        pTicket->m_role        = role;
+        pTicket->m_uSlot       = (uint32_t)(pFetch - g_pShared->m_arrFetches);
+        pTicket->m_uGeneration = pFetch->m_uGeneration;
+    }
+
+    cache_unlock(&g_pShared->m_arrStripes[uStripe].m_uLocked);
+
+    cache_wake(arrWake);
+    return role;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_fetch_done(PROXY_CACHE_TICKET* pTicket, bool bPass)
+{
+    if (!g_pShared || !pTicket || pTicket->m_role != PROXY_CACHE_LEAD) return;
+
+    PROXY_CACHE_FETCH* pFetch  = &g_pShared->m_arrFetches[pTicket->m_uSlot];
+    uint32_t*          pStripe = &g_pShared->m_arrStripes[pTicket->m_uSlot / PROXY_CACHE_FETCH_SLOTS].m_uLocked;
+    uint64_t           uUntil  = monotonic_ms() + PROXY_CACHE_PASS_MS;
+    uint64_t arrWake[PROXY_CACHE_WAITER_WORDS] = { 0 };
+
+    cache_lock(pStripe);
+
+    // a fetch taken over as stale belongs to its new leader
+    if (pFetch->m_uGeneration == pTicket->m_uGeneration && pFetch->m_uState == PROXY_CACHE_FETCH_IN_FLIGHT)
+    {
+        cache_fetch_end_locked(pFetch, arrWake);
+        if (bPass)
+        {
+            pFetch->m_uState   = PROXY_CACHE_FETCH_NO_STORE;
+            pFetch->m_uSinceMs = uUntil;
+        }
+    }
+
+    cache_unlock(pStripe);
+
+    cache_wake(arrWake);
+    memset(pTicket, 0, sizeof(*pTicket));
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_cache_fetch_pending(const PROXY_CACHE_TICKET* pTicket)
+{
+    // pairs with the release in cache_fetch_end_locked(): a stored response is linked by then
+    if (!g_pShared || !pTicket || pTicket->m_role == PROXY_CACHE_PASS) return false;
+    return __atomic_load_n(&g_pShared->m_arrFetches[pTicket->m_uSlot].m_uGeneration, __ATOMIC_ACQUIRE) ==
+           pTicket->m_uGeneration;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int proxy_cache_wake_fd(void)
+{
+    return g_iWorkerIndex >= 0 ? g_arrWakeFds[g_iWorkerIndex] : -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_drain_wakeups(void)
+{
+    // one read resets the counter however many wakeups it summed up
+    int iFd = proxy_cache_wake_fd();
+    if (iFd < 0) return;
+
+    uint64_t uCount;
+    ssize_t n = read(iFd, &uCount, sizeof(uCount));
+    (void)n;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_policy_init(PROXY_CACHE_POLICY* pPolicy)
+{
+    memset(pPolicy, 0, sizeof(*pPolicy));
+    pPolicy->m_iMaxAge  = -1;
+    pPolicy->m_iSMaxAge = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_note_header(PROXY_CACHE_POLICY* pPolicy, const char* szKey, const char* szValue)
+{
+    if (!pPolicy || !szKey || !szValue) return;
+
+    if (strcasecmp(szKey, "Cache-Control") == 0)
+    {
+        char szName[32];
+        int64_t iValue;
+        const char* p = szValue;
+
+        while ((p = cache_next_directive(p, szName, sizeof(szName), &iValue)))
+        {
+            // no-cache would need revalidation, which is not done: it is not stored at all
+            if (strcmp(szName, "no-store") == 0 || strcmp(szName, "no-cache") == 0 ||
+                strcmp(szName, "private") == 0)
+                pPolicy->m_bNoStore = true;
+            else if (strcmp(szName, "public") == 0)
+                pPolicy->m_bPublic = true;
+            else if (strcmp(szName, "max-age") == 0 && iValue >= 0)
+                pPolicy->m_iMaxAge = iValue;
+            else if (strcmp(szName, "s-maxage") == 0 && iValue >= 0)
+            {
+                pPolicy->m_iSMaxAge = iValue;
+                pPolicy->m_bPublic  = true;
+            }
+        }
+    }
+    else if (strcasecmp(szKey, "Expires") == 0)
+    {
+        // an Expires that does not parse means already expired
+        time_t t = cache_parse_date(szValue);
+        pPolicy->m_tExpires = t ? t : 1;
+    }
+    else if (strcasecmp(szKey, "Date") == 0)
+        pPolicy->m_tDate = cache_parse_date(szValue);
+    else if (strcasecmp(szKey, "Age") == 0)
+        pPolicy->m_uAge = strtoull(szValue, NULL, 10);
+    else if (strcasecmp(szKey, "Set-Cookie") == 0)
+        pPolicy->m_bNoStore = true;
+    else if (strcasecmp(szKey, "Vary") == 0)
+    {
+        // one Vary list is kept, a second one is not worth merging
+        if (pPolicy->m_szVary || strchr(szValue, '*')) pPolicy->m_bNoStore = true;
+        pPolicy->m_szVary = szValue;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+PROXY_CACHE_ITEM* proxy_cache_fill_begin
+(
+    const REQUEST_INFO* ri,
+    int iStatus,
+    const char* szReason,
+    const PROXY_CACHE_POLICY* pPolicy,
+    size_t iHeadMax,
+    uint64_t uBodyLength
+)
+{
+    if (!g_pShared || !ri || !pPolicy || pPolicy->m_bNoStore || !ri->m_szMethod || !ri->m_szPath) return NULL;
+    if (strcmp(ri->m_szMethod, "GET") != 0 || !cache_status_storable(iStatus)) return NULL;
+
+    bool    bNoStore;
+    int64_t iMaxAge;
+    cache_request_bypasses(ri, &bNoStore, &iMaxAge);
+    if (bNoStore) return NULL;
+
+    // what was answered for one set of credentials is only shared when the upstream says so
+    if (!pPolicy->m_bPublic && cache_find_header(ri, "Authorization")) return NULL;
+
+    uint64_t uFreshMs = cache_fresh_ms(pPolicy);
+    if (uFreshMs == 0) return NULL;
+
+    char szKey[PROXY_CACHE_KEY_MAX];
+    size_t iKeyLength = cache_build_key(ri, szKey, sizeof(szKey));
+
+    char arrVary[PROXY_CACHE_VARY_MAX];
+    size_t iVaryLength = 0;
+    if (iKeyLength == 0 || !cache_build_vary(ri, pPolicy->m_szVary, arrVary, sizeof(arrVary), &iVaryLength))
+        return NULL;
+
+    if (!szReason) szReason = "";
+    size_t iReasonLength = strlen(szReason);
+    if (iReasonLength > 255) return NULL;
+
+    // the blank line after the headers is reserved here as well
+    iHeadMax += 2;
+    if (uBodyLength > PROXY_CACHE_MAX_ITEM || iHeadMax > PROXY_CACHE_MAX_ITEM) return NULL;
+
+    size_t iSize = sizeof(PROXY_CACHE_ITEM) + iKeyLength + iVaryLength + iReasonLength + 1 + iHeadMax + (size_t)uBodyLength;
+    if (iSize > PROXY_CACHE_MAX_ITEM) return NULL;
+
+    uint64_t uNowMs = monotonic_ms();
+    PROXY_CACHE_ITEM* pItem = cache_alloc(iSize, uNowMs);
+    if (!pItem) return NULL;
+
+    uint64_t uAgeMs = pPolicy->m_uAge * 1000;
+
+    pItem->m_uHash         = cache_hash(szKey, iKeyLength);
+    pItem->m_uExpiresMs    = uNowMs + uFreshMs;
+    pItem->m_uBornMs       = uNowMs > uAgeMs ? uNowMs - uAgeMs : 0;
+    pItem->m_iStatus       = (uint16_t)iStatus;
+    pItem->m_iKeyLength    = (uint16_t)iKeyLength;
+    pItem->m_iVaryLength   = (uint16_t)iVaryLength;
+    pItem->m_iReasonLength = (uint16_t)iReasonLength;
+    pItem->m_iHeadMax      = (uint32_t)iHeadMax;
+    pItem->m_iBodyLength   = (uint32_t)uBodyLength;
+
+    memcpy(pItem->m_arrData, szKey, iKeyLength);
+    memcpy(pItem->m_arrData + iKeyLength, arrVary, iVaryLength);
+    memcpy(pItem->m_arrData + iKeyLength + iVaryLength, szReason, iReasonLength + 1);
+
+    return pItem;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_fill_header(PROXY_CACHE_ITEM* pItem, const char* szKey, const char* szValue)
+{
+    if (!pItem || pItem->m_bFailed || pItem->m_bHeadClosed || !szKey || !szValue) return;
+
+    // a hit says its own Age
+    if (strcasecmp(szKey, "Age") == 0) return;
+
+    size_t iKey   = strlen(szKey);
+    size_t iValue = strlen(szValue);
+    if (pItem->m_iHeadLength + iKey + iValue + 4 + 2 > pItem->m_iHeadMax)
+    {
+        pItem->m_bFailed = true;
+        return;
+    }
+
+    char* p = cache_rendered(pItem) + pItem->m_iHeadLength;
+    memcpy(p, szKey, iKey);
+    memcpy(p + iKey, ": ", 2);
+    memcpy(p + iKey + 2, szValue, iValue);
+    memcpy(p + iKey + 2 + iValue, "\r\n", 2);
+    pItem->m_iHeadLength += (uint32_t)(iKey + iValue + 4);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool proxy_cache_fill_body(PROXY_CACHE_ITEM* pItem, const char* pData, size_t iLength)
+{
+    if (!pItem || pItem->m_bFailed) return false;
+
+    cache_close_head(pItem);
+    if (iLength > pItem->m_iBodyLength - pItem->m_iBodyFilled)
+    {
+        pItem->m_bFailed = true;
+        return false;
+    }
+
+    memcpy(cache_rendered(pItem) + pItem->m_iHeadLength + pItem->m_iBodyFilled, pData, iLength);
+    pItem->m_iBodyFilled += (uint32_t)iLength;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_fill_commit(PROXY_CACHE_ITEM* pItem)
+{
+    /*
+        The filler's reference becomes the index's. Whatever was stored for
+        the same key and Vary values is unlinked; it is freed once the
+        responses still sending it are done.
+    */
+
+    if (!pItem) return;
+
+    cache_close_head(pItem);
+    if (pItem->m_bFailed || pItem->m_iBodyFilled != pItem->m_iBodyLength)
+    {
+        proxy_cache_fill_abort(pItem);
+        return;
+    }
+
+    PROXY_CACHE_ITEM* pOld = NULL;
+    PROXY_CACHE_ITEM** ppBucket = &g_arrBuckets[pItem->m_uHash & g_iBucketMask];
+
+    uint32_t* pStripe = cache_stripe_lock(pItem->m_uHash);
+    cache_lock(pStripe);
+
+    for (PROXY_CACHE_ITEM* pOther = *ppBucket; pOther; pOther = pOther->m_pNext)
+    {
+        if (pOther->m_uHash == pItem->m_uHash && pOther->m_iKeyLength == pItem->m_iKeyLength &&
+            pOther->m_iVaryLength == pItem->m_iVaryLength &&
+            memcmp(pOther->m_arrData, pItem->m_arrData, (size_t)pItem->m_iKeyLength + pItem->m_iVaryLength) == 0)
+        {
+            pOld = pOther;
+            cache_unlink_locked(pOther);
+            break;
+        }
+    }
+
+    pItem->m_pNext = *ppBucket;
+    *ppBucket = pItem;
+    __atomic_store_n(&pItem->m_bLinked, 1, __ATOMIC_RELAXED);
+
+    cache_unlock(pStripe);
+
+    if (pOld) cache_unref(pOld);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_fill_abort(PROXY_CACHE_ITEM* pItem)
+{
+    if (pItem) cache_unref(pItem);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void proxy_cache_release(void* pItem)
+{
+    if (pItem) cache_unref((PROXY_CACHE_ITEM*)pItem);
+}
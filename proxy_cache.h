@@ -0,0 +1,167 @@
+/*
+    File name    : proxy_cache.h
+    creation date: 15-04-26
+    Author       : Solomon
+*/
+
+/*
+    Shared response cache for proxied content.
+
+    One anonymous MAP_SHARED segment is mapped by the master before the
+    workers are forked, so every worker reads and fills the same store and
+    the hit ratio does not depend on which worker a client lands on. The
+    segment sits at the same address in every process, so items link to
+    each other with plain pointers.
+
+    Memory is handed out like a slab allocator: the segment is cut into
+    1 MB pages, a page is given to one size class (1 KB, 2 KB .. 1 MB) the
+    first time that class runs dry and is cut into equal items. One item
+    holds one response completely: the key, the request header values its
+    Vary names, the status and the rendered headers, blank line and body.
+    A hit is queued straight out of the segment, no copy, and leaves with
+    the per-request head in one sendmsg().
+
+    The index is a hash table of item chains whose buckets are covered by
+    PROXY_CACHE_STRIPES spinlocks; each size class has one more lock for
+    its free list and its CLOCK hand. A lookup takes the lock of its
+    stripe only. Nothing under a lock makes a system call.
+
+    A class with no free item and no page left sweeps its items with its
+    CLOCK hand: an expired item is taken at once, a recently hit one loses
+    its reference bit and gets another turn, one being sent is skipped.
+
+    Items are refcounted. The index holds one reference and every queued
+    response one more, so an item replaced or evicted while it is still
+    being sent stays intact until the last response using it is done.
+
+    What is stored:
+      - responses to GET (a HEAD is answered from them as well)
+      - status 200, 203, 204, 300, 301, 404 or 410, body framed by
+        Content-Length (or none), the whole item within the largest class
+      - with an explicit lifetime: s-maxage, max-age or Expires, less the
+        upstream's Age
+      - never no-store, no-cache, private, Set-Cookie or Vary: *, and an
+        answer to a request with Authorization only when public / s-maxage
+    A request saying no-cache, no-store, Pragma: no-cache or a max-age the
+    item is older than goes to the upstream; its response replaces the
+    stored one (no-store: nothing is stored).
+
+    Concurrent misses are collapsed into one upstream fetch. The first miss
+    for a key registers it in a small table of fetches in flight, kept in
+    the segment under the same stripe locks; a miss for a key already being
+    fetched parks its client and marks its worker as waiting. When the
+    fetch is stored (or turns out not to be storable) the waiting workers
+    are woken through their eventfd and serve their clients from the cache,
+    so an expiry costs the upstream one request, not one per client.
+    A response that may not be stored leaves a pass marker behind for
+    PROXY_CACHE_PASS_MS: requests for it go straight to the upstream
+    instead of queueing behind each other.
+*/
+
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+#include <stddef.h>     // provides size_t
+#include <stdint.h>     // provides uint64_t, int64_t
+#include <stdbool.h>
+#include <time.h>       // provides time_t
+#include "http.h"       // provides REQUEST_INFO
+
+#define PROXY_CACHE_PAGE_SIZE     (1024 * 1024)
+#define PROXY_CACHE_MIN_ITEM      1024
+#define PROXY_CACHE_CLASSES       11        // PROXY_CACHE_MIN_ITEM << 0 .. 10, the last one is a page
+#define PROXY_CACHE_STRIPES       64        // locks over the index buckets, power of two
+#define PROXY_CACHE_KEY_MAX       2048      // Host + path
+#define PROXY_CACHE_VARY_MAX      512       // stored request header values
+#define PROXY_CACHE_MAX_MB        65536
+#define PROXY_CACHE_FETCH_SLOTS   16        // fetches in flight per stripe
+#define PROXY_CACHE_PASS_MS       10000     // a key found not storable is not waited on this long
+
+#define DEFAULT_PROXY_CACHE_MB    0         // off
+
+typedef struct CONNECTION       CONNECTION;
+typedef struct PROXY_CACHE_ITEM PROXY_CACHE_ITEM;
+
+// what the upstream's response headers say about storing it, gathered header by header
+typedef struct PROXY_CACHE_POLICY
+{
+    bool        m_bNoStore;        // no-store, no-cache, private, Set-Cookie, Vary: * or a second Vary
+    bool        m_bPublic;         // public or s-maxage: may answer requests with Authorization
+    int64_t     m_iMaxAge;         // seconds, -1 when absent
+    int64_t     m_iSMaxAge;        // seconds, -1 when absent
+    time_t      m_tExpires;        // 0 when absent, 1 when unparsable (already expired)
+    time_t      m_tDate;           // 0 when absent
+    uint64_t    m_uAge;            // seconds the upstream says the response is old
+    const char* m_szVary;          // borrowed from the upstream's buffer, NULL when absent
+} PROXY_CACHE_POLICY;
+
+typedef enum
+{
+    PROXY_CACHE_PASS = 0,          // go to the upstream, nobody waits on it
+    PROXY_CACHE_LEAD,              // go to the upstream, concurrent misses wait for its response
+    PROXY_CACHE_WAIT,              // another request is fetching it, wait for the wakeup
+} PROXY_CACHE_ROLE;
+
+// a request's part in a fetch in flight; all zero holds none
+typedef struct PROXY_CACHE_TICKET
+{
+    PROXY_CACHE_ROLE m_role;
+    uint32_t         m_uSlot;
+    uint32_t         m_uGeneration;    // of the slot when joined, bumped once the fetch is over
+} PROXY_CACHE_TICKET;
+
+/*===================================== Master ======================================*/
+bool proxy_cache_init         (size_t iBytes, int iWorkerCount); // before fork; 0 leaves the cache off
+
+/*===================================== Worker ======================================*/
+void proxy_cache_attach       (int iWorkerIndex);
+bool proxy_cache_enabled      (void);
+bool proxy_cache_serve        (CONNECTION* pConn, const REQUEST_INFO* ri); // true when a stored response was queued
+
+PROXY_CACHE_ROLE proxy_cache_join(const REQUEST_INFO* ri, bool bMayWait, uint64_t uStaleMs, PROXY_CACHE_TICKET* pTicket);
+void proxy_cache_fetch_done   (PROXY_CACHE_TICKET* pTicket, bool bPass);
+bool proxy_cache_fetch_pending(const PROXY_CACHE_TICKET* pTicket);
+int  proxy_cache_wake_fd      (void);              // -1 when misses are not collapsed
+void proxy_cache_drain_wakeups(void);
+
+void proxy_cache_policy_init  (PROXY_CACHE_POLICY* pPolicy);
+void proxy_cache_note_header  (PROXY_CACHE_POLICY* pPolicy, const char* szKey, const char* szValue);
+
+PROXY_CACHE_ITEM* proxy_cache_fill_begin(const REQUEST_INFO* ri, int iStatus, const char* szReason,
+                                         const PROXY_CACHE_POLICY* pPolicy, size_t iHeadMax, uint64_t uBodyLength);
+void proxy_cache_fill_header  (PROXY_CACHE_ITEM* pItem, const char* szKey, const char* szValue);
+bool proxy_cache_fill_body    (PROXY_CACHE_ITEM* pItem, const char* pData, size_t iLength);
+void proxy_cache_fill_commit  (PROXY_CACHE_ITEM* pItem);
+void proxy_cache_fill_abort   (PROXY_CACHE_ITEM* pItem);
+
+void proxy_cache_release      (void* pItem);       // drops a reference, matches OUT_RELEASE_FN
+
+#endif
+
+/*
+
+proxy_cache_init()        -> maps the segment: header, page owners, index buckets, then the pages, and
+                             opens one eventfd per worker for the fetch wakeups
+proxy_cache_attach()      -> picks this worker's eventfd and bit in the waiter masks
+proxy_cache_serve()       -> looks the request up (key and Vary values) and queues a fresh item with our
+                             status line / Date / Connection and an Age header; a stale item met on the
+                             way is dropped from the index
+proxy_cache_join()        -> after a miss: registers a fetch for the key (LEAD), adds this worker to the
+                             waiters of the one in flight (WAIT, only when bMayWait), or neither (PASS:
+                             not a plain GET, a pass marker, the stripe's slots all busy). A fetch older
+                             than uStaleMs is taken over, its leader is presumed gone
+proxy_cache_fetch_done()  -> the leader's response is stored or will not be: frees the slot (or turns it
+                             into a pass marker) and wakes the waiting workers; a no-op for other tickets
+proxy_cache_fetch_pending()-> whether the fetch a waiter joined is still in flight
+proxy_cache_drain_wakeups()-> resets this worker's eventfd after it became readable
+proxy_cache_note_header() -> folds one upstream response header into the policy
+proxy_cache_fill_begin()  -> decides whether the response may be stored and takes an unlinked item for
+                             it; NULL when it may not, is too large, or no item could be freed
+proxy_cache_fill_header() -> appends one end-to-end header to the item (Age is left out, it is ours)
+proxy_cache_fill_body()   -> copies body bytes as they are passed to the client; false when they overflow
+                             the announced length, the caller then aborts the fill
+proxy_cache_fill_commit() -> links the complete item, replacing the one with the same key and Vary values;
+                             an item missing body bytes is dropped instead
+proxy_cache_fill_abort()  -> gives an unfinished item back to its class
+
+*/
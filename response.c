@@ -4,16 +4,67 @@
     Author: Solomon
 */
 
+#define _GNU_SOURCE     // enables strcasestr()
+
 #include <stddef.h>     // provides size_t
 #include <stdio.h>      // provides snprintf()
 #include <string.h>     // provides strcmp(), strncasecmp()
 #include <strings.h>    // provides strlen(), strncasecmp(), strcmp()
-#include <sys/socket.h> // provides send()
+#include <stdbool.h>
 #include <time.h>       // provides type time_t, struct tm, gmtime_r(), strftime()
+#include <unistd.h>     // provides close()
 #include "response.h"   // provides REQUEST_INFO
 #include "http.h"       // provides REQUEST_INFO
+#include "connection.h" // provides connection_queue_copy(), connection_queue_file(), connection_queue_shared()
+
+#define MAX_RESPONSE_HEADER_SIZE RESPONSE_HEAD_CAPACITY   // the builder head is the largest buffer written into
+
+#define RESPONSE_SERVER_HEADER     "Server: Solomon/1.0\r\n"
+#define RESPONSE_DATE_LENGTH       29    // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define RESPONSE_VERSIONS          2     // HTTP/1.0, HTTP/1.1
+#define RESPONSE_TEMPLATE_SIZE     160
 
-#define MAX_RESPONSE_HEADER_SIZE 4096
+/*
+    Pre-rendered response heads, per worker: status line, Date, Server and
+    Connection for every (version, status, connection mode). The Date
+    value is patched in place once per second by response_clock_tick().
+*/
+typedef struct RESPONSE_TEMPLATE
+{
+    char   m_szText[RESPONSE_TEMPLATE_SIZE];
+    size_t m_iLength;
+    size_t m_iDateAt;     // offset of the Date value in m_szText
+} RESPONSE_TEMPLATE;
+
+static const struct
+{
+    int         m_iStatus;
+    const char* m_szReason;
+} g_arrTemplateStatuses[] = {
+    { 200, "OK" },
+    { 204, "No Content" },
+    { 301, "Moved Permanently" },
+    { 304, "Not Modified" },
+    { 400, "Bad Request" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 405, "Method Not Allowed" },
+    { 413, "Payload Too Large" },
+    { 414, "URI Too Long" },
+    { 500, "Internal Server Error" },
+    { 501, "Not Implemented" },
+    { 502, "Bad Gateway" },
+    { 503, "Service Unavailable" },
+    { 504, "Gateway Timeout" },
+    { 505, "HTTP Version Not Supported" },
+};
+
+#define RESPONSE_TEMPLATE_STATUSES ((int)(sizeof(g_arrTemplateStatuses) / sizeof(g_arrTemplateStatuses[0])))
+
+static RESPONSE_TEMPLATE g_arrTemplates[RESPONSE_VERSIONS][RESPONSE_TEMPLATE_STATUSES][2]; // [..][..][keep-alive]
+static bool              g_bTemplatesReady;
+static time_t            g_tDateSecond = (time_t)-1;
+static char              g_szDate[RESPONSE_DATE_LENGTH + 1];
 
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////
@@ -47,116 +98,192 @@ static int parse_result_to_http_status(PARSE_RESULT rc)
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-static const char* http_reason_phrase(int status)
+static int response_status_index(int iStatus)
+{
+    for (int iX = 0; iX < RESPONSE_TEMPLATE_STATUSES; ++iX)
+    {
+        if (g_arrTemplateStatuses[iX].m_iStatus == iStatus) return iX;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void response_render_templates(void)
 {
-    switch (status) {
-        case 400: return "Bad Request";
-        case 405: return "Method Not Allowed";
-        case 500: return "Internal Server Error";
-        case 501: return "Not Implemented";
-        case 505: return "HTTP Version Not Supported";
-        default:  return "Error";
+    /*
+        Renders every (version, status, connection) head once per worker.
+        The Date value sits at a known offset in each of them, so the
+        per-second refresh is a 29 byte memcpy per template.
+    */
+
+    static const char* const arrVersions[RESPONSE_VERSIONS] = { "HTTP/1.0", "HTTP/1.1" };
+
+    for (int iV = 0; iV < RESPONSE_VERSIONS; ++iV)
+    {
+        for (int iS = 0; iS < RESPONSE_TEMPLATE_STATUSES; ++iS)
+        {
+            for (int iC = 0; iC < 2; ++iC)
+            {
+                RESPONSE_TEMPLATE* pT = &g_arrTemplates[iV][iS][iC];
+
+                int iDateAt = snprintf(pT->m_szText, sizeof(pT->m_szText), "%s %d %s\r\nDate: ",
+                                       arrVersions[iV], g_arrTemplateStatuses[iS].m_iStatus,
+                                       g_arrTemplateStatuses[iS].m_szReason);
+
+                int iLength = snprintf(pT->m_szText + iDateAt, sizeof(pT->m_szText) - (size_t)iDateAt,
+                                       "%s\r\n" RESPONSE_SERVER_HEADER "Connection: %s\r\n",
+                                       g_szDate, iC ? "keep-alive" : "close");
+
+                pT->m_iDateAt = (size_t)iDateAt;
+                pT->m_iLength = (size_t)iDateAt + (size_t)iLength;
+            }
+        }
     }
+
+    g_bTemplatesReady = true;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-void send_parse_error_response(int iClientFd, const REQUEST_INFO* ri)
+static void response_clock_ready(void)
 {
-    if (!ri || iClientFd < 0) return;
+    // a worker that has not ticked yet still gets a valid Date
+    if (!g_bTemplatesReady) response_clock_tick();
+}
 
-    char buffer[512];
-    int iStatus = parse_result_to_http_status(ri->m_parseResult);
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static size_t response_format_size(char* pOut, size_t iValue)
+{
+    // decimal digits without snprintf(), pOut needs 20 bytes
+    char arrDigits[20];
+    size_t iCount = 0;
 
-    // if the version exists echo it or just use http 1.1
-    const char* version = (ri->m_szVersion &&
-                          (!strcmp(ri->m_szVersion, "HTTP/1.0") || 
-                           !strcmp(ri->m_szVersion, "HTTP.1.1") ))
-                          ? ri->m_szVersion : "HTTP/1.1";
+    do
+    {
+        arrDigits[iCount++] = (char)('0' + iValue % 10);
+        iValue /= 10;
+    } while (iValue);
 
-    int n = snprintf(buffer, sizeof(buffer),
-        "%s %d %s\r\n"
-        "Connection: close\r\n"
-        "Content-Length: 0\r\n"
-        "\r\n",
-        version,
-        iStatus,
-        http_reason_phrase(iStatus)
-    );
+    for (size_t iX = 0; iX < iCount; ++iX)
+        pOut[iX] = arrDigits[iCount - 1 - iX];
 
-    send(iClientFd,  buffer, n, 0);
+    return iCount;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-void send_simple_response
+static int write_response_head
 (
-    int iClientFd,
     const REQUEST_INFO* ri,
     int iStatus,
-    const char* reason,
-    const char* body,
-    size_t iBodyLen
+    const char* szReason,
+    bool bKeepAlive,
+    char* buffer,
+    size_t iOffset
 )
 {
-    if (iClientFd < 0 || !reason) return;
-
-    const char* szVersion = (ri &&
-                            ri->m_szVersion &&
-                            (!strcmp(ri->m_szVersion, "HTTP/1.0") || !strcmp(ri->m_szVersion, "HTTP/1.1"))) ? 
-                            ri->m_szVersion : "HTTP/1.1";
+    /*
+        Status line, Date, Server and Connection in one memcpy of the
+        matching template. A status (or reason) without a template is
+        formatted here instead, which only the unusual responses pay.
+    */
 
-    // send headers first, even if the body fails the headers must be sent 
-    char buffer[512];
-    int iHeaderSize = snprintf(buffer, sizeof(buffer),
-                              "%s %d %s\r\n"
-                              "Connection: close\r\n"
-                              "Content-Length: %zu\r\n"
-                              "\r\n",
-        szVersion, iStatus, reason, iBodyLen
-    );
+    response_clock_ready();
 
-    if (iHeaderSize < 0 || iHeaderSize >= (int)sizeof(buffer))
-        return;
+    int iV = (ri && ri->m_szVersion && strcmp(ri->m_szVersion, "HTTP/1.0") == 0) ? 0 : 1;
+    int iS = response_status_index(iStatus);
 
-    // send the headers
-    size_t iSent = 0;
-    while (iSent < (size_t)iHeaderSize)
+    if (iS >= 0 && (!szReason || strcmp(szReason, g_arrTemplateStatuses[iS].m_szReason) == 0))
     {
-        ssize_t n = send(iClientFd, buffer + iSent, iHeaderSize - iSent, 0);
-        if (n <= 0) return;
-        iSent += n; 
+        const RESPONSE_TEMPLATE* pT = &g_arrTemplates[iV][iS][bKeepAlive ? 1 : 0];
+        if (iOffset + pT->m_iLength >= MAX_RESPONSE_HEADER_SIZE) return -1;
+
+        memcpy(buffer + iOffset, pT->m_szText, pT->m_iLength);
+        return (int)(iOffset + pT->m_iLength);
     }
 
-    // send body now
-    if (body && iBodyLen > 0)
+    size_t iRemaining = MAX_RESPONSE_HEADER_SIZE > iOffset ? MAX_RESPONSE_HEADER_SIZE - iOffset : 0;
+    int iWrote = snprintf(buffer + iOffset, iRemaining,
+                          "%s %d %s\r\nDate: %s\r\n" RESPONSE_SERVER_HEADER "Connection: %s\r\n",
+                          iV ? "HTTP/1.1" : "HTTP/1.0", iStatus, szReason ? szReason : "Error",
+                          g_szDate, bKeepAlive ? "keep-alive" : "close");
+    if (iWrote < 0 || (size_t)iWrote >= iRemaining) return -1;
+
+    return (int)(iOffset + (size_t)iWrote);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int write_vary_header(const REQUEST_INFO* ri, char* buffer, size_t iOffset)
+{
+    /* Minimal Vary header if request advertised Accept-Encoding (helps caches).
+     * Only add when we actually compress; we don't compress here, but adding
+     * Vary unconditionally is not ideal. We'll add Vary only if client sent Accept-Encoding.
+     */
+
+    static const char szVary[] = "Vary: Accept-Encoding\r\n";
+
+    for (size_t i = 0; i < ri->m_headers.count; ++i)
     {
-        iSent = 0;
-        while (iSent < iBodyLen)
+        const char* key = ri->m_headers.entries[i].szKey;
+        if (!key) continue;
+        if (strncasecmp(key, "accept-encoding", 15) == 0)
         {
-            ssize_t n = send(iClientFd, body + iSent, iBodyLen - iSent, 0);
-            if (n <= 0) return;
-            iSent += n;
+            if (iOffset + sizeof(szVary) - 1 >= MAX_RESPONSE_HEADER_SIZE) return -1;
+            memcpy(buffer + iOffset, szVary, sizeof(szVary) - 1);
+            return (int)(iOffset + sizeof(szVary) - 1);
         }
     }
+
+    return (int)iOffset;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-static int header_key_eq(const char *a, const char *b)
+void response_clock_tick(void)
 {
-    /* Helper: case-insensitive header key compare (exact match) */
-    if (!a || !b) return 0;
-    size_t la = strlen(a);
-    size_t lb = strlen(b);
-    if (la != lb) return 0;
-    return (strncasecmp(a, b, la) == 0);
+    /*
+        Called by the event loop on every wakeup. The coarse clock is a
+        vDSO read; only when the second changed is the Date value
+        formatted and patched into every template.
+    */
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+    if (g_bTemplatesReady && ts.tv_sec == g_tDateSecond) return;
+    g_tDateSecond = ts.tv_sec;
+
+    struct tm gm; // gm means `GreenWich Mean` which is now called UTC time, tm means time components
+    gmtime_r(&g_tDateSecond, &gm);
+
+    // Date: <day-name>, <day> <month> <year> <hour>:<minute>:<second> GMT, always 29 characters
+    char szDate[64];
+    if (strftime(szDate, sizeof(szDate), "%a, %d %b %Y %H:%M:%S GMT", &gm) != RESPONSE_DATE_LENGTH)
+        return;
+    memcpy(g_szDate, szDate, RESPONSE_DATE_LENGTH + 1);
+
+    if (!g_bTemplatesReady)
+    {
+        response_render_templates();
+        return;
+    }
+
+    for (int iV = 0; iV < RESPONSE_VERSIONS; ++iV)
+        for (int iS = 0; iS < RESPONSE_TEMPLATE_STATUSES; ++iS)
+            for (int iC = 0; iC < 2; ++iC)
+            {
+                RESPONSE_TEMPLATE* pT = &g_arrTemplates[iV][iS][iC];
+                memcpy(pT->m_szText + pT->m_iDateAt, g_szDate, RESPONSE_DATE_LENGTH);
+            }
 }
 
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////
-/* --------------------------- Main Functions --------------------------- */
+/* --------------------------- Response Builder --------------------------- */
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////
@@ -164,115 +291,478 @@ static int header_key_eq(const char *a, const char *b)
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-int initialize_response_header_buffer(REQUEST_INFO* ri_requestInfo)
+static void response_head_append(RESPONSE_BUILDER* pB, const char* pData, size_t iLength)
 {
-    if (!ri_requestInfo) return -1;    
+    if (pB->m_bFailed) return;
 
-    char buffer[MAX_RESPONSE_HEADER_SIZE];
-    int offset = 0;
+    if (pB->m_iHeadLength + iLength > sizeof(pB->m_arrHead))
+    {
+        pB->m_bFailed = true;
+        return;
+    }
 
-    offset = write_status_line(ri_requestInfo, buffer, offset);
-    if (offset > MAX_RESPONSE_HEADER_SIZE) return -1;
+    memcpy(pB->m_arrHead + pB->m_iHeadLength, pData, iLength);
+    pB->m_iHeadLength += iLength;
+}
 
-    offset = write_headers(ri_requestInfo, buffer, offset);
-    if (offset > MAX_RESPONSE_HEADER_SIZE) return -1;
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static OUT_SEGMENT* response_next_slice(RESPONSE_BUILDER* pB)
+{
+    // a slice after a prerendered one would land behind its body
+    if (pB->m_bFailed || pB->m_bHeadComplete || pB->m_iSliceCount == RESPONSE_MAX_SLICES)
+    {
+        pB->m_bFailed = true;
+        return NULL;
+    }
 
-    offset = write_final_crlf(ri_requestInfo, buffer, offset);
-    if (offset > MAX_RESPONSE_HEADER_SIZE) return -1;
+    OUT_SEGMENT* pSlice = &pB->m_arrSlices[pB->m_iSliceCount];
+    memset(pSlice, 0, sizeof(*pSlice));
+    pSlice->m_iFileFd = -1;
+    return pSlice;
+}
 
-    return 0;
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void response_release_slice(OUT_SEGMENT* pSlice)
+{
+    if (pSlice->m_pfnRelease)
+        pSlice->m_pfnRelease(pSlice->m_pReleaseCtx);
+    else if (pSlice->m_bOwnsFd && pSlice->m_iFileFd >= 0)
+        close(pSlice->m_iFileFd);
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-int write_status_line(REQUEST_INFO* ri, char* buffer, size_t iOffset)
+void response_begin
+(
+    RESPONSE_BUILDER* pB,
+    CONNECTION* pConn,
+    const REQUEST_INFO* ri,
+    int iStatus,
+    const char* szReason
+)
 {
-    if (!ri || !buffer) return -1;
+    pB->m_pConn          = pConn;
+    pB->m_pRequest       = ri;
+    pB->m_iStatus        = iStatus;
+    pB->m_bFailed        = !pConn;
+    pB->m_bLengthWritten = false;
+    pB->m_bHeadComplete  = false;
+    pB->m_iHeadLength    = 0;
+    pB->m_iSliceCount    = 0;
+    pB->m_iBodyLength    = 0;
+
+    if (pB->m_bFailed) return;
+
+    // the Connection value follows the worker's decision for this request
+    int iOffset = write_response_head(ri, iStatus, szReason, !pConn->m_bCloseAfterFlush, pB->m_arrHead, 0);
+    if (iOffset < 0) pB->m_bFailed = true;
+    else             pB->m_iHeadLength = (size_t)iOffset;
+}
 
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_header(RESPONSE_BUILDER* pB, const char* szName, const char* szValue)
+{
+    if (!szName || !szValue)
+    {
+        pB->m_bFailed = true;
+        return;
+    }
 
-    /* Status line format -> "version status reason\r\n" */
+    response_head_append(pB, szName, strlen(szName));
+    response_head_append(pB, ": ", 2);
+    response_head_append(pB, szValue, strlen(szValue));
+    response_head_append(pB, "\r\n", 2);
+}
 
-    /* choose a sensible HTTP version: echo valid request version or fall back */
-    const char* version = "HTTP/1.1";
-    if (ri->m_szVersion &&
-        (!strcmp(ri->m_szVersion, "HTTP/1.0") ||
-         !strcmp(ri->m_szVersion, "HTTP/1.1")))
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_raw_headers(RESPONSE_BUILDER* pB, const char* pLines, size_t iLength, bool bHasLength)
+{
+    if (!pLines)
     {
-        version = ri->m_szVersion;
+        pB->m_bFailed = true;
+        return;
     }
 
-    /* decide status code:
-       - if parser succeeded, assume 200 OK (application can override by not using this helper)
-       - if parser failed, map parse result to an appropriate error status */
-    int status = (ri->m_parseResult == PARSE_SUCCESS) ?
-                 200 : parse_result_to_http_status(ri->m_parseResult);
+    response_head_append(pB, pLines, iLength);
+    if (bHasLength) pB->m_bLengthWritten = true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_vary(RESPONSE_BUILDER* pB)
+{
+    if (pB->m_bFailed || !pB->m_pRequest) return;
 
-    const char* reason = (status == 200) ? "OK" : http_reason_phrase(status);
+    int iOffset = write_vary_header(pB->m_pRequest, pB->m_arrHead, pB->m_iHeadLength);
+    if (iOffset < 0) pB->m_bFailed = true;
+    else             pB->m_iHeadLength = (size_t)iOffset;
+}
 
-    /* remaining space in the header buffer */
-    size_t remaining = MAX_RESPONSE_HEADER_SIZE > iOffset ? MAX_RESPONSE_HEADER_SIZE - iOffset : 0;
-    if (remaining == 0) return -1;
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_body(RESPONSE_BUILDER* pB, const void* pData, size_t iLength)
+{
+    /*
+        Body bytes usually come from the caller's stack, so they are copied
+        into the request arena now; the slice then points at the copy.
+    */
 
-    /* snprintf returns the number of characters that would have been written (excluding '\0') */
-    int wrote = snprintf(buffer + iOffset, remaining, "%s %d %s\r\n", version, status, reason);
-    if (wrote < 0) return -1;
+    if (iLength == 0) return;
 
-    /* if wrote >= remaining, the output was truncated -> error */
-    if ((size_t)wrote >= remaining) return -1;
+    OUT_SEGMENT* pSlice = response_next_slice(pB);
+    if (!pSlice) return;
 
-    /* return new offset (old + bytes written) */
-    return (int)(iOffset + (size_t)wrote);
+    char* pCopy = pData ? arenaAlloc(&pB->m_pConn->m_arena, iLength) : NULL;
+    if (!pCopy)
+    {
+        pB->m_bFailed = true;
+        return;
+    }
+    memcpy(pCopy, pData, iLength);
+
+    pSlice->m_type    = OUT_SEGMENT_MEMORY;
+    pSlice->m_pData   = pCopy;
+    pSlice->m_iLength = iLength;
+
+    pB->m_iSliceCount++;
+    pB->m_iBodyLength += iLength;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-int write_headers(REQUEST_INFO* ri, char* buffer, size_t iOffset)
+void response_add_body_shared
+(
+    RESPONSE_BUILDER* pB,
+    const char* pData,
+    size_t iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void* pReleaseCtx
+)
 {
-    if (!ri || !buffer) return -1;
-    
-    size_t offset = iOffset;
-    size_t iRemaning = (MAX_RESPONSE_HEADER_SIZE > iOffset) ? (MAX_RESPONSE_HEADER_SIZE - iOffset) : 0;
-    if (iRemaning == 0) return -1;
-    
-    int iWrote;
- 
-    // 1) write the Date header
-    // syntax for Date header is -> Date: <day-name>, <day> <month> <year> <hour>:<minute>:<second> GMT
-    
-    /*--------------------------------------- Date Header --------------------------------------*/
+    OUT_SEGMENT* pSlice = pData ? response_next_slice(pB) : NULL;
+    if (!pSlice)
     {
-        time_t now = time(NULL);
-        struct tm gm; // gm means `GreenWich Mean` which is now called UTC time, tm means time components
-        
-        if (gmtime_r(&now, &gm) == NULL) return -1;
+        pB->m_bFailed = true;
+        if (pfnRelease) pfnRelease(pReleaseCtx);
+        return;
+    }
 
-        char dateBuffer[64];
-        // strftime() means string format time, fills dateBuffer with string values of time using gm
-        if (strftime(dateBuffer, sizeof(dateBuffer), "%a, %d %b %Y %H:%M:%S GMT", &gm) == 0)
-            return -1;
+    pSlice->m_type        = OUT_SEGMENT_MEMORY;
+    pSlice->m_pData       = pData;
+    pSlice->m_iLength     = iLength;
+    pSlice->m_pfnRelease  = pfnRelease;
+    pSlice->m_pReleaseCtx = pReleaseCtx;
 
-        iWrote = snprintf(buffer + offset, iRemaning, "Date: %s\r\n", dateBuffer);
-        if (iWrote < 0 || (size_t)iWrote > iRemaning) return -1;
-        offset += (size_t)iWrote;
-        iRemaning += (size_t)iWrote;
+    pB->m_iSliceCount++;
+    pB->m_iBodyLength += iLength;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_prerendered
+(
+    RESPONSE_BUILDER* pB,
+    const char* pData,
+    size_t iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void* pReleaseCtx
+)
+{
+    // entity headers, blank line and body in one shared buffer: the head is done after it
+    response_add_body_shared(pB, pData, iLength, pfnRelease, pReleaseCtx);
+    pB->m_bHeadComplete = true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_file(RESPONSE_BUILDER* pB, int iFileFd, off_t iOffset, size_t iLength)
+{
+    OUT_SEGMENT* pSlice = iFileFd >= 0 ? response_next_slice(pB) : NULL;
+    if (!pSlice)
+    {
+        pB->m_bFailed = true;
+        if (iFileFd >= 0) close(iFileFd);
+        return;
     }
-    /*------------------------------------------------------------------------------------------*/
 
-    // 2) Write Server header 
-    /*--------------------------------------- Server header --------------------------------------*/
+    pSlice->m_type    = OUT_SEGMENT_FILE;
+    pSlice->m_iFileFd = iFileFd;
+    pSlice->m_iOffset = iOffset;
+    pSlice->m_iLength = iLength;
+    pSlice->m_bOwnsFd = true;
+
+    pB->m_iSliceCount++;
+    pB->m_iBodyLength += iLength;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void response_add_file_shared
+(
+    RESPONSE_BUILDER* pB,
+    int iFileFd,
+    off_t iOffset,
+    size_t iLength,
+    OUT_RELEASE_FN pfnRelease,
+    void* pReleaseCtx
+)
+{
+    OUT_SEGMENT* pSlice = iFileFd >= 0 ? response_next_slice(pB) : NULL;
+    if (!pSlice)
     {
-        const char* szServerHeader = "Server: Solomon/1.0\r\n";
-        size_t iHeaderLen = strlen(szServerHeader);
+        pB->m_bFailed = true;
+        if (pfnRelease) pfnRelease(pReleaseCtx);
+        return;
+    }
 
-        if (iHeaderLen >= iRemaning) return -1;
-        memcpy(buffer + offset, szServerHeader, iHeaderLen);
-        offset += iHeaderLen;
-        iRemaning -= iHeaderLen;
+    pSlice->m_type        = OUT_SEGMENT_FILE;
+    pSlice->m_iFileFd     = iFileFd;
+    pSlice->m_iOffset     = iOffset;
+    pSlice->m_iLength     = iLength;
+    pSlice->m_pfnRelease  = pfnRelease;
+    pSlice->m_pReleaseCtx = pReleaseCtx;
+
+    pB->m_iSliceCount++;
+    pB->m_iBodyLength += iLength;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool response_finish(RESPONSE_BUILDER* pB)
+{
+    /*
+        Closes the head (Content-Length from the slices, blank line) and
+        queues head and slices in order. Adjacent memory leaves in one
+        sendmsg(); nothing is sent here, the worker flushes the queue.
+        Whatever a slice holds is released if it never made it into the
+        queue.
+    */
+
+    if (!pB->m_bHeadComplete)
+    {
+        if (!pB->m_bLengthWritten)
+        {
+            char szLength[40] = "Content-Length: ";
+            size_t iLen = 16 + response_format_size(szLength + 16, pB->m_iBodyLength);
+            response_head_append(pB, szLength, iLen);
+            response_head_append(pB, "\r\n", 2);
+        }
+        response_head_append(pB, "\r\n", 2);
     }
-    /*------------------------------------------------------------------------------------------*/
 
-    // 3) Connection header
-    /*-------------------------------------- Connection header --------------------------------------*/
+    size_t iQueued = 0;
+    if (!pB->m_bFailed && connection_queue_copy(pB->m_pConn, pB->m_arrHead, pB->m_iHeadLength))
+    {
+        CONNECTION* pConn = pB->m_pConn;
+        pConn->m_iStatus = pB->m_iStatus;
+
+        // the connection_queue_*() calls release a slice themselves when they fail
+        for (; iQueued < pB->m_iSliceCount; ++iQueued)
+        {
+            OUT_SEGMENT* pSlice = &pB->m_arrSlices[iQueued];
+            bool bQueued;
+
+            if (pSlice->m_type == OUT_SEGMENT_MEMORY)
+                bQueued = connection_queue_shared(pConn, pSlice->m_pData, pSlice->m_iLength,
+                                                  pSlice->m_pfnRelease, pSlice->m_pReleaseCtx);
+            else if (pSlice->m_bOwnsFd)
+                bQueued = connection_queue_file(pConn, pSlice->m_iFileFd, pSlice->m_iOffset, pSlice->m_iLength);
+            else
+                bQueued = connection_queue_shared_file(pConn, pSlice->m_iFileFd, pSlice->m_iOffset, pSlice->m_iLength,
+                                                       pSlice->m_pfnRelease, pSlice->m_pReleaseCtx);
+
+            if (!bQueued)
+            {
+                pB->m_bFailed = true;
+                iQueued++;
+                break;
+            }
+        }
+
+        if (!pB->m_bFailed) return true;
+    }
+
+    pB->m_bFailed = true;
+    for (size_t iX = iQueued; iX < pB->m_iSliceCount; ++iX)
+        response_release_slice(&pB->m_arrSlices[iX]);
+
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool send_parse_error_response(CONNECTION* pConn, const REQUEST_INFO* ri)
+{
+    if (!pConn || !ri) return false;
+
+    // the connection is closed after this response whatever the request asked
+    pConn->m_bCloseAfterFlush = true;
+
+    RESPONSE_BUILDER builder;
+    response_begin(&builder, pConn, ri, parse_result_to_http_status(ri->m_parseResult), NULL);
+    return response_finish(&builder);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool send_simple_response
+(
+    CONNECTION* pConn,
+    const REQUEST_INFO* ri,
+    int iStatus,
+    const char* reason,
+    const char* body,
+    size_t iBodyLen
+)
+{
+    return send_content_response(pConn, ri, iStatus, reason, NULL, body, iBodyLen);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool send_content_response
+(
+    CONNECTION* pConn,
+    const REQUEST_INFO* ri,
+    int iStatus,
+    const char* reason,
+    const char* szContentType,
+    const char* body,
+    size_t iBodyLen
+)
+{
+    if (!pConn || !reason) return false;
+
+    RESPONSE_BUILDER builder;
+    response_begin(&builder, pConn, ri, iStatus, reason);
+    if (szContentType) response_add_header(&builder, "Content-Type", szContentType);
+    if (body)          response_add_body(&builder, body, iBodyLen);
+
+    return response_finish(&builder);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool send_file_response
+(
+    CONNECTION* pConn,
+    const REQUEST_INFO* ri,
+    const char* szContentType,
+    int iFileFd,
+    size_t iFileSize,
+    time_t tLastModified
+)
+{
+    /*
+        200 response for a static file: the entity headers come from the
+        regular header writer, the body is a file range the output queue
+        sends with sendfile() right behind the head.
+    */
+
+    if (!pConn || !ri || iFileFd < 0)
+    {
+        if (iFileFd >= 0) close(iFileFd);
+        return false;
+    }
+
+    RESPONSE_BUILDER builder;
+    response_begin(&builder, pConn, ri, 200, NULL);
+    response_add_vary(&builder);
+
+    char szEntity[512];
+    int iEntityLen = write_entity_headers(ri, szEntity, 0, szContentType, iFileSize, tLastModified);
+    if (iEntityLen < 0) builder.m_bFailed = true;
+    else                response_add_raw_headers(&builder, szEntity, (size_t)iEntityLen, true);
+
+    response_add_file(&builder, iFileFd, 0, iFileSize);
+    return response_finish(&builder);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool send_prebuilt_file_response
+(
+    CONNECTION* pConn,
+    const REQUEST_INFO* ri,
+    const char* szEntityHeaders,
+    size_t iEntityHeadersLen,
+    int iFileFd,
+    size_t iFileSize,
+    OUT_RELEASE_FN pfnRelease,
+    void* pReleaseCtx
+)
+{
+    /*
+        Same response as send_file_response() for a file whose entity
+        headers were rendered once and cached with its descriptor. Only the
+        per-request part (status line, Date, Connection...) is written here.
+        pfnRelease runs when the body is done, even if queueing fails.
+    */
+
+    if (!pConn || !ri || !szEntityHeaders)
+    {
+        if (pfnRelease) pfnRelease(pReleaseCtx);
+        return false;
+    }
+
+    RESPONSE_BUILDER builder;
+    response_begin(&builder, pConn, ri, 200, NULL);
+    response_add_vary(&builder);
+    response_add_raw_headers(&builder, szEntityHeaders, iEntityHeadersLen, true);
+    response_add_file_shared(&builder, iFileFd, 0, iFileSize, pfnRelease, pReleaseCtx);
+
+    return response_finish(&builder);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool send_prerendered_response
+(
+    CONNECTION* pConn,
+    const REQUEST_INFO* ri,
+    const char* pRendered,
+    size_t iRenderedLen,
+    OUT_RELEASE_FN pfnRelease,
+    void* pReleaseCtx
+)
+{
+    /*
+        200 response whose entity headers, blank line and body were rendered
+        once into a single buffer. Only the status line and the per-request
+        headers (Date, Connection...) are written here; both pieces then
+        leave together in one sendmsg().
+    */
+
+    if (!pConn || !ri || !pRendered)
+    {
+        if (pfnRelease) pfnRelease(pReleaseCtx);
+        return false;
+    }
+
+    RESPONSE_BUILDER builder;
+    response_begin(&builder, pConn, ri, 200, NULL);
+    response_add_vary(&builder);
+    response_add_prerendered(&builder, pRendered, iRenderedLen, pfnRelease, pReleaseCtx);
+
+    return response_finish(&builder);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool response_wants_keep_alive(const REQUEST_INFO* ri)
+{
+    /*
+        HTTP/1.1 and above default to keep-alive unless the client sent "Connection: close",
+        HTTP/1.0 defaults to close unless the client explicitly asks for keep-alive.
+        The worker uses the same answer to decide whether to keep the socket open.
+    */
+
+    if (!ri) return false;
+
     int iFoundConnectionHeader = 0;
     int iRequestWantsClose     = 0;
     int iRequestWantsKeepAlive = 0;
@@ -284,7 +774,7 @@ int write_headers(REQUEST_INFO* ri, char* buffer, size_t iOffset)
         
         if (!key || !value) continue;
 
-        if (strncasecmp(key, "Connection", 10) == 0)
+        if (strcasecmp(key, "Connection") == 0)
         {
             iFoundConnectionHeader = 1;
             if (strcasestr(value, "close"))      iRequestWantsClose = 1;
@@ -292,61 +782,155 @@ int write_headers(REQUEST_INFO* ri, char* buffer, size_t iOffset)
         }
     }
 
-    int iSendClose = 0;
-    if (iFoundConnectionHeader && iRequestWantsClose) iSendClose = 1;
-    else if (ri->m_szVersion && strcmp(ri->m_szVersion, "HTTP/1.0") == 0) // HTTP/1.0 defaults to close unless clinet explicityly asks keep-alive
-        { if (!iRequestWantsKeepAlive) iSendClose = 1; }
+    if (iFoundConnectionHeader && iRequestWantsClose) return false;
 
-    else iSendClose = 0; // HTTP/1.1 and above defauls to keep-alive
+    if (!ri->m_szVersion) return false;
+    if (strcmp(ri->m_szVersion, "HTTP/1.0") == 0) return iRequestWantsKeepAlive;
 
-    if (iSendClose) iWrote = snprintf(buffer + offset, iRemaning, "Connection: close\r\n");
-    else iWrote = snprintf(buffer + offset, iRemaning, "Connection: keep-alive\r\n");
+    return true;
+}
 
-    if (iWrote < 0 || (size_t)iWrote >= iRemaning) return -1;
-    offset += iWrote;
-    iRemaning -= iWrote;     
-    /*------------------------------------------------------------------------------------------*/
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int header_key_eq(const char *a, const char *b)
+{
+    /* Helper: case-insensitive header key compare (exact match) */
+    if (!a || !b) return 0;
+    size_t la = strlen(a);
+    size_t lb = strlen(b);
+    if (la != lb) return 0;
+    return (strncasecmp(a, b, la) == 0);
+}
 
-    /*4) Minimal Vary header if request advertised Accept-Encoding (helps caches)
-     * Only add when we actually compress; we don't compress here, but adding
-     * Vary unconditionally is not ideal. We'll add Vary only if client sent Accept-Encoding.
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+/* --------------------------- Main Functions --------------------------- */
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int write_status_line(const REQUEST_INFO* ri, char* buffer, size_t iOffset)
+{
+    if (!ri || !buffer) return -1;
+
+    /* decide status code:
+       - if parser succeeded, assume 200 OK (application can override by not using this helper)
+       - if parser failed, map parse result to an appropriate error status */
+    int status = (ri->m_parseResult == PARSE_SUCCESS) ?
+                 200 : parse_result_to_http_status(ri->m_parseResult);
+
+    /* the template starts with "version status reason\r\n", copied up to "Date: " */
+    response_clock_ready();
+
+    int iV = (ri->m_szVersion && strcmp(ri->m_szVersion, "HTTP/1.0") == 0) ? 0 : 1;
+    int iS = response_status_index(status);
+    if (iS < 0) return -1;
+
+    const RESPONSE_TEMPLATE* pT = &g_arrTemplates[iV][iS][1];
+    size_t iLineLen = pT->m_iDateAt - (sizeof("Date: ") - 1);
+
+    if (iOffset + iLineLen >= MAX_RESPONSE_HEADER_SIZE) return -1;
+    memcpy(buffer + iOffset, pT->m_szText, iLineLen);
+
+    /* return new offset (old + bytes written) */
+    return (int)(iOffset + iLineLen);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int write_headers(const REQUEST_INFO* ri, char* buffer, size_t iOffset)
+{
+    /*
+        Date, Server and Connection (cut from the 200 template, the rest of
+        a template does not depend on the status) and Vary when it applies.
     */
-    
-    /*-------------------------------------- Vary header --------------------------------------*/
-    for (size_t i = 0; i < ri->m_headers.count; ++i)
+
+    if (!ri || !buffer) return -1;
+
+    response_clock_ready();
+
+    int iV = (ri->m_szVersion && strcmp(ri->m_szVersion, "HTTP/1.0") == 0) ? 0 : 1;
+    const RESPONSE_TEMPLATE* pT = &g_arrTemplates[iV][0][response_wants_keep_alive(ri) ? 1 : 0];
+
+    size_t iStart = pT->m_iDateAt - (sizeof("Date: ") - 1);
+    size_t iLen   = pT->m_iLength - iStart;
+
+    if (iOffset + iLen >= MAX_RESPONSE_HEADER_SIZE) return -1;
+    memcpy(buffer + iOffset, pT->m_szText + iStart, iLen);
+
+    return write_vary_header(ri, buffer, iOffset + iLen);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int write_entity_headers
+(
+    const REQUEST_INFO* ri,
+    char* buffer,
+    size_t iOffset,
+    const char* szContentType,
+    size_t iContentLength,
+    time_t tLastModified
+)
+{
+    /*
+        Headers describing the body: Content-Type, Content-Length and,
+        when the body comes from a file, Last-Modified (same format as Date).
+    */
+
+    if (!ri || !buffer) return -1;
+
+    size_t offset = iOffset;
+    size_t iRemaning = (MAX_RESPONSE_HEADER_SIZE > iOffset) ? (MAX_RESPONSE_HEADER_SIZE - iOffset) : 0;
+    if (iRemaning == 0) return -1;
+
+    size_t iTypeLen = szContentType ? strlen(szContentType) : 0;
+    if (iTypeLen + 64 >= iRemaning) return -1;
+
+    char* p = buffer + offset;
+    if (szContentType)
     {
-        const char* key = ri->m_headers.entries[i].szKey;
-        if (!key) continue;
-        if (strncasecmp(key, "accept-encoding", 15) == 0)
-        {
-            iWrote = snprintf(buffer + offset, iRemaning, "Vary: Accept-Encoding\r\n");
-            if (iWrote < 0 || (size_t)iWrote >= iRemaning) return -1;
-            offset += (size_t)iWrote;
-            iRemaning -= (size_t)iWrote;
-            break;
-        }
+        memcpy(p, "Content-Type: ", 14);            p += 14;
+        memcpy(p, szContentType, iTypeLen);         p += iTypeLen;
+        memcpy(p, "\r\n", 2);                       p += 2;
     }
-    /*------------------------------------------------------------------------------------------*/
+    memcpy(p, "Content-Length: ", 16);              p += 16;
+    p += response_format_size(p, iContentLength);
+    memcpy(p, "\r\n", 2);                           p += 2;
+
+    offset    = (size_t)(p - buffer);
+    iRemaning = MAX_RESPONSE_HEADER_SIZE - offset;
 
-    return (size_t)offset;
+    if (tLastModified > 0)
+    {
+        struct tm gm;
+        char dateBuffer[64];
+
+        if (gmtime_r(&tLastModified, &gm) == NULL) return -1;
+        if (strftime(dateBuffer, sizeof(dateBuffer), "%a, %d %b %Y %H:%M:%S GMT", &gm) == 0)
+            return -1;
+
+        int iWrote = snprintf(buffer + offset, iRemaning, "Last-Modified: %s\r\n", dateBuffer);
+        if (iWrote < 0 || (size_t)iWrote >= iRemaning) return -1;
+        offset += (size_t)iWrote;
+    }
+
+    return (int)offset;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-int write_final_crlf(REQUEST_INFO* ri, char* buffer, size_t iOffset)
+int write_final_crlf(const REQUEST_INFO* ri, char* buffer, size_t iOffset)
 {
     if (!ri || !buffer) return -1;
-    const char* finalCRLF = "\r\n";
-    
-    int iRemaning = (MAX_RESPONSE_HEADER_SIZE > iOffset) ? MAX_RESPONSE_HEADER_SIZE - iOffset : 0;
-    if (iRemaning == 0) return -1;
+    if (iOffset + 2 >= MAX_RESPONSE_HEADER_SIZE) return -1;
 
-    int offset = iOffset;
-    int iWrote;
-    
-    iWrote = snprintf(buffer + offset, iRemaning, "%s", finalCRLF);
-    if (iWrote < 0 || (size_t)iWrote >= iRemaning) return -1;
-    offset += (size_t)iWrote;
+    buffer[iOffset]     = '\r';
+    buffer[iOffset + 1] = '\n';
 
-    return offset;
+    return (int)(iOffset + 2);
 }
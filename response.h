@@ -17,8 +17,43 @@
 
 #include "http.h"
 #include <stddef.h> // provides size_t
+#include <stdbool.h>
+#include <time.h>   // provides time_t
+#include "output_queue.h" // provides OUT_RELEASE_FN, OUT_SEGMENT, OUTPUT_QUEUE_MAX_SEGMENTS
                     
+#define RESPONSE_HEAD_CAPACITY 4096
+#define RESPONSE_MAX_SLICES    (OUTPUT_QUEUE_MAX_SEGMENTS - 1)   // one queue slot is the head
+
 typedef struct REQUEST_INFO REQUEST_INFO;
+typedef struct CONNECTION   CONNECTION;
+
+/*
+    One response under construction, normally on the caller's stack.
+    The head (status line, headers, blank line) is assembled in m_arrHead
+    and body slices are only recorded; response_finish() queues the head
+    and every slice back to back, so the output queue sends the whole
+    response with a single gathered sendmsg() (file ranges follow with
+    sendfile(), the head marked MSG_MORE so it does not leave alone).
+
+    Any failure along the way is remembered and reported by
+    response_finish(), which then also releases what the slices hold.
+*/
+typedef struct RESPONSE_BUILDER
+{
+    CONNECTION*         m_pConn;
+    const REQUEST_INFO* m_pRequest;
+    int                 m_iStatus;
+    bool                m_bFailed;
+    bool                m_bLengthWritten;   // Content-Length came with the caller's headers
+    bool                m_bHeadComplete;    // a prerendered slice carries the blank line itself
+
+    char                m_arrHead[RESPONSE_HEAD_CAPACITY];
+    size_t              m_iHeadLength;
+
+    OUT_SEGMENT         m_arrSlices[RESPONSE_MAX_SLICES];
+    size_t              m_iSliceCount;
+    size_t              m_iBodyLength;
+} RESPONSE_BUILDER;
 
 typedef enum
 {
@@ -28,13 +63,48 @@ typedef enum
     RESPONSE_FAIL_NO_CONTENT,
 } RESPONSE_RESULT;
 /* ---------------------------------- Main Functions --------------------------------------- */
-int initialize_response_header_buffer(REQUEST_INFO* ri_requestInfo);
-int write_status_line                (REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset);
-int write_headers                    (REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset);
-int write_final_crlf                 (REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset);
+int write_status_line                (const REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset);
+int write_headers                    (const REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset);
+int write_entity_headers             (const REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset,
+                                      const char* szContentType, size_t iContentLength, time_t tLastModified);
+int write_final_crlf                 (const REQUEST_INFO* ri_requestInfo, char* buffer, size_t iOffset);
 
 /* ---------------------------------- Helper Functions --------------------------------------- */
-void send_parse_error_response(int iClientFd, const REQUEST_INFO* ri);
-void send_simple_response     (int iClientFd, const REQUEST_INFO* ri, int iStatus, const char* szReasonPhrase, const char* pBody, size_t bodyLen);
+// both only queue the response on the connection, the worker flushes it
+bool send_parse_error_response(CONNECTION* pConn, const REQUEST_INFO* ri);
+bool send_simple_response     (CONNECTION* pConn, const REQUEST_INFO* ri, int iStatus, const char* szReasonPhrase, const char* pBody, size_t bodyLen);
+bool send_content_response    (CONNECTION* pConn, const REQUEST_INFO* ri, int iStatus, const char* szReasonPhrase,
+                               const char* szContentType, const char* pBody, size_t bodyLen); // NULL type: no Content-Type header
+bool send_file_response       (CONNECTION* pConn, const REQUEST_INFO* ri, const char* szContentType,
+                               int iFileFd, size_t iFileSize, time_t tLastModified); // takes ownership of iFileFd
+bool send_prebuilt_file_response(CONNECTION* pConn, const REQUEST_INFO* ri, const char* szEntityHeaders, size_t iEntityHeadersLen,
+                                 int iFileFd, size_t iFileSize, OUT_RELEASE_FN pfnRelease, void* pReleaseCtx); // shared iFileFd
+bool send_prerendered_response (CONNECTION* pConn, const REQUEST_INFO* ri, const char* pRendered, size_t iRenderedLen,
+                                OUT_RELEASE_FN pfnRelease, void* pReleaseCtx); // pRendered = entity headers + CRLF + body
+bool response_wants_keep_alive(const REQUEST_INFO* ri); // same decision as the Connection header written in responses
+void response_clock_tick(void); // refreshes the cached Date (at most once per second), called by the event loop
+
+/* ---------------------------------- Response Builder --------------------------------------- */
+void response_begin           (RESPONSE_BUILDER* pB, CONNECTION* pConn, const REQUEST_INFO* ri, int iStatus, const char* szReasonPhrase);
+void response_add_header      (RESPONSE_BUILDER* pB, const char* szName, const char* szValue);
+void response_add_raw_headers (RESPONSE_BUILDER* pB, const char* pLines, size_t iLength, bool bHasLength); // CRLF terminated lines
+void response_add_vary        (RESPONSE_BUILDER* pB); // Vary: Accept-Encoding when the request sent one
+void response_add_body        (RESPONSE_BUILDER* pB, const void* pData, size_t iLength); // copied into the arena
+void response_add_body_shared (RESPONSE_BUILDER* pB, const char* pData, size_t iLength, OUT_RELEASE_FN pfnRelease, void* pReleaseCtx);
+void response_add_prerendered (RESPONSE_BUILDER* pB, const char* pData, size_t iLength, OUT_RELEASE_FN pfnRelease, void* pReleaseCtx);
+void response_add_file        (RESPONSE_BUILDER* pB, int iFileFd, off_t iOffset, size_t iLength); // takes ownership of iFileFd
+void response_add_file_shared (RESPONSE_BUILDER* pB, int iFileFd, off_t iOffset, size_t iLength, OUT_RELEASE_FN pfnRelease, void* pReleaseCtx);
+bool response_finish          (RESPONSE_BUILDER* pB);
 
 #endif
+
+/*
+
+response_begin()           -> status line, Date, Server and Connection from the pre-rendered template
+response_add_*()           -> appends a header to the head or records a body slice, nothing is queued yet
+response_add_prerendered() -> entity headers + blank line + body rendered once (cache entries), the builder
+                              then writes neither Content-Length nor the blank line
+response_finish()          -> adds Content-Length (sum of the slices) and the blank line, then queues the head
+                              and the slices so they leave in one gathered send; on failure every slice is released
+
+*/
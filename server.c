@@ -4,11 +4,21 @@
     Author: Solomon
 */
 
+#define _GNU_SOURCE     // enables sched_setaffinity(), CPU_SET() and friends
+
 #include <errno.h>      // provides EINTR macro
+#include <sched.h>      // provides sched_getaffinity(), sched_setaffinity(), cpu_set_t
+#include <sys/syscall.h>// provides SYS_set_mempolicy
+#include <linux/mempolicy.h> // provides MPOL_LOCAL
 #include "server.h"     // provides SERVER struct
+#include "metrics.h"    // provides metrics_attach(), metrics_worker_restarted()
+#include "access_log.h" // provides access_log_attach(), access_log_spawn_writer(), access_log_stop_writer()
+#include "health.h"     // provides health_is_checker(), health_spawn_checker(), health_stop_checker()
+#include "proxy_cache.h" // provides proxy_cache_attach()
 #include <stdbool.h>
 #include <signal.h>     // provides kill()
-#include <sys/socket.h> // provides socket(), bind(), listen()
+#include <sys/socket.h> // provides socket(), bind(), listen(), SO_REUSEPORT, SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h> // provides struct sock_filter, struct sock_fprog, SKF_AD_CPU
 #include <stdio.h>      // provides perror()
 #include <fcntl.h>      // provides fcntl()
 #include <string.h>     // provides memset()                        
@@ -44,57 +54,233 @@ SERVER server_create
     s_Server.m_iBacklog     = iBacklog;
     s_Server.m_iWorkerCount = iWorkerCount;
     s_Server.m_iListenFd    = -1;
+    s_Server.m_iAcceptBatch = DEFAULT_ACCEPT_BATCH;
+
+    s_Server.m_timeouts.m_uHeaderMs    = DEFAULT_HEADER_TIMEOUT_MS;
+    s_Server.m_timeouts.m_uBodyMs      = DEFAULT_BODY_TIMEOUT_MS;
+    s_Server.m_timeouts.m_uKeepAliveMs = DEFAULT_KEEPALIVE_TIMEOUT_MS;
+    s_Server.m_timeouts.m_uWriteMs     = DEFAULT_WRITE_TIMEOUT_MS;
+
+    for (int iX = 0; iX < MAX_WORKERS; ++iX)
+    {
+        s_Server.m_arrListenFds[iX]  = -1;
+        s_Server.m_arrWorkerCpus[iX] = -1;
+    }
 
     return s_Server;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-int server_setup_listener(SERVER* s_pServer)
+static int server_open_listener(SERVER* s_pServer, bool bReusePort)
 {
-    s_pServer->m_iListenFd = socket(
+    int iFd = socket(
         s_pServer->m_iDomain,
         s_pServer->m_iService,
         s_pServer->m_iProtocol
     );
 
-    if (s_pServer->m_iListenFd < 0) return -1;
+    if (iFd < 0) return -1;
 
     // 1) Get the current flag of the socket
-    int iFlags = fcntl(s_pServer->m_iListenFd, F_GETFL, 0);
-    if (iFlags < 0) return -1;
+    int iFlags = fcntl(iFd, F_GETFL, 0);
 
     // 2) Add the non blocking Macro into the socket
-    if (fcntl(s_pServer->m_iListenFd, F_SETFL, iFlags | O_NONBLOCK) < 0)
+    if (iFlags < 0 || fcntl(iFd, F_SETFL, iFlags | O_NONBLOCK) < 0)
+    {
+        close(iFd);
         return -1;
+    }
 
     // the server can bind to the same IP:port even if the previous connection 
     // on that port is in TIME_WAIT state.
     int iOpt = 1;
-    if (setsockopt(
-            s_pServer->m_iListenFd,
-            SOL_SOCKET,
-            SO_REUSEADDR,
-            &iOpt,
-            sizeof(iOpt)) < 0)
+    if (setsockopt(iFd, SOL_SOCKET, SO_REUSEADDR, &iOpt, sizeof(iOpt)) < 0)
+    {
+        close(iFd);
         return -1;
-    
+    }
+
+    // every socket of the group must set it before bind()
+    if (bReusePort && setsockopt(iFd, SOL_SOCKET, SO_REUSEPORT, &iOpt, sizeof(iOpt)) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+
     // bind the socket to an ip address and a port number
-    if (bind(
-            s_pServer->m_iListenFd,
-            (struct sockaddr*)&s_pServer->m_si_address,
-            sizeof(s_pServer->m_si_address)) < 0)
+    // then start listening to the socket for any incoming requests
+    if (bind(iFd, (struct sockaddr*)&s_pServer->m_si_address, sizeof(s_pServer->m_si_address)) < 0 ||
+        listen(iFd, s_pServer->m_iBacklog) < 0)
+    {
+        close(iFd);
         return -1;
+    }
+
+    return iFd;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int server_attach_cpu_steering(SERVER* s_pServer)
+{
+    /*
+        Sockets join the reuseport group in the order they start listening,
+        so socket i belongs to worker slot i. The program picks the socket
+        by the CPU that received the packet: connections stay on the CPU
+        (and with pinned workers on the worker) that took the interrupt.
+    */
+
+    struct sock_filter arrCode[] = {
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },  // A = cpu
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, (uint32_t)s_pServer->m_iWorkerCount },  // A %= workers
+        { BPF_RET | BPF_A,             0, 0, 0 },                                    // socket index
+    };
+
+    struct sock_fprog prog = {
+        .len    = sizeof(arrCode) / sizeof(arrCode[0]),
+        .filter = arrCode,
+    };
+
+    // attaching to one socket programs the whole group
+    return setsockopt(s_pServer->m_arrListenFds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int server_setup_listener(SERVER* s_pServer)
+{
+    if (!s_pServer) return -1;
+
+    if (!s_pServer->m_bReusePort)
+    {
+        s_pServer->m_iListenFd = server_open_listener(s_pServer, false);
+        return s_pServer->m_iListenFd < 0 ? -1 : 0;
+    }
+
+    /*
+        The sockets are opened here by the master and not inside each
+        worker: a respawned worker inherits the socket of the slot it
+        replaces, so the connections already queued on it are not reset and
+        the group order the CPU steering relies on never changes.
+    */
+
+    if (s_pServer->m_iWorkerCount <= 0 || s_pServer->m_iWorkerCount > MAX_WORKERS) return -1;
+
+    for (int iX = 0; iX < s_pServer->m_iWorkerCount; ++iX)
+    {
+        s_pServer->m_arrListenFds[iX] = server_open_listener(s_pServer, true);
+        if (s_pServer->m_arrListenFds[iX] < 0)
+        {
+            perror("SO_REUSEPORT listener");
+            return -1;
+        }
+
+        // the kernel prefers the group member whose incoming cpu matches the
+        // cpu handling the SYN, i.e. the worker pinned to that cpu
+        int iCpu = s_pServer->m_arrWorkerCpus[iX];
+        if (iCpu >= 0)
+            setsockopt(s_pServer->m_arrListenFds[iX], SOL_SOCKET, SO_INCOMING_CPU, &iCpu, sizeof(iCpu));
+    }
+
+    if (s_pServer->m_bReusePortCpuSteering && server_attach_cpu_steering(s_pServer) < 0)
+    {
+        // not fatal, the kernel falls back to hashing the 4-tuple
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int server_plan_workers(SERVER* s_pServer)
+{
+    /*
+        Usable cpus are the ones this process may run on (taskset, cgroup
+        cpusets), not every cpu of the machine. An automatic worker count
+        gets one worker per usable cpu; with pinning, slot i gets the i-th
+        usable cpu (wrapping around when there are more workers than cpus).
+    */
+
+    if (!s_pServer) return -1;
 
-    // start listening to the socket for any incoming requests
-    if (listen(
-            s_pServer->m_iListenFd,
-            s_pServer->m_iBacklog) < 0)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) < 0)
+    {
+        perror("sched_getaffinity");
         return -1;
+    }
+
+    int arrCpus[CPU_SETSIZE];
+    int iCpuCount = 0;
+    for (int iCpu = 0; iCpu < CPU_SETSIZE; ++iCpu)
+    {
+        if (CPU_ISSET(iCpu, &cpuSet))
+            arrCpus[iCpuCount++] = iCpu;
+    }
+    if (iCpuCount == 0) return -1;
+
+    if (s_pServer->m_iWorkerCount <= 0)
+        s_pServer->m_iWorkerCount = iCpuCount < MAX_WORKERS ? iCpuCount : MAX_WORKERS;
+
+    if (s_pServer->m_iWorkerCount > MAX_WORKERS) return -1;
+
+    for (int iX = 0; iX < s_pServer->m_iWorkerCount; ++iX)
+        s_pServer->m_arrWorkerCpus[iX] = s_pServer->m_bPinWorkers ? arrCpus[iX % iCpuCount] : -1;
 
     return 0;
 }
 
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void server_place_worker(SERVER* s_pServer, int iWorkerIndex)
+{
+    /*
+        Runs in the child before worker_run() allocates anything.
+        Pinning stops the scheduler from migrating the worker (cold caches,
+        remote memory); MPOL_LOCAL makes every later allocation come from
+        the NUMA node of that cpu even if the master was started under an
+        interleave / bind policy. Failures only cost locality, so they are
+        reported and ignored.
+
+        Steering the NIC's RX queue interrupts to the same cpus is done
+        outside the server (/proc/irq/<n>/smp_affinity or irqbalance hints),
+        together with --reuseport-cpu the packet, the socket and the worker
+        then share one cpu.
+    */
+
+    int iCpu = s_pServer->m_arrWorkerCpus[iWorkerIndex];
+    if (iCpu < 0) return;
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(iCpu, &cpuSet);
+
+    if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) < 0)
+    {
+        perror("sched_setaffinity");
+        return;
+    }
+
+    // no libnuma needed for a single call
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0)
+        perror("set_mempolicy");
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void server_worker_main(SERVER* s_pServer, int iWorkerIndex)
+{
+    server_place_worker(s_pServer, iWorkerIndex);
+    metrics_attach(iWorkerIndex);
+    access_log_attach(iWorkerIndex);
+    proxy_cache_attach(iWorkerIndex);
+    worker_run(s_pServer, iWorkerIndex);
+    _exit(0);
+}
+
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
 int server_spawn_workers(SERVER* s_pServer)
@@ -107,10 +293,7 @@ int server_spawn_workers(SERVER* s_pServer)
         if (pid < 0) return -1;
 
         if (pid == 0)
-        {
-            worker_run(s_pServer);
-            _exit(0);
-        }
+            server_worker_main(s_pServer, (int)iX);
 
         s_pServer->m_arrWorkers[iX] = pid;
     }
@@ -132,16 +315,28 @@ void server_master_loop(SERVER* s_pServer)
 
        while ((iDeadPid = waitpid(-1, &iStatus, WNOHANG)) > 0)
        {
+            // the log writer resumes from the tails it left in the rings
+            if (access_log_is_writer(iDeadPid))
+            {
+                access_log_spawn_writer();
+                continue;
+            }
+
+            // the checker starts over with every upstream's probe streak at zero
+            if (health_is_checker(iDeadPid))
+            {
+                health_spawn_checker();
+                continue;
+            }
+
             for (size_t iX = 0; iX < s_pServer->m_iWorkerCount; ++iX)
             {
                 if (s_pServer->m_arrWorkers[iX] == iDeadPid)
                 {
+                    metrics_worker_restarted();
                     pid_t pid = fork();
                     if (pid == 0)
-                    {
-                        worker_run(s_pServer);
-                        _exit(0);
-                    }
+                        server_worker_main(s_pServer, (int)iX);
                     s_pServer->m_arrWorkers[iX] = pid;
                     break;
                 }
@@ -179,6 +374,16 @@ void server_shutdown(SERVER* s_pServer)
         }
     }
 
+    // every worker is gone, the writer drains what they logged and exits
+    access_log_stop_writer();
+    health_stop_checker();
+
     if (s_pServer->m_iListenFd >= 0)
         close(s_pServer->m_iListenFd);
+
+    for (int iX = 0; iX < MAX_WORKERS; ++iX)
+    {
+        if (s_pServer->m_arrListenFds[iX] >= 0)
+            close(s_pServer->m_arrListenFds[iX]);
+    }
 }
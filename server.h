@@ -11,8 +11,16 @@
 #include <netinet/in.h> // struct sockaddr_in
 #include <stdbool.h>
 #include "worker.h"
+#include "connection.h" // provides CONN_TIMEOUTS
 
-#define MAX_WORKERS 32
+#define MAX_WORKERS 256
+#define DEFAULT_ACCEPT_BATCH 64   // connections accepted per listener wakeup
+
+// per connection deadlines, see CONN_TIMER_KIND
+#define DEFAULT_HEADER_TIMEOUT_MS    10000
+#define DEFAULT_BODY_TIMEOUT_MS      30000
+#define DEFAULT_KEEPALIVE_TIMEOUT_MS 15000
+#define DEFAULT_WRITE_TIMEOUT_MS     30000
 
 /*
 * @brief Represents a server configuration
@@ -48,9 +56,25 @@ typedef struct SERVER
     int                m_iBacklog;
 
     // listening socket
-    int                m_iListenFd;
+    int                m_iListenFd;                   // shared by all workers (default mode)
     struct sockaddr_in m_si_address;
 
+    // SO_REUSEPORT mode: one listening socket per worker slot, the kernel
+    // spreads new connections across them instead of waking every worker
+    bool               m_bReusePort;
+    bool               m_bReusePortCpuSteering;       // classic BPF: socket index = cpu % worker count
+    int                m_arrListenFds[MAX_WORKERS];
+
+    int                m_iAcceptBatch;                // accept4() calls per listener wakeup
+
+    bool               m_bUseIoUring;                 // workers run the io_uring loop (epoll if unsupported)
+
+    CONN_TIMEOUTS      m_timeouts;                    // header / body / keep-alive / write stall
+
+    // placement: worker slot i runs on m_arrWorkerCpus[i] when pinning is on
+    bool               m_bPinWorkers;
+    int                m_arrWorkerCpus[MAX_WORKERS];  // -1 = not pinned
+
     // worker management
     int                m_iWorkerCount;
     pid_t              m_arrWorkers[MAX_WORKERS];
@@ -68,7 +92,8 @@ SERVER server_create
     int           iBacklog,
     int           iWorkerCount
 );
-int  server_setup_listener(SERVER* s_pServer); // create socket, bind, listen, set non-blocking 
+int  server_plan_workers  (SERVER* s_pServer); // resolve an automatic worker count (0) and the cpu of each slot
+int  server_setup_listener(SERVER* s_pServer); // create socket(s), bind, listen, set non-blocking 
 int  server_spawn_workers (SERVER* s_pServer); // fork worker 
 void server_master_loop   (SERVER* s_pServer);
 void server_shutdown      (SERVER* s_pServer);
@@ -78,10 +103,14 @@ void server_shutdown      (SERVER* s_pServer);
 /*
  
 server_create()         -> creates and fills most values of the SERVER struct variable
-server_setup_listener() -> attaches a listening socket to the listening socket variable of the SERVER and sets it to non blocking and starts listening to it
-server_spawn_workers()  -> spawns N number of workers that will respond to the requests on the listening socket
+server_plan_workers()   -> sizes the worker count to the usable cpus when it is 0 and, with pinning, assigns one cpu per worker slot
+server_setup_listener() -> attaches a listening socket to the listening socket variable of the SERVER and sets it to non blocking and starts listening to it,
+                           in SO_REUSEPORT mode one socket per worker slot (kept by the master so a respawned worker takes over the same socket)
+server_spawn_workers()  -> spawns N number of workers that will respond to the requests on the listening socket,
+                           each one pinned to its cpu (and local NUMA node) first when pinning is on
 server_master_loop()    -> respawns any worker if it dies and replaces it pid in the SERVER struct's variable 
-server_shutdown()       -> kills all the workers and shuts down the listening socket
+server_shutdown()       -> kills all the workers, then stops the access log writer once it drained their records,
+                           and shuts down the listening socket
 
 */
 
@@ -4,68 +4,170 @@
     Author: Solomon
 */
 
+#define _GNU_SOURCE       // enables splice(), SPLICE_F_* flags
+
 #include <sys/socket.h>   // provoides send()
-#include <fcntl.h>        // provides open(), O_RDONLY
-#include <unistd.h>       // provides close(), read(), write()
+#include <sys/sendfile.h> // provides sendfile()
+#include <fcntl.h>        // provides open(), O_RDONLY, splice(), pipe2()
+#include <unistd.h>       // provides close(), read()
 #include <string.h>       // provides strcmp(), strlen(), strcpy(), strcat()
 #include <stdio.h>        // provides printf()
-#include <stdlib.h>       // provides free(), calloc()
+#include <stdlib.h>       // provides realpath()
 #include <sys/stat.h>     // provides struct stat;
 #include <stdbool.h>
 #include <linux/limits.h> // provides PATH_MAX
 #include <errno.h>        // provides errno
 #include <inttypes.h>     // provides sszie_t
 #include "static_files.h"
-#include "data_structures/stack.h"
+#include "arena.h"        // provides arenaAlloc()
+#include "connection.h"   // provides CONNECTION
+#include "response.h"     // provides send_file_response(), send_simple_response()
+#include "file_cache.h"   // provides file_cache_lookup(), file_cache_insert()
 
 #define ROOT "./www"
 #define ROOT_LENGTH 5
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-void serverFile(const char* szURL, int socketFd)
+static bool send_cached_file_response(CONNECTION* pConn, const REQUEST_INFO* ri, FILE_CACHE_ENTRY* pEntry)
+{
+    // the queued body holds the reference taken by lookup / insert
+    if (pEntry->m_pRendered)
+        return send_prerendered_response(
+            pConn, ri,
+            pEntry->m_pRendered, pEntry->m_iRenderedLen,
+            file_cache_release, pEntry
+        );
+
+    return send_prebuilt_file_response(
+        pConn, ri,
+        pEntry->m_szEntityHeaders, pEntry->m_iEntityHeadersLen,
+        pEntry->m_iFd, (size_t)pEntry->m_stat.st_size,
+        file_cache_release, pEntry
+    );
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void serverFile(CONNECTION* pConn, const REQUEST_INFO* ri)
 {
     /*
-        Entry point for serving a static file over a socket
-        Coordinates path validation, access checks, and streaming
+        Entry point for serving a static file over a connection
+        Coordinates path validation, access checks, and queues a complete
+        response (headers from response.c, body as a file range)
+        Repeat requests are answered from the worker's file cache without
+        any filesystem syscall; misses do the full check and fill it
+        Path scratch memory comes from the request arena
     */
 
-    if (!isSafePath(szURL)) return;
+    if (!pConn || !ri || !ri->m_szPath) return;
+
+    // the query string is not part of the file name
+    const char* szURL = ri->m_szPath;
+    const char* szQuery = strpbrk(szURL, "?#");
+    if (szQuery)
+    {
+        szURL = arenaStrndup(&pConn->m_arena, szURL, (size_t)(szQuery - szURL));
+        if (!szURL)
+        {
+            sendErrorResponse(pConn, ri, 500);
+            return;
+        }
+    }
+
+    // anything that does not resolve inside ROOT is reported as missing,
+    // a traversal attempt learns nothing about what exists outside
+    const char* szNormalized = decodeURLPath(szURL, &pConn->m_arena);
+    if (!szNormalized)
+    {
+        sendErrorResponse(pConn, ri, 404);
+        return;
+    }
+
+    char* szFilePath = URLToFilePath(szNormalized, &pConn->m_arena);
+    if (!szFilePath)
+    {
+        sendErrorResponse(pConn, ri, 500);
+        return;
+    }
+
+    // cache key is the URL path of the file actually served ("/" -> "/index.html")
+    const char* szKey = szFilePath + ROOT_LENGTH;
+
+    FILE_CACHE_ENTRY* pEntry = file_cache_lookup(szKey);
+    if (pEntry)
+    {
+        if (!send_cached_file_response(pConn, ri, pEntry))
+            pConn->m_bCloseAfterFlush = true;
+        return;
+    }
 
-    char* szBuffer = URLToFilePath(szURL);
-    if (!szBuffer) return;
+    if (!isInsideRoot(szFilePath))
+    {
+        sendErrorResponse(pConn, ri, 404);
+        return;
+    }
 
     struct stat stStat;
-    int iStatus = validateFileAccess(szBuffer, &stStat);
+    int iStatus = validateFileAccess(szFilePath, &stStat);
     if (iStatus != 200)
     {
-        sendErrorResponse(socketFd, iStatus);
-        free(szBuffer);
+        sendErrorResponse(pConn, ri, iStatus);
         return;
     }
 
-    int iFileFd = openFileReadOnly(szBuffer);
+    int iFileFd = openFileReadOnly(szFilePath);
     if (iFileFd < 0)
     {
-        sendErrorResponse(socketFd, 500);
-        free(szBuffer);
+        sendErrorResponse(pConn, ri, 500);
         return;
     }
 
-    if (!sendFileToSocket(socketFd, iFileFd, stStat.st_size))
-        sendErrorResponse(socketFd, 500);
+    // stat again through the descriptor, the path may have changed in between
+    if (fstat(iFileFd, &stStat) != 0 || !S_ISREG(stStat.st_mode))
+    {
+        close(iFileFd);
+        sendErrorResponse(pConn, ri, 500);
+        return;
+    }
+
+    const char* szMIMEType = getMIMEType(szFilePath);
+
+    char szEntityHeaders[512];
+    int iEntityLen = write_entity_headers(ri, szEntityHeaders, 0, szMIMEType,
+                                          (size_t)stStat.st_size, stStat.st_mtime);
+    if (iEntityLen > 0)
+        pEntry = file_cache_insert(szKey, iFileFd, &stStat, szMIMEType, szEntityHeaders, (size_t)iEntityLen);
+
+    bool bQueued;
+    if (pEntry)
+        bQueued = send_cached_file_response(pConn, ri, pEntry);
+    else // cache disabled or full of allocation failures, the queue owns the descriptor
+        bQueued = send_file_response(pConn, ri, szMIMEType, iFileFd, (size_t)stStat.st_size, stStat.st_mtime);
 
-    close(iFileFd);
-    free(szBuffer);
+    if (!bQueued) pConn->m_bCloseAfterFlush = true;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-char* URLToFilePath(const char* szURL)
+bool initStaticFiles(void)
+{
+    /*
+        Per-worker setup, called after fork
+        Without inotify the file cache stays off and every request
+        goes through the full path checks
+    */
+
+    return file_cache_init(ROOT, FILE_CACHE_MAX_ENTRIES, FILE_CACHE_SMALL_FILE_MAX);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+char* URLToFilePath(const char* szURL, Arena* pArena)
 {
     /*
         Converts a URL path into a filesystem path under ROOT
-        Dynamically allocates and resizes buffer as needed
+        The buffer is carved from the request arena
     */
 
     if (strcmp(szURL, "/") == 0)
@@ -73,25 +175,12 @@ char* URLToFilePath(const char* szURL)
 
     size_t iRootLen = strlen(ROOT);
     size_t iURLLen  = strlen(szURL);
-    size_t iBufferSize = 128;
 
-    char* szBuffer = calloc(iBufferSize, 1);
+    char* szBuffer = arenaAlloc(pArena, iRootLen + iURLLen + 1);
     if (!szBuffer) return NULL;
 
-    while (iRootLen + iURLLen + 1 > iBufferSize)
-    {
-        iBufferSize *= 2;
-        char* szTemp = realloc(szBuffer, iBufferSize);
-        if (!szTemp)
-        {
-            free(szBuffer);
-            return NULL;
-        }
-        szBuffer = szTemp;
-    }
-
-    strcpy(szBuffer, ROOT);
-    strcat(szBuffer, szURL);
+    memcpy(szBuffer, ROOT, iRootLen);
+    memcpy(szBuffer + iRootLen, szURL, iURLLen + 1);
 
     return szBuffer;
 }
@@ -160,228 +249,174 @@ const char* getMIMEType(const char* szFilePath)
         Returns static string literals for HTTP headers
     */
 
-    int iDotIndex = -1;
-    int iLen = strlen(szFilePath);
-
-    for (int iX = iLen - 1; iX >= 0; iX--)
-    {
-        if (szFilePath[iX] == '.')
-        {
-            iDotIndex = iX;
-            break;
-        }
-    }
-
-    if (iDotIndex == -1)
-        return "application/octet-stream";
-
-    int iExtLen = iLen - iDotIndex - 1;
-    if (iExtLen <= 0)
-        return "application/octet-stream";
-
-    char* szExt = calloc(iExtLen + 1, 1);
-    if (!szExt)
+    const char* szDot = strrchr(szFilePath, '.');
+    if (!szDot || szDot[1] == '\0')
         return "application/octet-stream";
 
-    memcpy(szExt, szFilePath + iDotIndex + 1, iExtLen);
-
-    if (strcmp(szExt, "html") == 0 || strcmp(szExt, "htm") == 0)
-    {
-        free(szExt);
-        return "text/html";
-    }
-    if (strcmp(szExt, "css") == 0)
-    {
-        free(szExt);
-        return "text/css";
-    }
-    if (strcmp(szExt, "js") == 0)
-    {
-        free(szExt);
-        return "application/javascript";
-    }
-    if (strcmp(szExt, "png") == 0)
-    {
-        free(szExt);
-        return "image/png";
-    }
-    if (strcmp(szExt, "jpg") == 0 || strcmp(szExt, "jpeg") == 0)
-    {
-        free(szExt);
-        return "image/jpeg";
-    }
-    if (strcmp(szExt, "gif") == 0)
-    {
-        free(szExt);
-        return "image/gif";
-    }
-    if (strcmp(szExt, "svg") == 0)
-    {
-        free(szExt);
-        return "image/svg+xml";
-    }
-    if (strcmp(szExt, "ico") == 0)
-    {
-        free(szExt);
-        return "image/x-icon";
-    }
-    if (strcmp(szExt, "json") == 0)
-    {
-        free(szExt);
-        return "application/json";
-    }
-    if (strcmp(szExt, "txt") == 0)
-    {
-        free(szExt);
-        return "text/plain";
-    }
-    if (strcmp(szExt, "pdf") == 0)
-    {
-        free(szExt);
-        return "application/pdf";
-    }
+    // the extension is compared in place, no copy is needed
+    const char* szExt = szDot + 1;
+
+    if (strcmp(szExt, "html") == 0 || strcmp(szExt, "htm") == 0) return "text/html";
+    if (strcmp(szExt, "css") == 0)                                return "text/css";
+    if (strcmp(szExt, "js") == 0)                                 return "application/javascript";
+    if (strcmp(szExt, "png") == 0)                                return "image/png";
+    if (strcmp(szExt, "jpg") == 0 || strcmp(szExt, "jpeg") == 0)  return "image/jpeg";
+    if (strcmp(szExt, "gif") == 0)                                return "image/gif";
+    if (strcmp(szExt, "svg") == 0)                                return "image/svg+xml";
+    if (strcmp(szExt, "ico") == 0)                                return "image/x-icon";
+    if (strcmp(szExt, "json") == 0)                               return "application/json";
+    if (strcmp(szExt, "txt") == 0)                                return "text/plain";
+    if (strcmp(szExt, "pdf") == 0)                                return "application/pdf";
 
-    free(szExt);
     return "application/octet-stream";
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-bool isSafePath(const char* szURL)
+const char* decodeURLPath(const char* szURL, Arena* pArena)
 {
     /*
-        Validates and normalizes a URL path to prevent traversal
-        Ensures resolved filesystem path stays within ROOT
+        Percent-decodes and normalizes a URL path without touching the
+        filesystem, so the result can be used as a cache key
+        Returns NULL for malformed paths and root escape attempts
     */
 
-    if (!szURL || szURL[0] != '/') return false;
+    if (!szURL || szURL[0] != '/') return NULL;
 
     size_t iLen = strlen(szURL);
-    char* szDecoded = calloc(iLen + 1, 1);
-    if (!szDecoded) return false;
+    char* szDecoded = arenaAlloc(pArena, iLen + 1);
+    if (!szDecoded) return NULL;
 
     size_t iOut = 0;
 
     for (size_t iX = 0; iX < iLen; iX++)
     {
-        if (szURL[iX] == '\\') { free(szDecoded); return false; }
-        if ((unsigned char)szURL[iX] < 0x20 || szURL[iX] == 0x7F)
-        {
-            free(szDecoded);
-            return false;
-        }
+        if (szURL[iX] == '\\') return NULL;
+        if ((unsigned char)szURL[iX] < 0x20 || szURL[iX] == 0x7F) return NULL;
 
         if (szURL[iX] == '%' && iX + 2 < iLen &&
             isHex(szURL[iX + 1]) && isHex(szURL[iX + 2]))
         {
-            unsigned char iHi = isHex(szURL[iX + 1]);
-            unsigned char iLo = isHex(szURL[iX + 2]);
-            szDecoded[iOut++] = (iHi << 4) | iLo;
+            unsigned char iHi = hexValue(szURL[iX + 1]);
+            unsigned char iLo = hexValue(szURL[iX + 2]);
+            szDecoded[iOut++] = (char)((iHi << 4) | iLo);
             iX += 2;
             continue;
         }
 
-        if (szURL[iX] == '%') { free(szDecoded); return false; }
+        if (szURL[iX] == '%') return NULL;
         szDecoded[iOut++] = szURL[iX];
     }
 
     szDecoded[iOut] = '\0';
 
-    char* szNormalized = normalizePath(szDecoded);
-    free(szDecoded);
-    if (!szNormalized) return false;
+    // a decoded NUL or control byte would cut the path short
+    if (strlen(szDecoded) != iOut) return NULL;
 
-    char* szFullPath = calloc(strlen(szNormalized) + ROOT_LENGTH + 1, 1);
-    if (!szFullPath)
-    {
-        free(szNormalized);
-        return false;
-    }
+    return normalizePath(szDecoded, pArena);
+}
 
-    strcpy(szFullPath, ROOT);
-    strcat(szFullPath, szNormalized);
-    free(szNormalized);
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool isInsideRoot(const char* szFilePath)
+{
+    /*
+        Resolves symlinks with realpath() and checks that the file
+        really lives below ROOT
+    */
 
     char szResolved[PATH_MAX];
-    if (!realpath(szFullPath, szResolved))
-    {
-        free(szFullPath);
-        return false;
-    }
+    if (!realpath(szFilePath, szResolved)) return false;
 
     static char szResolvedRoot[PATH_MAX];
     static bool bRootResolved = false;
 
     if (!bRootResolved)
     {
-        if (!realpath(ROOT, szResolvedRoot))
-        {
-            free(szFullPath);
-            return false;
-        }
+        if (!realpath(ROOT, szResolvedRoot)) return false;
         bRootResolved = true;
     }
 
     size_t iRootLen = strlen(szResolvedRoot);
-    bool bOk = strncmp(szResolved, szResolvedRoot, iRootLen) == 0 &&
-               (szResolved[iRootLen] == '/' || szResolved[iRootLen] == '\0');
+    return strncmp(szResolved, szResolvedRoot, iRootLen) == 0 &&
+           (szResolved[iRootLen] == '/' || szResolved[iRootLen] == '\0');
+}
 
-    free(szFullPath);
-    return bOk;
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool isSafePath(const char* szURL, Arena* pArena, const char** pszNormalized)
+{
+    /*
+        Validates and normalizes a URL path to prevent traversal
+        Ensures resolved filesystem path stays within ROOT
+        Scratch strings come from the request arena
+        On success *pszNormalized (if given) is the decoded, normalized URL path
+    */
+
+    const char* szNormalized = decodeURLPath(szURL, pArena);
+    if (!szNormalized) return false;
+
+    size_t iNormalizedLen = strlen(szNormalized);
+    char* szFullPath = arenaAlloc(pArena, iNormalizedLen + ROOT_LENGTH + 1);
+    if (!szFullPath) return false;
+
+    memcpy(szFullPath, ROOT, ROOT_LENGTH);
+    memcpy(szFullPath + ROOT_LENGTH, szNormalized, iNormalizedLen + 1);
+
+    if (!isInsideRoot(szFullPath)) return false;
+
+    if (pszNormalized) *pszNormalized = szNormalized;
+    return true;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-char* normalizePath(char* szPath)
+char* normalizePath(char* szPath, Arena* pArena)
 {
     /*
-        Normalizes path segments using a stack-based approach
-        Resolves '.', '..' and rejects root escape attempts
+        Normalizes path segments in a single pass
+        '..' rewinds the output to the previous '/', which is what
+        popping the last segment off a stack amounts to
+        Rejects root escape attempts
     */
 
-    Stack stStack;
-    initialize(&stStack, 20, sizeof(char*));
+    size_t iLen = strlen(szPath);
+    char* szBuffer = arenaAlloc(pArena, iLen + 2);
+    if (!szBuffer) return NULL;
 
-    char* szToken = strtok(szPath, "/");
+    size_t iOut = 0;
+    char* pSavePtr = NULL;
+
+    char* szToken = strtok_r(szPath, "/", &pSavePtr);
     while (szToken)
     {
         if (strcmp(szToken, ".") == 0)
         {
-            szToken = strtok(NULL, "/");
+            szToken = strtok_r(NULL, "/", &pSavePtr);
             continue;
         }
 
         if (strcmp(szToken, "..") == 0)
         {
-            if (isEmpty(&stStack))
+            if (iOut == 0)
                 return NULL;
-            pop(&stStack);
-            szToken = strtok(NULL, "/");
+            while (iOut > 0 && szBuffer[--iOut] != '/');
+            szToken = strtok_r(NULL, "/", &pSavePtr);
             continue;
         }
 
-        push(&stStack, szToken);
-        szToken = strtok(NULL, "/");
-    }
-
-    char** pszItems = (char**)stStack.array;
-    size_t iTotal = 1;
-
-    for (size_t iX = 0; iX < stStack.top; iX++)
-        iTotal += strlen(pszItems[iX]) + 1;
+        size_t iTokenLen = strlen(szToken);
+        szBuffer[iOut++] = '/';
+        memcpy(szBuffer + iOut, szToken, iTokenLen);
+        iOut += iTokenLen;
 
-    char* szBuffer = calloc(iTotal + 1, 1);
-    if (!szBuffer) return NULL;
-
-    char* p = szBuffer;
-    for (size_t iX = 0; iX < stStack.top; iX++)
-    {
-        *p++ = '/';
-        size_t iLen = strlen(pszItems[iX]);
-        memcpy(p, pszItems[iX], iLen);
-        p += iLen;
+        szToken = strtok_r(NULL, "/", &pSavePtr);
     }
 
+    // the root itself normalizes to "/" so URLToFilePath() maps it to the index
+    if (iOut == 0) szBuffer[iOut++] = '/';
+
+    szBuffer[iOut] = '\0';
     return szBuffer;
 }
 
@@ -399,6 +434,20 @@ bool isHex(char c)
            (c >= 'a' && c <= 'f');
 }
 
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+unsigned char hexValue(char c)
+{
+    /*
+        Converts one hexadecimal digit to its value
+        Caller validates the digit with isHex() first
+    */
+
+    if (c >= '0' && c <= '9') return (unsigned char)(c - '0');
+    if (c >= 'a' && c <= 'f') return (unsigned char)(10 + c - 'a');
+    return (unsigned char)(10 + c - 'A');
+}
+
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
 int validateFileAccess(const char* szFilePath, struct stat* outStat)
@@ -445,45 +494,83 @@ int openFileReadOnly(const char* szFilePath)
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-bool sendFileToSocket(int socketFd, int fileFd, off_t fileSize)
+static ssize_t spliceFileToSocket(int socketFd, int fileFd, off_t* pOffset, size_t count)
 {
     /*
-        Streams file contents to a socket using buffered I/O
-        Correctly handles partial writes and interruptions
+        Fallback for sources sendfile() refuses: file -> pipe -> socket,
+        still without copying through userspace.
+        The pipe is shared by the whole worker, so it must be empty when this
+        returns. Whatever the socket did not take is thrown away and will be
+        spliced again from *pOffset on the next EPOLLOUT.
     */
 
-    char szBuffer[8192];
-    off_t iTotalSent = 0;
+    static int s_arrPipe[2] = { -1, -1 };
+    if (s_arrPipe[0] < 0 && pipe2(s_arrPipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
 
-    while (iTotalSent < fileSize)
-    {
-        ssize_t iBytesRead = read(fileFd, szBuffer, sizeof(szBuffer));
-        if (iBytesRead <= 0) return false;
+    // a default pipe holds 64 KiB, asking for more would only block
+    size_t iChunk = count < 65536 ? count : 65536;
 
-        ssize_t iSent = 0;
-        while (iSent < iBytesRead)
-        {
-            ssize_t iN = send(socketFd, szBuffer + iSent,
-                              iBytesRead - iSent, 0);
-            if (iN <= 0) return false;
+    loff_t iFileOffset = *pOffset;
+    ssize_t iPiped = splice(fileFd, &iFileOffset, s_arrPipe[1], NULL, iChunk,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (iPiped <= 0) return iPiped;
 
-            iSent += iN;
-            iTotalSent += iN;
+    ssize_t iSent = splice(s_arrPipe[0], NULL, socketFd, NULL, (size_t)iPiped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    int iSavedErrno = errno;
+
+    if (iSent < iPiped)
+    {
+        char szDiscard[4096];
+        size_t iLeft = (size_t)iPiped - (iSent > 0 ? (size_t)iSent : 0);
+        while (iLeft > 0)
+        {
+            ssize_t n = read(s_arrPipe[0], szDiscard, iLeft < sizeof(szDiscard) ? iLeft : sizeof(szDiscard));
+            if (n <= 0) break;
+            iLeft -= (size_t)n;
         }
     }
 
-    return true;
+    if (iSent > 0) *pOffset += iSent;
+
+    errno = iSavedErrno;
+    return iSent;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+ssize_t sendFileToSocket(int socketFd, int fileFd, off_t* pOffset, size_t count)
+{
+    /*
+        Hands the file range to the kernel with sendfile(), no userspace copy
+        Never blocks: returns -1 with errno EAGAIN when the socket is full,
+        so the output queue resumes at *pOffset on EPOLLOUT
+        Returns 0 if the file ended before count bytes were sent
+    */
+
+    ssize_t iSent = sendfile(socketFd, fileFd, pOffset, count);
+    if (iSent >= 0) return iSent;
+
+    // the source cannot be mapped (not a regular file), move it with splice
+    if (errno == EINVAL || errno == ENOSYS)
+        return spliceFileToSocket(socketFd, fileFd, pOffset, count);
+
+    return -1;
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-void sendErrorResponse(int socketFd, int statusCode)
+void sendErrorResponse(CONNECTION* pConn, const REQUEST_INFO* ri, int statusCode)
 {
     /*
-        Sends a minimal HTTP error response to the client
+        Queues a minimal HTTP error response for the client
         Includes status line, headers, and short body
+        The connection stays open if the request asked for keep-alive
     */
 
+    if (!pConn) return;
+
     const char* szReason = getReasonPhrase(statusCode);
 
     char szBody[64];
@@ -491,20 +578,10 @@ void sendErrorResponse(int socketFd, int statusCode)
         szBody, sizeof(szBody),
         "%d %s\n", statusCode, szReason
     );
+    if (iBodyLength < 0) iBodyLength = 0;
 
-    char szHeaders[256];
-    int iHeaderLength = snprintf(
-        szHeaders, sizeof(szHeaders),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: text/plain\r\n"
-        "Content-Length: %d\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        statusCode, szReason, iBodyLength
-    );
-
-    send(socketFd, szHeaders, iHeaderLength, 0);
-    send(socketFd, szBody, iBodyLength, 0);
+    if (!send_simple_response(pConn, ri, statusCode, szReason, szBody, (size_t)iBodyLength))
+        pConn->m_bCloseAfterFlush = true;
 }
 
 ////////////////////////////////////////////////////////////
@@ -541,6 +618,7 @@ const char* getReasonPhrase(int statusCode)
         case 400: return "Bad Request";
         case 403: return "Forbidden";
         case 404: return "Not Found";
+        case 414: return "URI Too Long";
         case 500: return "Internal Server Error";
         default:  return "Error";
     }
@@ -11,6 +11,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+typedef struct Arena      Arena;
+typedef struct CONNECTION CONNECTION;
+typedef struct REQUEST_INFO REQUEST_INFO;
+
 /*
     Holds metadata and permission information about a file
     Extracted from stat()
@@ -33,8 +37,9 @@ typedef struct FileStats
 /*
     Converts a requested URL path into a filesystem path
     Example: "/" -> "./www/index.html"
+    The returned string lives in pArena until the next arenaReset()
 */
-char* URLToFilePath(const char* URL);
+char* URLToFilePath(const char* URL, Arena* pArena);
 
 /*
     Retrieves file metadata and permission flags for a given path
@@ -54,10 +59,21 @@ const char* getMIMEType(const char* filePath);
 /*
     Validates the requested URL path to prevent directory traversal
     Blocks "../", "//", and URL-encoded traversal attempts
+    Scratch strings are allocated from pArena
+    On success *pszNormalized points to the decoded, normalized path to serve
 */
-bool isSafePath(const char* URL);
-char* normalizePath(char* szPath);
+bool isSafePath(const char* URL, Arena* pArena, const char** pszNormalized);
+
+/*
+    The two halves of isSafePath()
+    decodeURLPath() only works on the string (no syscalls), NULL if malformed
+    isInsideRoot() resolves symlinks of a filesystem path and checks it stays below ROOT
+*/
+const char* decodeURLPath(const char* URL, Arena* pArena);
+bool isInsideRoot(const char* filePath);
+char* normalizePath(char* szPath, Arena* pArena);
 bool isHex(char c);
+unsigned char hexValue(char c);
 
 /*
     Checks file existence, type, and permissions using stat()
@@ -73,15 +89,29 @@ int validateFileAccess(const char* filePath, struct stat* outStat);
 int openFileReadOnly(const char* filePath);
 
 /*
-    Streams a file to a socket using a read/send loop
-    Handles partial writes and avoids loading the entire file into memory
+    Per-worker setup of the static file cache (inotify on ROOT)
+    Returns false when the cache is disabled, serving still works
+*/
+bool initStaticFiles(void);
+
+/*
+    Serves ri->m_szPath from ROOT: validates the path, then queues the
+    response headers and the file on the connection's output queue
+    Errors are queued as minimal error responses
+*/
+void serverFile(CONNECTION* pConn, const REQUEST_INFO* ri);
+
+/*
+    Sends the next piece of a file range to a non-blocking socket
+    Zero-copy: sendfile(), or splice() through a pipe for non-regular sources
+    Advances *pOffset by the bytes sent, returns -1 / EAGAIN when the socket is full
 */
-bool sendFileToSocket(int socketFd, int fileFd, off_t fileSize);
+ssize_t sendFileToSocket(int socketFd, int fileFd, off_t* pOffset, size_t count);
 
 /*
-    Sends a minimal HTTP error response (403, 404, 500, etc.)
+    Queues a minimal HTTP error response (403, 404, 500, etc.)
 */
-void sendErrorResponse(int socketFd, int statusCode);
+void sendErrorResponse(CONNECTION* pConn, const REQUEST_INFO* ri, int statusCode);
 const char* getReasonPhrase(int statusCode); // phrase corrosponding to statusCode 
 /*
     Determines whether a MIME type should be treated as text
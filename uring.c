@@ -0,0 +1,316 @@
+/*
+    File name    : uring.c
+    creation date: 28-03-26
+    Author       : Solomon
+*/
+
+#include <errno.h>        // provides errno, EINTR
+#include <string.h>       // provides memset()
+#include <stdlib.h>       // provides aligned_alloc(), free()
+#include <unistd.h>       // provides syscall(), close()
+#include <sys/mman.h>     // provides mmap(), munmap()
+#include <sys/syscall.h>  // provides SYS_io_uring_setup, SYS_io_uring_enter, SYS_io_uring_register
+#include "uring.h"
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int sys_io_uring_setup(uint32_t uEntries, struct io_uring_params* pParams)
+{
+    return (int)syscall(SYS_io_uring_setup, uEntries, pParams);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int sys_io_uring_enter(int iFd, uint32_t uToSubmit, uint32_t uMinComplete, uint32_t uFlags,
+                              const void* pArg, size_t iArgSize)
+{
+    return (int)syscall(SYS_io_uring_enter, iFd, uToSubmit, uMinComplete, uFlags, pArg, iArgSize);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static int sys_io_uring_register(int iFd, uint32_t uOpcode, const void* pArg, uint32_t uCount)
+{
+    return (int)syscall(SYS_io_uring_register, iFd, uOpcode, pArg, uCount);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int uring_init(URING* pRing, uint32_t uEntries)
+{
+    /*
+        SINGLE_ISSUER + DEFER_TASKRUN (6.1+) let completions run only when
+        the worker enters the kernel anyway; older kernels reject the flags
+        and get a plain ring instead.
+    */
+
+    if (!pRing) return -EINVAL;
+    memset(pRing, 0, sizeof(*pRing));
+    pRing->m_iRingFd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+    int iFd = sys_io_uring_setup(uEntries, &params);
+    if (iFd < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        iFd = sys_io_uring_setup(uEntries, &params);
+    }
+    if (iFd < 0) return -errno;
+
+    pRing->m_iRingFd = iFd;
+    pRing->m_bExtArg = (params.features & IORING_FEAT_EXT_ARG) != 0;
+
+    pRing->m_iSqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    pRing->m_iCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool bSingleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (bSingleMmap)
+    {
+        if (pRing->m_iCqRingSize > pRing->m_iSqRingSize) pRing->m_iSqRingSize = pRing->m_iCqRingSize;
+        pRing->m_iCqRingSize = pRing->m_iSqRingSize;
+    }
+
+    pRing->m_pSqRing = mmap(NULL, pRing->m_iSqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, iFd, IORING_OFF_SQ_RING);
+    if (pRing->m_pSqRing == MAP_FAILED)
+    {
+        pRing->m_pSqRing = NULL;
+        uring_destroy(pRing);
+        return -ENOMEM;
+    }
+
+    if (bSingleMmap)
+        pRing->m_pCqRing = pRing->m_pSqRing;
+    else
+    {
+        pRing->m_pCqRing = mmap(NULL, pRing->m_iCqRingSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, iFd, IORING_OFF_CQ_RING);
+        if (pRing->m_pCqRing == MAP_FAILED)
+        {
+            pRing->m_pCqRing = NULL;
+            uring_destroy(pRing);
+            return -ENOMEM;
+        }
+    }
+
+    pRing->m_iSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    pRing->m_pSqes = mmap(NULL, pRing->m_iSqesSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, iFd, IORING_OFF_SQES);
+    if (pRing->m_pSqes == MAP_FAILED)
+    {
+        pRing->m_pSqes = NULL;
+        uring_destroy(pRing);
+        return -ENOMEM;
+    }
+
+    char* pSq = pRing->m_pSqRing;
+    pRing->m_pSqHead    = (uint32_t*)(pSq + params.sq_off.head);
+    pRing->m_pSqTail    = (uint32_t*)(pSq + params.sq_off.tail);
+    pRing->m_pSqArray   = (uint32_t*)(pSq + params.sq_off.array);
+    pRing->m_uSqMask    = *(uint32_t*)(pSq + params.sq_off.ring_mask);
+    pRing->m_uSqEntries = *(uint32_t*)(pSq + params.sq_off.ring_entries);
+    pRing->m_uSqLocalTail = *pRing->m_pSqTail;
+
+    char* pCq = pRing->m_pCqRing;
+    pRing->m_pCqHead = (uint32_t*)(pCq + params.cq_off.head);
+    pRing->m_pCqTail = (uint32_t*)(pCq + params.cq_off.tail);
+    pRing->m_uCqMask = *(uint32_t*)(pCq + params.cq_off.ring_mask);
+    pRing->m_pCqes   = (struct io_uring_cqe*)(pCq + params.cq_off.cqes);
+
+    // SQ slot i always uses SQE i, the indirection array never changes
+    for (uint32_t iX = 0; iX < pRing->m_uSqEntries; ++iX)
+        pRing->m_pSqArray[iX] = iX;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void uring_destroy(URING* pRing)
+{
+    if (!pRing) return;
+
+    if (pRing->m_pBufRing) munmap(pRing->m_pBufRing, pRing->m_iBufRingSize);
+    free(pRing->m_pBufMemory);
+
+    if (pRing->m_pSqes) munmap(pRing->m_pSqes, pRing->m_iSqesSize);
+    if (pRing->m_pCqRing && pRing->m_pCqRing != pRing->m_pSqRing) munmap(pRing->m_pCqRing, pRing->m_iCqRingSize);
+    if (pRing->m_pSqRing) munmap(pRing->m_pSqRing, pRing->m_iSqRingSize);
+    if (pRing->m_iRingFd >= 0) close(pRing->m_iRingFd);
+
+    memset(pRing, 0, sizeof(*pRing));
+    pRing->m_iRingFd = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+struct io_uring_sqe* uring_get_sqe(URING* pRing)
+{
+    uint32_t uHead = __atomic_load_n(pRing->m_pSqHead, __ATOMIC_ACQUIRE);
+    if (pRing->m_uSqLocalTail - uHead >= pRing->m_uSqEntries) return NULL;
+
+    struct io_uring_sqe* pSqe = &pRing->m_pSqes[pRing->m_uSqLocalTail & pRing->m_uSqMask];
+    pRing->m_uSqLocalTail++;
+
+    memset(pSqe, 0, sizeof(*pSqe));
+    return pSqe;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+uint32_t uring_sq_space(URING* pRing)
+{
+    uint32_t uHead = __atomic_load_n(pRing->m_pSqHead, __ATOMIC_ACQUIRE);
+    return pRing->m_uSqEntries - (pRing->m_uSqLocalTail - uHead);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int uring_submit_and_wait(URING* pRing, uint32_t uWaitFor)
+{
+    /*
+        Publishes every SQE handed out since the last call and, in the same
+        syscall, waits for uWaitFor completions. This single io_uring_enter()
+        per loop iteration replaces the whole epoll_wait + recv + send + close
+        sequence of the epoll loop.
+    */
+
+    // everything the kernel has not consumed yet, including SQEs published
+    // by an earlier call that was interrupted before submitting them
+    uint32_t uToSubmit = pRing->m_uSqLocalTail - __atomic_load_n(pRing->m_pSqHead, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(pRing->m_pSqTail, pRing->m_uSqLocalTail, __ATOMIC_RELEASE);
+
+    uint32_t uFlags = uWaitFor ? IORING_ENTER_GETEVENTS : 0;
+    int iRet = sys_io_uring_enter(pRing->m_iRingFd, uToSubmit, uWaitFor, uFlags, NULL, 0);
+    return iRet < 0 ? -errno : iRet;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int uring_submit_and_wait_timeout(URING* pRing, uint32_t uWaitFor, int iTimeoutMs)
+{
+    /*
+        Same as uring_submit_and_wait() but gives up waiting after
+        iTimeoutMs (-ETIME). The timeout travels with io_uring_enter()
+        itself (IORING_ENTER_EXT_ARG), so no timeout SQE has to be queued
+        and cancelled on every iteration.
+    */
+
+    if (iTimeoutMs < 0 || !pRing->m_bExtArg) return uring_submit_and_wait(pRing, uWaitFor);
+
+    uint32_t uToSubmit = pRing->m_uSqLocalTail - __atomic_load_n(pRing->m_pSqHead, __ATOMIC_ACQUIRE);
+    __atomic_store_n(pRing->m_pSqTail, pRing->m_uSqLocalTail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    ts.tv_sec  = iTimeoutMs / 1000;
+    ts.tv_nsec = (long long)(iTimeoutMs % 1000) * 1000000;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    int iRet = sys_io_uring_enter(pRing->m_iRingFd, uToSubmit, uWaitFor,
+                                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    return iRet < 0 ? -errno : iRet;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+struct io_uring_cqe* uring_peek_cqe(URING* pRing)
+{
+    uint32_t uHead = *pRing->m_pCqHead;
+    uint32_t uTail = __atomic_load_n(pRing->m_pCqTail, __ATOMIC_ACQUIRE);
+    if (uHead == uTail) return NULL;
+
+    return &pRing->m_pCqes[uHead & pRing->m_uCqMask];
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void uring_cqe_seen(URING* pRing)
+{
+    __atomic_store_n(pRing->m_pCqHead, *pRing->m_pCqHead + 1, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int uring_register_files(URING* pRing, const int* pFds, uint32_t uCount)
+{
+    if (sys_io_uring_register(pRing->m_iRingFd, IORING_REGISTER_FILES, pFds, uCount) < 0)
+        return -errno;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+int uring_setup_buffers(URING* pRing, uint16_t uGroupId, uint32_t uCount, uint32_t uSize)
+{
+    /*
+        Provided buffers: recv picks a free buffer itself when data arrives,
+        so idle connections do not pin a receive buffer each.
+        uCount must be a power of two (ring size).
+    */
+
+    if (uCount == 0 || (uCount & (uCount - 1)) != 0 || uCount > 32768) return -EINVAL;
+
+    pRing->m_iBufRingSize = uCount * sizeof(struct io_uring_buf);
+    void* pRingMemory = mmap(NULL, pRing->m_iBufRingSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pRingMemory == MAP_FAILED) return -ENOMEM;
+
+    pRing->m_pBufMemory = aligned_alloc(4096, (size_t)uCount * uSize);
+    if (!pRing->m_pBufMemory)
+    {
+        munmap(pRingMemory, pRing->m_iBufRingSize);
+        return -ENOMEM;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)pRingMemory;
+    reg.ring_entries = uCount;
+    reg.bgid         = uGroupId;
+
+    if (sys_io_uring_register(pRing->m_iRingFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int iErr = -errno;
+        munmap(pRingMemory, pRing->m_iBufRingSize);
+        free(pRing->m_pBufMemory);
+        pRing->m_pBufMemory = NULL;
+        return iErr;
+    }
+
+    pRing->m_pBufRing  = pRingMemory;
+    pRing->m_uBufCount = uCount;
+    pRing->m_uBufSize  = uSize;
+    pRing->m_uBufTail  = 0;
+
+    for (uint32_t iX = 0; iX < uCount; ++iX)
+        uring_recycle_buffer(pRing, (uint16_t)iX);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+char* uring_buffer(URING* pRing, uint16_t uBufferId)
+{
+    return pRing->m_pBufMemory + (size_t)uBufferId * pRing->m_uBufSize;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void uring_recycle_buffer(URING* pRing, uint16_t uBufferId)
+{
+    struct io_uring_buf* pBuf = &pRing->m_pBufRing->bufs[pRing->m_uBufTail & (pRing->m_uBufCount - 1)];
+    pBuf->addr = (uint64_t)(uintptr_t)uring_buffer(pRing, uBufferId);
+    pBuf->len  = pRing->m_uBufSize;
+    pBuf->bid  = uBufferId;
+
+    pRing->m_uBufTail++;
+    __atomic_store_n(&pRing->m_pBufRing->tail, pRing->m_uBufTail, __ATOMIC_RELEASE);
+}
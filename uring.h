@@ -0,0 +1,87 @@
+/*
+    File name    : uring.h
+    creation date: 28-03-26
+    Author       : Solomon
+*/
+
+/*
+    Minimal io_uring wrapper on top of the raw syscalls (no liburing):
+    ring setup / teardown, SQE allocation, submit + wait, CQE iteration,
+    registered files and one provided buffer ring.
+
+    Only what the worker's io_uring loop needs is here; SQE fields are
+    filled by the caller with the kernel's struct io_uring_sqe directly.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>           // provides size_t
+#include <stdint.h>           // provides uint32_t, uint16_t
+#include <stdbool.h>
+#include <linux/time_types.h> // provides struct __kernel_timespec
+#include <linux/io_uring.h>   // provides struct io_uring_sqe, struct io_uring_cqe, IORING_* constants
+
+typedef struct URING
+{
+    int       m_iRingFd;
+    bool      m_bExtArg;            // io_uring_enter() takes a wait timeout (5.11+)
+
+    // submission queue
+    uint32_t* m_pSqHead;
+    uint32_t* m_pSqTail;
+    uint32_t* m_pSqArray;
+    uint32_t  m_uSqMask;
+    uint32_t  m_uSqEntries;
+    uint32_t  m_uSqLocalTail;       // SQEs handed out but not yet published
+    struct io_uring_sqe* m_pSqes;
+
+    // completion queue
+    uint32_t* m_pCqHead;
+    uint32_t* m_pCqTail;
+    uint32_t  m_uCqMask;
+    struct io_uring_cqe* m_pCqes;
+
+    // mmap()ed regions, kept for munmap()
+    void*     m_pSqRing;
+    size_t    m_iSqRingSize;
+    void*     m_pCqRing;            // same as m_pSqRing with IORING_FEAT_SINGLE_MMAP
+    size_t    m_iCqRingSize;
+    size_t    m_iSqesSize;
+
+    // provided buffer ring (group 0)
+    struct io_uring_buf_ring* m_pBufRing;
+    size_t    m_iBufRingSize;
+    char*     m_pBufMemory;
+    uint32_t  m_uBufCount;          // power of two
+    uint32_t  m_uBufSize;
+    uint16_t  m_uBufTail;
+} URING;
+
+int                  uring_init          (URING* pRing, uint32_t uEntries);   // 0 or -errno
+void                 uring_destroy       (URING* pRing);
+struct io_uring_sqe* uring_get_sqe       (URING* pRing);                      // zeroed SQE, NULL when the SQ is full
+uint32_t             uring_sq_space      (URING* pRing);                      // SQEs that can still be handed out
+int                  uring_submit_and_wait(URING* pRing, uint32_t uWaitFor);   // submitted count or -errno
+int                  uring_submit_and_wait_timeout(URING* pRing, uint32_t uWaitFor, int iTimeoutMs); // -ETIME on timeout
+struct io_uring_cqe* uring_peek_cqe      (URING* pRing);                      // NULL when no completion is pending
+void                 uring_cqe_seen      (URING* pRing);                      // consumes the CQE returned by peek
+
+int                  uring_register_files(URING* pRing, const int* pFds, uint32_t uCount);
+
+int                  uring_setup_buffers (URING* pRing, uint16_t uGroupId, uint32_t uCount, uint32_t uSize);
+char*                uring_buffer        (URING* pRing, uint16_t uBufferId);
+void                 uring_recycle_buffer(URING* pRing, uint16_t uBufferId);  // gives a buffer back to the kernel
+
+#endif
+
+/*
+
+uring_init()            -> io_uring_setup() and maps the SQ / CQ rings
+uring_get_sqe()         -> next free submission entry, published by the next submit
+uring_submit_and_wait() -> io_uring_enter(): submits everything queued and waits for uWaitFor completions
+uring_peek_cqe()        -> oldest completion, uring_cqe_seen() releases it
+uring_setup_buffers()   -> registers a ring of uCount buffers of uSize bytes for IOSQE_BUFFER_SELECT
+uring_recycle_buffer()  -> returns a consumed buffer to the ring
+
+*/
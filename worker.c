@@ -8,20 +8,39 @@
 
 #include <fcntl.h>      // provides O_NONBLOCK O_CLOEXEC
 #include <stdint.h>     // provides uint32_t
-#include <errno.h>      // provides errno, EINTR
+#include <stdbool.h>
+#include <errno.h>      // provides errno, EINTR, ECONNABORTED
 #include "worker.h"
 #include <sys/socket.h> // provides accept4(), recv(), send(), struct sockaddr
 #include <netinet/in.h> // provides IPv4 socket structures like struct sockaddr_in
-#include <sys/epoll.h>  // provides epoll_create1(),  epoll_wait(), struct epoll_event, EPOLLIN, EPOLLERR, EPOLLHUP, EPOLLRDHUP
-#include <stdio.h>      // provides snprintf()
+#include <sys/epoll.h>  // provides epoll_create1(),  epoll_wait(), struct epoll_event, EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP, EPOLLRDHUP, EPOLLEXCLUSIVE
 #include <string.h>     // provides memset(), strlen()
 #include <signal.h>     // signal(), SIGTERM, SIGINT, SIGPIPE, sig_atomic_t
+#include <unistd.h>     // provides close()
 #include "server.h"
 #include "http.h"
-#include "response.h"   // provides send_simple_response
+#include "response.h"   // provides send_simple_response(), response_clock_tick()
+#include "connection.h" // provides CONNECTION
+#include "static_files.h" // provides serverFile(), initStaticFiles()
+#include "file_cache.h"   // provides file_cache_watch_fd(), file_cache_process_events()
+#include "worker_uring.h" // provides worker_run_uring()
+#include "timer_wheel.h"  // provides TimerWheel
+#include "metrics.h"      // provides metrics_request_done(), metrics_send_response()
+#include "access_log.h"   // provides access_log_request()
+#include "proxy.h"        // provides proxy_forward(), proxy_handle_event(), proxy_client_drained()
 
 static volatile sig_atomic_t g_Running = 1;
 
+// every connection's current deadline (header / body / keep-alive / write)
+#define WORKER_TIMER_TICK_MS 100
+static TimerWheel g_timers;
+static const CONN_TIMEOUTS* g_pTimeouts;
+
+// proxied responses are continued from upstream events, outside of the client's own
+static int g_iEpollFd = -1;
+
+static void worker_process_requests(int iEpollFd, CONNECTION* pConn);
+
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
 static void worker_on_signal(int sig)
@@ -32,155 +51,423 @@ static void worker_on_signal(int sig)
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-void worker_run(struct SERVER* s_pServer)
+static void worker_close_connection(int iEpollFd, CONNECTION* pConn)
+{
+    if (pConn->m_pUpstream) proxy_client_closed(pConn);
+
+    timerWheelCancel(&g_timers, &pConn->m_timer);
+    epoll_ctl(iEpollFd, EPOLL_CTL_DEL, pConn->m_iFd, NULL);
+    connection_destroy(pConn);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void worker_arm_timer(CONNECTION* pConn)
+{
+    // re-armed whenever the connection goes back to waiting, O(1) each time
+    uint64_t uNow = monotonic_ms();
+    timerWheelSchedule(&g_timers, &pConn->m_timer, connection_deadline(pConn, g_pTimeouts, uNow));
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void worker_on_timeout(TimerNode* pNode, void* pContext)
+{
+    // a connection that ran out of time is dropped without a response
+    int iEpollFd = *(int*)pContext;
+    worker_close_connection(iEpollFd, (CONNECTION*)pNode->data);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool worker_set_events(int iEpollFd, CONNECTION* pConn, uint32_t uEvents)
+{
+    if (pConn->m_uEpollEvents == uEvents) return true;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = uEvents;
+    ev.data.fd = pConn->m_iFd;
+
+    if (epoll_ctl(iEpollFd, EPOLL_CTL_MOD, pConn->m_iFd, &ev) < 0) return false;
+
+    pConn->m_uEpollEvents = uEvents;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool worker_flush_connection(int iEpollFd, CONNECTION* pConn)
+{
+    /*
+        Writes the queued response. Returns true only when the queue drained
+        and the connection stays open for the next request; otherwise the
+        connection is either closed or waiting for EPOLLOUT.
+
+        While a response is parked, the connection listens for EPOLLOUT only:
+        new requests stay in the kernel buffer (level triggered EPOLLIN would
+        otherwise fire on every wait) and are parsed once the response is out.
+        A proxied response that is not complete yet parks the client with no
+        interest at all; the upstream's events bring the rest.
+    */
+
+    OUTPUT_RESULT result = connection_flush(pConn);
+
+    if (result == OUTPUT_ERROR)
+    {
+        worker_close_connection(iEpollFd, pConn);
+        return false;
+    }
+
+    if (result == OUTPUT_BLOCKED)
+    {
+        if (!worker_set_events(iEpollFd, pConn, EPOLLOUT))
+            worker_close_connection(iEpollFd, pConn);
+        else
+            worker_arm_timer(pConn);
+        return false;
+    }
+
+    if (pConn->m_pUpstream && !proxy_client_drained(pConn))
+    {
+        // the upstream connection has its own deadlines while the response is due
+        timerWheelCancel(&g_timers, &pConn->m_timer);
+        if (!worker_set_events(iEpollFd, pConn, 0))
+            worker_close_connection(iEpollFd, pConn);
+        return false;
+    }
+
+    metrics_request_done(pConn);
+    access_log_request(pConn);
+
+    if (pConn->m_bCloseAfterFlush)
+    {
+        worker_close_connection(iEpollFd, pConn);
+        return false;
+    }
+
+    connection_finish_request(pConn);
+
+    if (!worker_set_events(iEpollFd, pConn, EPOLLIN | EPOLLRDHUP))
+    {
+        worker_close_connection(iEpollFd, pConn);
+        return false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool worker_proxy_flush(CONNECTION* pConn)
+{
+    // the proxy queued response bytes (or an error) on a parked client
+    int iFd = pConn->m_iFd;
+
+    if (worker_flush_connection(g_iEpollFd, pConn))
+        worker_process_requests(g_iEpollFd, pConn);
+
+    return connection_lookup(iFd) == pConn;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void worker_process_requests(int iEpollFd, CONNECTION* pConn)
+{
+    /*
+        Answers every complete request already buffered, in the order they
+        arrived; a pipelining client may have sent several in one segment.
+        Each response must leave before the next request is parsed, which
+        keeps responses in order and bounds what one client can queue.
+    */
+
+    while (1)
+    {
+        PARSER_STATUS status = connection_parse(pConn);
+        if (status == PARSER_NEED_MORE)
+        {
+            if (pConn->m_bPeerClosed)
+                worker_close_connection(iEpollFd, pConn);
+            else
+                worker_arm_timer(pConn);
+            return;
+        }
+
+        REQUEST_INFO* ri = &pConn->m_request;
+
+        if (status == PARSER_ERROR)
+        {
+            pConn->m_bCloseAfterFlush = true;
+            send_parse_error_response(pConn, ri);
+            worker_flush_connection(iEpollFd, pConn);
+            return;
+        }
+
+        // decided before the handler runs, the response carries the same answer
+        if (!response_wants_keep_alive(ri))
+            pConn->m_bCloseAfterFlush = true;
+
+        /* here normal request handling begins */
+        handle_application_request(pConn, ri);
+
+        if (!worker_flush_connection(iEpollFd, pConn))
+            return;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void worker_handle_readable(int iEpollFd, CONNECTION* pConn)
+{
+    /*
+        Appends whatever arrived to the connection's buffer and feeds only
+        those new bytes to the parser. Partial requests simply wait for the
+        next EPOLLIN.
+    */
+
+    CONN_READ_RESULT readResult = connection_read(pConn);
+    if (readResult == CONN_READ_ERROR)
+    {
+        worker_close_connection(iEpollFd, pConn);
+        return;
+    }
+
+    worker_process_requests(iEpollFd, pConn);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void worker_handle_writable(int iEpollFd, CONNECTION* pConn)
+{
+    /*
+        The socket has room again: continue the parked response and, once it
+        is out, serve the pipelined requests that were waiting behind it.
+    */
+
+    if (worker_flush_connection(iEpollFd, pConn))
+        worker_process_requests(iEpollFd, pConn);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void worker_accept_connections(int iEpollFd, int iListenFd, int iBatch)
+{
+    /*
+        Drains up to iBatch pending connections per wakeup, stopping early
+        on EAGAIN. Anything left over (burst larger than the batch) keeps
+        the level triggered listener ready, so it is picked up on the next
+        epoll_wait() after the other ready clients had their turn.
+    */
+
+    if (iBatch <= 0) iBatch = 1;
+
+    for (int iX = 0; iX < iBatch; ++iX)
+    {
+        struct sockaddr_in clientAddr;
+        socklen_t clientLen = sizeof(clientAddr);
+
+        int iClientFd = accept4(
+            iListenFd,
+            (struct sockaddr*)&clientAddr,
+            &clientLen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+        if (iClientFd < 0)
+        {
+            // ECONNABORTED: the client gave up while queued, try the next one
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return; // EAGAIN, or EMFILE / ENFILE: try again on the next wakeup
+        }
+
+        CONNECTION* pConn = connection_create(iClientFd);
+        if (!pConn)
+        {
+            close(iClientFd);
+            continue;
+        }
+
+        // make an epoll instance of the client
+        // EPOLLIN -> notify when client sends data
+        // EPOLLRDHUP -> notify when clients closes its read / write or finished sending the request
+        struct epoll_event cev;
+        memset(&cev, 0, sizeof(cev));
+        cev.events = EPOLLIN | EPOLLRDHUP;
+        cev.data.fd = iClientFd;
+        if (epoll_ctl(iEpollFd, EPOLL_CTL_ADD, iClientFd, &cev) < 0)
+            connection_destroy(pConn);
+        else
+        {
+            pConn->m_uPeerAddr    = clientAddr.sin_addr.s_addr;
+            pConn->m_uEpollEvents = cev.events;
+            worker_arm_timer(pConn);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+void worker_run(struct SERVER* s_pServer, int iWorkerIndex)
 {
     if (!s_pServer) return;
-    if (s_pServer->m_iListenFd < 0) return;
+    if (iWorkerIndex < 0 || iWorkerIndex >= MAX_WORKERS) return;
+
+    // in SO_REUSEPORT mode this worker only ever sees its own socket
+    int iListenFd = s_pServer->m_bReusePort ? s_pServer->m_arrListenFds[iWorkerIndex]
+                                            : s_pServer->m_iListenFd;
+    if (iListenFd < 0) return;
 
     signal(SIGTERM, worker_on_signal);
     signal(SIGINT, worker_on_signal);
     signal(SIGPIPE, SIG_IGN);
-    
+
+    // static files are cached per worker, inotify tells us when to drop them
+    bool bFileCache = initStaticFiles();
+
+    g_pTimeouts = &s_pServer->m_timeouts;
+    timerWheelInit(&g_timers, monotonic_ms(), WORKER_TIMER_TICK_MS);
+
+    // the io_uring loop returns false only when the kernel cannot run it
+    if (s_pServer->m_bUseIoUring &&
+        worker_run_uring(s_pServer, iListenFd, bFileCache ? file_cache_watch_fd() : -1, &g_Running))
+    {
+        file_cache_shutdown();
+        return;
+    }
+
     int iEpollFd = epoll_create1(EPOLL_CLOEXEC);
     if (iEpollFd < 0) return;
 
+    // every registration carries its descriptor: the listener and the file
+    // cache watch are recognised by number, clients through the fd table
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLIN; // tells epoll that the socket has something to read
-    ev.data.fd = s_pServer->m_iListenFd;
+    ev.data.fd = iListenFd;
+
+    // a listener shared by every worker wakes only one (or a few) of them
+    // per connection instead of all; a per-worker REUSEPORT socket has no herd
+    if (!s_pServer->m_bReusePort)
+        ev.events |= EPOLLEXCLUSIVE;
 
-    if (epoll_ctl(iEpollFd, EPOLL_CTL_ADD, s_pServer->m_iListenFd, &ev) < 0)
+    if (epoll_ctl(iEpollFd, EPOLL_CTL_ADD, iListenFd, &ev) < 0)
         return;
 
+    g_iEpollFd = iEpollFd;
+    bool bProxy = proxy_enabled() && proxy_attach(iEpollFd, worker_proxy_flush);
+
+    int iWatchFd = bFileCache ? file_cache_watch_fd() : -1;
+    if (iWatchFd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.fd = iWatchFd;
+        epoll_ctl(iEpollFd, EPOLL_CTL_ADD, iWatchFd, &ev);
+    }
+
     struct epoll_event events[64];
 
     while (g_Running)
     {
-        int iN = epoll_wait(iEpollFd, events, 64, -1);
+        // sleeps until the next deadline at the latest
+        uint64_t uNow = monotonic_ms();
+        int iTimeout = timerWheelTimeout(&g_timers, uNow);
+        if (bProxy)
+        {
+            int iProxyTimeout = proxy_timeout(uNow);
+            if (iProxyTimeout >= 0 && (iTimeout < 0 || iProxyTimeout < iTimeout)) iTimeout = iProxyTimeout;
+        }
+
+        int iN = epoll_wait(iEpollFd, events, 64, iTimeout);
         if (iN < 0)
         {
             if (errno == EINTR) continue;
             break;
         }
 
+        // every response of this batch shares one Date value
+        response_clock_tick();
+
         for (int iX = 0; iX < iN; ++iX)
         {
             int iFd = events[iX].data.fd;
             uint32_t uEv = events[iX].events;
-            
-            // if returned flag has any of the three
-            // EPOLLERR -> socket has pending error
-            // EPOLLHUP -> connection closed
-            // EPOLLRDHUP -> peer performed shutdown
-            if (uEv & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+
+            if (iFd == iWatchFd)
+            {
+                file_cache_process_events();
+                continue;
+            }
+
+            if (iFd == iListenFd)
             {
-                epoll_ctl(iEpollFd, EPOLL_CTL_DEL, iFd, NULL);
-                close(iFd);
+                worker_accept_connections(iEpollFd, iListenFd, s_pServer->m_iAcceptBatch);
                 continue;
             }
 
-            if (iFd == s_pServer->m_iListenFd)
+            // anything that is not a client is an upstream socket of the proxy
+            CONNECTION* pConn = connection_lookup(iFd);
+            if (!pConn)
             {
-                struct sockaddr_in clientAddr;
-                socklen_t clientLen = sizeof(clientAddr);
-
-                int iClientFd = accept4(
-                    s_pServer->m_iListenFd,
-                    (struct sockaddr*)&clientAddr,
-                    &clientLen,
-                    SOCK_NONBLOCK | SOCK_CLOEXEC
-                );
-                
-                // make an epoll instance of the client
-                // EPOLLIN -> notify when client sends data
-                // EPOLLRDHUP -> notify when clients closes its read / write or finished sending the request
-                if (iClientFd >= 0)
-                {
-                    struct epoll_event cev;
-                    memset(&cev, 0, sizeof(cev));
-                    cev.events = EPOLLIN | EPOLLRDHUP;
-                    cev.data.fd = iClientFd;
-                    epoll_ctl(iEpollFd, EPOLL_CTL_ADD, iClientFd, &cev);
-                }
+                if (bProxy) proxy_handle_event(iFd, uEv);
+                continue;
             }
-            else if (uEv & EPOLLIN)
+
+            // if returned flag has any of the two
+            // EPOLLERR -> socket has pending error
+            // EPOLLHUP -> connection closed
+            if (uEv & (EPOLLERR | EPOLLHUP))
             {
-                char buffer[64000];
-                int n = recv(iFd, buffer, sizeof(buffer) - 1, 0);
-                if (n <= 0)
-                {
-                    epoll_ctl(iEpollFd, EPOLL_CTL_DEL, iFd, NULL);
-                    close(iFd);
-                    continue;
-                }
-
-                buffer[n] = '\0';
-
-                /* --------------- parse request and print to terminal --------------- */
-                REQUEST_INFO ri = { 0 };
-
-                PARSE_RESULT rc = launch_parser(&ri, buffer, n);
-                if (rc != PARSE_SUCCESS)
-                {
-                    send_parse_error_response(iFd, &ri);
-                    free_request_info(&ri);
-                    return;
-                }
-
-                /* here normal request handling begins */
-                handle_application_request(iFd, &ri);
-                free_request_info(&ri);
-
-                /* ------------------------------------------------------------------ */
-
-                const char body[] = "test successful";
-                char response[256];
-
-                snprintf(response, sizeof(response),
-                    "HTTP/1.1 200 OK\r\n"
-                    "Content-Type: text/plain\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Connection: close\r\n"
-                    "\r\n"
-                    "%s",
-                    strlen(body), body
-                );
-
-                send(iFd, response, strlen(response), 0);
-                epoll_ctl(iEpollFd, EPOLL_CTL_DEL, iFd, NULL);
-                close(iFd);
+                worker_close_connection(iEpollFd, pConn);
+                continue;
             }
+
+            // EPOLLOUT is only registered while a response is parked
+            if (uEv & EPOLLOUT)
+            {
+                worker_handle_writable(iEpollFd, pConn);
+                continue;
+            }
+
+            // EPOLLRDHUP (peer performed shutdown) still needs a read:
+            // the request may have arrived together with the FIN
+            if (uEv & (EPOLLIN | EPOLLRDHUP))
+                worker_handle_readable(iEpollFd, pConn);
         }
+
+        // after the events, so none of them refers to a connection closed here
+        timerWheelAdvance(&g_timers, monotonic_ms(), worker_on_timeout, &iEpollFd);
+        if (bProxy) proxy_advance(monotonic_ms());
     }
 
+    if (bProxy) proxy_shutdown();
+    file_cache_shutdown();
     close(iEpollFd);
 }
 
 ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////
-void handle_application_request(int iClientFd, const REQUEST_INFO *ri)
+void handle_application_request(CONNECTION* pConn, const REQUEST_INFO *ri)
 {
+    /* /metrics is always answered here, the proxied prefix goes upstream whatever the method */
+    bool bMetrics = metrics_is_request(ri);
+    if (!bMetrics && proxy_is_request(ri))
+    {
+        proxy_forward(pConn, ri);
+        return;
+    }
+
     /* Only GET method is suppored */
     if (strcmp(ri->m_szMethod, "GET") != 0)
     {
-        send_simple_response(iClientFd, ri, 405, "Method Not Allowed", NULL, 0);
+        send_simple_response(pConn, ri, 405, "Method Not Allowed", NULL, 0);
         return;
     }
 
-    if (strcmp(ri->m_szPath, "/") == 0)
+    if (bMetrics)
     {
-        const char body[] = "Hello, world\n";
-        send_simple_response(
-            iClientFd,
-            ri,
-            200,
-            "OK",
-            body,
-            sizeof(body) - 1
-        );
+        metrics_send_response(pConn, ri);
         return;
     }
 
-    /* default */
-    send_simple_response(iClientFd, ri, 404, "Not Found", NULL, 0);
+    /* every other GET is answered from the static root */
+    serverFile(pConn, ri);
 }
@@ -11,9 +11,10 @@
 // forward deceleration 
 typedef struct SERVER SERVER;
 typedef struct REQUEST_INFO REQUEST_INFO;
+typedef struct CONNECTION CONNECTION;
 
 
-void worker_run(SERVER* s_pServer);
-void handle_application_request(int iClientFd, const REQUEST_INFO *ri);
+void worker_run(SERVER* s_pServer, int iWorkerIndex); // iWorkerIndex picks the SO_REUSEPORT socket
+void handle_application_request(CONNECTION* pConn, const REQUEST_INFO *ri); // queues the response on pConn
 
 #endif 
@@ -0,0 +1,866 @@
+/*
+    File name    : worker_uring.c
+    creation date: 28-03-26
+    Author       : Solomon
+*/
+
+#define _GNU_SOURCE     // enables SOCK_NONBLOCK, SOCK_CLOEXEC
+
+#include <stdio.h>      // provides fprintf()
+#include <stdlib.h>     // provides calloc(), free()
+#include <stdint.h>     // provides uint64_t, uintptr_t
+#include <string.h>     // provides memset(), memcpy()
+#include <errno.h>      // provides ENOBUFS, ECANCELED, EINTR, EAGAIN, EBUSY, ETIME
+#include <poll.h>       // provides POLLIN, POLLOUT
+#include <unistd.h>     // provides close()
+#include <sys/socket.h> // provides shutdown(), struct msghdr, MSG_NOSIGNAL, MSG_WAITALL, SOCK_NONBLOCK
+#include "worker_uring.h"
+#include "uring.h"
+#include "server.h"
+#include "http.h"
+#include "response.h"     // provides send_parse_error_response(), response_wants_keep_alive(), response_clock_tick()
+#include "connection.h"   // provides CONNECTION
+#include "file_cache.h"   // provides file_cache_process_events()
+#include "timer_wheel.h"  // provides TimerWheel
+#include "pool.h"         // provides Pool
+#include "metrics.h"      // provides metrics_request_done(), metrics_bytes_received(), metrics_bytes_sent()
+#include "access_log.h"   // provides access_log_request()
+
+#define URING_ENTRIES       1024
+#define URING_BUFFER_COUNT  1024   // provided receive buffers shared by every connection of the worker
+#define URING_BUFFER_SIZE   4096
+#define URING_BUFFER_GROUP  0
+#define URING_LISTEN_SLOT   0      // registered file index of the listening socket
+#define URING_NO_BUFFER     0xFFFF
+#define URING_TIMER_TICK_MS 100
+#define URING_CONN_POOL_SLAB 256
+
+// low bits of user_data, the rest is the URING_CONN (or NULL)
+typedef enum
+{
+    URING_OP_ACCEPT = 0,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL,        // POLLOUT while a file range waits for socket space
+    URING_OP_CLOSE,
+    URING_OP_CANCEL,
+    URING_OP_WATCH,       // file cache inotify descriptor
+} URING_OP;
+
+#define URING_OP_MASK 7u
+
+typedef struct URING_CONN
+{
+    CONNECTION* m_pConn;
+    int         m_iFd;            // -1 once the ring has closed it
+    int         m_iPendingOps;    // submitted operations that still owe a final completion
+
+    bool        m_bRecvArmed;     // multishot recv in flight
+    bool        m_bRecvPaused;    // read buffer full, recv cancelled until the parser catches up
+    bool        m_bStarved;       // recv ended with ENOBUFS, waits on the starved list
+    bool        m_bSending;       // send or POLLOUT in flight
+    bool        m_bCloseLinked;   // the in-flight send carries a linked close
+    bool        m_bClosing;
+
+    // the in-flight sendmsg() reads these until it completes
+    struct iovec  m_arrIov[OUTPUT_QUEUE_MAX_SEGMENTS];
+    struct msghdr m_msg;
+    size_t        m_iSendBytes;
+
+    // received buffers that did not fit the read buffer yet, oldest first
+    uint16_t    m_uHeldHead;
+    uint16_t    m_uHeldTail;
+    uint32_t    m_uHeldOffset;    // bytes of the head buffer already copied
+
+    struct URING_CONN* m_pNextStarved;
+} URING_CONN;
+
+typedef struct URING_WORKER
+{
+    URING       m_ring;
+    int         m_iWatchFd;
+    bool        m_bAcceptArmed;
+    bool        m_bWatchArmed;
+    bool        m_bRecycled;      // a buffer went back to the ring since the starved list was fed
+
+    URING_CONN* m_pStarved;
+
+    TimerWheel  m_timers;         // one deadline per connection, data points to its URING_CONN
+    Pool        m_connPool;       // URING_CONN objects
+    const CONN_TIMEOUTS* m_pTimeouts;
+
+    // per provided buffer: valid bytes and the next buffer held by the same connection
+    uint16_t    m_arrBufLength[URING_BUFFER_COUNT];
+    uint16_t    m_arrBufNext[URING_BUFFER_COUNT];
+} URING_WORKER;
+
+static void uring_process_requests(URING_WORKER* pW, URING_CONN* pUc);
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static uint64_t uring_tag(void* pOwner, URING_OP op)
+{
+    return (uint64_t)(uintptr_t)pOwner | (uint64_t)op;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool uring_reserve(URING_WORKER* pW, uint32_t uCount)
+{
+    /*
+        Linked operations must land in the same submission, otherwise the
+        link would end at the submission boundary. Flushes the SQ first
+        when it cannot take uCount more entries.
+    */
+
+    if (uring_sq_space(&pW->m_ring) >= uCount) return true;
+
+    uring_submit_and_wait(&pW->m_ring, 0);
+    return uring_sq_space(&pW->m_ring) >= uCount;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static struct io_uring_sqe* uring_next_sqe(URING_WORKER* pW)
+{
+    if (!uring_reserve(pW, 1)) return NULL;
+    return uring_get_sqe(&pW->m_ring);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_arm_timer(URING_WORKER* pW, URING_CONN* pUc)
+{
+    CONNECTION* pConn = pUc->m_pConn;
+    timerWheelSchedule(&pW->m_timers, &pConn->m_timer, connection_deadline(pConn, pW->m_pTimeouts, monotonic_ms()));
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool uring_arm_accept(URING_WORKER* pW)
+{
+    // SOCK_NONBLOCK: file ranges are still sent with sendfile() from the loop
+    struct io_uring_sqe* pSqe = uring_next_sqe(pW);
+    if (!pSqe) return false;
+
+    pSqe->opcode       = IORING_OP_ACCEPT;
+    pSqe->fd           = URING_LISTEN_SLOT;
+    pSqe->flags        = IOSQE_FIXED_FILE;
+    pSqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    pSqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    pSqe->user_data    = uring_tag(NULL, URING_OP_ACCEPT);
+
+    pW->m_bAcceptArmed = true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool uring_arm_watch(URING_WORKER* pW)
+{
+    struct io_uring_sqe* pSqe = uring_next_sqe(pW);
+    if (!pSqe) return false;
+
+    pSqe->opcode        = IORING_OP_POLL_ADD;
+    pSqe->fd            = pW->m_iWatchFd;
+    pSqe->len           = IORING_POLL_ADD_MULTI;
+    pSqe->poll32_events = POLLIN;
+    pSqe->user_data     = uring_tag(NULL, URING_OP_WATCH);
+
+    pW->m_bWatchArmed = true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool uring_arm_recv(URING_WORKER* pW, URING_CONN* pUc)
+{
+    struct io_uring_sqe* pSqe = uring_next_sqe(pW);
+    if (!pSqe) return false;
+
+    pSqe->opcode    = IORING_OP_RECV;
+    pSqe->fd        = pUc->m_iFd;
+    pSqe->flags     = IOSQE_BUFFER_SELECT;
+    pSqe->buf_group = URING_BUFFER_GROUP;
+    pSqe->ioprio    = IORING_RECV_MULTISHOT;
+    pSqe->user_data = uring_tag(pUc, URING_OP_RECV);
+
+    pUc->m_bRecvArmed = true;
+    pUc->m_iPendingOps++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_cancel_recv(URING_WORKER* pW, URING_CONN* pUc)
+{
+    // the recv completes with -ECANCELED, the cancel's own completion is ignored
+    struct io_uring_sqe* pSqe = uring_next_sqe(pW);
+    if (!pSqe) return;
+
+    pSqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    pSqe->addr      = uring_tag(pUc, URING_OP_RECV);
+    pSqe->user_data = uring_tag(NULL, URING_OP_CANCEL);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_close_connection(URING_WORKER* pW, URING_CONN* pUc)
+{
+    /*
+        Cancels everything still pending on the socket and closes it, as a
+        hard link so the close runs whether or not there was anything left
+        to cancel. The state is freed once the last completion is in.
+    */
+
+    if (pUc->m_bClosing) return;
+    pUc->m_bClosing = true;
+    timerWheelCancel(&pW->m_timers, &pUc->m_pConn->m_timer);
+
+    // the send in flight already carries the close
+    if (pUc->m_bCloseLinked) return;
+
+    if (uring_reserve(pW, 2))
+    {
+        struct io_uring_sqe* pCancel = uring_get_sqe(&pW->m_ring);
+        pCancel->opcode       = IORING_OP_ASYNC_CANCEL;
+        pCancel->fd           = pUc->m_iFd;
+        pCancel->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        pCancel->flags        = IOSQE_IO_HARDLINK;
+        pCancel->user_data    = uring_tag(NULL, URING_OP_CANCEL);
+
+        struct io_uring_sqe* pClose = uring_get_sqe(&pW->m_ring);
+        pClose->opcode    = IORING_OP_CLOSE;
+        pClose->fd        = pUc->m_iFd;
+        pClose->user_data = uring_tag(pUc, URING_OP_CLOSE);
+
+        pUc->m_iPendingOps++;
+        return;
+    }
+
+    // no room in the ring: shutdown() ends whatever is pending on the socket
+    shutdown(pUc->m_iFd, SHUT_RDWR);
+    close(pUc->m_iFd);
+    connection_forget_fd(pUc->m_pConn);
+    pUc->m_iFd = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_release_if_done(URING_WORKER* pW, URING_CONN* pUc)
+{
+    if (!pUc->m_bClosing || pUc->m_iPendingOps > 0) return;
+
+    timerWheelCancel(&pW->m_timers, &pUc->m_pConn->m_timer);
+
+    while (pUc->m_uHeldHead != URING_NO_BUFFER)
+    {
+        uint16_t uBuffer = pUc->m_uHeldHead;
+        pUc->m_uHeldHead = pW->m_arrBufNext[uBuffer];
+        uring_recycle_buffer(&pW->m_ring, uBuffer);
+        pW->m_bRecycled = true;
+    }
+
+    if (pUc->m_bStarved)
+    {
+        URING_CONN** ppLink = &pW->m_pStarved;
+        while (*ppLink && *ppLink != pUc) ppLink = &(*ppLink)->m_pNextStarved;
+        if (*ppLink) *ppLink = pUc->m_pNextStarved;
+    }
+
+    // the socket was closed by the ring (or by the fallback above)
+    connection_forget_fd(pUc->m_pConn);
+    connection_destroy(pUc->m_pConn);
+    poolFree(&pW->m_connPool, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool uring_pump_held(URING_WORKER* pW, URING_CONN* pUc)
+{
+    /*
+        Copies held receive buffers into the read buffer while it has room
+        and gives every emptied buffer back to the ring right away.
+        The connection's read buffer is only attached once there is
+        something to copy; false when none could be had.
+    */
+
+    CONNECTION* pConn = pUc->m_pConn;
+
+    if (pUc->m_uHeldHead != URING_NO_BUFFER && !connection_acquire_buffer(pConn))
+        return false;
+
+    while (pUc->m_uHeldHead != URING_NO_BUFFER && pConn->m_iReadLength < pConn->m_iReadCapacity)
+    {
+        uint16_t uBuffer = pUc->m_uHeldHead;
+        size_t iAvailable = pW->m_arrBufLength[uBuffer] - pUc->m_uHeldOffset;
+        size_t iRoom = pConn->m_iReadCapacity - pConn->m_iReadLength;
+        size_t iTake = iAvailable < iRoom ? iAvailable : iRoom;
+
+        memcpy(pConn->m_pReadBuffer + pConn->m_iReadLength,
+               uring_buffer(&pW->m_ring, uBuffer) + pUc->m_uHeldOffset,
+               iTake);
+        pConn->m_iReadLength += iTake;
+        pConn->m_pReadBuffer[pConn->m_iReadLength] = '\0';
+        pUc->m_uHeldOffset += (uint32_t)iTake;
+
+        if (pUc->m_uHeldOffset == pW->m_arrBufLength[uBuffer])
+        {
+            pUc->m_uHeldHead   = pW->m_arrBufNext[uBuffer];
+            pUc->m_uHeldOffset = 0;
+            uring_recycle_buffer(&pW->m_ring, uBuffer);
+            pW->m_bRecycled = true;
+        }
+    }
+
+    if (pUc->m_uHeldHead == URING_NO_BUFFER)
+    {
+        pUc->m_uHeldTail   = URING_NO_BUFFER;
+        pUc->m_bRecvPaused = false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_rearm_recv(URING_WORKER* pW, URING_CONN* pUc)
+{
+    if (pUc->m_bClosing || pUc->m_bRecvArmed || pUc->m_bRecvPaused || pUc->m_bStarved) return;
+    if (pUc->m_pConn->m_bPeerClosed) return;
+
+    if (!uring_arm_recv(pW, pUc))
+        uring_close_connection(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_receive(URING_WORKER* pW, URING_CONN* pUc, uint16_t uBuffer, size_t iLength)
+{
+    /*
+        Every buffer is queued behind the ones already held, so bytes stay
+        in order, and then pumped into the read buffer. Whatever is still
+        held afterwards means the read buffer is full: the recv is cancelled
+        (TCP flow control takes over) until the parser catches up.
+    */
+
+    pW->m_arrBufLength[uBuffer] = (uint16_t)iLength;
+    pW->m_arrBufNext[uBuffer]   = URING_NO_BUFFER;
+    metrics_bytes_received(iLength);
+
+    if (pUc->m_uHeldTail == URING_NO_BUFFER)
+        pUc->m_uHeldHead = uBuffer;
+    else
+        pW->m_arrBufNext[pUc->m_uHeldTail] = uBuffer;
+    pUc->m_uHeldTail = uBuffer;
+
+    if (!uring_pump_held(pW, pUc))
+    {
+        uring_close_connection(pW, pUc);
+        return;
+    }
+    pUc->m_pConn->m_uLastActivity = monotonic_ms();
+
+    if (pUc->m_uHeldHead != URING_NO_BUFFER && !pUc->m_bRecvPaused)
+    {
+        pUc->m_bRecvPaused = true;
+        if (pUc->m_bRecvArmed) uring_cancel_recv(pW, pUc);
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_arm_pollout(URING_WORKER* pW, URING_CONN* pUc)
+{
+    struct io_uring_sqe* pSqe = uring_next_sqe(pW);
+    if (!pSqe)
+    {
+        uring_close_connection(pW, pUc);
+        return;
+    }
+
+    pSqe->opcode        = IORING_OP_POLL_ADD;
+    pSqe->fd            = pUc->m_iFd;
+    pSqe->poll32_events = POLLOUT;
+    pSqe->user_data     = uring_tag(pUc, URING_OP_POLL);
+
+    pUc->m_bSending = true;
+    pUc->m_iPendingOps++;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static OUTPUT_RESULT uring_send(URING_WORKER* pW, URING_CONN* pUc)
+{
+    /*
+        Starts sending the head of the output queue.
+        Memory segments leave as one gathered SENDMSG; MSG_WAITALL makes the
+        kernel finish the whole run before completing. When that run is the
+        rest of a "Connection: close" response, the close is linked behind
+        it and both go out in the same submission; when a file range
+        follows the run is sent with MSG_MORE.
+        A file range at the head still goes through sendfile() (zero copy
+        from the page cache); a full socket parks it on a POLLOUT.
+
+        OUTPUT_BLOCKED means an operation is in flight and its completion
+        continues the response.
+    */
+
+    CONNECTION* pConn = pUc->m_pConn;
+    OUTPUT_QUEUE* pQueue = &pConn->m_output;
+
+    if (output_queue_empty(pQueue)) return OUTPUT_DRAINED;
+
+    size_t iBytes = 0;
+    size_t iIovCount = output_queue_gather(pQueue, pUc->m_arrIov, OUTPUT_QUEUE_MAX_SEGMENTS, &iBytes);
+
+    if (iIovCount == 0)
+    {
+        OUTPUT_RESULT result = connection_flush(pConn);
+        if (result == OUTPUT_BLOCKED)
+        {
+            uring_arm_pollout(pW, pUc);
+            uring_arm_timer(pW, pUc);
+        }
+        return result;
+    }
+
+    bool bLinkClose = pConn->m_bCloseAfterFlush && iBytes == pQueue->m_iPendingBytes;
+
+    if (!uring_reserve(pW, bLinkClose ? 3 : 1)) return OUTPUT_ERROR;
+
+    // the close must not leave a multishot recv behind on the socket
+    if (bLinkClose && pUc->m_bRecvArmed) uring_cancel_recv(pW, pUc);
+
+    memset(&pUc->m_msg, 0, sizeof(pUc->m_msg));
+    pUc->m_msg.msg_iov    = pUc->m_arrIov;
+    pUc->m_msg.msg_iovlen = iIovCount;
+
+    struct io_uring_sqe* pSend = uring_get_sqe(&pW->m_ring);
+    pSend->opcode    = IORING_OP_SENDMSG;
+    pSend->fd        = pUc->m_iFd;
+    pSend->addr      = (uint64_t)(uintptr_t)&pUc->m_msg;
+    pSend->len       = 1;
+    pSend->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    pSend->user_data = uring_tag(pUc, URING_OP_SEND);
+
+    // the head of a file response is held back until sendfile() adds the body
+    if (output_queue_file_follows(pQueue, iIovCount)) pSend->msg_flags |= MSG_MORE;
+
+    pUc->m_bSending   = true;
+    pUc->m_iSendBytes = iBytes;
+    pUc->m_iPendingOps++;
+
+    if (bLinkClose)
+    {
+        pSend->flags |= IOSQE_IO_LINK;
+
+        struct io_uring_sqe* pClose = uring_get_sqe(&pW->m_ring);
+        pClose->opcode    = IORING_OP_CLOSE;
+        pClose->fd        = pUc->m_iFd;
+        pClose->user_data = uring_tag(pUc, URING_OP_CLOSE);
+
+        pUc->m_bCloseLinked = true;
+        pUc->m_iPendingOps++;
+    }
+
+    uring_arm_timer(pW, pUc);
+    return OUTPUT_BLOCKED;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static bool uring_finish_response(URING_WORKER* pW, URING_CONN* pUc)
+{
+    // true when the connection stays open for the next request
+    metrics_request_done(pUc->m_pConn);
+    access_log_request(pUc->m_pConn);
+
+    if (pUc->m_pConn->m_bCloseAfterFlush)
+    {
+        uring_close_connection(pW, pUc);
+        return false;
+    }
+
+    connection_finish_request(pUc->m_pConn);
+    if (!uring_pump_held(pW, pUc))
+    {
+        uring_close_connection(pW, pUc);
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_continue_response(URING_WORKER* pW, URING_CONN* pUc)
+{
+    OUTPUT_RESULT result = uring_send(pW, pUc);
+
+    if (result == OUTPUT_ERROR)
+    {
+        uring_close_connection(pW, pUc);
+        return;
+    }
+
+    if (result == OUTPUT_BLOCKED) return;
+
+    if (uring_finish_response(pW, pUc))
+        uring_process_requests(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_process_requests(URING_WORKER* pW, URING_CONN* pUc)
+{
+    /*
+        Same rules as the epoll loop: buffered requests are answered in
+        order and the next one is parsed only after the previous response
+        has completely left.
+    */
+
+    CONNECTION* pConn = pUc->m_pConn;
+
+    while (!pUc->m_bClosing && !pUc->m_bSending)
+    {
+        PARSER_STATUS status = connection_parse(pConn);
+        if (status == PARSER_NEED_MORE)
+        {
+            if (pConn->m_bPeerClosed)
+                uring_close_connection(pW, pUc);
+            else
+            {
+                uring_rearm_recv(pW, pUc);
+                if (!pUc->m_bClosing) uring_arm_timer(pW, pUc);
+            }
+            return;
+        }
+
+        REQUEST_INFO* ri = &pConn->m_request;
+
+        if (status == PARSER_ERROR)
+        {
+            pConn->m_bCloseAfterFlush = true;
+            send_parse_error_response(pConn, ri);
+        }
+        else
+        {
+            if (!response_wants_keep_alive(ri))
+                pConn->m_bCloseAfterFlush = true;
+
+            handle_application_request(pConn, ri);
+        }
+
+        OUTPUT_RESULT result = uring_send(pW, pUc);
+        if (result == OUTPUT_ERROR)
+        {
+            uring_close_connection(pW, pUc);
+            return;
+        }
+
+        if (result == OUTPUT_BLOCKED) return;
+
+        if (!uring_finish_response(pW, pUc)) return;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_on_accept(URING_WORKER* pW, int iResult, uint32_t uFlags)
+{
+    if (!(uFlags & IORING_CQE_F_MORE)) pW->m_bAcceptArmed = false;
+
+    // EMFILE / ENFILE / ECONNABORTED: the accept is re-armed by the loop
+    if (iResult < 0) return;
+
+    CONNECTION* pConn = connection_create(iResult);
+    if (!pConn)
+    {
+        close(iResult);
+        return;
+    }
+
+    URING_CONN* pUc = poolAlloc(&pW->m_connPool);
+    if (!pUc)
+    {
+        connection_destroy(pConn);
+        return;
+    }
+    memset(pUc, 0, sizeof(*pUc));
+
+    pUc->m_pConn     = pConn;
+    pUc->m_iFd       = iResult;
+    pUc->m_uHeldHead = URING_NO_BUFFER;
+    pUc->m_uHeldTail = URING_NO_BUFFER;
+    pConn->m_timer.data = pUc;
+
+    // a multishot accept has no per-connection address, asked once here for the access log
+    struct sockaddr_in peerAddr;
+    socklen_t peerLen = sizeof(peerAddr);
+    if (getpeername(iResult, (struct sockaddr*)&peerAddr, &peerLen) == 0 && peerAddr.sin_family == AF_INET)
+        pConn->m_uPeerAddr = peerAddr.sin_addr.s_addr;
+
+    if (!uring_arm_recv(pW, pUc))
+    {
+        uring_close_connection(pW, pUc);
+        uring_release_if_done(pW, pUc);
+        return;
+    }
+
+    uring_arm_timer(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_on_recv(URING_WORKER* pW, URING_CONN* pUc, int iResult, uint32_t uFlags)
+{
+    if (!(uFlags & IORING_CQE_F_MORE))
+    {
+        pUc->m_bRecvArmed = false;
+        pUc->m_iPendingOps--;
+    }
+
+    if (iResult > 0)
+    {
+        uint16_t uBuffer = (uint16_t)(uFlags >> IORING_CQE_BUFFER_SHIFT);
+        if (pUc->m_bClosing)
+        {
+            uring_recycle_buffer(&pW->m_ring, uBuffer);
+            pW->m_bRecycled = true;
+            return;
+        }
+
+        uring_receive(pW, pUc, uBuffer, (size_t)iResult);
+
+        if (!pUc->m_bSending)
+            uring_process_requests(pW, pUc);
+        else
+            uring_rearm_recv(pW, pUc);
+        return;
+    }
+
+    if (pUc->m_bClosing) return;
+
+    if (iResult == 0)
+    {
+        pUc->m_pConn->m_bPeerClosed = true;
+        if (!pUc->m_bSending) uring_process_requests(pW, pUc);
+        return;
+    }
+
+    // every provided buffer is in use: retried once one comes back
+    if (iResult == -ENOBUFS)
+    {
+        pUc->m_bStarved     = true;
+        pUc->m_pNextStarved = pW->m_pStarved;
+        pW->m_pStarved      = pUc;
+        return;
+    }
+
+    // cancelled on purpose, the read buffer is full
+    if (iResult == -ECANCELED)
+    {
+        uring_rearm_recv(pW, pUc);
+        return;
+    }
+
+    uring_close_connection(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_on_send(URING_WORKER* pW, URING_CONN* pUc, int iResult)
+{
+    pUc->m_iPendingOps--;
+    pUc->m_bSending = false;
+
+    if (pUc->m_bClosing) return;
+
+    if (iResult < 0 || (size_t)iResult > pUc->m_iSendBytes)
+    {
+        uring_close_connection(pW, pUc);
+        return;
+    }
+
+    pUc->m_pConn->m_uLastActivity = monotonic_ms();
+    output_queue_consume(&pUc->m_pConn->m_output, (size_t)iResult);
+    metrics_bytes_sent((size_t)iResult);
+
+    // the linked close runs after a complete send and is cancelled after a short one,
+    // either way the connection ends (see uring_on_close)
+    if (pUc->m_bCloseLinked)
+    {
+        if ((size_t)iResult == pUc->m_iSendBytes)
+        {
+            metrics_request_done(pUc->m_pConn);
+            access_log_request(pUc->m_pConn);
+        }
+        pUc->m_bClosing = true;
+        return;
+    }
+
+    uring_continue_response(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_on_poll(URING_WORKER* pW, URING_CONN* pUc, int iResult)
+{
+    pUc->m_iPendingOps--;
+    pUc->m_bSending = false;
+
+    if (pUc->m_bClosing) return;
+
+    if (iResult < 0)
+    {
+        uring_close_connection(pW, pUc);
+        return;
+    }
+
+    uring_continue_response(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_on_close(URING_CONN* pUc, int iResult)
+{
+    pUc->m_iPendingOps--;
+    pUc->m_bClosing = true;
+
+    // a linked close is cancelled when its send came up short
+    if (iResult < 0 && pUc->m_iFd >= 0)
+        close(pUc->m_iFd);
+
+    connection_forget_fd(pUc->m_pConn);
+    pUc->m_iFd = -1;
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_feed_starved(URING_WORKER* pW)
+{
+    URING_CONN* pUc = pW->m_pStarved;
+    pW->m_pStarved  = NULL;
+    pW->m_bRecycled = false;
+
+    while (pUc)
+    {
+        URING_CONN* pNext = pUc->m_pNextStarved;
+        pUc->m_pNextStarved = NULL;
+        pUc->m_bStarved     = false;
+
+        uring_rearm_recv(pW, pUc);
+        uring_release_if_done(pW, pUc);
+        pUc = pNext;
+    }
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_on_timeout(TimerNode* pNode, void* pContext)
+{
+    URING_WORKER* pW = pContext;
+    URING_CONN* pUc = pNode->data;
+
+    uring_close_connection(pW, pUc);
+    uring_release_if_done(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+static void uring_dispatch(URING_WORKER* pW, uint64_t uUserData, int iResult, uint32_t uFlags)
+{
+    URING_OP op = (URING_OP)(uUserData & URING_OP_MASK);
+    URING_CONN* pUc = (URING_CONN*)(uintptr_t)(uUserData & ~(uint64_t)URING_OP_MASK);
+
+    switch (op)
+    {
+        case URING_OP_ACCEPT:
+            uring_on_accept(pW, iResult, uFlags);
+            return;
+
+        case URING_OP_WATCH:
+            if (!(uFlags & IORING_CQE_F_MORE)) pW->m_bWatchArmed = false;
+            file_cache_process_events();
+            return;
+
+        case URING_OP_CANCEL:
+            return;
+
+        case URING_OP_RECV:  uring_on_recv(pW, pUc, iResult, uFlags); break;
+        case URING_OP_SEND:  uring_on_send(pW, pUc, iResult);         break;
+        case URING_OP_POLL:  uring_on_poll(pW, pUc, iResult);         break;
+        case URING_OP_CLOSE: uring_on_close(pUc, iResult);            break;
+    }
+
+    uring_release_if_done(pW, pUc);
+}
+
+////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////
+bool worker_run_uring(SERVER* s_pServer, int iListenFd, int iWatchFd, volatile sig_atomic_t* pRunning)
+{
+    /*
+        One io_uring_enter() per iteration submits everything the previous
+        completions queued (sends, re-armed recvs, closes) and waits for the
+        next completion. Accept and recv are multishot, so an idle
+        connection costs no syscall at all to keep listening.
+    */
+
+    URING_WORKER* pW = calloc(1, sizeof(URING_WORKER));
+    if (!pW) return false;
+
+    pW->m_iWatchFd  = iWatchFd;
+    pW->m_pTimeouts = &s_pServer->m_timeouts;
+    timerWheelInit(&pW->m_timers, monotonic_ms(), URING_TIMER_TICK_MS);
+    poolInit(&pW->m_connPool, sizeof(URING_CONN), URING_CONN_POOL_SLAB);
+
+    int iErr = uring_init(&pW->m_ring, URING_ENTRIES);
+    if (iErr == 0) iErr = uring_register_files(&pW->m_ring, &iListenFd, 1);
+    if (iErr == 0) iErr = uring_setup_buffers(&pW->m_ring, URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE);
+    if (iErr == 0 && !uring_arm_accept(pW)) iErr = -EBUSY;
+
+    if (iErr < 0)
+    {
+        fprintf(stderr, "worker: io_uring unavailable (%s), using epoll\n", strerror(-iErr));
+        uring_destroy(&pW->m_ring);
+        free(pW);
+        return false;
+    }
+
+    while (*pRunning)
+    {
+        if (!pW->m_bAcceptArmed) uring_arm_accept(pW);
+        if (pW->m_iWatchFd >= 0 && !pW->m_bWatchArmed) uring_arm_watch(pW);
+
+        // sleeps until the next connection deadline at the latest
+        int iTimeout = timerWheelTimeout(&pW->m_timers, monotonic_ms());
+        int iRet = uring_submit_and_wait_timeout(&pW->m_ring, 1, iTimeout);
+        if (iRet < 0 && iRet != -EINTR && iRet != -EAGAIN && iRet != -EBUSY && iRet != -ETIME)
+            break;
+
+        // every response of this batch shares one Date value
+        response_clock_tick();
+
+        struct io_uring_cqe* pCqe;
+        while ((pCqe = uring_peek_cqe(&pW->m_ring)) != NULL)
+        {
+            uint64_t uUserData = pCqe->user_data;
+            int      iResult   = pCqe->res;
+            uint32_t uFlags    = pCqe->flags;
+            uring_cqe_seen(&pW->m_ring);
+
+            uring_dispatch(pW, uUserData, iResult, uFlags);
+        }
+
+        if (pW->m_bRecycled && pW->m_pStarved)
+            uring_feed_starved(pW);
+
+        timerWheelAdvance(&pW->m_timers, monotonic_ms(), uring_on_timeout, pW);
+    }
+
+    uring_destroy(&pW->m_ring);
+    poolDestroy(&pW->m_connPool);
+    free(pW);
+    return true;
+}
@@ -0,0 +1,35 @@
+/*
+    File name    : worker_uring.h
+    creation date: 28-03-26
+    Author       : Solomon
+*/
+
+/*
+    io_uring flavour of the worker event loop, selected with --io-uring.
+
+    Same connections, parser, handlers and output queue as the epoll loop;
+    only the I/O is different: one multishot accept on the (registered)
+    listening socket, one multishot recv per client drawing from a shared
+    ring of provided buffers, gathered sends and, for "Connection: close",
+    a send linked to the close so both go out in one submission.
+*/
+
+#ifndef WORKER_URING_H
+#define WORKER_URING_H
+
+#include <stdbool.h>
+#include <signal.h>     // provides sig_atomic_t
+
+typedef struct SERVER SERVER;
+
+// false when the kernel cannot run the io_uring loop (the caller falls back to epoll)
+bool worker_run_uring(SERVER* s_pServer, int iListenFd, int iWatchFd, volatile sig_atomic_t* pRunning);
+
+#endif
+
+/*
+
+worker_run_uring() -> sets up the ring, the provided buffers and the multishot accept, then serves
+                      connections until *pRunning drops; iWatchFd (file cache inotify, or -1) is polled too
+
+*/